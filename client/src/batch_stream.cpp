@@ -0,0 +1,114 @@
+#include "batch_stream.hpp"
+
+#include <string.h>
+
+#include "protocol.hpp"
+
+bool is_streamed_op(uint8_t op_code) {
+  return op_code == OP_SET_LEDS_BATCHED || op_code == OP_SET_LEDS_FRAME;
+}
+
+// Reads len bytes into buf, counting them against left.
+static int read_counted(stream_read_fn read, void *ctx, uint8_t *buf,
+                        uint32_t len, uint32_t *left) {
+  if (len > *left) {
+    return -1;
+  }
+  *left -= len;
+  return read(ctx, buf, len);
+}
+
+int stream_batches(const MessageHeader *header, stream_read_fn read,
+                   void *read_ctx, const BatchSink *sink, uint8_t *chunk,
+                   StreamedBatches *out) {
+  memset(out, 0, sizeof(*out));
+  out->op_code = header->op_code;
+  if (!is_streamed_op(header->op_code) ||
+      header->size < sizeof(MessageHeader)) {
+    out->error = "not a batched message";
+    return -1;
+  }
+  uint32_t left = header->size - sizeof(MessageHeader);
+
+  uint8_t batch_count;
+  if (header->op_code == OP_SET_LEDS_FRAME) {
+    SetLedsFrameMessage fixed;
+    if (read_counted(read, read_ctx, (uint8_t *)&fixed + sizeof(MessageHeader),
+                     sizeof(fixed) - sizeof(MessageHeader), &left) != 0) {
+      out->error = "message ends in its header";
+      return -1;
+    }
+    out->flags = fixed.flags;
+    out->frame_seq = fixed.frame_seq;
+    batch_count = fixed.batch_count;
+  } else if (read_counted(read, read_ctx, &batch_count, sizeof(batch_count),
+                          &left) != 0) {
+    out->error = "message ends in its header";
+    return -1;
+  }
+
+  uint32_t trailer = frame_trailer_size(out->flags);
+  if (trailer > left) {
+    out->error = "message ends before its present-at time";
+    return -1;
+  }
+  left -= trailer;
+
+  for (uint8_t i = 0; i < batch_count; ++i) {
+    LedsBatchEntryHeader eh;
+    if (read_counted(read, read_ctx, (uint8_t *)&eh, sizeof(eh), &left) != 0) {
+      out->error = "batch is being read past the end of the message";
+      return -1;
+    }
+    if (eh.num_leds > left / 3) {
+      out->error = "batch extends beyond the message";
+      return -1;
+    }
+    if (!sink->begin_pin(sink->ctx, eh.gpio_pin, eh.num_leds)) {
+      out->error = "batch is for a pin that can't take it";
+      return -1;
+    }
+
+    for (uint32_t done = 0; done < eh.num_leds;) {
+      uint32_t count = eh.num_leds - done;
+      if (count > BATCH_STREAM_CHUNK / 3) {
+        count = BATCH_STREAM_CHUNK / 3;
+      }
+      if (read_counted(read, read_ctx, chunk, count * 3, &left) != 0) {
+        out->error = "connection lost in the middle of a batch";
+        return -1;
+      }
+      sink->set_pixels(sink->ctx, done, chunk, count);
+      done += count;
+    }
+  }
+
+  // Anything between the last batch and the trailer is skipped, as it was
+  // when the whole message was read first.
+  while (left > 0) {
+    uint32_t len = left < BATCH_STREAM_CHUNK ? left : BATCH_STREAM_CHUNK;
+    if (read_counted(read, read_ctx, chunk, len, &left) != 0) {
+      out->error = "connection lost after the batches";
+      return -1;
+    }
+  }
+
+  if (trailer > 0) {
+    if (read(read_ctx, (uint8_t *)&out->present_at_us, trailer) != 0) {
+      out->error = "connection lost in the present-at time";
+      return -1;
+    }
+    out->has_present_at = true;
+  }
+  return 0;
+}
+
+int memory_stream_read(void *ctx, uint8_t *buf, uint32_t len) {
+  MemoryStream *stream = (MemoryStream *)ctx;
+  if (len > (uint32_t)(stream->end - stream->p)) {
+    return -1;
+  }
+  memcpy(buf, stream->p, len);
+  stream->p += len;
+  return 0;
+}
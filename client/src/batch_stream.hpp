@@ -0,0 +1,59 @@
+#ifndef BATCH_STREAM_H
+#define BATCH_STREAM_H
+
+#include <stdint.h>
+
+#include "protocol.hpp"
+
+// Pixel bytes read at a time, a whole number of pixels. This, not the frame,
+// bounds the memory a SetLedsFrame or SetLedsBatched takes to apply.
+#define BATCH_STREAM_CHUNK 768
+
+// Reads exactly len more bytes of the message into buf, returning 0, or -1 if
+// they can't be read.
+typedef int (*stream_read_fn)(void *ctx, uint8_t *buf, uint32_t len);
+
+// Where stream_batches puts each pin's pixels.
+typedef struct {
+  // Called before a pin's pixels; returns false if the pin isn't configured
+  // or num_leds won't fit its strip, which rejects the message.
+  bool (*begin_pin)(void *ctx, uint8_t gpio_pin, uint32_t num_leds);
+  // count pixels of 3 bytes each, as sent, for the pin's LEDs from index on.
+  void (*set_pixels)(void *ctx, uint32_t index, const uint8_t *pixels,
+                     uint32_t count);
+  void *ctx;
+} BatchSink;
+
+// What stream_batches read besides the pixels.
+typedef struct {
+  uint8_t op_code;
+  // Only set for SetLedsFrame.
+  uint8_t flags;
+  uint32_t frame_seq;
+  bool has_present_at;
+  uint64_t present_at_us;
+  // Why the message was rejected, when stream_batches fails.
+  const char *error;
+} StreamedBatches;
+
+// A message held whole in memory, for stream_batches to read from.
+typedef struct {
+  const uint8_t *p;
+  const uint8_t *end;
+} MemoryStream;
+
+// Whether op_code is a SetLedsBatched or SetLedsFrame, which stream_batches
+// applies however large they are.
+bool is_streamed_op(uint8_t op_code);
+// Reads the rest of a SetLedsBatched or SetLedsFrame whose header has been
+// read, handing the pixels to sink as they arrive, BATCH_STREAM_CHUNK bytes
+// at a time through chunk. Nothing past header->size is read. Returns 0, or
+// -1 with out->error set, possibly after some pins have been written.
+int stream_batches(const MessageHeader *header, stream_read_fn read,
+                   void *read_ctx, const BatchSink *sink, uint8_t *chunk,
+                   StreamedBatches *out);
+// A stream_read_fn for a MemoryStream, which stream_batches is handed with p
+// just past the message header.
+int memory_stream_read(void *ctx, uint8_t *buf, uint32_t len);
+
+#endif
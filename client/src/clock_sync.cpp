@@ -0,0 +1,103 @@
+#include "clock_sync.hpp"
+
+#include <string.h>
+
+#include "protocol.hpp"
+
+void clock_sync_reset(ClockSync *sync) {
+  memset(sync, 0, sizeof(*sync));
+}
+
+int64_t clock_sync_next_ping(const ClockSync *sync) {
+  return sync->next_ping_us;
+}
+
+uint32_t clock_sync_write_ping(ClockSync *sync, uint8_t *buf, int64_t now_us) {
+  sync->next_ping_us = now_us + (sync->sample_count < CLOCK_SYNC_BURST
+                                     ? CLOCK_SYNC_FAST_INTERVAL_US
+                                     : CLOCK_SYNC_INTERVAL_US);
+  return write_time_ping(buf, now_us);
+}
+
+int64_t clock_sync_offset(const ClockSync *sync, int64_t local_us) {
+  return sync->base_offset_us +
+         (int64_t)(sync->drift * (double)(local_us - sync->base_local_us));
+}
+
+// Measures drift between the last anchor and the best sample, once they are
+// far enough apart for the offsets' noise not to swamp it.
+static void update_drift(ClockSync *sync, const ClockSample *best) {
+  if (!sync->have_anchor) {
+    sync->have_anchor = true;
+    sync->anchor_local_us = best->local_us;
+    sync->anchor_offset_us = best->offset_us;
+    return;
+  }
+  int64_t span = best->local_us - sync->anchor_local_us;
+  if (span < CLOCK_SYNC_DRIFT_SPAN_US) {
+    return;
+  }
+  double measured =
+      (double)(best->offset_us - sync->anchor_offset_us) / (double)span;
+  if (measured > CLOCK_SYNC_MAX_DRIFT) {
+    measured = CLOCK_SYNC_MAX_DRIFT;
+  } else if (measured < -CLOCK_SYNC_MAX_DRIFT) {
+    measured = -CLOCK_SYNC_MAX_DRIFT;
+  }
+  // The first measurement is taken as is, later ones smoothed.
+  if (sync->drift == 0) {
+    sync->drift = measured;
+  } else {
+    sync->drift += (measured - sync->drift) / 4;
+  }
+  sync->anchor_local_us = best->local_us;
+  sync->anchor_offset_us = best->offset_us;
+}
+
+void clock_sync_pong(ClockSync *sync, const TimePongMessage *msg,
+                     int64_t now_us) {
+  if (!msg) {
+    return;
+  }
+  int64_t t0 = (int64_t)msg->client_send_us;
+  int64_t t1 = (int64_t)msg->server_recv_us;
+  int64_t t2 = (int64_t)msg->server_send_us;
+  int64_t t3 = now_us;
+  int64_t delay = (t3 - t0) - (t2 - t1);
+  if (t0 > t3 || t2 < t1 || delay < 0) {
+    return;
+  }
+
+  ClockSample sample;
+  sample.local_us = t0 + (t3 - t0) / 2;
+  sample.offset_us = ((t1 - t0) + (t2 - t3)) / 2;
+  sample.delay_us = delay;
+  sync->samples[sync->sample_count % CLOCK_SYNC_SAMPLES] = sample;
+  sync->sample_count++;
+
+  // The best sample may be a few seconds old; the offset is carried forward
+  // from when it was taken by the drift.
+  uint32_t kept = sync->sample_count < CLOCK_SYNC_SAMPLES ? sync->sample_count
+                                                          : CLOCK_SYNC_SAMPLES;
+  const ClockSample *best = &sync->samples[0];
+  for (uint32_t i = 1; i < kept; ++i) {
+    if (sync->samples[i].delay_us < best->delay_us) {
+      best = &sync->samples[i];
+    }
+  }
+  update_drift(sync, best);
+  sync->base_local_us = best->local_us;
+  sync->base_offset_us = best->offset_us;
+  sync->synced = sync->sample_count >= CLOCK_SYNC_MIN_SAMPLES;
+}
+
+bool clock_sync_synced(const ClockSync *sync) { return sync->synced; }
+
+int64_t clock_sync_to_local(const ClockSync *sync, int64_t server_us) {
+  // server = local + base_offset + drift * (local - base_local), solved for
+  // local.
+  double local = ((double)(server_us - sync->base_offset_us) +
+                  sync->drift * (double)sync->base_local_us) /
+                 (1.0 + sync->drift);
+  return (int64_t)local;
+}
@@ -0,0 +1,69 @@
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include <stdint.h>
+
+#include "protocol.hpp"
+
+// Pings every CLOCK_SYNC_FAST_INTERVAL_US until CLOCK_SYNC_BURST answers have
+// come back, then every CLOCK_SYNC_INTERVAL_US.
+#define CLOCK_SYNC_FAST_INTERVAL_US 100000
+#define CLOCK_SYNC_INTERVAL_US 1000000
+#define CLOCK_SYNC_BURST 8
+// Answers the offset is picked from: the one with the shortest round trip,
+// which was held up least on the way.
+#define CLOCK_SYNC_SAMPLES 8
+// Answers needed before the offset is trusted.
+#define CLOCK_SYNC_MIN_SAMPLES 4
+// Drift is measured between offsets at least this far apart, and never
+// believed beyond CLOCK_SYNC_MAX_DRIFT (a crystal is good to 50 ppm or so).
+#define CLOCK_SYNC_DRIFT_SPAN_US 4000000
+#define CLOCK_SYNC_MAX_DRIFT 0.0005
+
+typedef struct {
+  // The client's clock halfway through the exchange, the server's clock
+  // minus the client's at that moment, and the round trip.
+  int64_t local_us;
+  int64_t offset_us;
+  int64_t delay_us;
+} ClockSample;
+
+// Estimates the server's clock from TimePing/TimePong exchanges, NTP style:
+// the offset comes from the best recent answer and the drift from how that
+// offset moves over time. Nothing here reads a clock; every time is passed
+// in on the client's clock in microseconds, so it can run against
+// esp_timer_get_time() or any other timer.
+typedef struct {
+  ClockSample samples[CLOCK_SYNC_SAMPLES];
+  uint32_t sample_count;
+  int64_t next_ping_us;
+  // The best sample's offset and when it was taken, and the server's clock
+  // rate relative to the client's, less one.
+  bool synced;
+  int64_t base_local_us;
+  int64_t base_offset_us;
+  double drift;
+  // The offset drift was last measured from.
+  bool have_anchor;
+  int64_t anchor_local_us;
+  int64_t anchor_offset_us;
+} ClockSync;
+
+// Forgets everything, for a new connection. The first ping is due at once.
+void clock_sync_reset(ClockSync *sync);
+// When the next ping should go out.
+int64_t clock_sync_next_ping(const ClockSync *sync);
+// Writes a TimePing sent at now_us into buf and schedules the next one.
+// Returns the message size.
+uint32_t clock_sync_write_ping(ClockSync *sync, uint8_t *buf, int64_t now_us);
+// Takes the server's answer, read at now_us.
+void clock_sync_pong(ClockSync *sync, const TimePongMessage *msg,
+                     int64_t now_us);
+bool clock_sync_synced(const ClockSync *sync);
+// The client's clock when the server's reads server_us. Only meaningful once
+// synced.
+int64_t clock_sync_to_local(const ClockSync *sync, int64_t server_us);
+// The estimated offset, server minus client, at local_us.
+int64_t clock_sync_offset(const ClockSync *sync, int64_t local_us);
+
+#endif
@@ -1,18 +1,80 @@
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "led_strip.h"
 
+#include <sys/socket.h>
+
+#include "clock_sync.hpp"
+#include "network.hpp"
 #include "protocol.hpp"
 #include "redraw.hpp"
 #include "set_config.hpp"
 
 static const char *TAG = "Redraw";
 
+// Present-at times further out than this are taken to be a bad clock estimate
+// and the frame is shown at once.
+#define MAX_PRESENT_DELAY_US 1000000
+
 TaskHandle_t notify_handle = nullptr;
 
+// The numbered frame the strips hold, written by the main task and read here
+// when a refresh starts.
+static portMUX_TYPE loaded_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool loaded_has_seq = false;
+static uint32_t loaded_seq = 0;
+static int64_t loaded_recv_us = 0;
+static volatile int ack_sockfd = -1;
+// Fires the redraw for a frame with a present-at time.
+static esp_timer_handle_t latch_timer = nullptr;
+
+void frame_loaded(uint32_t frame_seq, int64_t recv_us) {
+  taskENTER_CRITICAL(&loaded_lock);
+  loaded_has_seq = true;
+  loaded_seq = frame_seq;
+  loaded_recv_us = recv_us;
+  taskEXIT_CRITICAL(&loaded_lock);
+}
+
+void forget_loaded_frame() {
+  taskENTER_CRITICAL(&loaded_lock);
+  loaded_has_seq = false;
+  taskEXIT_CRITICAL(&loaded_lock);
+}
+
+void set_ack_socket(int sockfd) { ack_sockfd = sockfd; }
+
+// Tells the server frame_seq is showing. Sent straight from here so the latch
+// time isn't held up behind a frame the main task is reading. An ack that
+// doesn't fit in the socket's send buffer is dropped; the server counts the
+// frame as not shown.
+static void send_frame_ack(uint32_t frame_seq, int64_t recv_us,
+                           int64_t latch_us) {
+  int sockfd = ack_sockfd;
+  if (sockfd < 0) {
+    return;
+  }
+  uint8_t message[sizeof(FrameAckMessage)];
+  uint32_t message_size =
+      write_frame_ack(message, frame_seq, recv_us, latch_us);
+  if (send(sockfd, message, message_size, MSG_DONTWAIT) !=
+      (ssize_t)message_size) {
+    ESP_LOGD(TAG, "Failed to ack frame %u", (unsigned int)frame_seq);
+  }
+}
+
 IRAM_ATTR static void redraw_task(void *) {
+  bool acked_any = false;
+  uint32_t acked_seq = 0;
   while (true) {
     ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
 
+    taskENTER_CRITICAL(&loaded_lock);
+    bool has_seq = loaded_has_seq;
+    uint32_t seq = loaded_seq;
+    int64_t recv_us = loaded_recv_us;
+    taskEXIT_CRITICAL(&loaded_lock);
+
     xSemaphoreTake(pin_to_handle_mutex, portMAX_DELAY);
     for (auto &entry : pin_to_handle) {
       led_strip_handle_t strip = entry.second;
@@ -22,6 +84,12 @@ IRAM_ATTR static void redraw_task(void *) {
     xSemaphoreGive(pin_to_handle_mutex);
 
     // ESP_LOGI(TAG, "Completed full LED redraw.");
+    // A frame refreshed again by a later OP_REDRAW is only acked once.
+    if (has_seq && (!acked_any || seq != acked_seq)) {
+      send_frame_ack(seq, recv_us, esp_timer_get_time());
+      acked_any = true;
+      acked_seq = seq;
+    }
   }
 }
 
@@ -42,6 +110,30 @@ int redraw(RedrawMessage *msg) {
   return 0;
 }
 
+static void latch_timer_cb(void *) { xTaskNotifyGive(notify_handle); }
+
+void latch_frame(const uint8_t *msg) {
+  uint64_t present_at_us = 0;
+  bool has_present_at = frame_present_at(msg, &present_at_us);
+  latch_frame_at(has_present_at, present_at_us);
+}
+
+void latch_frame_at(bool has_present_at, uint64_t present_at_us) {
+  if (has_present_at && clock_sync_synced(&clock_sync)) {
+    int64_t delay_us =
+        clock_sync_to_local(&clock_sync, (int64_t)present_at_us) -
+        esp_timer_get_time();
+    if (delay_us > 0 && delay_us < MAX_PRESENT_DELAY_US) {
+      // A newer frame replaces one still waiting; its pixels are already in
+      // the strip buffers.
+      esp_timer_stop(latch_timer);
+      ESP_ERROR_CHECK(esp_timer_start_once(latch_timer, delay_us));
+      return;
+    }
+  }
+  xTaskNotifyGive(notify_handle);
+}
+
 void init_redraw() {
   // "What's worse, if the RMT interrupt is delayed or not serviced in time
   // (e.g. if Wi-Fi interrupt happens on the same CPU core), the RMT
@@ -52,4 +144,9 @@ void init_redraw() {
                           &notify_handle, 1);
 
   ESP_LOGI(TAG, "Started redraw task on core 1");
+
+  esp_timer_create_args_t timer_args = {};
+  timer_args.callback = latch_timer_cb;
+  timer_args.name = "latch";
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &latch_timer));
 }
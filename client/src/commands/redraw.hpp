@@ -8,5 +8,19 @@ extern TaskHandle_t notify_handle;
 
 void init_redraw();
 int redraw(RedrawMessage *msg);
+// Refreshes the strips for a numbered frame with the latch flag that has
+// just been applied: at its present-at time if it has one and the clock is
+// synced, otherwise at once.
+void latch_frame(const uint8_t *msg);
+// The same for a frame whose message isn't held whole, given its present-at
+// time if it has one.
+void latch_frame_at(bool has_present_at, uint64_t present_at_us);
+// Records that the strips now hold frame_seq, whose message was read at
+// recv_us, so the refresh that shows it is acked. Anything else written to
+// the strips forgets it, and the refreshes after that aren't acked.
+void frame_loaded(uint32_t frame_seq, int64_t recv_us);
+void forget_loaded_frame();
+// Where FrameAcks go, or -1 while not connected.
+void set_ack_socket(int sockfd);
 
 #endif
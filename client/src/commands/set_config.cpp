@@ -5,10 +5,13 @@
 
 #include "protocol.hpp"
 #include "set_config.hpp"
+#include "set_leds.hpp"
 
 static const char *TAG = "SetConfig";
 
 std::map<uint8_t, led_strip_handle_t> pin_to_handle;
+std::map<uint8_t, uint8_t> pin_to_color_order;
+std::map<uint8_t, uint16_t> pin_to_max_leds;
 SemaphoreHandle_t pin_to_handle_mutex = xSemaphoreCreateMutex();
 
 void clear_led_strips() {
@@ -16,6 +19,9 @@ void clear_led_strips() {
     led_strip_del(entry.second);
   }
   pin_to_handle.clear();
+  pin_to_color_order.clear();
+  pin_to_max_leds.clear();
+  reset_frame_baseline();
 }
 
 int set_config(SetConfigMessage *msg) {
@@ -85,6 +91,8 @@ int set_config(SetConfigMessage *msg) {
 
     ESP_ERROR_CHECK(led_strip_clear(strip));
     pin_to_handle[gpio_pin] = strip;
+    pin_to_color_order[gpio_pin] = pinfo->color_order;
+    pin_to_max_leds[gpio_pin] = num_leds;
   }
 
   ESP_LOGI(TAG, "Configuration updated");
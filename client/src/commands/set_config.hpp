@@ -7,6 +7,10 @@
 #include "protocol.hpp"
 
 extern std::map<uint8_t, led_strip_handle_t> pin_to_handle;
+// COLOR_ORDER_* of the pixel data the server sends for each pin.
+extern std::map<uint8_t, uint8_t> pin_to_color_order;
+// LEDs each pin's strip was created with; pixels past them are rejected.
+extern std::map<uint8_t, uint16_t> pin_to_max_leds;
 extern SemaphoreHandle_t pin_to_handle_mutex;
 
 int set_config(SetConfigMessage *msg);
@@ -1,11 +1,42 @@
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "led_strip.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+
+#include "batch_stream.hpp"
 #include "protocol.hpp"
 #include "redraw.hpp"
 #include "set_config.hpp"
 
 static const char *TAG = "SetLeds";
 
+// The last full frame (SetLedsFrame, SetLedsCompressed or SetLedsQuantized) or
+// SetLedsDelta applied, which deltas are built on.
+// Anything else that changes the strips leaves them with no known frame.
+static bool have_baseline = false;
+static uint32_t baseline_seq = 0;
+// Set once a resync has been asked for, so it is only asked for once while
+// deltas keep arriving before the full frame.
+static bool resync_requested = false;
+
+void reset_frame_baseline() {
+  have_baseline = false;
+  resync_requested = false;
+}
+
+// Offsets of red, green and blue in the pixel data for gpio_pin.
+static void pin_channel_offsets(uint8_t gpio_pin, uint8_t *r, uint8_t *g,
+                                uint8_t *b) {
+  auto it = pin_to_color_order.find(gpio_pin);
+  uint8_t color_order =
+      it == pin_to_color_order.end() ? COLOR_ORDER_RGB : it->second;
+  if (!color_order_offsets(color_order, r, g, b)) {
+    color_order_offsets(COLOR_ORDER_RGB, r, g, b);
+  }
+}
+
 int set_leds(SetLedsMessage *msg) {
   ESP_LOGI(TAG, "Handling set_leds");
 
@@ -32,17 +63,108 @@ int set_leds(SetLedsMessage *msg) {
   int num_pixels = data_size / 3; // assuming RGB
   uint8_t *pixel_data = msg->pixel_data;
 
+  uint8_t ro, go, bo;
+  pin_channel_offsets(gpio_pin, &ro, &go, &bo);
+
   for (int i = 0; i < num_pixels; i++) {
-    uint8_t r = pixel_data[i * 3];
-    uint8_t g = pixel_data[i * 3 + 1];
-    uint8_t b = pixel_data[i * 3 + 2];
+    uint8_t r = pixel_data[i * 3 + ro];
+    uint8_t g = pixel_data[i * 3 + go];
+    uint8_t b = pixel_data[i * 3 + bo];
 
     ESP_ERROR_CHECK(led_strip_set_pixel(strip, i, r, g, b));
   }
+  forget_loaded_frame();
 
   return 0;
 }
 
+// Where decode_pixels and stream_batches put a pin's pixels: straight into its
+// strip buffer.
+typedef struct {
+  led_strip_handle_t strip;
+  uint8_t ro, go, bo;
+} StripSink;
+
+static void set_strip_pixel(void *ctx, uint32_t index, const uint8_t *pixel) {
+  StripSink *sink = (StripSink *)ctx;
+  ESP_ERROR_CHECK(led_strip_set_pixel(sink->strip, index, pixel[sink->ro],
+                                      pixel[sink->go], pixel[sink->bo]));
+}
+
+static bool begin_strip_pin(void *ctx, uint8_t gpio_pin, uint32_t num_leds) {
+  StripSink *sink = (StripSink *)ctx;
+  auto it = pin_to_handle.find(gpio_pin);
+  if (it == pin_to_handle.end() || !it->second) {
+    ESP_LOGE(TAG, "Unconfigured GPIO pin %d in batch", gpio_pin);
+    return false;
+  }
+  auto max_leds = pin_to_max_leds.find(gpio_pin);
+  if (max_leds == pin_to_max_leds.end() || num_leds > max_leds->second) {
+    ESP_LOGE(TAG, "Batch of %u LEDs is longer than the strip on pin %d",
+             (unsigned int)num_leds, gpio_pin);
+    return false;
+  }
+  sink->strip = it->second;
+  pin_channel_offsets(gpio_pin, &sink->ro, &sink->go, &sink->bo);
+  return true;
+}
+
+static void set_strip_pixels(void *ctx, uint32_t index, const uint8_t *pixels,
+                             uint32_t count) {
+  for (uint32_t i = 0; i < count; ++i) {
+    set_strip_pixel(ctx, index + i, pixels + i * 3);
+  }
+}
+
+// Only the main task applies frames, so one chunk does for every message.
+static uint8_t stream_chunk[BATCH_STREAM_CHUNK];
+
+// Applies a SetLedsBatched or SetLedsFrame to the strip buffers as read
+// hands it over, then refreshes or latches the strips.
+static int apply_streamed(const MessageHeader *header, stream_read_fn read,
+                          void *read_ctx) {
+  StripSink strip_sink;
+  BatchSink sink = {begin_strip_pin, set_strip_pixels, &strip_sink};
+  StreamedBatches batches;
+  if (stream_batches(header, read, read_ctx, &sink, stream_chunk, &batches) !=
+      0) {
+    ESP_LOGE(TAG, "Failed to apply batches: %s", batches.error);
+    return -1;
+  }
+
+  if (batches.op_code == OP_SET_LEDS_BATCHED) {
+    have_baseline = false;
+    forget_loaded_frame();
+
+    // TODO: ideally redraw cmd would be separate
+    xTaskNotifyGive(notify_handle);
+    return 0;
+  }
+
+  // Read once the last pixel has arrived, as a buffered frame would be.
+  int64_t recv_us = esp_timer_get_time();
+  have_baseline = true;
+  baseline_seq = batches.frame_seq;
+  frame_loaded(batches.frame_seq, recv_us);
+  resync_requested = false;
+
+  // Without the latch flag the server sends OP_REDRAW to every client at the
+  // same deadline, so the whole wall changes at once.
+  if (batches.flags & LEDS_FRAME_FLAG_LATCH) {
+    latch_frame_at(batches.has_present_at, batches.present_at_us);
+  }
+
+  return 0;
+}
+
+// Applies a message held whole, as UDP frames are.
+static int apply_buffered(const MessageHeader *header) {
+  MemoryStream stream;
+  stream.p = (const uint8_t *)header + sizeof(MessageHeader);
+  stream.end = (const uint8_t *)header + header->size;
+  return apply_streamed(header, memory_stream_read, &stream);
+}
+
 int set_leds_batched(SetLedsBatchedMessage *msg) {
   ESP_LOGI(TAG, "Handling set_leds_batched");
 
@@ -51,35 +173,228 @@ int set_leds_batched(SetLedsBatchedMessage *msg) {
     return -1;
   }
 
+  return apply_buffered((const MessageHeader *)msg);
+}
+
+int set_leds_frame(SetLedsFrameMessage *msg) {
+  ESP_LOGD(TAG, "Handling set_leds_frame");
+
+  if (msg == NULL) {
+    ESP_LOGE(TAG, "Invalid set_leds_frame message (null)");
+    return -1;
+  }
+
+  return apply_buffered((const MessageHeader *)msg);
+}
+
+int set_leds_streamed(const MessageHeader *header, stream_read_fn read,
+                      void *read_ctx) {
+  ESP_LOGD(TAG, "Streaming op %d of %u bytes", header->op_code,
+           (unsigned int)header->size);
+  return apply_streamed(header, read, read_ctx);
+}
+
+// Decodes each pin's pixels into its strip buffer as they are read, without
+// refreshing the strips.
+static int apply_compressed_batches(uint8_t *p, uint8_t *end,
+                                    uint8_t batch_count) {
+  for (uint8_t i = 0; i < batch_count; ++i) {
+    if (p + sizeof(LedsCompressedEntryHeader) > end) {
+      ESP_LOGE(TAG, "Compressed batch %d is being read past all %d batches",
+               i, batch_count);
+      return -1;
+    }
+
+    LedsCompressedEntryHeader *eh = (LedsCompressedEntryHeader *)p;
+    uint8_t gpio_pin = eh->gpio_pin;
+    p += sizeof(LedsCompressedEntryHeader);
+
+    if (p + eh->data_size > end) {
+      ESP_LOGE(TAG, "Compressed batch %d extends beyond the message", i);
+      return -1;
+    }
+
+    auto it = pin_to_handle.find(gpio_pin);
+    if (it == pin_to_handle.end()) {
+      ESP_LOGE(TAG, "Unconfigured GPIO pin %d in compressed batch %d",
+               gpio_pin, i);
+      return -1;
+    }
+
+    StripSink sink;
+    sink.strip = it->second;
+    if (!sink.strip) {
+      ESP_LOGE(TAG, "LED strip handle not initialized for pin %d", gpio_pin);
+      return -1;
+    }
+    auto max_leds = pin_to_max_leds.find(gpio_pin);
+    if (max_leds == pin_to_max_leds.end() || eh->num_leds > max_leds->second) {
+      ESP_LOGE(TAG, "Compressed batch of %u LEDs is longer than the strip on "
+               "pin %d", (unsigned int)eh->num_leds, gpio_pin);
+      return -1;
+    }
+    pin_channel_offsets(gpio_pin, &sink.ro, &sink.go, &sink.bo);
+
+    if (!decode_pixels(eh->encoding, p, eh->data_size, eh->num_leds,
+                       set_strip_pixel, &sink)) {
+      ESP_LOGE(TAG, "Malformed encoding %d for pin %d", eh->encoding,
+               gpio_pin);
+      return -1;
+    }
+    p += eh->data_size;
+  }
+
+  return 0;
+}
+
+int set_leds_compressed(SetLedsCompressedMessage *msg) {
+  ESP_LOGD(TAG, "Handling set_leds_compressed");
+  int64_t recv_us = esp_timer_get_time();
+
+  if (msg == NULL) {
+    ESP_LOGE(TAG, "Invalid set_leds_compressed message (null)");
+    return -1;
+  }
+
   uint32_t total_size = msg->header.size;
-  uint8_t batch_count = msg->batch_count;
-  uint8_t *p = (uint8_t *)msg + sizeof(MessageHeader) + 1;
-  uint8_t *end = (uint8_t *)msg + total_size;
+  uint8_t *p = (uint8_t *)msg + sizeof(SetLedsCompressedMessage);
+  uint8_t *end = (uint8_t *)msg + total_size - frame_trailer_size(msg->flags);
 
+  if (apply_compressed_batches(p, end, msg->batch_count) != 0) {
+    ESP_LOGE(TAG, "Failed to apply compressed frame %u",
+             (unsigned int)msg->frame_seq);
+    return -1;
+  }
+  // A compressed frame is a full frame, so deltas can build on it.
+  have_baseline = true;
+  baseline_seq = msg->frame_seq;
+  frame_loaded(msg->frame_seq, recv_us);
+  resync_requested = false;
+
+  if (msg->flags & LEDS_FRAME_FLAG_LATCH) {
+    latch_frame((uint8_t *)msg);
+  }
+
+  return 0;
+}
+
+// Expands each pin's pixels straight into its strip buffer, without
+// refreshing the strips.
+static int apply_quantized_batches(uint8_t *p, uint8_t *end, uint8_t depth,
+                                   uint8_t batch_count) {
   for (uint8_t i = 0; i < batch_count; ++i) {
-    if (p + sizeof(LedsBatchEntryHeader) > end) {
-      ESP_LOGE(TAG, "Batch %d is being read past all %d batches", i,
+    if (p + sizeof(LedsQuantizedEntryHeader) > end) {
+      ESP_LOGE(TAG, "Quantized batch %d is being read past all %d batches", i,
                batch_count);
       return -1;
     }
 
-    LedsBatchEntryHeader *eh = (LedsBatchEntryHeader *)p;
+    LedsQuantizedEntryHeader *eh = (LedsQuantizedEntryHeader *)p;
     uint8_t gpio_pin = eh->gpio_pin;
-    uint32_t num_leds = eh->num_leds;
-    p += sizeof(LedsBatchEntryHeader);
-
-    uint32_t pixel_bytes = num_leds * 3;
-    if (p + pixel_bytes > end) {
-      ESP_LOGE(
-          TAG,
-          "Batch %d has num leds %u and extends beyond the size of the message",
-          *p, (unsigned int)num_leds);
+    p += sizeof(LedsQuantizedEntryHeader);
+
+    uint32_t data_size = quantized_pixels_size(depth, eh->num_leds);
+    if (data_size == 0 || p + data_size > end) {
+      ESP_LOGE(TAG, "Quantized batch %d extends beyond the message", i);
       return -1;
     }
 
     auto it = pin_to_handle.find(gpio_pin);
     if (it == pin_to_handle.end()) {
-      ESP_LOGE(TAG, "Unconfigured GPIO pin %d in batch %d", gpio_pin, i);
+      ESP_LOGE(TAG, "Unconfigured GPIO pin %d in quantized batch %d",
+               gpio_pin, i);
+      return -1;
+    }
+
+    StripSink sink;
+    sink.strip = it->second;
+    if (!sink.strip) {
+      ESP_LOGE(TAG, "LED strip handle not initialized for pin %d", gpio_pin);
+      return -1;
+    }
+    auto max_leds = pin_to_max_leds.find(gpio_pin);
+    if (max_leds == pin_to_max_leds.end() || eh->num_leds > max_leds->second) {
+      ESP_LOGE(TAG, "Quantized batch of %u LEDs is longer than the strip on "
+               "pin %d", (unsigned int)eh->num_leds, gpio_pin);
+      return -1;
+    }
+    pin_channel_offsets(gpio_pin, &sink.ro, &sink.go, &sink.bo);
+
+    expand_pixels(depth, eh->max_level, p, eh->num_leds, set_strip_pixel,
+                  &sink);
+    p += data_size;
+  }
+
+  return 0;
+}
+
+int set_leds_quantized(SetLedsQuantizedMessage *msg) {
+  ESP_LOGD(TAG, "Handling set_leds_quantized");
+  int64_t recv_us = esp_timer_get_time();
+
+  if (msg == NULL) {
+    ESP_LOGE(TAG, "Invalid set_leds_quantized message (null)");
+    return -1;
+  }
+
+  uint32_t total_size = msg->header.size;
+  uint8_t *p = (uint8_t *)msg + sizeof(SetLedsQuantizedMessage);
+  uint8_t *end = (uint8_t *)msg + total_size - frame_trailer_size(msg->flags);
+
+  if (apply_quantized_batches(p, end, msg->depth, msg->batch_count) != 0) {
+    ESP_LOGE(TAG, "Failed to apply %d bit frame %u", msg->depth,
+             (unsigned int)msg->frame_seq);
+    return -1;
+  }
+  // Deltas carry full pixels and only touch the LEDs that changed, so they
+  // can still build on a quantised frame.
+  have_baseline = true;
+  baseline_seq = msg->frame_seq;
+  frame_loaded(msg->frame_seq, recv_us);
+  resync_requested = false;
+
+  if (msg->flags & LEDS_FRAME_FLAG_LATCH) {
+    latch_frame((uint8_t *)msg);
+  }
+
+  return 0;
+}
+
+static int send_resync(int sockfd) {
+  uint32_t message_size = 0;
+  uint8_t *message = encode_resync(baseline_seq, &message_size);
+  if (!message) {
+    ESP_LOGE(TAG, "Failed to encode resync");
+    return -1;
+  }
+
+  ssize_t sent = send(sockfd, message, message_size, 0);
+  free_message_buffer(message);
+  if (sent != (ssize_t)message_size) {
+    ESP_LOGW(TAG, "Failed to send resync: %d", errno);
+    return -1;
+  }
+  return 0;
+}
+
+// Writes each run of changed pixels over the strip buffers, which still hold
+// the base frame.
+static int apply_delta_batches(uint8_t *p, uint8_t *end, uint8_t batch_count) {
+  for (uint8_t i = 0; i < batch_count; ++i) {
+    if (p + sizeof(LedsDeltaEntryHeader) > end) {
+      ESP_LOGE(TAG, "Delta batch %d is being read past all %d batches", i,
+               batch_count);
+      return -1;
+    }
+
+    LedsDeltaEntryHeader *eh = (LedsDeltaEntryHeader *)p;
+    uint8_t gpio_pin = eh->gpio_pin;
+    uint16_t run_count = eh->run_count;
+    p += sizeof(LedsDeltaEntryHeader);
+
+    auto it = pin_to_handle.find(gpio_pin);
+    if (it == pin_to_handle.end()) {
+      ESP_LOGE(TAG, "Unconfigured GPIO pin %d in delta batch %d", gpio_pin, i);
       return -1;
     }
 
@@ -89,18 +404,88 @@ int set_leds_batched(SetLedsBatchedMessage *msg) {
       return -1;
     }
 
-    for (uint32_t idx = 0; idx < num_leds; ++idx) {
-      uint8_t r = p[idx * 3 + 0];
-      uint8_t g = p[idx * 3 + 1];
-      uint8_t b = p[idx * 3 + 2];
-      ESP_ERROR_CHECK(led_strip_set_pixel(strip, idx, r, g, b));
+    auto max_leds = pin_to_max_leds.find(gpio_pin);
+    if (max_leds == pin_to_max_leds.end()) {
+      ESP_LOGE(TAG, "No strip length for pin %d in delta batch %d", gpio_pin,
+               i);
+      return -1;
+    }
+
+    uint8_t ro, go, bo;
+    pin_channel_offsets(gpio_pin, &ro, &go, &bo);
+
+    for (uint16_t r = 0; r < run_count; ++r) {
+      if (p + sizeof(LedsDeltaRunHeader) > end) {
+        ESP_LOGE(TAG, "Run %d of pin %d is past the end of the message", r,
+                 gpio_pin);
+        return -1;
+      }
+      LedsDeltaRunHeader *rh = (LedsDeltaRunHeader *)p;
+      uint32_t start = rh->start;
+      uint32_t num_leds = rh->num_leds;
+      p += sizeof(LedsDeltaRunHeader);
+
+      if (p + num_leds * 3 > end) {
+        ESP_LOGE(TAG, "Run %d of pin %d extends beyond the message", r,
+                 gpio_pin);
+        return -1;
+      }
+      if (start > max_leds->second || num_leds > max_leds->second - start) {
+        ESP_LOGE(TAG, "Run %d of pin %d is past the end of its %u LEDs", r,
+                 gpio_pin, (unsigned int)max_leds->second);
+        return -1;
+      }
+
+      for (uint32_t idx = 0; idx < num_leds; ++idx) {
+        uint8_t red = p[idx * 3 + ro];
+        uint8_t green = p[idx * 3 + go];
+        uint8_t blue = p[idx * 3 + bo];
+        ESP_ERROR_CHECK(
+            led_strip_set_pixel(strip, start + idx, red, green, blue));
+      }
+      p += num_leds * 3;
     }
+  }
+
+  return 0;
+}
+
+int set_leds_delta(SetLedsDeltaMessage *msg, int sockfd) {
+  ESP_LOGD(TAG, "Handling set_leds_delta");
+  int64_t recv_us = esp_timer_get_time();
 
-    p += pixel_bytes;
+  if (msg == NULL) {
+    ESP_LOGE(TAG, "Invalid set_leds_delta message (null)");
+    return -1;
   }
 
-  // TODO: ideally redraw cmd would be separate
-  xTaskNotifyGive(notify_handle);
+  // A frame in between was missed, so the strips don't hold the frame the
+  // runs were taken against. Skip deltas until the server sends a full frame.
+  if (!have_baseline || msg->base_seq != baseline_seq) {
+    if (resync_requested) {
+      return 0;
+    }
+    ESP_LOGW(TAG, "Delta for frame %u is based on %u, have %u; resyncing",
+             (unsigned int)msg->frame_seq, (unsigned int)msg->base_seq,
+             (unsigned int)baseline_seq);
+    resync_requested = true;
+    return send_resync(sockfd);
+  }
+
+  uint32_t total_size = msg->header.size;
+  uint8_t *p = (uint8_t *)msg + sizeof(SetLedsDeltaMessage);
+  uint8_t *end = (uint8_t *)msg + total_size - frame_trailer_size(msg->flags);
+
+  if (apply_delta_batches(p, end, msg->batch_count) != 0) {
+    ESP_LOGE(TAG, "Failed to apply delta %u", (unsigned int)msg->frame_seq);
+    return -1;
+  }
+  baseline_seq = msg->frame_seq;
+  frame_loaded(msg->frame_seq, recv_us);
+
+  if (msg->flags & LEDS_FRAME_FLAG_LATCH) {
+    latch_frame((uint8_t *)msg);
+  }
 
   return 0;
 }
@@ -1,9 +1,20 @@
 #ifndef SET_LEDS_H
 #define SET_LEDS_H
 
+#include "batch_stream.hpp"
 #include "protocol.hpp"
 
 int set_leds(SetLedsMessage *msg);
 int set_leds_batched(SetLedsBatchedMessage *msg);
+int set_leds_frame(SetLedsFrameMessage *msg);
+// Applies a SetLedsBatched or SetLedsFrame whose header has been read, reading
+// the rest through read as it goes rather than holding it whole.
+int set_leds_streamed(const MessageHeader *header, stream_read_fn read,
+                      void *read_ctx);
+int set_leds_compressed(SetLedsCompressedMessage *msg);
+int set_leds_quantized(SetLedsQuantizedMessage *msg);
+int set_leds_delta(SetLedsDeltaMessage *msg, int sockfd);
+// Forgets the frame the strips hold, so the next delta asks for a resync.
+void reset_frame_baseline();
 
 #endif
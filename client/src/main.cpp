@@ -1,5 +1,6 @@
 #include "commands/redraw.hpp"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "nvs_flash.h"
@@ -8,6 +9,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#include <sys/select.h>
 
 #include "log.hpp"
 #include "network.hpp"
@@ -47,19 +49,55 @@ extern "C" void app_main(void) {
 
   int sockfd;
   blocking_checkin(&sockfd);
+  set_ack_socket(sockfd);
+  // Frames may come over UDP; control messages always come over TCP.
+  int udp_sockfd = open_udp(sockfd);
 
   // The buffer is allocated and resized in parse_tcp_message automatically.
   uint32_t buffer_size = 0;
   uint8_t *buffer = nullptr;
 
   while (true) {
-    if (parse_tcp_message(sockfd, &buffer, &buffer_size) < 0) {
+    send_time_ping(sockfd);
+
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(sockfd, &readable);
+    if (udp_sockfd >= 0) {
+      FD_SET(udp_sockfd, &readable);
+    }
+    // Wake up for the next time ping if nothing arrives before it.
+    struct timeval tv = {RECV_TIMEOUT_SEC, 0};
+    int64_t until_ping_us =
+        clock_sync_next_ping(&clock_sync) - esp_timer_get_time();
+    if (until_ping_us < (int64_t)RECV_TIMEOUT_SEC * 1000000) {
+      until_ping_us = until_ping_us > 0 ? until_ping_us : 0;
+      tv.tv_sec = until_ping_us / 1000000;
+      tv.tv_usec = until_ping_us % 1000000;
+    }
+    int max_fd = udp_sockfd > sockfd ? udp_sockfd : sockfd;
+    int ready = select(max_fd + 1, &readable, NULL, NULL, &tv);
+
+    if (ready > 0 && udp_sockfd >= 0 && FD_ISSET(udp_sockfd, &readable) &&
+        parse_udp_fragment(udp_sockfd, sockfd) < 0) {
+      close(udp_sockfd);
+      udp_sockfd = open_udp(sockfd);
+    }
+
+    if (ready > 0 && FD_ISSET(sockfd, &readable) &&
+        parse_tcp_message(sockfd, &buffer, &buffer_size) < 0) {
+      set_ack_socket(-1);
       close(sockfd);
+      if (udp_sockfd >= 0) {
+        close(udp_sockfd);
+      }
       ESP_LOGI(TAG, "Reconnecting to server...");
 
       vTaskDelay(pdMS_TO_TICKS(CHECK_IN_DELAY_MS));
 
       blocking_checkin(&sockfd);
+      set_ack_socket(sockfd);
+      udp_sockfd = open_udp(sockfd);
     }
 
     // unsigned long pending = 0;
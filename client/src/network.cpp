@@ -1,7 +1,9 @@
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "soc/soc_caps.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
@@ -18,6 +20,8 @@
 #include "commands/redraw.hpp"
 #include "commands/set_config.hpp"
 #include "commands/set_leds.hpp"
+#include "batch_stream.hpp"
+#include "clock_sync.hpp"
 #include "network.hpp"
 #include "protocol.hpp"
 
@@ -26,6 +30,8 @@
 
 static const char *TAG = "Network";
 
+ClockSync clock_sync;
+
 // There should be a separate header file, "wifi_credentials.hpp", that defines
 // preprocessor constants, WIFI_SSID and WIFI_PASSWORD, that are used by the
 // clients to connect to wifi.
@@ -203,6 +209,27 @@ int read_exact(int sockfd, uint8_t *buffer, uint32_t len) {
   return 0;
 }
 
+// Everything handle_message and parse_udp_fragment take, for the check-in.
+static void fill_capabilities(ClientCapabilities *caps) {
+  memset(caps, 0, sizeof(*caps));
+  caps->version = CHECK_IN_VERSION;
+  caps->max_message_size = MAX_MESSAGE_SIZE;
+  caps->op_codes = CAPS_BIT(OP_SET_LEDS) | CAPS_BIT(OP_SET_LEDS_BATCHED) |
+                   CAPS_BIT(OP_SET_LEDS_FRAME) |
+                   CAPS_BIT(OP_SET_LEDS_COMPRESSED) |
+                   CAPS_BIT(OP_SET_LEDS_QUANTIZED) |
+                   CAPS_BIT(OP_SET_LEDS_DELTA) | CAPS_BIT(OP_GET_LOGS) |
+                   CAPS_BIT(OP_REDRAW) | CAPS_BIT(OP_SET_CONFIG) |
+                   CAPS_BIT(OP_TIME_PONG) | CAPS_BIT(OP_FRAME_FRAGMENT);
+  caps->pixel_encodings = CAPS_BIT(PIXEL_ENCODING_RAW) |
+                          CAPS_BIT(PIXEL_ENCODING_RLE) |
+                          CAPS_BIT(PIXEL_ENCODING_PALETTE);
+  caps->wire_depths = CAPS_WIRE_DEPTH_RGB565 | CAPS_WIRE_DEPTH_RGB444;
+  caps->frame_flags = LEDS_FRAME_FLAG_LATCH | LEDS_FRAME_FLAG_PRESENT_AT;
+  caps->features = CAPS_FEATURE_UDP | CAPS_FEATURE_STREAMED_BATCHES;
+  caps->rmt_channels = SOC_RMT_TX_CANDIDATES_PER_GROUP;
+}
+
 int checkin(int *out_sockfd) {
   ESP_LOGI(TAG, "Sending check-in message");
 
@@ -278,9 +305,11 @@ int checkin(int *out_sockfd) {
 
   uint8_t mac[6];
   ESP_ERROR_CHECK(esp_wifi_get_mac(WIFI_IF_STA, mac));
+  ClientCapabilities caps;
+  fill_capabilities(&caps);
 
   uint32_t message_size = 0;
-  uint8_t *buffer = encode_check_in(mac, &message_size);
+  uint8_t *buffer = encode_check_in(mac, &caps, &message_size);
   if (!buffer) {
     ESP_LOGW(TAG, "Failed to encode check-in message");
     close(sockfd);
@@ -298,24 +327,125 @@ int checkin(int *out_sockfd) {
 
   ESP_LOGI(TAG, "Check-in message sent");
   *out_sockfd = sockfd;
+  // The server may have restarted with a different clock.
+  clock_sync_reset(&clock_sync);
+
+  return 0;
+}
+
+// Handles a whole message, however it arrived. sockfd is the TCP connection,
+// for anything that needs answering.
+static int handle_message(int sockfd, uint8_t *buffer) {
+  int64_t now_us = esp_timer_get_time();
+  uint16_t op_code = get_message_op_code(buffer);
+  ESP_LOGD(TAG, "Received OpCode: 0x%04X", op_code);
+
+  switch (op_code) {
+  case OP_SET_LEDS: {
+    if (set_leds(decode_set_leds(buffer)) != 0) {
+      return -1;
+    }
+    break;
+  }
+  case OP_SET_LEDS_BATCHED: {
+    if (set_leds_batched(decode_set_leds_batched(buffer)) != 0) {
+      return -1;
+    }
+    break;
+  }
+  case OP_SET_LEDS_FRAME: {
+    if (set_leds_frame(decode_set_leds_frame(buffer)) != 0) {
+      return -1;
+    }
+    break;
+  }
+  case OP_SET_LEDS_COMPRESSED: {
+    if (set_leds_compressed(decode_set_leds_compressed(buffer)) != 0) {
+      return -1;
+    }
+    break;
+  }
+  case OP_SET_LEDS_QUANTIZED: {
+    if (set_leds_quantized(decode_set_leds_quantized(buffer)) != 0) {
+      return -1;
+    }
+    break;
+  }
+  case OP_SET_LEDS_DELTA: {
+    if (set_leds_delta(decode_set_leds_delta(buffer), sockfd) != 0) {
+      return -1;
+    }
+    break;
+  }
+  case OP_GET_LOGS: {
+    if (get_logs(decode_get_logs(buffer), sockfd) != 0) {
+      return -1;
+    }
+    break;
+  }
+  case OP_REDRAW: {
+    if (redraw(decode_redraw(buffer)) != 0) {
+      return -1;
+    }
+    break;
+  }
+  case OP_SET_CONFIG: {
+    if (set_config(decode_set_config(buffer)) != 0) {
+      return -1;
+    }
+    break;
+  }
+  case OP_TIME_PONG: {
+    clock_sync_pong(&clock_sync, decode_time_pong(buffer), now_us);
+    break;
+  }
+  default:
+    ESP_LOGW(TAG, "Unknown OpCode: 0x%02X", op_code);
+    break;
+  }
 
   return 0;
 }
 
+void send_time_ping(int sockfd) {
+  int64_t now_us = esp_timer_get_time();
+  if (now_us < clock_sync_next_ping(&clock_sync)) {
+    return;
+  }
+  uint8_t message[sizeof(TimePingMessage)];
+  uint32_t message_size = clock_sync_write_ping(&clock_sync, message, now_us);
+  if (send(sockfd, message, message_size, 0) != (ssize_t)message_size) {
+    ESP_LOGW(TAG, "Failed to send time ping: %d", errno);
+  }
+}
+
+// A stream_read_fn straight off the TCP socket.
+static int read_socket(void *ctx, uint8_t *buf, uint32_t len) {
+  return read_exact(*(int *)ctx, buf, len);
+}
+
 int parse_tcp_message(int sockfd, uint8_t **buffer, uint32_t *buffer_size) {
-  uint8_t size_buffer[sizeof(uint32_t)];
-  if (read_exact(sockfd, size_buffer, sizeof(size_buffer)) != 0) {
+  MessageHeader header;
+  if (read_exact(sockfd, (uint8_t *)&header, sizeof(header)) != 0) {
     return -1;
   }
 
-  uint32_t message_size = get_message_size(size_buffer);
+  uint32_t message_size = header.size;
 
   ESP_LOGD(TAG, "Message size from header: %u bytes",
            (unsigned int)message_size);
-  if (message_size == 0) {
-    ESP_LOGE(TAG, "msg size of 0");
+  if (message_size < sizeof(MessageHeader)) {
+    ESP_LOGE(TAG, "msg size of %u", (unsigned int)message_size);
     return -1;
-  } else if (message_size > 10000) {
+  }
+
+  // Pixels go from the socket to the strips a chunk at a time, so frames for
+  // long chains don't need a buffer as big as themselves.
+  if (is_streamed_op(header.op_code)) {
+    return set_leds_streamed(&header, read_socket, &sockfd);
+  }
+
+  if (message_size > MAX_MESSAGE_SIZE) {
     ESP_LOGE(TAG, "msg is way too big");
     return -1;
   }
@@ -331,51 +461,143 @@ int parse_tcp_message(int sockfd, uint8_t **buffer, uint32_t *buffer_size) {
     }
   }
 
-  memcpy(*buffer, size_buffer, sizeof(uint32_t));
+  memcpy(*buffer, &header, sizeof(header));
 
-  uint32_t remaining_bytes = message_size - sizeof(uint32_t);
-  if (read_exact(sockfd, *buffer + sizeof(uint32_t), remaining_bytes) != 0) {
+  uint32_t remaining_bytes = message_size - sizeof(header);
+  if (read_exact(sockfd, *buffer + sizeof(header), remaining_bytes) != 0) {
     return -1;
   }
 
-  uint16_t op_code = get_message_op_code(*buffer);
-  ESP_LOGD(TAG, "Received OpCode: 0x%04X", op_code);
+  return handle_message(sockfd, *buffer);
+}
 
-  switch (op_code) {
-  case OP_SET_LEDS: {
-    if (set_leds(decode_set_leds(*buffer)) != 0) {
-      return -1;
-    }
-    break;
+// The frame being put back together from UDP fragments. Only the newest frame
+// is kept: fragments of an older one arrive too late to be shown.
+static uint8_t *udp_frame = nullptr;
+static uint32_t udp_frame_capacity = 0;
+static bool udp_have_latest = false;
+static bool udp_assembling = false;
+static uint32_t udp_latest_seq = 0;
+static uint32_t udp_frame_size = 0;
+static uint16_t udp_fragments_left = 0;
+static uint64_t udp_fragments_seen = 0;
+
+int open_udp(int tcp_sockfd) {
+  int udp_sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (udp_sockfd < 0) {
+    ESP_LOGE(TAG, "Failed to create UDP socket: %d", errno);
+    return -1;
   }
-  case OP_SET_LEDS_BATCHED: {
-    if (set_leds_batched(decode_set_leds_batched(*buffer)) != 0) {
-      return -1;
-    }
-    break;
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = 0;
+  socklen_t addr_len = sizeof(addr);
+  if (bind(udp_sockfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      getsockname(udp_sockfd, (struct sockaddr *)&addr, &addr_len) != 0) {
+    ESP_LOGE(TAG, "Failed to bind UDP socket: %d", errno);
+    close(udp_sockfd);
+    return -1;
   }
-  case OP_GET_LOGS: {
-    if (get_logs(decode_get_logs(*buffer), sockfd) != 0) {
-      return -1;
-    }
-    break;
+
+  uint16_t port = ntohs(addr.sin_port);
+  uint32_t message_size = 0;
+  uint8_t *message = encode_udp_port(port, &message_size);
+  if (!message) {
+    ESP_LOGE(TAG, "Failed to encode UDP port");
+    close(udp_sockfd);
+    return -1;
   }
-  case OP_REDRAW: {
-    if (redraw(decode_redraw(*buffer)) != 0) {
-      return -1;
+  ssize_t sent = send(tcp_sockfd, message, message_size, 0);
+  free_message_buffer(message);
+  if (sent != (ssize_t)message_size) {
+    ESP_LOGE(TAG, "Failed to send UDP port: %d", errno);
+    close(udp_sockfd);
+    return -1;
+  }
+
+  udp_have_latest = false;
+  udp_assembling = false;
+  ESP_LOGI(TAG, "Taking frames on UDP port %u", port);
+  return udp_sockfd;
+}
+
+// Whether frame a was sent before frame b, allowing for wrap-around.
+static bool seq_before(uint32_t a, uint32_t b) { return (int32_t)(a - b) < 0; }
+
+int parse_udp_fragment(int udp_sockfd, int tcp_sockfd) {
+  static uint8_t datagram[MAX_UDP_DATAGRAM];
+  ssize_t len = recv(udp_sockfd, datagram, sizeof(datagram), MSG_DONTWAIT);
+  if (len < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return 0;
     }
-    break;
+    ESP_LOGW(TAG, "Error reading UDP socket: %d", errno);
+    return -1;
   }
-  case OP_SET_CONFIG: {
-    if (set_config(decode_set_config(*buffer)) != 0) {
-      return -1;
+  if (len < (ssize_t)sizeof(MessageHeader) ||
+      get_message_size(datagram) != (uint32_t)len ||
+      get_message_op_code(datagram) != OP_FRAME_FRAGMENT) {
+    ESP_LOGW(TAG, "Ignoring a %d byte datagram that isn't a frame fragment",
+             (int)len);
+    return 0;
+  }
+
+  FrameFragmentMessage *frag = decode_frame_fragment(datagram);
+  if (!frag || frag->fragment_count > MAX_FRAME_FRAGMENTS ||
+      frag->total_size > MAX_MESSAGE_SIZE) {
+    ESP_LOGW(TAG, "Ignoring a malformed frame fragment");
+    return 0;
+  }
+
+  uint32_t seq = frag->frame_seq;
+  bool current = udp_assembling && seq == udp_latest_seq;
+  if (!current && udp_have_latest && !seq_before(udp_latest_seq, seq)) {
+    ESP_LOGD(TAG, "Dropping late fragment of frame %u", (unsigned int)seq);
+    return 0;
+  }
+  if (!current) {
+    if (udp_assembling) {
+      ESP_LOGD(TAG, "Frame %u is incomplete, dropping it for frame %u",
+               (unsigned int)udp_latest_seq, (unsigned int)seq);
     }
-    break;
+    if (frag->total_size > udp_frame_capacity) {
+      uint8_t *new_frame = (uint8_t *)realloc(udp_frame, frag->total_size);
+      if (!new_frame) {
+        ESP_LOGW(TAG, "Failed to resize UDP frame buffer");
+        return 0;
+      }
+      udp_frame = new_frame;
+      udp_frame_capacity = frag->total_size;
+    }
+    udp_have_latest = true;
+    udp_assembling = true;
+    udp_latest_seq = seq;
+    udp_frame_size = frag->total_size;
+    udp_fragments_left = frag->fragment_count;
+    udp_fragments_seen = 0;
   }
-  default:
-    ESP_LOGW(TAG, "Unknown OpCode: 0x%02X", op_code);
-    break;
+
+  uint64_t bit = 1ULL << frag->fragment_index;
+  if (frag->total_size != udp_frame_size || (udp_fragments_seen & bit)) {
+    return 0;
+  }
+  memcpy(udp_frame + frag->offset, datagram + sizeof(FrameFragmentMessage),
+         len - sizeof(FrameFragmentMessage));
+  udp_fragments_seen |= bit;
+  if (--udp_fragments_left > 0) {
+    return 0;
   }
 
+  udp_assembling = false;
+  if (get_message_size(udp_frame) != udp_frame_size) {
+    ESP_LOGW(TAG, "Frame %u doesn't match its fragments", (unsigned int)seq);
+    return 0;
+  }
+  if (handle_message(tcp_sockfd, udp_frame) != 0) {
+    ESP_LOGW(TAG, "Failed to apply frame %u from UDP", (unsigned int)seq);
+  }
   return 0;
 }
@@ -8,9 +8,31 @@
 #define CHECK_IN_DELAY_MS 500
 #define RECV_TIMEOUT_SEC 5
 
+// Larger messages are refused, whether over TCP or reassembled from UDP,
+// except SetLedsFrame and SetLedsBatched over TCP, which are streamed into the
+// strips without being held whole.
+#define MAX_MESSAGE_SIZE 10000
+// A full Ethernet/WiFi frame; the server's udp-mtu must not exceed it.
+#define MAX_UDP_DATAGRAM 1500
+#define MAX_FRAME_FRAGMENTS 64
+
 #include <unistd.h>
 
+#include "clock_sync.hpp"
+
+// The server's clock as seen from this one, for frames with a present-at
+// time. Only used from the main task.
+extern ClockSync clock_sync;
+
 int checkin(int *out_sockfd);
 int parse_tcp_message(int sockfd, uint8_t **buffer, uint32_t *buffer_size);
+// Sends a TimePing if one is due.
+void send_time_ping(int sockfd);
+// Listens for frames over UDP and tells the server on tcp_sockfd, returning
+// the UDP socket or -1, in which case frames keep coming over TCP.
+int open_udp(int tcp_sockfd);
+// Reads one datagram, applying the frame it completes. Returns -1 if the UDP
+// socket failed.
+int parse_udp_fragment(int udp_sockfd, int tcp_sockfd);
 
 #endif
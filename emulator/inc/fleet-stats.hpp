@@ -0,0 +1,126 @@
+#ifndef FLEET_STATS_HPP
+#define FLEET_STATS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Nanoseconds on the monotonic clock every simulated client shares.
+int64_t now_ns();
+
+// Counters one simulated client keeps. Totals only grow; the *_max fields
+// are taken and reset by each report, the *_peak fields never are.
+struct SimStats {
+    // Messages with LED data applied, and their bytes.
+    std::atomic<uint64_t> frames;
+    std::atomic<uint64_t> bytes;
+    // Strip refreshes, and refresh requests folded into one already waiting
+    // because the previous refresh hadn't finished.
+    std::atomic<uint64_t> latches;
+    std::atomic<uint64_t> coalesced;
+    // Frames written into the strips while a refresh was sending them out,
+    // which on the ESP32 shows part of each frame.
+    std::atomic<uint64_t> torn;
+    // Gaps in frame_seq: frames the server dropped or never sent because
+    // nothing changed, and frames lost on the way.
+    std::atomic<uint64_t> seq_gaps;
+    // Frames or datagrams dropped by the injected loss.
+    std::atomic<uint64_t> lost;
+    std::atomic<uint64_t> resyncs;
+    // Messages the firmware would have refused, dropping the connection.
+    std::atomic<uint64_t> rejected;
+    std::atomic<uint64_t> reconnects;
+    // From a frame arriving to the refresh that showed it finishing.
+    std::atomic<uint64_t> latency_count;
+    std::atomic<int64_t> latency_sum_ns;
+    std::atomic<int64_t> latency_max_ns;
+    std::atomic<int64_t> latency_peak_ns;
+    // How long after the first client in the fleet a frame arrived here.
+    std::atomic<uint64_t> lag_count;
+    std::atomic<int64_t> lag_sum_ns;
+    std::atomic<int64_t> lag_max_ns;
+    std::atomic<int64_t> lag_peak_ns;
+    // How far the client's estimate of the server's clock was off after each
+    // time pong, once synced.
+    std::atomic<uint64_t> clock_error_count;
+    std::atomic<int64_t> clock_error_sum_ns;
+    std::atomic<int64_t> clock_error_max_ns;
+    std::atomic<int64_t> clock_error_peak_ns;
+    // Frames whose present-at time had passed, or was too far off, by the
+    // time they were applied, and were shown at once.
+    std::atomic<uint64_t> late_presents;
+
+    SimStats();
+    void add_latency(int64_t ns);
+    void add_lag(int64_t ns);
+    void add_clock_error(int64_t ns);
+};
+
+// A copy of SimStats at one moment, so reports can print what changed.
+struct SimStatsSample {
+    uint64_t frames, bytes, latches, coalesced, torn, seq_gaps, lost, resyncs, rejected, reconnects;
+    uint64_t latency_count, lag_count, clock_error_count, late_presents;
+    int64_t latency_sum_ns, latency_max_ns, latency_peak_ns;
+    int64_t lag_sum_ns, lag_max_ns, lag_peak_ns;
+    int64_t clock_error_sum_ns, clock_error_max_ns, clock_error_peak_ns;
+
+    // Takes the counters, resetting the maxima.
+    void take(SimStats& stats);
+};
+
+// How far apart the fleet showed the same frames.
+struct SkewSummary {
+    // Frames shown anywhere, by how many clients on average, and how many of
+    // them were shown by more than one client, which the spread is taken
+    // over.
+    uint64_t frames;
+    double avg_clients;
+    uint64_t compared;
+    int64_t avg_ns;
+    int64_t p95_ns;
+    int64_t max_ns;
+};
+
+// When each numbered frame first arrived anywhere in the fleet and when the
+// first and last client finished showing it. Keyed by frame_seq in a ring,
+// so only the last LATCH_TABLE_SLOTS frames are kept.
+class LatchTable {
+public:
+    LatchTable();
+
+    // Records a client receiving frame seq at now, returning how long after
+    // the first client that was.
+    int64_t arrived(uint32_t seq, int64_t now);
+    // Records a client finishing showing frame seq at now.
+    void latched(uint32_t seq, int64_t now);
+    // Summarises the frames last touched before settled and not summarised
+    // yet.
+    SkewSummary collect(int64_t settled);
+    // Summarises every frame collected so far.
+    SkewSummary whole_run();
+
+private:
+    struct Slot {
+        bool used;
+        bool collected;
+        uint32_t seq;
+        int64_t first_arrival;
+        int64_t last_touch;
+        int64_t first_latch;
+        int64_t last_latch;
+        uint32_t latches;
+    };
+    std::mutex mut;
+    std::vector<Slot> slots;
+    std::vector<int64_t> skews;
+    // Everything collected so far.
+    std::vector<int64_t> run_skews;
+    uint64_t run_frames;
+    uint64_t run_clients;
+
+    Slot& slot_locked(uint32_t seq, int64_t now);
+};
+
+#endif
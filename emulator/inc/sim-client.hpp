@@ -0,0 +1,167 @@
+#ifndef SIM_CLIENT_HPP
+#define SIM_CLIENT_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "clock_sync.hpp"
+#include "fleet-stats.hpp"
+#include "sim-strips.hpp"
+
+// How every simulated client connects and misbehaves.
+struct SimOptions {
+    std::string host;
+    // Tried in order at every check-in, like the firmware does.
+    uint16_t port_start;
+    uint16_t port_end;
+    // Listen for frames over UDP, as the firmware always does.
+    bool udp;
+    // Every message is handled latency_ns after it was read, plus up to
+    // jitter_ns more, without reordering.
+    int64_t latency_ns;
+    int64_t jitter_ns;
+    // Fraction of UDP datagrams and TCP frame messages thrown away on
+    // arrival, as though a busy client never took them.
+    double loss;
+    // Caps how fast the TCP socket is read, 0 for no cap.
+    int64_t read_bytes_per_sec;
+    // WS2812 timing: 24 bits at 800 kHz per LED, and the latch gap after
+    // each strip.
+    int64_t ns_per_led;
+    int64_t reset_ns;
+    // Each client's clock runs fast or slow by up to this fraction, like an
+    // ESP32's crystal.
+    double clock_drift;
+    // Send capabilities at check-in, as the firmware does; without them the
+    // server sends what it would to older firmware.
+    bool capabilities;
+
+    SimOptions();
+};
+
+// One simulated ESP32. Mirrors the firmware's main loop: check in, take
+// SetConfig and frames over TCP (and UDP), apply them to its strips and
+// refresh them on a separate redraw thread, reconnecting whenever the
+// connection drops. Reading the socket happens on its own thread so
+// injected latency delays messages without slowing how fast they are read.
+class SimClient {
+public:
+    std::string name;
+    SimStats stats;
+
+    SimClient(const uint8_t mac[6], const SimOptions& options, LatchTable* latches);
+    ~SimClient();
+
+    void start();
+    // Disconnects and joins every thread.
+    void stop();
+    bool connected() const;
+
+private:
+    // A whole message read off the network, to be handled at due.
+    struct Inbound {
+        std::vector<uint8_t> data;
+        int64_t arrival;
+        int64_t due;
+    };
+
+    uint8_t mac[6];
+    const SimOptions& options;
+    LatchTable* latches;
+    std::atomic<bool> stopping;
+    std::atomic<bool> is_connected;
+    // The TCP connection, shut down by stop() to wake the threads reading
+    // it. Guarded by inbox_mut.
+    int current_socket;
+    std::thread session_thread;
+    std::thread reader_thread;
+    std::thread redraw_thread;
+    std::mt19937 rng;
+
+    // Held while the strips are written or refreshed, like
+    // pin_to_handle_mutex.
+    std::mutex strips_mut;
+    SimStrips strips;
+
+    // Messages read but not handled yet, filled by the reader. Once
+    // conn_closed, by either side, the reader stops and the session handles
+    // what is left.
+    std::mutex inbox_mut;
+    std::condition_variable inbox_cv;
+    std::deque<Inbound> inbox;
+    bool conn_closed;
+    int64_t last_due;
+
+    // Refresh requests for the redraw thread, the frame the strips hold, the
+    // frame they held when the refresh was asked for, and whether one is
+    // being sent out. *_arrival is when a frame was read off the network and
+    // *_recv when it was handled, which is what FrameAcks carry.
+    std::mutex redraw_mut;
+    std::condition_variable redraw_cv;
+    uint32_t redraw_pending;
+    bool loaded_has_seq;
+    uint32_t loaded_seq;
+    int64_t loaded_arrival;
+    int64_t loaded_recv;
+    bool pending_has_seq;
+    uint32_t pending_seq;
+    int64_t pending_arrival;
+    int64_t pending_recv;
+    bool refreshing;
+    // A refresh waiting for a frame's present-at time, like the firmware's
+    // latch_timer.
+    bool latch_timer_armed;
+    int64_t latch_due;
+    // The last numbered frame received, to count gaps.
+    bool have_last_seq;
+    uint32_t last_seq;
+
+    // The UDP frame being put back together, as in parse_udp_fragment.
+    std::vector<uint8_t> udp_frame;
+    bool udp_have_latest;
+    bool udp_assembling;
+    uint32_t udp_latest_seq;
+    uint32_t udp_frame_size;
+    uint16_t udp_fragments_left;
+    uint64_t udp_fragments_seen;
+
+    // The simulated esp_timer: when this client booted and how far its clock
+    // drifts, and its estimate of the server's clock. Session thread only.
+    int64_t boot_ns;
+    double drift;
+    ClockSync clock;
+
+    void session();
+    int check_in();
+    int open_udp(int tcp_socket);
+    void reader(int tcp_socket, int udp_socket);
+    int read_exact(int socket, uint8_t* buf, uint32_t len);
+    int read_tcp_message(int socket);
+    void read_udp_fragment(int socket);
+    bool lose();
+    void deliver(std::vector<uint8_t>& data);
+    void close_conn();
+    // Waits for the next message to be due, returning 1 with it, 0 if until
+    // passes first or -1 once the connection is closed and drained.
+    int next_message(Inbound& msg, int64_t until);
+    int64_t local_us(int64_t real_ns) const;
+    int64_t real_ns(int64_t local_us) const;
+    void send_time_ping(int tcp_socket);
+    void time_pong(const uint8_t* buf);
+    int64_t latch_time(const StripUpdate& update);
+    void request_redraw_locked();
+    int handle_message(int tcp_socket, const Inbound& msg);
+    void redraw_task();
+    void send_frame_ack(uint32_t seq, int64_t recv, int64_t latched);
+};
+
+// Parses a MAC written like config.yaml's, with - or : between the bytes.
+bool parse_mac(const std::string& text, uint8_t mac[6]);
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef SIM_STRIPS_HPP
+#define SIM_STRIPS_HPP
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include "protocol.hpp"
+
+// What applying a message asks of the client around it.
+struct StripUpdate {
+    // The message carried LED data, numbered seq if has_seq.
+    bool frame;
+    bool has_seq;
+    uint32_t seq;
+    // Refresh the strips now, as the firmware does with xTaskNotifyGive, or
+    // at present_at_us on the server's clock if has_present_at.
+    bool latch;
+    bool has_present_at;
+    uint64_t present_at_us;
+    // Send ResyncMessage with last_seq resync_seq.
+    bool resync;
+    uint32_t resync_seq;
+};
+
+// The LED strips of one simulated ESP32, kept the way the firmware keeps
+// them: set_config creates them, the SetLeds* handlers write pixels into
+// their buffers and deltas build on the last full frame. Every check the
+// firmware makes is made here too, so apply() fails for exactly the messages
+// that would make a real client drop the connection. It also fails for
+// pixels written past the end of a strip, which on the ESP32 abort in
+// ESP_ERROR_CHECK.
+class SimStrips {
+public:
+    // Why the last apply() failed.
+    std::string error;
+
+    // legacy strips are those of firmware from before capabilities were sent,
+    // which only knew SetConfig, SetLeds, SetLedsBatched, Redraw and GetLogs.
+    explicit SimStrips(bool legacy);
+
+    // Applies a whole LED or config message. Returns -1 where the firmware
+    // would, and for legacy strips on any op code that firmware didn't know:
+    // it ignored them, so a frame sent that way never showed. Other op codes
+    // are left alone and return 0.
+    int apply(const uint8_t* msg, StripUpdate& update);
+    bool configured() const;
+    // How long refreshing every strip takes, one after another like the
+    // redraw task, at ns_per_led per LED plus reset_ns per strip.
+    int64_t refresh_ns(int64_t ns_per_led, int64_t reset_ns) const;
+    uint32_t total_leds() const;
+
+private:
+    struct Strip {
+        uint8_t color_order;
+        uint32_t num_leds;
+        std::vector<uint8_t> pixels;
+    };
+    // Where stream_batches writes the pin it is on.
+    struct BatchTarget {
+        SimStrips* strips;
+        Strip* strip;
+        std::string error;
+    };
+    bool legacy;
+    std::map<uint8_t, Strip> strips;
+    bool have_baseline;
+    uint32_t baseline_seq;
+    bool resync_requested;
+
+    int fail(const std::string& why);
+    Strip* strip(uint8_t gpio_pin);
+    bool set_pixel(Strip* s, uint32_t index, const uint8_t* pixel);
+    int set_config(SetConfigMessage* msg);
+    int set_leds(SetLedsMessage* msg);
+    static bool begin_pin(void* ctx, uint8_t gpio_pin, uint32_t num_leds);
+    static void set_pixels(void* ctx, uint32_t index, const uint8_t* pixels, uint32_t count);
+    int apply_streamed(const uint8_t* msg, StripUpdate& update);
+    int apply_compressed_batches(const uint8_t* p, const uint8_t* end, uint8_t batch_count);
+    int apply_quantized_batches(const uint8_t* p, const uint8_t* end, uint8_t depth, uint8_t batch_count);
+    int apply_delta_batches(const uint8_t* p, const uint8_t* end, uint8_t batch_count);
+    void full_frame(uint32_t seq, uint8_t flags, StripUpdate& update);
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include "fleet-stats.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Frames LatchTable remembers, about a minute at 60 fps.
+const uint32_t LATCH_TABLE_SLOTS = 4096;
+
+int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void store_max(std::atomic<int64_t>& max, int64_t value) {
+    int64_t seen = max.load();
+    while (value > seen && !max.compare_exchange_weak(seen, value)) {}
+}
+
+SimStats::SimStats()
+    : frames(0), bytes(0), latches(0), coalesced(0), torn(0), seq_gaps(0), lost(0),
+      resyncs(0), rejected(0), reconnects(0),
+      latency_count(0), latency_sum_ns(0), latency_max_ns(0), latency_peak_ns(0),
+      lag_count(0), lag_sum_ns(0), lag_max_ns(0), lag_peak_ns(0),
+      clock_error_count(0), clock_error_sum_ns(0), clock_error_max_ns(0), clock_error_peak_ns(0),
+      late_presents(0)
+{}
+
+void SimStats::add_latency(int64_t ns) {
+    this->latency_count++;
+    this->latency_sum_ns += ns;
+    store_max(this->latency_max_ns, ns);
+    store_max(this->latency_peak_ns, ns);
+}
+
+void SimStats::add_lag(int64_t ns) {
+    this->lag_count++;
+    this->lag_sum_ns += ns;
+    store_max(this->lag_max_ns, ns);
+    store_max(this->lag_peak_ns, ns);
+}
+
+void SimStats::add_clock_error(int64_t ns) {
+    this->clock_error_count++;
+    this->clock_error_sum_ns += ns;
+    store_max(this->clock_error_max_ns, ns);
+    store_max(this->clock_error_peak_ns, ns);
+}
+
+void SimStatsSample::take(SimStats& stats) {
+    this->frames = stats.frames.load();
+    this->bytes = stats.bytes.load();
+    this->latches = stats.latches.load();
+    this->coalesced = stats.coalesced.load();
+    this->torn = stats.torn.load();
+    this->seq_gaps = stats.seq_gaps.load();
+    this->lost = stats.lost.load();
+    this->resyncs = stats.resyncs.load();
+    this->rejected = stats.rejected.load();
+    this->reconnects = stats.reconnects.load();
+    this->latency_count = stats.latency_count.load();
+    this->latency_sum_ns = stats.latency_sum_ns.load();
+    this->latency_max_ns = stats.latency_max_ns.exchange(0);
+    this->latency_peak_ns = stats.latency_peak_ns.load();
+    this->lag_count = stats.lag_count.load();
+    this->lag_sum_ns = stats.lag_sum_ns.load();
+    this->lag_max_ns = stats.lag_max_ns.exchange(0);
+    this->lag_peak_ns = stats.lag_peak_ns.load();
+    this->clock_error_count = stats.clock_error_count.load();
+    this->clock_error_sum_ns = stats.clock_error_sum_ns.load();
+    this->clock_error_max_ns = stats.clock_error_max_ns.exchange(0);
+    this->clock_error_peak_ns = stats.clock_error_peak_ns.load();
+    this->late_presents = stats.late_presents.load();
+}
+
+LatchTable::LatchTable()
+    : mut(),
+      slots(LATCH_TABLE_SLOTS),
+      skews(),
+      run_skews(),
+      run_frames(0),
+      run_clients(0)
+{
+    this->skews.reserve(LATCH_TABLE_SLOTS);
+}
+
+// The slot for seq, taken over from whichever older frame had it.
+LatchTable::Slot& LatchTable::slot_locked(uint32_t seq, int64_t now) {
+    Slot& slot = this->slots[seq % LATCH_TABLE_SLOTS];
+    if (!slot.used || slot.seq != seq) {
+        slot = Slot();
+        slot.used = true;
+        slot.seq = seq;
+        slot.first_arrival = now;
+    }
+    slot.last_touch = now;
+    return slot;
+}
+
+int64_t LatchTable::arrived(uint32_t seq, int64_t now) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    Slot& slot = this->slot_locked(seq, now);
+    return now - slot.first_arrival;
+}
+
+void LatchTable::latched(uint32_t seq, int64_t now) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    Slot& slot = this->slot_locked(seq, now);
+    if (slot.latches == 0) {
+        slot.first_latch = now;
+    }
+    slot.last_latch = now;
+    slot.latches++;
+}
+
+// Sorts skews to summarise them.
+static SkewSummary summarise(std::vector<int64_t>& skews, uint64_t frames, uint64_t clients) {
+    SkewSummary summary = SkewSummary();
+    summary.frames = frames;
+    if (frames > 0) {
+        summary.avg_clients = (double)clients / frames;
+    }
+    summary.compared = skews.size();
+    if (!skews.empty()) {
+        std::sort(skews.begin(), skews.end());
+        int64_t sum = 0;
+        for (int64_t skew : skews) {
+            sum += skew;
+        }
+        summary.avg_ns = sum / (int64_t)skews.size();
+        summary.p95_ns = skews[skews.size() * 95 / 100];
+        summary.max_ns = skews.back();
+    }
+    return summary;
+}
+
+SkewSummary LatchTable::collect(int64_t settled) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    uint64_t frames = 0;
+    uint64_t clients = 0;
+    this->skews.clear();
+    for (Slot& slot : this->slots) {
+        if (!slot.used || slot.collected || slot.latches == 0 || slot.last_touch >= settled) {
+            continue;
+        }
+        slot.collected = true;
+        frames++;
+        clients += slot.latches;
+        if (slot.latches > 1) {
+            this->skews.push_back(slot.last_latch - slot.first_latch);
+        }
+    }
+    this->run_frames += frames;
+    this->run_clients += clients;
+    this->run_skews.insert(this->run_skews.end(), this->skews.begin(), this->skews.end());
+    return summarise(this->skews, frames, clients);
+}
+
+SkewSummary LatchTable::whole_run() {
+    std::lock_guard<std::mutex> lock(this->mut);
+    return summarise(this->run_skews, this->run_frames, this->run_clients);
+}
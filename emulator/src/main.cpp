@@ -0,0 +1,245 @@
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "fleet-stats.hpp"
+#include "sim-client.hpp"
+
+// A frame's latch skew is only summarised once no client has touched it for
+// this long, plus any injected latency.
+const int64_t SKEW_SETTLE_NS = 1000000000;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void on_interrupt(int) {
+    interrupted = 1;
+}
+
+static void usage(const char* program) {
+    std::cerr << "Usage: " << program << " [options] [MAC...]\n"
+              << "Simulates ESP32 clients checking in with the LED wall server.\n"
+              << "  --server HOST        server to check in with (127.0.0.1)\n"
+              << "  --ports FIRST-LAST   ports to try in order (7070-7074)\n"
+              << "  --base-mac MAC       with --clients, MACs to count up from\n"
+              << "  --clients N          how many MACs to count up from --base-mac\n"
+              << "  --tcp-only           don't listen for frames over UDP\n"
+              << "  --legacy-check-in    check in and take messages like firmware without capabilities\n"
+              << "  --latency MS         handle every message MS late\n"
+              << "  --jitter MS          and up to MS later still\n"
+              << "  --loss FRACTION      drop this fraction of frames and UDP datagrams\n"
+              << "  --read-rate BYTES    read TCP no faster than BYTES per second\n"
+              << "  --us-per-led US      WS2812 refresh time per LED (30)\n"
+              << "  --reset-us US        latch gap after each strip (280)\n"
+              << "  --clock-drift PPM    run each client's clock up to PPM fast or slow (0)\n"
+              << "  --duration S         stop after S seconds, 0 to run until Ctrl-C (0)\n"
+              << "  --report S           print stats every S seconds (5)\n";
+    exit(-1);
+}
+
+static double ms(int64_t ns) {
+    return ns / 1e6;
+}
+
+static double per_sec(uint64_t count, double seconds) {
+    return seconds > 0 ? count / seconds : 0;
+}
+
+static double avg_ms(int64_t sum_ns, uint64_t count) {
+    return count > 0 ? ms(sum_ns / (int64_t)count) : 0;
+}
+
+// Prints what changed since last, fleet first and then each client. The
+// whole run is reported with an empty last and its peaks.
+static void report(std::vector<SimClient*>& clients, std::vector<SimStatsSample>& last,
+                   std::vector<SimStatsSample>& now, const SkewSummary& skew,
+                   double elapsed, double window, bool whole_run) {
+    int connected = 0;
+    uint64_t frames = 0, latches_done = 0;
+    for (size_t i = 0; i < clients.size(); ++i) {
+        connected += clients[i]->connected();
+        frames += now[i].frames - last[i].frames;
+        latches_done += now[i].latches - last[i].latches;
+    }
+
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1)
+        << "[" << elapsed << " s] " << connected << "/" << clients.size() << " connected, "
+        << per_sec(frames, window) / clients.size() << " fps in, "
+        << per_sec(latches_done, window) / clients.size() << " refreshes per client\n"
+        << std::setprecision(2)
+        << "  latch skew avg " << ms(skew.avg_ns) << " ms, p95 " << ms(skew.p95_ns)
+        << " ms, max " << ms(skew.max_ns) << " ms over " << skew.compared << " of "
+        << skew.frames << " frames (" << skew.avg_clients << " clients each)\n";
+    for (size_t i = 0; i < clients.size(); ++i) {
+        SimStatsSample& a = last[i];
+        SimStatsSample& b = now[i];
+        out << std::setprecision(1)
+            << "  " << clients[i]->name << ": " << per_sec(b.frames - a.frames, window) << " fps in, "
+            << per_sec(b.latches - a.latches, window) << " refreshes"
+            << std::setprecision(2)
+            << ", latency avg " << avg_ms(b.latency_sum_ns - a.latency_sum_ns, b.latency_count - a.latency_count)
+            << " max " << ms(whole_run ? b.latency_peak_ns : b.latency_max_ns) << " ms"
+            << ", lag avg " << avg_ms(b.lag_sum_ns - a.lag_sum_ns, b.lag_count - a.lag_count)
+            << " max " << ms(whole_run ? b.lag_peak_ns : b.lag_max_ns) << " ms"
+            << ", clock error avg " << avg_ms(b.clock_error_sum_ns - a.clock_error_sum_ns,
+                                              b.clock_error_count - a.clock_error_count)
+            << " max " << ms(whole_run ? b.clock_error_peak_ns : b.clock_error_max_ns) << " ms, "
+            << b.late_presents - a.late_presents << " late, "
+            << b.seq_gaps - a.seq_gaps << " seq gaps, "
+            << b.lost - a.lost << " lost, "
+            << b.coalesced - a.coalesced << " coalesced, "
+            << b.torn - a.torn << " torn, "
+            << b.resyncs - a.resyncs << " resyncs, "
+            << b.rejected - a.rejected << " rejected, "
+            << b.reconnects - a.reconnects << " reconnects\n";
+    }
+    std::cout << out.str() << std::flush;
+}
+
+static void take_all(std::vector<SimClient*>& clients, std::vector<SimStatsSample>& samples) {
+    for (size_t i = 0; i < clients.size(); ++i) {
+        samples[i].take(clients[i]->stats);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    SimOptions options;
+    std::vector<std::string> macs;
+    std::string base_mac;
+    int num_clients = 0;
+    double duration_s = 0;
+    double report_s = 5;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--tcp-only") {
+            options.udp = false;
+            continue;
+        }
+        if (arg == "--legacy-check-in") {
+            options.capabilities = false;
+            continue;
+        }
+        if (arg.rfind("--", 0) != 0) {
+            macs.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        std::string value = argv[++i];
+        try {
+            if (arg == "--server") {
+                options.host = value;
+            } else if (arg == "--ports") {
+                size_t dash = value.find('-');
+                options.port_start = std::stoi(value.substr(0, dash));
+                options.port_end = dash == std::string::npos ? options.port_start : std::stoi(value.substr(dash + 1));
+            } else if (arg == "--base-mac") {
+                base_mac = value;
+            } else if (arg == "--clients") {
+                num_clients = std::stoi(value);
+            } else if (arg == "--latency") {
+                options.latency_ns = std::stod(value) * 1e6;
+            } else if (arg == "--jitter") {
+                options.jitter_ns = std::stod(value) * 1e6;
+            } else if (arg == "--loss") {
+                options.loss = std::stod(value);
+            } else if (arg == "--read-rate") {
+                options.read_bytes_per_sec = std::stoll(value);
+            } else if (arg == "--us-per-led") {
+                options.ns_per_led = std::stod(value) * 1e3;
+            } else if (arg == "--reset-us") {
+                options.reset_ns = std::stod(value) * 1e3;
+            } else if (arg == "--clock-drift") {
+                options.clock_drift = std::stod(value) / 1e6;
+            } else if (arg == "--duration") {
+                duration_s = std::stod(value);
+            } else if (arg == "--report") {
+                report_s = std::stod(value);
+            } else {
+                usage(argv[0]);
+            }
+        } catch (std::exception&) {
+            std::cerr << "Bad value for " << arg << ": " << value << "\n";
+            usage(argv[0]);
+        }
+    }
+
+    LatchTable latches;
+    std::vector<SimClient*> clients;
+    for (const std::string& text : macs) {
+        uint8_t mac[6];
+        if (!parse_mac(text, mac)) {
+            std::cerr << "Bad MAC address: " << text << "\n";
+            exit(-1);
+        }
+        clients.push_back(new SimClient(mac, options, &latches));
+    }
+    if (num_clients > 0) {
+        uint8_t mac[6];
+        if (!parse_mac(base_mac, mac)) {
+            std::cerr << "--clients needs a --base-mac\n";
+            exit(-1);
+        }
+        for (int i = 0; i < num_clients; ++i) {
+            clients.push_back(new SimClient(mac, options, &latches));
+            // Count up through the low bytes.
+            for (int b = 5; b >= 0 && ++mac[b] == 0; --b) {}
+        }
+    }
+    if (clients.empty() || report_s <= 0) {
+        usage(argv[0]);
+    }
+
+    signal(SIGINT, on_interrupt);
+    signal(SIGTERM, on_interrupt);
+    std::cout << "Simulating " << clients.size() << " clients against " << options.host << ":"
+              << options.port_start << "-" << options.port_end << "\n";
+    for (SimClient* c : clients) {
+        c->start();
+    }
+
+    std::vector<SimStatsSample> first(clients.size());
+    std::vector<SimStatsSample> last(clients.size());
+    std::vector<SimStatsSample> now_stats(clients.size());
+    int64_t start = now_ns();
+    int64_t last_report = start;
+    int64_t settle = SKEW_SETTLE_NS + options.latency_ns + options.jitter_ns;
+    while (!interrupted) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        int64_t now = now_ns();
+        bool done = duration_s > 0 && now - start >= duration_s * 1e9;
+        if (!done && now - last_report < report_s * 1e9) {
+            continue;
+        }
+        take_all(clients, now_stats);
+        report(clients, last, now_stats, latches.collect(now - settle),
+               (now - start) / 1e9, (now - last_report) / 1e9, false);
+        last = now_stats;
+        last_report = now;
+        if (done) {
+            break;
+        }
+    }
+
+    for (SimClient* c : clients) {
+        c->stop();
+    }
+    int64_t now = now_ns();
+    take_all(clients, now_stats);
+    latches.collect(now);
+    std::cout << "Whole run:\n";
+    report(clients, first, now_stats, latches.whole_run(), (now - start) / 1e9, (now - start) / 1e9, true);
+    for (SimClient* c : clients) {
+        delete c;
+    }
+    return 0;
+}
@@ -0,0 +1,772 @@
+#include "sim-client.hpp"
+#include "batch_stream.hpp"
+#include "clock_sync.hpp"
+#include "fleet-stats.hpp"
+#include "protocol.hpp"
+#include "sim-strips.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <string>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+// The firmware's ports, timeouts and message limits.
+#include "network.hpp"
+
+// Messages read ahead of the one being handled. Past this the reader stops
+// and the socket fills, as it would on a client that can't keep up.
+const size_t MAX_INBOX = 64;
+// Largest read while --read-rate is capping the reader.
+const uint32_t THROTTLED_READ = 1460;
+// How often the reader looks up from select to check it should stop.
+const int READER_POLL_MS = 100;
+// CONFIG_LWIP_TCP_WND_DEFAULT in client/sdkconfig. The socket buffers no
+// more than the firmware's window, so a slow reader pushes back on the
+// server as soon as a real client would.
+const int ESP32_TCP_WINDOW = 65534;
+const int64_t WS2812_NS_PER_LED = 30000;
+const int64_t WS2812_RESET_NS = 280000;
+// Each client's clock starts up to this long before the emulator, as though
+// the ESP32s had booted at different times.
+const int64_t MAX_BOOT_AGE_NS = 60000000000;
+// As MAX_PRESENT_DELAY_US in the firmware.
+const int64_t MAX_PRESENT_DELAY_NS = 1000000000;
+// SOC_RMT_TX_CANDIDATES_PER_GROUP on the original ESP32.
+const uint8_t ESP32_RMT_CHANNELS = 8;
+
+SimOptions::SimOptions()
+    : host("127.0.0.1"),
+      port_start(SERVER_PORT_START),
+      port_end(SERVER_PORT_END),
+      udp(true),
+      latency_ns(0),
+      jitter_ns(0),
+      loss(0),
+      read_bytes_per_sec(0),
+      ns_per_led(WS2812_NS_PER_LED),
+      reset_ns(WS2812_RESET_NS),
+      clock_drift(0),
+      capabilities(true)
+{}
+
+bool parse_mac(const std::string& text, uint8_t mac[6]) {
+    std::string digits;
+    for (char ch : text) {
+        if (ch == '-' || ch == ':') {
+            continue;
+        }
+        if (!isxdigit((unsigned char)ch)) {
+            return false;
+        }
+        digits += ch;
+    }
+    if (digits.size() != 12) {
+        return false;
+    }
+    for (int i = 0; i < 6; ++i) {
+        mac[i] = (uint8_t)std::stoi(digits.substr(i * 2, 2), NULL, 16);
+    }
+    return true;
+}
+
+static bool is_frame_op(uint8_t op_code) {
+    switch (op_code) {
+        case OP_SET_LEDS_BATCHED:
+        case OP_SET_LEDS_FRAME:
+        case OP_SET_LEDS_DELTA:
+        case OP_SET_LEDS_COMPRESSED:
+        case OP_SET_LEDS_QUANTIZED:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// The frame_seq of a numbered frame message, which always follows the
+// header and flags.
+static bool peek_frame_seq(const std::vector<uint8_t>& data, uint32_t* seq) {
+    uint8_t op_code = get_message_op_code(data.data());
+    if (op_code == OP_SET_LEDS_BATCHED || !is_frame_op(op_code) ||
+        data.size() < sizeof(SetLedsFrameMessage)) {
+        return false;
+    }
+    *seq = ((const SetLedsFrameMessage*)data.data())->frame_seq;
+    return true;
+}
+
+// Whether frame a was sent before frame b, allowing for wrap-around.
+static bool seq_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+// Sends a message from one of the encode_* functions and frees it. size is
+// taken by pointer because the encoder sets it in the same call.
+static bool send_all(int socket, uint8_t* message, const uint32_t* size) {
+    if (!message) {
+        return false;
+    }
+    ssize_t sent = send(socket, message, *size, MSG_NOSIGNAL);
+    free_message_buffer(message);
+    return sent == (ssize_t)*size;
+}
+
+SimClient::SimClient(const uint8_t mac[6], const SimOptions& options, LatchTable* latches)
+    : name(),
+      stats(),
+      options(options),
+      latches(latches),
+      stopping(false),
+      is_connected(false),
+      current_socket(-1),
+      session_thread(),
+      reader_thread(),
+      redraw_thread(),
+      rng(),
+      strips_mut(),
+      strips(!options.capabilities),
+      inbox_mut(),
+      inbox_cv(),
+      inbox(),
+      conn_closed(false),
+      last_due(0),
+      redraw_mut(),
+      redraw_cv(),
+      redraw_pending(0),
+      loaded_has_seq(false),
+      loaded_seq(0),
+      loaded_arrival(0),
+      loaded_recv(0),
+      pending_has_seq(false),
+      pending_seq(0),
+      pending_arrival(0),
+      pending_recv(0),
+      refreshing(false),
+      latch_timer_armed(false),
+      latch_due(0),
+      have_last_seq(false),
+      last_seq(0),
+      udp_frame(),
+      udp_have_latest(false),
+      udp_assembling(false),
+      udp_latest_seq(0),
+      udp_frame_size(0),
+      udp_fragments_left(0),
+      udp_fragments_seen(0),
+      boot_ns(0),
+      drift(0),
+      clock()
+{
+    memcpy(this->mac, mac, sizeof(this->mac));
+    char text[18];
+    snprintf(text, sizeof(text), "%02X-%02X-%02X-%02X-%02X-%02X",
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    this->name = text;
+    std::seed_seq seed(mac, mac + 6);
+    this->rng.seed(seed);
+    this->boot_ns = now_ns() - std::uniform_int_distribution<int64_t>(0, MAX_BOOT_AGE_NS)(this->rng);
+    this->drift = std::uniform_real_distribution<double>(-options.clock_drift, options.clock_drift)(this->rng);
+    clock_sync_reset(&this->clock);
+}
+
+// The simulated esp_timer_get_time(): microseconds since this client booted,
+// running fast or slow by its drift.
+int64_t SimClient::local_us(int64_t real_ns) const {
+    return (int64_t)((real_ns - this->boot_ns) * (1.0 + this->drift) / 1000);
+}
+
+int64_t SimClient::real_ns(int64_t local_us) const {
+    return this->boot_ns + (int64_t)(local_us * 1000 / (1.0 + this->drift));
+}
+
+SimClient::~SimClient() {
+    this->stop();
+}
+
+void SimClient::start() {
+    this->redraw_thread = std::thread(&SimClient::redraw_task, this);
+    this->session_thread = std::thread(&SimClient::session, this);
+}
+
+void SimClient::stop() {
+    {
+        // Under the lock, so the session can't close the socket in between.
+        std::lock_guard<std::mutex> lock(this->inbox_mut);
+        this->stopping = true;
+        if (this->current_socket != -1) {
+            shutdown(this->current_socket, SHUT_RDWR);
+        }
+        this->inbox_cv.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->redraw_mut);
+        this->redraw_cv.notify_all();
+    }
+    if (this->session_thread.joinable()) {
+        this->session_thread.join();
+    }
+    if (this->redraw_thread.joinable()) {
+        this->redraw_thread.join();
+    }
+}
+
+bool SimClient::connected() const {
+    return this->is_connected.load();
+}
+
+// One connection after another, like app_main's loop around blocking_checkin.
+void SimClient::session() {
+    bool first = true;
+    while (!this->stopping) {
+        int tcp_socket = this->check_in();
+        if (tcp_socket < 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(CHECK_IN_DELAY_MS));
+            continue;
+        }
+        if (!first) {
+            this->stats.reconnects++;
+        }
+        first = false;
+        // Firmware from before capabilities were sent had no UDP port or
+        // time sync.
+        bool legacy = !this->options.capabilities;
+        int udp_socket = this->options.udp && !legacy ? this->open_udp(tcp_socket) : -1;
+
+        {
+            std::lock_guard<std::mutex> lock(this->inbox_mut);
+            this->inbox.clear();
+            this->conn_closed = false;
+            this->last_due = 0;
+            this->current_socket = tcp_socket;
+        }
+        this->have_last_seq = false;
+        this->is_connected = true;
+        this->reader_thread = std::thread(&SimClient::reader, this, tcp_socket, udp_socket);
+
+        // The server may have restarted with a different clock.
+        clock_sync_reset(&this->clock);
+        Inbound msg;
+        while (true) {
+            int64_t until = INT64_MAX;
+            if (!legacy) {
+                this->send_time_ping(tcp_socket);
+                until = this->real_ns(clock_sync_next_ping(&this->clock));
+            }
+            int got = this->next_message(msg, until);
+            if (got < 0 || (got > 0 && this->handle_message(tcp_socket, msg) != 0)) {
+                break;
+            }
+        }
+
+        this->is_connected = false;
+        this->close_conn();
+        shutdown(tcp_socket, SHUT_RDWR);
+        this->reader_thread.join();
+        {
+            std::lock_guard<std::mutex> lock(this->inbox_mut);
+            this->current_socket = -1;
+        }
+        close(tcp_socket);
+        if (udp_socket >= 0) {
+            close(udp_socket);
+        }
+        if (!this->stopping) {
+            std::cout << this->name + ": disconnected, checking in again\n";
+            std::this_thread::sleep_for(std::chrono::milliseconds(CHECK_IN_DELAY_MS));
+        }
+    }
+}
+
+// Everything the firmware's fill_capabilities() lists, which the emulator
+// handles too. Frames only come over UDP if it listens there.
+static void fill_capabilities(const SimOptions& options, ClientCapabilities* caps) {
+    memset(caps, 0, sizeof(*caps));
+    caps->version = CHECK_IN_VERSION;
+    caps->max_message_size = MAX_MESSAGE_SIZE;
+    caps->op_codes = CAPS_BIT(OP_SET_LEDS) | CAPS_BIT(OP_SET_LEDS_BATCHED) | CAPS_BIT(OP_SET_LEDS_FRAME) |
+        CAPS_BIT(OP_SET_LEDS_COMPRESSED) | CAPS_BIT(OP_SET_LEDS_QUANTIZED) | CAPS_BIT(OP_SET_LEDS_DELTA) |
+        CAPS_BIT(OP_GET_LOGS) | CAPS_BIT(OP_REDRAW) | CAPS_BIT(OP_SET_CONFIG) | CAPS_BIT(OP_TIME_PONG) |
+        CAPS_BIT(OP_FRAME_FRAGMENT);
+    caps->pixel_encodings =
+        CAPS_BIT(PIXEL_ENCODING_RAW) | CAPS_BIT(PIXEL_ENCODING_RLE) | CAPS_BIT(PIXEL_ENCODING_PALETTE);
+    caps->wire_depths = CAPS_WIRE_DEPTH_RGB565 | CAPS_WIRE_DEPTH_RGB444;
+    caps->frame_flags = LEDS_FRAME_FLAG_LATCH | LEDS_FRAME_FLAG_PRESENT_AT;
+    caps->features = CAPS_FEATURE_STREAMED_BATCHES | (options.udp ? CAPS_FEATURE_UDP : 0);
+    caps->rmt_channels = ESP32_RMT_CHANNELS;
+}
+
+// Connects to the first port that answers and checks in, as checkin() does,
+// or with only the MAC address as older firmware did. Returns the socket or
+// -1.
+int SimClient::check_in() {
+    sockaddr_in dest_addr;
+    memset(&dest_addr, 0, sizeof(dest_addr));
+    dest_addr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, this->options.host.c_str(), &dest_addr.sin_addr.s_addr) != 1) {
+        addrinfo hints = {};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* res = NULL;
+        if (getaddrinfo(this->options.host.c_str(), NULL, &hints, &res) != 0 || !res) {
+            return -1;
+        }
+        dest_addr.sin_addr = ((sockaddr_in*)res->ai_addr)->sin_addr;
+        freeaddrinfo(res);
+    }
+
+    int socket_fd = -1;
+    for (uint32_t port = this->options.port_start; port <= this->options.port_end; ++port) {
+        socket_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+        if (socket_fd < 0) {
+            continue;
+        }
+        timeval tv = {RECV_TIMEOUT_SEC, 0};
+        setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        // Linux doubles this for its bookkeeping, leaving about the window.
+        int window = ESP32_TCP_WINDOW;
+        setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &window, sizeof(window));
+        dest_addr.sin_port = htons(port);
+        if (connect(socket_fd, (sockaddr*)&dest_addr, sizeof(dest_addr)) == 0) {
+            break;
+        }
+        close(socket_fd);
+        socket_fd = -1;
+    }
+    if (socket_fd < 0) {
+        return -1;
+    }
+
+    ClientCapabilities caps;
+    fill_capabilities(this->options, &caps);
+    uint32_t message_size = 0;
+    uint8_t* message = encode_check_in(this->mac, this->options.capabilities ? &caps : NULL, &message_size);
+    if (!send_all(socket_fd, message, &message_size)) {
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
+
+// Listens for frames on a UDP port and tells the server, as open_udp() does.
+int SimClient::open_udp(int tcp_socket) {
+    int udp_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (udp_socket < 0) {
+        return -1;
+    }
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    socklen_t addr_len = sizeof(addr);
+    uint32_t message_size = 0;
+    if (bind(udp_socket, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+        getsockname(udp_socket, (sockaddr*)&addr, &addr_len) != 0 ||
+        !send_all(tcp_socket, encode_udp_port(ntohs(addr.sin_port), &message_size), &message_size)) {
+        close(udp_socket);
+        return -1;
+    }
+    this->udp_have_latest = false;
+    this->udp_assembling = false;
+    return udp_socket;
+}
+
+void SimClient::reader(int tcp_socket, int udp_socket) {
+    while (!this->stopping) {
+        {
+            std::lock_guard<std::mutex> lock(this->inbox_mut);
+            if (this->conn_closed) {
+                break;
+            }
+        }
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(tcp_socket, &readable);
+        if (udp_socket >= 0) {
+            FD_SET(udp_socket, &readable);
+        }
+        timeval tv = {0, READER_POLL_MS * 1000};
+        int ready = select(std::max(tcp_socket, udp_socket) + 1, &readable, NULL, NULL, &tv);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        if (udp_socket >= 0 && FD_ISSET(udp_socket, &readable)) {
+            this->read_udp_fragment(udp_socket);
+        }
+        if (FD_ISSET(tcp_socket, &readable) && this->read_tcp_message(tcp_socket) != 0) {
+            break;
+        }
+    }
+    this->close_conn();
+}
+
+void SimClient::close_conn() {
+    std::lock_guard<std::mutex> lock(this->inbox_mut);
+    this->conn_closed = true;
+    this->inbox_cv.notify_all();
+}
+
+int SimClient::read_exact(int socket, uint8_t* buf, uint32_t len) {
+    uint32_t total = 0;
+    while (total < len) {
+        uint32_t want = len - total;
+        if (this->options.read_bytes_per_sec > 0) {
+            want = std::min(want, THROTTLED_READ);
+        }
+        ssize_t n = recv(socket, buf + total, want, MSG_WAITALL);
+        if (n > 0) {
+            total += n;
+            if (this->options.read_bytes_per_sec > 0) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(n * 1000000000LL / this->options.read_bytes_per_sec));
+            }
+        } else if (n == 0) {
+            return -1;
+        } else if ((errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) && !this->stopping) {
+            continue;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Reads one message like parse_tcp_message, refusing the same sizes. The
+// firmware streams SetLedsFrame and SetLedsBatched into its strips, so they
+// may be any size; here they are still read whole, to be delayed in the inbox,
+// and stream_batches applies them later. Firmware from before capabilities
+// were sent refused them too.
+int SimClient::read_tcp_message(int socket) {
+    uint8_t size_buffer[sizeof(MessageHeader)];
+    if (this->read_exact(socket, size_buffer, sizeof(size_buffer)) != 0) {
+        return -1;
+    }
+    uint32_t message_size = get_message_size(size_buffer);
+    bool streamed = this->options.capabilities && is_streamed_op(get_message_op_code(size_buffer));
+    if (message_size < sizeof(MessageHeader) || (message_size > MAX_MESSAGE_SIZE && !streamed)) {
+        std::cout << this->name + ": refusing a " + std::to_string(message_size) + " byte message\n";
+        this->stats.rejected++;
+        return -1;
+    }
+    std::vector<uint8_t> data(message_size);
+    memcpy(data.data(), size_buffer, sizeof(size_buffer));
+    if (this->read_exact(socket, data.data() + sizeof(size_buffer), message_size - sizeof(size_buffer)) != 0) {
+        return -1;
+    }
+    if (is_frame_op(get_message_op_code(data.data())) && this->lose()) {
+        this->stats.lost++;
+        return 0;
+    }
+    this->deliver(data);
+    return 0;
+}
+
+// Takes one datagram into the frame being reassembled, as parse_udp_fragment
+// does, delivering the frame once it is whole.
+void SimClient::read_udp_fragment(int socket) {
+    uint8_t datagram[MAX_UDP_DATAGRAM];
+    ssize_t len = recv(socket, datagram, sizeof(datagram), MSG_DONTWAIT);
+    if (len < (ssize_t)sizeof(MessageHeader) ||
+        get_message_size(datagram) != (uint32_t)len ||
+        get_message_op_code(datagram) != OP_FRAME_FRAGMENT) {
+        return;
+    }
+    if (this->lose()) {
+        this->stats.lost++;
+        return;
+    }
+    FrameFragmentMessage* frag = decode_frame_fragment(datagram);
+    if (!frag || frag->fragment_count > MAX_FRAME_FRAGMENTS || frag->total_size > MAX_MESSAGE_SIZE) {
+        return;
+    }
+
+    uint32_t seq = frag->frame_seq;
+    bool current = this->udp_assembling && seq == this->udp_latest_seq;
+    if (!current && this->udp_have_latest && !seq_before(this->udp_latest_seq, seq)) {
+        return;
+    }
+    if (!current) {
+        this->udp_frame.resize(std::max<size_t>(this->udp_frame.size(), frag->total_size));
+        this->udp_have_latest = true;
+        this->udp_assembling = true;
+        this->udp_latest_seq = seq;
+        this->udp_frame_size = frag->total_size;
+        this->udp_fragments_left = frag->fragment_count;
+        this->udp_fragments_seen = 0;
+    }
+
+    uint64_t bit = 1ULL << frag->fragment_index;
+    if (frag->total_size != this->udp_frame_size || (this->udp_fragments_seen & bit)) {
+        return;
+    }
+    memcpy(this->udp_frame.data() + frag->offset, datagram + sizeof(FrameFragmentMessage),
+           len - sizeof(FrameFragmentMessage));
+    this->udp_fragments_seen |= bit;
+    if (--this->udp_fragments_left > 0) {
+        return;
+    }
+
+    this->udp_assembling = false;
+    if (this->udp_frame_size < sizeof(MessageHeader) ||
+        get_message_size(this->udp_frame.data()) != this->udp_frame_size) {
+        return;
+    }
+    std::vector<uint8_t> data(this->udp_frame.begin(), this->udp_frame.begin() + this->udp_frame_size);
+    this->deliver(data);
+}
+
+bool SimClient::lose() {
+    return this->options.loss > 0 &&
+           std::uniform_real_distribution<double>(0, 1)(this->rng) < this->options.loss;
+}
+
+// Queues a message to be handled once its injected latency has passed,
+// waiting while the inbox is full.
+void SimClient::deliver(std::vector<uint8_t>& data) {
+    int64_t arrival = now_ns();
+    uint32_t seq;
+    if (peek_frame_seq(data, &seq)) {
+        this->stats.add_lag(this->latches->arrived(seq, arrival));
+    }
+    int64_t due = arrival + this->options.latency_ns;
+    if (this->options.jitter_ns > 0) {
+        due += std::uniform_int_distribution<int64_t>(0, this->options.jitter_ns)(this->rng);
+    }
+    std::unique_lock<std::mutex> lock(this->inbox_mut);
+    this->inbox_cv.wait(lock, [&]() {
+        return this->inbox.size() < MAX_INBOX || this->conn_closed || this->stopping;
+    });
+    if (this->conn_closed || this->stopping) {
+        return;
+    }
+    // Messages on one connection arrive in order, jitter or not.
+    due = std::max(due, this->last_due);
+    this->last_due = due;
+    this->inbox.push_back(Inbound{std::move(data), arrival, due});
+    this->inbox_cv.notify_all();
+}
+
+// Waits for the next message to come due. Returns false once the connection
+// is closed and everything read before that has been handled.
+int SimClient::next_message(Inbound& msg, int64_t until) {
+    std::unique_lock<std::mutex> lock(this->inbox_mut);
+    while (!this->stopping) {
+        int64_t now = now_ns();
+        if (!this->inbox.empty() && this->inbox.front().due <= now) {
+            msg = std::move(this->inbox.front());
+            this->inbox.pop_front();
+            this->inbox_cv.notify_all();
+            return 1;
+        }
+        if (this->inbox.empty() && this->conn_closed) {
+            return -1;
+        }
+        if (now >= until) {
+            return 0;
+        }
+        int64_t wake = this->inbox.empty() ? now + READER_POLL_MS * 1000000LL : this->inbox.front().due;
+        this->inbox_cv.wait_for(lock, std::chrono::nanoseconds(std::min(wake, until) - now));
+    }
+    return -1;
+}
+
+// Sends a TimePing if one is due, like send_time_ping in the firmware.
+void SimClient::send_time_ping(int tcp_socket) {
+    int64_t now = this->local_us(now_ns());
+    if (now < clock_sync_next_ping(&this->clock)) {
+        return;
+    }
+    uint8_t message[sizeof(TimePingMessage)];
+    uint32_t size = clock_sync_write_ping(&this->clock, message, now);
+    send(tcp_socket, message, size, MSG_NOSIGNAL);
+}
+
+// Takes a TimePong, and measures how far the estimate is from the truth,
+// which here is known: the server's clock is this machine's steady clock.
+void SimClient::time_pong(const uint8_t* buf) {
+    int64_t real = now_ns();
+    int64_t local = this->local_us(real);
+    clock_sync_pong(&this->clock, decode_time_pong(buf), local);
+    if (clock_sync_synced(&this->clock)) {
+        int64_t true_offset_us = real / 1000 - local;
+        this->stats.add_clock_error(std::abs(clock_sync_offset(&this->clock, local) - true_offset_us) * 1000);
+    }
+}
+
+// When to refresh for a frame with the latch flag, like latch_frame in the
+// firmware: at its present-at time on this client's estimate of the server's
+// clock, or at once. Returns 0 for at once.
+int64_t SimClient::latch_time(const StripUpdate& update) {
+    if (!update.has_present_at || !clock_sync_synced(&this->clock)) {
+        return 0;
+    }
+    int64_t due = this->real_ns(clock_sync_to_local(&this->clock, (int64_t)update.present_at_us));
+    int64_t delay = due - now_ns();
+    if (delay <= 0 || delay >= MAX_PRESENT_DELAY_NS) {
+        this->stats.late_presents++;
+        return 0;
+    }
+    return due;
+}
+
+// Handles a whole message like handle_message in the firmware. Returns -1
+// where the firmware would drop the connection.
+int SimClient::handle_message(int tcp_socket, const Inbound& msg) {
+    const uint8_t* buf = msg.data.data();
+    if (get_message_op_code(buf) == OP_TIME_PONG && this->options.capabilities) {
+        this->time_pong(buf);
+        return 0;
+    }
+    if (get_message_op_code(buf) == OP_GET_LOGS) {
+        // The firmware answers with its buffered log, which is empty here.
+        uint32_t size = 0;
+        return send_all(tcp_socket, encode_send_logs("", &size), &size) ? 0 : -1;
+    }
+
+    StripUpdate update;
+    {
+        std::lock_guard<std::mutex> lock(this->strips_mut);
+        if (this->strips.apply(buf, update) != 0) {
+            this->stats.rejected++;
+            std::cout << this->name + ": " + this->strips.error + ", dropping the connection\n";
+            return -1;
+        }
+    }
+
+    if (update.resync) {
+        this->stats.resyncs++;
+        uint32_t size = 0;
+        if (!send_all(tcp_socket, encode_resync(update.resync_seq, &size), &size)) {
+            return -1;
+        }
+    }
+    if (update.frame) {
+        this->stats.frames++;
+        this->stats.bytes += msg.data.size();
+        if (update.has_seq) {
+            if (this->have_last_seq && seq_before(this->last_seq, update.seq)) {
+                this->stats.seq_gaps += update.seq - this->last_seq - 1;
+            }
+            if (!this->have_last_seq || seq_before(this->last_seq, update.seq)) {
+                this->have_last_seq = true;
+                this->last_seq = update.seq;
+            }
+        }
+        std::lock_guard<std::mutex> lock(this->redraw_mut);
+        // The firmware writes straight into the buffers being sent out.
+        if (this->refreshing) {
+            this->stats.torn++;
+        }
+        this->loaded_has_seq = update.has_seq;
+        this->loaded_seq = update.seq;
+        this->loaded_arrival = msg.arrival;
+        // The firmware stamps a frame when its handler starts.
+        this->loaded_recv = now_ns();
+    }
+    if (update.latch) {
+        int64_t due = this->latch_time(update);
+        std::lock_guard<std::mutex> lock(this->redraw_mut);
+        if (due) {
+            // Replaces any frame still waiting, as restarting the timer does.
+            this->latch_timer_armed = true;
+            this->latch_due = due;
+        } else {
+            this->request_redraw_locked();
+        }
+        this->redraw_cv.notify_all();
+    }
+    return 0;
+}
+
+// Acks a frame the strips finished showing, from the redraw thread as the
+// firmware does, with its timestamps in microseconds.
+void SimClient::send_frame_ack(uint32_t seq, int64_t recv, int64_t latched) {
+    uint8_t message[sizeof(FrameAckMessage)];
+    uint32_t size = write_frame_ack(message, seq, recv / 1000, latched / 1000);
+    std::lock_guard<std::mutex> lock(this->inbox_mut);
+    if (this->current_socket != -1) {
+        send(this->current_socket, message, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+}
+
+// The redraw task runs at once on its own core, so the refresh shows what is
+// loaded now, not whatever arrives before that thread runs.
+void SimClient::request_redraw_locked() {
+    this->redraw_pending++;
+    this->pending_has_seq = this->loaded_has_seq;
+    this->pending_seq = this->loaded_seq;
+    this->pending_arrival = this->loaded_arrival;
+    this->pending_recv = this->loaded_recv;
+}
+
+// Refreshes the strips whenever asked, like redraw_task. Requests made while
+// a refresh is running are folded into the next one, as a task notification
+// taken with pdTRUE does.
+void SimClient::redraw_task() {
+    int64_t shown_arrival = 0;
+    while (true) {
+        bool has_seq;
+        uint32_t seq;
+        int64_t arrival;
+        int64_t recv;
+        {
+            std::unique_lock<std::mutex> lock(this->redraw_mut);
+            while (this->redraw_pending == 0 && !this->stopping) {
+                if (!this->latch_timer_armed) {
+                    this->redraw_cv.wait(lock);
+                } else if (now_ns() >= this->latch_due) {
+                    // The timer firing, which notifies like a latch would.
+                    this->latch_timer_armed = false;
+                    this->request_redraw_locked();
+                } else {
+                    this->redraw_cv.wait_until(lock, std::chrono::steady_clock::time_point(
+                        std::chrono::nanoseconds(this->latch_due)));
+                }
+            }
+            if (this->stopping) {
+                return;
+            }
+            this->stats.coalesced += this->redraw_pending - 1;
+            this->redraw_pending = 0;
+            has_seq = this->pending_has_seq;
+            seq = this->pending_seq;
+            arrival = this->pending_arrival;
+            recv = this->pending_recv;
+            this->refreshing = true;
+        }
+        int64_t start = now_ns();
+        int64_t refresh_ns;
+        {
+            std::lock_guard<std::mutex> lock(this->strips_mut);
+            refresh_ns = this->strips.refresh_ns(this->options.ns_per_led, this->options.reset_ns);
+        }
+        std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::nanoseconds(start + refresh_ns)));
+        int64_t done = now_ns();
+        {
+            std::lock_guard<std::mutex> lock(this->redraw_mut);
+            this->refreshing = false;
+        }
+        this->stats.latches++;
+        // Only the first refresh to show a frame counts towards its latency.
+        if (arrival != shown_arrival) {
+            shown_arrival = arrival;
+            this->stats.add_latency(done - arrival);
+            if (has_seq) {
+                this->latches->latched(seq, done);
+                this->send_frame_ack(seq, recv, done);
+            }
+        }
+    }
+}
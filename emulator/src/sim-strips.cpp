@@ -0,0 +1,377 @@
+#include "sim-strips.hpp"
+#include "batch_stream.hpp"
+#include "protocol.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Where decode_pixels and expand_pixels hand a pin's pixels.
+struct StripSink {
+    std::vector<uint8_t>* pixels;
+    uint32_t num_leds;
+    uint8_t ro, go, bo;
+    bool overflow;
+};
+
+static void set_strip_pixel(void* ctx, uint32_t index, const uint8_t* pixel) {
+    StripSink* sink = (StripSink*)ctx;
+    if (index >= sink->num_leds) {
+        sink->overflow = true;
+        return;
+    }
+    uint8_t* out = sink->pixels->data() + index * 3;
+    out[0] = pixel[sink->ro];
+    out[1] = pixel[sink->go];
+    out[2] = pixel[sink->bo];
+}
+
+SimStrips::SimStrips(bool legacy)
+    : error(),
+      legacy(legacy),
+      strips(),
+      have_baseline(false),
+      baseline_seq(0),
+      resync_requested(false)
+{}
+
+bool SimStrips::configured() const {
+    return !this->strips.empty();
+}
+
+int64_t SimStrips::refresh_ns(int64_t ns_per_led, int64_t reset_ns) const {
+    int64_t ns = 0;
+    for (auto& it : this->strips) {
+        ns += it.second.num_leds * ns_per_led + reset_ns;
+    }
+    return ns;
+}
+
+uint32_t SimStrips::total_leds() const {
+    uint32_t leds = 0;
+    for (auto& it : this->strips) {
+        leds += it.second.num_leds;
+    }
+    return leds;
+}
+
+int SimStrips::fail(const std::string& why) {
+    this->error = why;
+    return -1;
+}
+
+SimStrips::Strip* SimStrips::strip(uint8_t gpio_pin) {
+    auto it = this->strips.find(gpio_pin);
+    if (it == this->strips.end()) {
+        return NULL;
+    }
+    return &it->second;
+}
+
+// Writes one pixel in the pin's colour order, as led_strip_set_pixel would.
+// Returns false past the end of the strip, where the firmware aborts.
+bool SimStrips::set_pixel(Strip* s, uint32_t index, const uint8_t* pixel) {
+    if (index >= s->num_leds) {
+        return false;
+    }
+    uint8_t ro, go, bo;
+    if (!color_order_offsets(s->color_order, &ro, &go, &bo)) {
+        color_order_offsets(COLOR_ORDER_RGB, &ro, &go, &bo);
+    }
+    uint8_t* out = s->pixels.data() + index * 3;
+    out[0] = pixel[ro];
+    out[1] = pixel[go];
+    out[2] = pixel[bo];
+    return true;
+}
+
+// Where a numbered frame's pin entries end, before any present-at time.
+static const uint8_t* frame_end(const uint8_t* msg, uint8_t flags) {
+    return msg + get_message_size(msg) - frame_trailer_size(flags);
+}
+
+// The op codes firmware from before capabilities were sent handled.
+static bool legacy_op(uint8_t op_code) {
+    switch (op_code) {
+        case OP_SET_LEDS:
+        case OP_GET_LOGS:
+        case OP_REDRAW:
+        case OP_SET_CONFIG:
+        case OP_SET_LEDS_BATCHED:
+            return true;
+        default:
+            return false;
+    }
+}
+
+int SimStrips::apply(const uint8_t* msg, StripUpdate& update) {
+    update = StripUpdate();
+    if (this->legacy && !legacy_op(get_message_op_code(msg))) {
+        return this->fail("op " + std::to_string(get_message_op_code(msg)) +
+                          " is newer than firmware that checks in without capabilities");
+    }
+    update.has_present_at = frame_present_at(msg, &update.present_at_us);
+    switch (get_message_op_code(msg)) {
+        case OP_SET_CONFIG:
+            return this->set_config(decode_set_config(msg));
+        case OP_SET_LEDS:
+            return this->set_leds(decode_set_leds(msg));
+        case OP_SET_LEDS_BATCHED:
+        case OP_SET_LEDS_FRAME:
+            return this->apply_streamed(msg, update);
+        case OP_SET_LEDS_COMPRESSED: {
+            SetLedsCompressedMessage* m = decode_set_leds_compressed(msg);
+            if (!m) {
+                return this->fail("invalid set_leds_compressed");
+            }
+            const uint8_t* p = msg + sizeof(SetLedsCompressedMessage);
+            if (this->apply_compressed_batches(p, frame_end(msg, m->flags), m->batch_count) != 0) {
+                return -1;
+            }
+            this->full_frame(m->frame_seq, m->flags, update);
+            return 0;
+        }
+        case OP_SET_LEDS_QUANTIZED: {
+            SetLedsQuantizedMessage* m = decode_set_leds_quantized(msg);
+            if (!m) {
+                return this->fail("invalid set_leds_quantized");
+            }
+            const uint8_t* p = msg + sizeof(SetLedsQuantizedMessage);
+            if (this->apply_quantized_batches(p, frame_end(msg, m->flags), m->depth, m->batch_count) != 0) {
+                return -1;
+            }
+            this->full_frame(m->frame_seq, m->flags, update);
+            return 0;
+        }
+        case OP_SET_LEDS_DELTA: {
+            SetLedsDeltaMessage* m = decode_set_leds_delta(msg);
+            if (!m) {
+                return this->fail("invalid set_leds_delta");
+            }
+            // Skipped until the full frame the resync asks for arrives.
+            if (!this->have_baseline || m->base_seq != this->baseline_seq) {
+                if (!this->resync_requested) {
+                    this->resync_requested = true;
+                    update.resync = true;
+                    update.resync_seq = this->baseline_seq;
+                }
+                return 0;
+            }
+            const uint8_t* p = msg + sizeof(SetLedsDeltaMessage);
+            if (this->apply_delta_batches(p, frame_end(msg, m->flags), m->batch_count) != 0) {
+                return -1;
+            }
+            this->baseline_seq = m->frame_seq;
+            update.frame = true;
+            update.has_seq = true;
+            update.seq = m->frame_seq;
+            update.latch = m->flags & LEDS_FRAME_FLAG_LATCH;
+            return 0;
+        }
+        case OP_REDRAW:
+            if (!decode_redraw(msg)) {
+                return this->fail("invalid redraw");
+            }
+            if (this->strips.empty()) {
+                return this->fail("redraw with no LED strips configured");
+            }
+            update.latch = true;
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+// A full frame was applied, so deltas can build on it.
+void SimStrips::full_frame(uint32_t seq, uint8_t flags, StripUpdate& update) {
+    this->have_baseline = true;
+    this->baseline_seq = seq;
+    this->resync_requested = false;
+    update.frame = true;
+    update.has_seq = true;
+    update.seq = seq;
+    update.latch = flags & LEDS_FRAME_FLAG_LATCH;
+}
+
+int SimStrips::set_config(SetConfigMessage* msg) {
+    if (!msg) {
+        return this->fail("invalid set_config");
+    }
+    this->strips.clear();
+    this->have_baseline = false;
+    this->resync_requested = false;
+    if (msg->pins_used == 0) {
+        return this->fail("set_config with no pins");
+    }
+    // The firmware trusts pins_used; reading past the message would give it
+    // garbage pins.
+    if (sizeof(SetConfigMessage) + msg->pins_used * sizeof(PinInfo) > msg->header.size) {
+        return this->fail("set_config pins extend beyond the message");
+    }
+    for (uint8_t i = 0; i < msg->pins_used; ++i) {
+        PinInfo* pinfo = &msg->pin_info[i];
+        if (pinfo->max_leds == 0) {
+            continue;
+        }
+        Strip& s = this->strips[pinfo->pin_num];
+        s.color_order = pinfo->color_order;
+        s.num_leds = pinfo->max_leds;
+        s.pixels.assign(pinfo->max_leds * 3, 0);
+    }
+    return 0;
+}
+
+int SimStrips::set_leds(SetLedsMessage* msg) {
+    if (!msg) {
+        return this->fail("invalid set_leds");
+    }
+    Strip* s = this->strip(msg->gpio_pin);
+    if (!s) {
+        return this->fail("set_leds for unconfigured pin " + std::to_string(msg->gpio_pin));
+    }
+    uint32_t num_pixels = (msg->header.size - sizeof(SetLedsMessage)) / 3;
+    for (uint32_t i = 0; i < num_pixels; ++i) {
+        if (!this->set_pixel(s, i, msg->pixel_data + i * 3)) {
+            return this->fail("set_leds writes past the strip on pin " + std::to_string(msg->gpio_pin));
+        }
+    }
+    return 0;
+}
+
+bool SimStrips::begin_pin(void* ctx, uint8_t gpio_pin, uint32_t num_leds) {
+    BatchTarget* target = (BatchTarget*)ctx;
+    target->strip = target->strips->strip(gpio_pin);
+    if (!target->strip) {
+        target->error = "unconfigured pin " + std::to_string(gpio_pin) + " in batch";
+        return false;
+    }
+    if (num_leds > target->strip->num_leds) {
+        target->error = "batch of " + std::to_string(num_leds) + " LEDs is longer than the strip on pin " +
+            std::to_string(gpio_pin);
+        return false;
+    }
+    return true;
+}
+
+void SimStrips::set_pixels(void* ctx, uint32_t index, const uint8_t* pixels, uint32_t count) {
+    BatchTarget* target = (BatchTarget*)ctx;
+    for (uint32_t i = 0; i < count; ++i) {
+        target->strips->set_pixel(target->strip, index + i, pixels + i * 3);
+    }
+}
+
+// Applies a SetLedsBatched or SetLedsFrame with the firmware's own
+// stream_batches, the strips standing in for led_strip, so frames larger than
+// MAX_MESSAGE_SIZE go through the same code as on the ESP32.
+int SimStrips::apply_streamed(const uint8_t* msg, StripUpdate& update) {
+    const MessageHeader* header = (const MessageHeader*)msg;
+    MemoryStream stream;
+    stream.p = msg + sizeof(MessageHeader);
+    stream.end = msg + header->size;
+    BatchTarget target = BatchTarget{this, NULL, ""};
+    BatchSink sink = {SimStrips::begin_pin, SimStrips::set_pixels, &target};
+    uint8_t chunk[BATCH_STREAM_CHUNK];
+    StreamedBatches batches;
+    if (stream_batches(header, memory_stream_read, &stream, &sink, chunk, &batches) != 0) {
+        return this->fail(target.error.empty() ? batches.error : target.error);
+    }
+    if (batches.op_code == OP_SET_LEDS_BATCHED) {
+        this->have_baseline = false;
+        update.frame = true;
+        update.latch = true;
+        return 0;
+    }
+    this->full_frame(batches.frame_seq, batches.flags, update);
+    return 0;
+}
+
+int SimStrips::apply_compressed_batches(const uint8_t* p, const uint8_t* end, uint8_t batch_count) {
+    for (uint8_t i = 0; i < batch_count; ++i) {
+        if (p + sizeof(LedsCompressedEntryHeader) > end) {
+            return this->fail("compressed batch " + std::to_string(i) + " is past the end of the message");
+        }
+        const LedsCompressedEntryHeader* eh = (const LedsCompressedEntryHeader*)p;
+        p += sizeof(LedsCompressedEntryHeader);
+        if (p + eh->data_size > end) {
+            return this->fail("compressed batch " + std::to_string(i) + " extends beyond the message");
+        }
+        Strip* s = this->strip(eh->gpio_pin);
+        if (!s) {
+            return this->fail("unconfigured pin " + std::to_string(eh->gpio_pin) + " in compressed batch");
+        }
+        StripSink sink = {&s->pixels, s->num_leds, 0, 0, 0, false};
+        if (!color_order_offsets(s->color_order, &sink.ro, &sink.go, &sink.bo)) {
+            color_order_offsets(COLOR_ORDER_RGB, &sink.ro, &sink.go, &sink.bo);
+        }
+        if (!decode_pixels(eh->encoding, p, eh->data_size, eh->num_leds, set_strip_pixel, &sink)) {
+            return this->fail("malformed encoding " + std::to_string(eh->encoding) + " for pin " + std::to_string(eh->gpio_pin));
+        }
+        if (sink.overflow) {
+            return this->fail("compressed batch writes past the strip on pin " + std::to_string(eh->gpio_pin));
+        }
+        p += eh->data_size;
+    }
+    return 0;
+}
+
+int SimStrips::apply_quantized_batches(const uint8_t* p, const uint8_t* end, uint8_t depth, uint8_t batch_count) {
+    for (uint8_t i = 0; i < batch_count; ++i) {
+        if (p + sizeof(LedsQuantizedEntryHeader) > end) {
+            return this->fail("quantized batch " + std::to_string(i) + " is past the end of the message");
+        }
+        const LedsQuantizedEntryHeader* eh = (const LedsQuantizedEntryHeader*)p;
+        p += sizeof(LedsQuantizedEntryHeader);
+        uint32_t data_size = quantized_pixels_size(depth, eh->num_leds);
+        if (data_size == 0 || p + data_size > end) {
+            return this->fail("quantized batch " + std::to_string(i) + " extends beyond the message");
+        }
+        Strip* s = this->strip(eh->gpio_pin);
+        if (!s) {
+            return this->fail("unconfigured pin " + std::to_string(eh->gpio_pin) + " in quantized batch");
+        }
+        StripSink sink = {&s->pixels, s->num_leds, 0, 0, 0, false};
+        if (!color_order_offsets(s->color_order, &sink.ro, &sink.go, &sink.bo)) {
+            color_order_offsets(COLOR_ORDER_RGB, &sink.ro, &sink.go, &sink.bo);
+        }
+        expand_pixels(depth, eh->max_level, p, eh->num_leds, set_strip_pixel, &sink);
+        if (sink.overflow) {
+            return this->fail("quantized batch writes past the strip on pin " + std::to_string(eh->gpio_pin));
+        }
+        p += data_size;
+    }
+    return 0;
+}
+
+int SimStrips::apply_delta_batches(const uint8_t* p, const uint8_t* end, uint8_t batch_count) {
+    for (uint8_t i = 0; i < batch_count; ++i) {
+        if (p + sizeof(LedsDeltaEntryHeader) > end) {
+            return this->fail("delta batch " + std::to_string(i) + " is past the end of the message");
+        }
+        const LedsDeltaEntryHeader* eh = (const LedsDeltaEntryHeader*)p;
+        uint8_t gpio_pin = eh->gpio_pin;
+        uint16_t run_count = eh->run_count;
+        p += sizeof(LedsDeltaEntryHeader);
+        Strip* s = this->strip(gpio_pin);
+        if (!s) {
+            return this->fail("unconfigured pin " + std::to_string(gpio_pin) + " in delta batch");
+        }
+        for (uint16_t r = 0; r < run_count; ++r) {
+            if (p + sizeof(LedsDeltaRunHeader) > end) {
+                return this->fail("delta run is past the end of the message");
+            }
+            const LedsDeltaRunHeader* rh = (const LedsDeltaRunHeader*)p;
+            uint32_t start = rh->start;
+            uint32_t num_leds = rh->num_leds;
+            p += sizeof(LedsDeltaRunHeader);
+            if (p + num_leds * 3 > end) {
+                return this->fail("delta run extends beyond the message");
+            }
+            for (uint32_t idx = 0; idx < num_leds; ++idx) {
+                if (!this->set_pixel(s, start + idx, p + idx * 3)) {
+                    return this->fail("delta run writes past the strip on pin " + std::to_string(gpio_pin));
+                }
+            }
+            p += num_leds * 3;
+        }
+    }
+    return 0;
+}
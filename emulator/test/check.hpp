@@ -0,0 +1,22 @@
+#ifndef CHECK_HPP
+#define CHECK_HPP
+
+#include <iostream>
+#include <string>
+
+// Checks for the host tests. A failed check is printed and counted, and the
+// test's main returns check_failures() so make check stops on it.
+inline int& check_failures() {
+    static int failures = 0;
+    return failures;
+}
+
+inline bool check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cout << "FAIL: " << what << "\n";
+        check_failures()++;
+    }
+    return ok;
+}
+
+#endif
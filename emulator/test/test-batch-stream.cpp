@@ -0,0 +1,267 @@
+#include "batch_stream.hpp"
+#include "check.hpp"
+#include "protocol.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// Streams SetLedsFrame and SetLedsBatched messages through the firmware's
+// stream_batches from memory, whole, cut short and with sizes that don't add
+// up, and checks what reaches the strips and what is rejected.
+
+// Pins the tests configure and the LEDs each strip was created with. The
+// first is longer than a chunk, so its pixels arrive in several.
+const uint8_t PIN_LONG = 16;
+const uint32_t LONG_LEDS = 600;
+const uint8_t PIN_SHORT = 17;
+const uint32_t SHORT_LEDS = 10;
+
+struct TestStrips {
+    std::map<uint8_t, std::vector<uint8_t>> pixels;
+    uint8_t pin;
+    uint32_t num_leds;
+    // The most pixels handed over at once.
+    uint32_t largest_chunk;
+};
+
+static bool test_begin_pin(void* ctx, uint8_t gpio_pin, uint32_t num_leds) {
+    TestStrips* strips = (TestStrips*)ctx;
+    auto strip = strips->pixels.find(gpio_pin);
+    if (strip == strips->pixels.end() || num_leds * 3 > strip->second.size()) {
+        return false;
+    }
+    strips->pin = gpio_pin;
+    strips->num_leds = num_leds;
+    return true;
+}
+
+static void test_set_pixels(void* ctx, uint32_t index, const uint8_t* pixels, uint32_t count) {
+    TestStrips* strips = (TestStrips*)ctx;
+    if (index + count > strips->num_leds) {
+        check(false, "pixels " + std::to_string(index) + " to " + std::to_string(index + count) +
+                     " written past the " + std::to_string(strips->num_leds) + " begun");
+        return;
+    }
+    memcpy(strips->pixels[strips->pin].data() + index * 3, pixels, count * 3);
+    strips->largest_chunk = std::max(strips->largest_chunk, count);
+}
+
+static void reset_strips(TestStrips* strips) {
+    strips->pixels.clear();
+    strips->pixels[PIN_LONG].assign(LONG_LEDS * 3, 0);
+    strips->pixels[PIN_SHORT].assign(SHORT_LEDS * 3, 0);
+    strips->pin = 0;
+    strips->num_leds = 0;
+    strips->largest_chunk = 0;
+}
+
+static uint8_t pixel_byte(uint8_t pin, uint32_t i) {
+    return (uint8_t)(pin * 31 + i * 7);
+}
+
+struct Batch {
+    uint8_t pin;
+    uint32_t num_leds;
+};
+
+// Builds a SetLedsFrame, or a SetLedsBatched if op_code says so, with the
+// given batches.
+static std::vector<uint8_t> make_message(uint8_t op_code, uint8_t flags, uint32_t seq,
+                                         const std::vector<Batch>& batches) {
+    uint32_t size = op_code == OP_SET_LEDS_FRAME ? sizeof(SetLedsFrameMessage) : sizeof(SetLedsBatchedMessage);
+    for (const Batch& b : batches) {
+        size += sizeof(LedsBatchEntryHeader) + b.num_leds * 3;
+    }
+    std::vector<uint8_t> msg(size);
+    uint8_t* p = op_code == OP_SET_LEDS_FRAME
+        ? write_set_leds_frame_header(msg.data(), size, flags, seq, batches.size())
+        : write_set_leds_batched_header(msg.data(), size, batches.size());
+    for (const Batch& b : batches) {
+        p = write_batch_entry_header(p, b.pin, b.num_leds);
+        for (uint32_t i = 0; i < b.num_leds * 3; ++i) {
+            *p++ = pixel_byte(b.pin, i);
+        }
+    }
+    return msg;
+}
+
+static std::vector<uint8_t> with_present_at(std::vector<uint8_t> msg, uint64_t present_at_us) {
+    msg.resize(msg.size() + sizeof(uint64_t));
+    append_present_at(msg.data(), present_at_us);
+    return msg;
+}
+
+// Streams the first available bytes of msg, which may be fewer than its
+// header says, and returns what stream_batches did. consumed is how much of
+// msg it read.
+static int stream(const std::vector<uint8_t>& msg, size_t available, TestStrips* strips,
+                  StreamedBatches* out, size_t* consumed) {
+    reset_strips(strips);
+    BatchSink sink = {test_begin_pin, test_set_pixels, strips};
+    MessageHeader header;
+    memcpy(&header, msg.data(), sizeof(header));
+    MemoryStream mem = {msg.data() + sizeof(header), msg.data() + available};
+    uint8_t chunk[BATCH_STREAM_CHUNK];
+    int res = stream_batches(&header, memory_stream_read, &mem, &sink, chunk, out);
+    *consumed = mem.p - msg.data();
+    return res;
+}
+
+static bool strip_has(const TestStrips& strips, uint8_t pin, uint32_t num_leds) {
+    const std::vector<uint8_t>& pixels = strips.pixels.at(pin);
+    for (uint32_t i = 0; i < num_leds * 3; ++i) {
+        if (pixels[i] != pixel_byte(pin, i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_frame() {
+    std::vector<uint8_t> msg = make_message(OP_SET_LEDS_FRAME, LEDS_FRAME_FLAG_LATCH, 42,
+                                            {{PIN_LONG, LONG_LEDS}, {PIN_SHORT, SHORT_LEDS}});
+    // Bytes after the message belong to the next one and mustn't be read.
+    size_t size = msg.size();
+    msg.resize(size + 16, 0xee);
+    TestStrips strips;
+    StreamedBatches out;
+    size_t consumed;
+    check(stream(msg, msg.size(), &strips, &out, &consumed) == 0,
+          std::string("frame rejected: ") + (out.error ? out.error : ""));
+    check(out.op_code == OP_SET_LEDS_FRAME && out.flags == LEDS_FRAME_FLAG_LATCH && out.frame_seq == 42,
+          "frame header read wrong");
+    check(!out.has_present_at, "frame without one read with a present-at time");
+    check(strip_has(strips, PIN_LONG, LONG_LEDS) && strip_has(strips, PIN_SHORT, SHORT_LEDS),
+          "frame's pixels didn't all reach the strips");
+    check(strips.largest_chunk <= BATCH_STREAM_CHUNK / 3,
+          std::to_string(strips.largest_chunk) + " pixels handed over at once, more than a chunk");
+    check(consumed == size, "read " + std::to_string(consumed) + " bytes of a " + std::to_string(size) +
+                            " byte frame");
+}
+
+static void test_batched() {
+    std::vector<uint8_t> msg = make_message(OP_SET_LEDS_BATCHED, 0, 0, {{PIN_SHORT, 4}, {PIN_LONG, 300}});
+    TestStrips strips;
+    StreamedBatches out;
+    size_t consumed;
+    check(stream(msg, msg.size(), &strips, &out, &consumed) == 0,
+          std::string("SetLedsBatched rejected: ") + (out.error ? out.error : ""));
+    check(out.op_code == OP_SET_LEDS_BATCHED && !out.has_present_at, "SetLedsBatched header read wrong");
+    check(strip_has(strips, PIN_SHORT, 4) && strip_has(strips, PIN_LONG, 300),
+          "SetLedsBatched's pixels didn't all reach the strips");
+    check(consumed == msg.size(), "SetLedsBatched not read to its end");
+}
+
+static void test_present_at() {
+    uint64_t present_at = 0x0123456789abcdefULL;
+    std::vector<uint8_t> msg = with_present_at(
+        make_message(OP_SET_LEDS_FRAME, LEDS_FRAME_FLAG_LATCH, 7, {{PIN_LONG, LONG_LEDS}}), present_at);
+    TestStrips strips;
+    StreamedBatches out;
+    size_t consumed;
+    check(stream(msg, msg.size(), &strips, &out, &consumed) == 0,
+          std::string("frame with a present-at time rejected: ") + (out.error ? out.error : ""));
+    check(out.has_present_at && out.present_at_us == present_at, "present-at time read wrong");
+    check(out.flags == (LEDS_FRAME_FLAG_LATCH | LEDS_FRAME_FLAG_PRESENT_AT), "present-at flags read wrong");
+    check(strip_has(strips, PIN_LONG, LONG_LEDS), "pixels of a frame with a present-at time read wrong");
+    check(consumed == msg.size(), "frame with a present-at time not read to its end");
+
+    // Bytes between the last batch and the present-at time are skipped.
+    msg = with_present_at(make_message(OP_SET_LEDS_FRAME, 0, 8, {{PIN_SHORT, 2}, {PIN_LONG, 300}}), present_at);
+    write_set_leds_frame_header(msg.data(), msg.size(), LEDS_FRAME_FLAG_PRESENT_AT, 8, 1);
+    check(stream(msg, msg.size(), &strips, &out, &consumed) == 0 && out.present_at_us == present_at &&
+              consumed == msg.size(),
+          "present-at time not found past bytes after the batches");
+
+    // A frame whose size leaves no room for the present-at time its flags
+    // promise.
+    std::vector<uint8_t> short_msg = make_message(OP_SET_LEDS_FRAME, LEDS_FRAME_FLAG_PRESENT_AT, 7, {});
+    size_t short_size = short_msg.size();
+    short_msg.resize(short_size + 4 * BATCH_STREAM_CHUNK, 0xee);
+    check(stream(short_msg, short_msg.size(), &strips, &out, &consumed) != 0 && consumed <= short_size,
+          "frame too short for its present-at time accepted");
+}
+
+// Every message cut off at every byte, as when the connection drops part way.
+static void test_truncated() {
+    std::vector<std::vector<uint8_t>> msgs = {
+        make_message(OP_SET_LEDS_FRAME, LEDS_FRAME_FLAG_LATCH, 1, {{PIN_LONG, LONG_LEDS}, {PIN_SHORT, 3}}),
+        make_message(OP_SET_LEDS_BATCHED, 0, 0, {{PIN_SHORT, SHORT_LEDS}}),
+        with_present_at(make_message(OP_SET_LEDS_FRAME, 0, 2, {{PIN_SHORT, SHORT_LEDS}}), 99),
+    };
+    for (const std::vector<uint8_t>& msg : msgs) {
+        int accepted = 0;
+        for (size_t available = sizeof(MessageHeader); available < msg.size(); ++available) {
+            TestStrips strips;
+            StreamedBatches out;
+            size_t consumed;
+            if (stream(msg, available, &strips, &out, &consumed) == 0 || !out.error) {
+                accepted++;
+            }
+        }
+        check(accepted == 0, std::to_string(accepted) + " cuts of a " + std::to_string(msg.size()) +
+                             " byte message accepted or rejected without a reason");
+    }
+}
+
+static void test_oversized() {
+    TestStrips strips;
+    StreamedBatches out;
+    size_t consumed;
+
+    // A batch claiming more pixels than the message has left, though its
+    // strip has room for them.
+    std::vector<uint8_t> msg = make_message(OP_SET_LEDS_FRAME, 0, 3, {{PIN_LONG, SHORT_LEDS}});
+    write_batch_entry_header(msg.data() + sizeof(SetLedsFrameMessage), PIN_LONG, LONG_LEDS);
+    check(stream(msg, msg.size(), &strips, &out, &consumed) != 0,
+          "batch longer than its message accepted");
+    check(strips.num_leds == 0, "pixels written from a batch longer than its message");
+
+    // A batch longer than the strip its pin was configured with.
+    msg = make_message(OP_SET_LEDS_FRAME, 0, 4, {{PIN_SHORT, SHORT_LEDS + 1}});
+    check(stream(msg, msg.size(), &strips, &out, &consumed) != 0, "batch longer than its strip accepted");
+    check(strips.num_leds == 0, "pixels written past the end of a strip");
+
+    // A pin that isn't configured.
+    msg = make_message(OP_SET_LEDS_BATCHED, 0, 0, {{5, 1}});
+    check(stream(msg, msg.size(), &strips, &out, &consumed) != 0, "batch for an unconfigured pin accepted");
+
+    // More batches than the message has room for.
+    msg = make_message(OP_SET_LEDS_FRAME, 0, 5, {{PIN_SHORT, 2}});
+    uint32_t size = msg.size();
+    write_set_leds_frame_header(msg.data(), size, 0, 5, 3);
+    // Followed by what could pass for the missing batches.
+    msg.resize(size + 2 * (sizeof(LedsBatchEntryHeader) + 3));
+    write_batch_entry_header(msg.data() + size, PIN_SHORT, 1);
+    write_batch_entry_header(msg.data() + size + sizeof(LedsBatchEntryHeader) + 3, PIN_SHORT, 1);
+    check(stream(msg, msg.size(), &strips, &out, &consumed) != 0, "more batches than the message holds accepted");
+    check(consumed <= size, "read past the end of a message with too many batches");
+
+    // A size too small for even the header, and messages that aren't batched.
+    msg = make_message(OP_SET_LEDS_FRAME, 0, 6, {});
+    uint32_t tiny = sizeof(MessageHeader) - 1;
+    memcpy(msg.data(), &tiny, sizeof(tiny));
+    check(stream(msg, msg.size(), &strips, &out, &consumed) != 0, "message smaller than its header accepted");
+    msg = make_message(OP_SET_LEDS_FRAME, 0, 6, {});
+    msg[offsetof(MessageHeader, op_code)] = OP_REDRAW;
+    check(!is_streamed_op(OP_REDRAW) && stream(msg, msg.size(), &strips, &out, &consumed) != 0,
+          "Redraw streamed as a batched message");
+}
+
+int main() {
+    test_frame();
+    test_batched();
+    test_present_at();
+    test_truncated();
+    test_oversized();
+    if (check_failures()) {
+        return 1;
+    }
+    std::cout << "OK: batch streaming\n";
+    return 0;
+}
@@ -0,0 +1,152 @@
+#include "check.hpp"
+#include "clock_sync.hpp"
+#include "protocol.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+// Runs the firmware's clock sync against a simulated server whose clock is
+// off from the client's by a known offset and runs fast or slow by a known
+// drift, and checks the offset and drift it settles on.
+
+// The server's clock is offset + local * (1 + drift), in microseconds.
+struct SimServer {
+    int64_t offset_us;
+    double drift;
+    // Each way takes base_delay_us plus up to jitter_us more, and every
+    // spike_every'th exchange is held up by spike_us on the way back.
+    int64_t base_delay_us;
+    int64_t jitter_us;
+    int spike_every;
+    int64_t spike_us;
+    uint32_t rng;
+    int exchanges;
+
+    int64_t server_us(int64_t local_us) const {
+        return this->offset_us + local_us + (int64_t)std::llround(this->drift * (double)local_us);
+    }
+
+    int64_t jitter() {
+        this->rng = this->rng * 1664525 + 1013904223;
+        return this->jitter_us ? (this->rng >> 8) % this->jitter_us : 0;
+    }
+};
+
+// Pings and answers until the client's clock reaches until_us, and returns
+// the client's clock at the end.
+static int64_t run(ClockSync* sync, SimServer* server, int64_t now_us, int64_t until_us) {
+    uint8_t buf[64];
+    while (now_us < until_us) {
+        now_us = std::max(now_us, clock_sync_next_ping(sync));
+        int64_t t0 = now_us;
+        clock_sync_write_ping(sync, buf, t0);
+        int64_t arrive = t0 + server->base_delay_us + server->jitter();
+        int64_t leave = arrive + 50;
+        int64_t back = leave + server->base_delay_us + server->jitter();
+        server->exchanges++;
+        if (server->spike_every && server->exchanges % server->spike_every == 0) {
+            back += server->spike_us;
+        }
+        write_time_pong(buf, t0, server->server_us(arrive), server->server_us(leave));
+        clock_sync_pong(sync, decode_time_pong(buf), back);
+        now_us = back;
+    }
+    return now_us;
+}
+
+static std::string us(int64_t v) {
+    return std::to_string(v) + " us";
+}
+
+static std::string ppm(double v) {
+    return std::to_string(v * 1e6) + " ppm";
+}
+
+static void test_converges(double drift, int64_t jitter_us, int spike_every) {
+    std::string name = "drift " + ppm(drift) + ", jitter " + us(jitter_us) +
+                       (spike_every ? ", spikes" : "") + ": ";
+    SimServer server = {987654321, drift, 2000, jitter_us, spike_every, 40000, 1, 0};
+    ClockSync sync;
+    clock_sync_reset(&sync);
+    int64_t start = 5000000;
+    int64_t now = start;
+    for (int i = 0; i < CLOCK_SYNC_MIN_SAMPLES; ++i) {
+        check(!clock_sync_synced(&sync), name + "synced after " + std::to_string(i) + " answers");
+        now = run(&sync, &server, now, now + 1);
+    }
+    check(clock_sync_synced(&sync), name + "not synced after " + std::to_string(CLOCK_SYNC_MIN_SAMPLES) + " answers");
+
+    // A minute at the slow ping rate, then the offset is checked a while
+    // after the last answer so an error in the drift shows in it too.
+    now = run(&sync, &server, now, start + 60000000);
+    int64_t later = now + 5000000;
+    int64_t true_offset = server.server_us(later) - later;
+    int64_t error = clock_sync_offset(&sync, later) - true_offset;
+    check(std::llabs(error) <= 200, name + "offset off by " + us(error));
+    check(std::fabs(sync.drift - drift) <= 5e-6,
+          name + "drift " + ppm(sync.drift) + " instead of " + ppm(drift));
+    int64_t local = clock_sync_to_local(&sync, server.server_us(later));
+    check(std::llabs(local - later) <= 200, name + "server time mapped back " + us(local - later) + " out");
+}
+
+static void test_drift_clamped() {
+    double drift = 4 * CLOCK_SYNC_MAX_DRIFT;
+    SimServer server = {0, drift, 2000, 0, 0, 0, 1, 0};
+    ClockSync sync;
+    clock_sync_reset(&sync);
+    run(&sync, &server, 0, 30000000);
+    check(sync.drift == CLOCK_SYNC_MAX_DRIFT,
+          "drift " + ppm(drift) + " measured as " + ppm(sync.drift) + ", not clamped to " +
+          ppm(CLOCK_SYNC_MAX_DRIFT));
+}
+
+static void test_ping_schedule() {
+    SimServer server = {0, 0, 2000, 0, 0, 0, 1, 0};
+    ClockSync sync;
+    clock_sync_reset(&sync);
+    check(clock_sync_next_ping(&sync) == 0, "the first ping isn't due at once");
+    int64_t now = 0;
+    for (int i = 0; i < CLOCK_SYNC_BURST; ++i) {
+        int64_t sent = std::max(now, clock_sync_next_ping(&sync));
+        now = run(&sync, &server, now, now + 1);
+        check(clock_sync_next_ping(&sync) - sent == CLOCK_SYNC_FAST_INTERVAL_US,
+              "ping " + std::to_string(i) + " of the burst not followed at the fast interval");
+    }
+    int64_t sent = std::max(now, clock_sync_next_ping(&sync));
+    run(&sync, &server, now, now + 1);
+    check(clock_sync_next_ping(&sync) - sent == CLOCK_SYNC_INTERVAL_US,
+          "pings after the burst not at the slow interval");
+}
+
+static void test_bad_answers() {
+    uint8_t buf[64];
+    ClockSync sync;
+    clock_sync_reset(&sync);
+    clock_sync_pong(&sync, NULL, 1000);
+    // Answered before it was read, arriving before it was sent, and a round
+    // trip shorter than the time the server says it held the ping.
+    write_time_pong(buf, 1000, 5000, 4000);
+    clock_sync_pong(&sync, decode_time_pong(buf), 2000);
+    write_time_pong(buf, 3000, 5000, 5100);
+    clock_sync_pong(&sync, decode_time_pong(buf), 2000);
+    write_time_pong(buf, 1000, 5000, 9000);
+    clock_sync_pong(&sync, decode_time_pong(buf), 2000);
+    check(sync.sample_count == 0, std::to_string(sync.sample_count) + " impossible answers taken");
+}
+
+int main() {
+    test_converges(0, 0, 0);
+    test_converges(40e-6, 200, 0);
+    test_converges(-40e-6, 200, 0);
+    test_converges(25e-6, 200, 3);
+    test_drift_clamped();
+    test_ping_schedule();
+    test_bad_answers();
+    if (check_failures()) {
+        return 1;
+    }
+    std::cout << "OK: clock sync\n";
+    return 0;
+}
@@ -40,34 +40,386 @@ uint8_t *encode_set_leds(uint8_t gpio_pin, const uint8_t *pixel_data,
   return buffer;
 }
 
-uint8_t *encode_set_leds_batched(uint8_t batch_count, const LedsBatch *batches,
-                                 uint32_t *out_size) {
+static uint32_t batches_size(uint8_t batch_count, const LedsBatch *batches) {
   uint32_t payload = 0;
   for (uint8_t i = 0; i < batch_count; ++i) {
     payload += sizeof(LedsBatchEntryHeader) + batches[i].num_leds * 3;
   }
+  return payload;
+}
+
+uint8_t *write_batch_entry_header(uint8_t *p, uint8_t gpio_pin,
+                                  uint32_t num_leds) {
+  LedsBatchEntryHeader *eh = (LedsBatchEntryHeader *)p;
+  eh->gpio_pin = gpio_pin;
+  eh->num_leds = num_leds;
+  return p + sizeof(*eh);
+}
+
+static void write_batches(uint8_t *p, uint8_t batch_count,
+                          const LedsBatch *batches) {
+  for (uint8_t i = 0; i < batch_count; ++i) {
+    const LedsBatch *b = &batches[i];
+    p = write_batch_entry_header(p, b->gpio_pin, b->num_leds);
+    if (b->pixel_data)
+      memcpy(p, b->pixel_data, b->num_leds * 3);
+    p += b->num_leds * 3;
+  }
+}
 
-  *out_size = sizeof(MessageHeader) + 1 + payload;
+uint8_t *write_set_leds_batched_header(uint8_t *buf, uint32_t size,
+                                       uint8_t batch_count) {
+  SetLedsBatchedMessage *msg = (SetLedsBatchedMessage *)buf;
+  msg->header.size = size;
+  msg->header.op_code = OP_SET_LEDS_BATCHED;
+  msg->batch_count = batch_count;
+  return buf + sizeof(SetLedsBatchedMessage);
+}
+
+uint8_t *write_set_leds_frame_header(uint8_t *buf, uint32_t size,
+                                     uint8_t flags, uint32_t frame_seq,
+                                     uint8_t batch_count) {
+  SetLedsFrameMessage *msg = (SetLedsFrameMessage *)buf;
+  msg->header.size = size;
+  msg->header.op_code = OP_SET_LEDS_FRAME;
+  msg->flags = flags;
+  msg->frame_seq = frame_seq;
+  msg->batch_count = batch_count;
+  return buf + sizeof(SetLedsFrameMessage);
+}
+
+uint8_t *write_set_leds_delta_header(uint8_t *buf, uint32_t size,
+                                     uint8_t flags, uint32_t frame_seq,
+                                     uint32_t base_seq, uint8_t batch_count) {
+  SetLedsDeltaMessage *msg = (SetLedsDeltaMessage *)buf;
+  msg->header.size = size;
+  msg->header.op_code = OP_SET_LEDS_DELTA;
+  msg->flags = flags;
+  msg->frame_seq = frame_seq;
+  msg->base_seq = base_seq;
+  msg->batch_count = batch_count;
+  return buf + sizeof(SetLedsDeltaMessage);
+}
+
+uint8_t *write_delta_entry_header(uint8_t *p, uint8_t gpio_pin,
+                                  uint16_t run_count) {
+  LedsDeltaEntryHeader *eh = (LedsDeltaEntryHeader *)p;
+  eh->gpio_pin = gpio_pin;
+  eh->run_count = run_count;
+  return p + sizeof(*eh);
+}
+
+uint8_t *write_delta_run_header(uint8_t *p, uint32_t start,
+                                uint16_t num_leds) {
+  LedsDeltaRunHeader *rh = (LedsDeltaRunHeader *)p;
+  rh->start = start;
+  rh->num_leds = num_leds;
+  return p + sizeof(*rh);
+}
+
+uint8_t *write_set_leds_compressed_header(uint8_t *buf, uint32_t size,
+                                          uint8_t flags, uint32_t frame_seq,
+                                          uint8_t batch_count) {
+  SetLedsCompressedMessage *msg = (SetLedsCompressedMessage *)buf;
+  msg->header.size = size;
+  msg->header.op_code = OP_SET_LEDS_COMPRESSED;
+  msg->flags = flags;
+  msg->frame_seq = frame_seq;
+  msg->batch_count = batch_count;
+  return buf + sizeof(SetLedsCompressedMessage);
+}
+
+uint8_t *write_compressed_entry_header(uint8_t *p, uint8_t gpio_pin,
+                                       uint8_t encoding, uint32_t num_leds,
+                                       uint32_t data_size) {
+  LedsCompressedEntryHeader *eh = (LedsCompressedEntryHeader *)p;
+  eh->gpio_pin = gpio_pin;
+  eh->encoding = encoding;
+  eh->num_leds = num_leds;
+  eh->data_size = data_size;
+  return p + sizeof(*eh);
+}
+
+static int same_pixel(const uint8_t *a, const uint8_t *b) {
+  return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+// Length of the run of identical pixels starting at i, up to max.
+static uint32_t run_length(const uint8_t *pixels, uint32_t i, uint32_t n,
+                           uint32_t max) {
+  uint32_t len = 1;
+  while (i + len < n && len < max &&
+         same_pixel(pixels + (i + len) * 3, pixels + i * 3))
+    ++len;
+  return len;
+}
+
+uint32_t encode_pixels_rle(const uint8_t *pixels, uint32_t num_leds,
+                           uint8_t *out, uint32_t out_cap) {
+  uint8_t *p = out;
+  uint8_t *end = out + out_cap;
+  uint32_t i = 0;
+  while (i < num_leds) {
+    uint32_t run = run_length(pixels, i, num_leds, 128);
+    if (run >= 2) {
+      if (p + 4 > end)
+        return 0;
+      *p++ = 0x7F + run;
+      memcpy(p, pixels + i * 3, 3);
+      p += 3;
+      i += run;
+      continue;
+    }
+    // Literals until the next run worth a token of its own.
+    uint32_t start = i;
+    while (i < num_leds && i - start < 128 &&
+           run_length(pixels, i, num_leds, 2) < 2)
+      ++i;
+    uint32_t count = i - start;
+    if (p + 1 + count * 3 > end)
+      return 0;
+    *p++ = count - 1;
+    memcpy(p, pixels + start * 3, count * 3);
+    p += count * 3;
+  }
+  return p - out;
+}
+
+uint32_t encode_pixels_palette(const uint8_t *pixels, uint32_t num_leds,
+                               uint8_t *out, uint32_t out_cap) {
+  uint8_t palette[PALETTE_MAX_COLORS * 3];
+  uint8_t colors = 0;
+  uint32_t header = 1;
+  // The palette goes first, so find every colour before writing runs.
+  for (uint32_t i = 0; i < num_leds; ++i) {
+    const uint8_t *px = pixels + i * 3;
+    uint8_t k = 0;
+    while (k < colors && !same_pixel(palette + k * 3, px))
+      ++k;
+    if (k == colors) {
+      if (colors == PALETTE_MAX_COLORS)
+        return 0;
+      memcpy(palette + colors * 3, px, 3);
+      ++colors;
+    }
+  }
+  header += colors * 3;
+  if (header > out_cap)
+    return 0;
+  out[0] = colors;
+  memcpy(out + 1, palette, colors * 3);
+
+  uint8_t *p = out + header;
+  uint8_t *end = out + out_cap;
+  uint32_t i = 0;
+  while (i < num_leds) {
+    uint32_t run = run_length(pixels, i, num_leds, 16);
+    uint8_t k = 0;
+    while (!same_pixel(palette + k * 3, pixels + i * 3))
+      ++k;
+    if (p + 1 > end)
+      return 0;
+    *p++ = ((run - 1) << 4) | k;
+    i += run;
+  }
+  return p - out;
+}
+
+bool decode_pixels(uint8_t encoding, const uint8_t *data, uint32_t data_size,
+                   uint32_t num_leds, pixel_sink sink, void *ctx) {
+  const uint8_t *p = data;
+  const uint8_t *end = data + data_size;
+  uint32_t idx = 0;
+  switch (encoding) {
+  case PIXEL_ENCODING_RAW:
+    if (data_size != num_leds * 3)
+      return false;
+    for (; idx < num_leds; ++idx)
+      sink(ctx, idx, p + idx * 3);
+    return true;
+  case PIXEL_ENCODING_RLE:
+    while (p < end) {
+      uint8_t token = *p++;
+      uint32_t count = token < 0x80 ? token + 1 : token - 0x7F;
+      uint32_t bytes = token < 0x80 ? count * 3 : 3;
+      if (p + bytes > end || idx + count > num_leds)
+        return false;
+      for (uint32_t i = 0; i < count; ++i)
+        sink(ctx, idx++, token < 0x80 ? p + i * 3 : p);
+      p += bytes;
+    }
+    return idx == num_leds;
+  case PIXEL_ENCODING_PALETTE: {
+    if (p >= end)
+      return false;
+    uint8_t colors = *p++;
+    const uint8_t *palette = p;
+    if (colors == 0 || colors > PALETTE_MAX_COLORS || p + colors * 3 > end)
+      return false;
+    p += colors * 3;
+    while (p < end) {
+      uint8_t token = *p++;
+      uint32_t count = (token >> 4) + 1;
+      uint8_t k = token & 0x0F;
+      if (k >= colors || idx + count > num_leds)
+        return false;
+      for (uint32_t i = 0; i < count; ++i)
+        sink(ctx, idx++, palette + k * 3);
+    }
+    return idx == num_leds;
+  }
+  default:
+    return false;
+  }
+}
+
+uint8_t *write_set_leds_quantized_header(uint8_t *buf, uint32_t size,
+                                         uint8_t flags, uint32_t frame_seq,
+                                         uint8_t depth, uint8_t batch_count) {
+  SetLedsQuantizedMessage *msg = (SetLedsQuantizedMessage *)buf;
+  msg->header.size = size;
+  msg->header.op_code = OP_SET_LEDS_QUANTIZED;
+  msg->flags = flags;
+  msg->frame_seq = frame_seq;
+  msg->depth = depth;
+  msg->batch_count = batch_count;
+  return buf + sizeof(SetLedsQuantizedMessage);
+}
+
+uint8_t *write_quantized_entry_header(uint8_t *p, uint8_t gpio_pin,
+                                      uint32_t num_leds, uint8_t max_level) {
+  LedsQuantizedEntryHeader *eh = (LedsQuantizedEntryHeader *)p;
+  eh->gpio_pin = gpio_pin;
+  eh->num_leds = num_leds;
+  eh->max_level = max_level;
+  return p + sizeof(*eh);
+}
+
+uint32_t quantized_pixels_size(uint8_t depth, uint32_t num_leds) {
+  switch (depth) {
+  case WIRE_DEPTH_RGB888:
+    return num_leds * 3;
+  case WIRE_DEPTH_RGB565:
+    return num_leds * 2;
+  case WIRE_DEPTH_RGB444:
+    return (num_leds * 12 + 7) / 8;
+  default:
+    return 0;
+  }
+}
+
+// The largest quantised value of each byte of a pixel at depth.
+static void depth_levels(uint8_t depth, uint32_t levels[3]) {
+  levels[0] = depth == WIRE_DEPTH_RGB565 ? 31 : 15;
+  levels[1] = depth == WIRE_DEPTH_RGB565 ? 63 : 15;
+  levels[2] = levels[0];
+}
+
+void quantize_pixels(uint8_t depth, uint8_t max_level, bool dither,
+                     const uint8_t *pixels, uint32_t num_leds, uint8_t *out) {
+  if (depth == WIRE_DEPTH_RGB888) {
+    memcpy(out, pixels, num_leds * 3);
+    return;
+  }
+  uint32_t levels[3];
+  depth_levels(depth, levels);
+  int32_t max = max_level ? max_level : 1;
+  // The error carried is what the client will show against what was wanted,
+  // so nothing is added where the levels all fit.
+  int32_t err[3] = {0, 0, 0};
+  for (uint32_t i = 0; i < num_leds; ++i) {
+    uint32_t q[3];
+    for (int c = 0; c < 3; ++c) {
+      int32_t l = levels[c];
+      int32_t want = pixels[i * 3 + c] + err[c];
+      int32_t level = (want * l + max / 2) / max;
+      if (level < 0)
+        level = 0;
+      if (level > l)
+        level = l;
+      q[c] = level;
+      err[c] = dither ? want - (level * max_level + l / 2) / l : 0;
+    }
+    if (depth == WIRE_DEPTH_RGB565) {
+      uint16_t v = (q[0] << 11) | (q[1] << 5) | q[2];
+      out[i * 2] = v & 0xFF;
+      out[i * 2 + 1] = v >> 8;
+    } else {
+      uint16_t v = (q[0] << 8) | (q[1] << 4) | q[2];
+      uint8_t *p = out + (i / 2) * 3;
+      if (i % 2 == 0) {
+        p[0] = v & 0xFF;
+        p[1] = v >> 8;
+      } else {
+        p[1] |= (v & 0x0F) << 4;
+        p[2] = v >> 4;
+      }
+    }
+  }
+}
+
+bool expand_pixels(uint8_t depth, uint8_t max_level, const uint8_t *data,
+                   uint32_t num_leds, pixel_sink sink, void *ctx) {
+  if (depth == WIRE_DEPTH_RGB888) {
+    for (uint32_t i = 0; i < num_leds; ++i)
+      sink(ctx, i, data + i * 3);
+    return true;
+  }
+  if (depth != WIRE_DEPTH_RGB565 && depth != WIRE_DEPTH_RGB444)
+    return false;
+  uint32_t levels[3];
+  depth_levels(depth, levels);
+  for (uint32_t i = 0; i < num_leds; ++i) {
+    uint32_t q[3];
+    if (depth == WIRE_DEPTH_RGB565) {
+      uint16_t v = data[i * 2] | (data[i * 2 + 1] << 8);
+      q[0] = v >> 11;
+      q[1] = (v >> 5) & 0x3F;
+      q[2] = v & 0x1F;
+    } else {
+      const uint8_t *p = data + (i / 2) * 3;
+      uint16_t v = i % 2 == 0 ? p[0] | ((p[1] & 0x0F) << 8)
+                              : (p[1] >> 4) | (p[2] << 4);
+      q[0] = v >> 8;
+      q[1] = (v >> 4) & 0x0F;
+      q[2] = v & 0x0F;
+    }
+    uint8_t pixel[3];
+    for (int c = 0; c < 3; ++c)
+      pixel[c] = (q[c] * max_level + levels[c] / 2) / levels[c];
+    sink(ctx, i, pixel);
+  }
+  return true;
+}
+
+uint8_t *encode_set_leds_batched(uint8_t batch_count, const LedsBatch *batches,
+                                 uint32_t *out_size) {
+  uint32_t payload = batches_size(batch_count, batches);
+
+  *out_size = sizeof(SetLedsBatchedMessage) + payload;
   uint8_t *buf = allocate_message_buffer(*out_size);
   if (!buf)
     return NULL;
 
-  MessageHeader *mh = (MessageHeader *)buf;
-  mh->size = *out_size;
-  mh->op_code = OP_SET_LEDS_BATCHED;
+  uint8_t *p = write_set_leds_batched_header(buf, *out_size, batch_count);
+  write_batches(p, batch_count, batches);
 
-  uint8_t *p = buf + sizeof(MessageHeader);
-  *p++ = batch_count;
+  return buf;
+}
 
-  for (uint8_t i = 0; i < batch_count; ++i) {
-    const LedsBatch *b = &batches[i];
-    LedsBatchEntryHeader *eh = (LedsBatchEntryHeader *)p;
-    eh->gpio_pin = b->gpio_pin;
-    eh->num_leds = b->num_leds;
-    p += sizeof(*eh);
-    memcpy(p, b->pixel_data, b->num_leds * 3);
-    p += b->num_leds * 3;
-  }
+uint8_t *encode_set_leds_frame(uint8_t flags, uint32_t frame_seq,
+                               uint8_t batch_count, const LedsBatch *batches,
+                               uint32_t *out_size) {
+  uint32_t payload = batches_size(batch_count, batches);
+
+  *out_size = sizeof(SetLedsFrameMessage) + payload;
+  uint8_t *buf = allocate_message_buffer(*out_size);
+  if (!buf)
+    return NULL;
+
+  uint8_t *p = write_set_leds_frame_header(buf, *out_size, flags, frame_seq,
+                                           batch_count);
+  write_batches(p, batch_count, batches);
 
   return buf;
 }
@@ -137,8 +489,9 @@ uint8_t *encode_set_config(uint8_t num_color_channels, uint8_t pins_used,
   return buffer;
 }
 
-uint8_t *encode_check_in(const uint8_t *mac_address, uint32_t *out_size) {
-  *out_size = sizeof(CheckInMessage);
+uint8_t *encode_check_in(const uint8_t *mac_address,
+                         const ClientCapabilities *caps, uint32_t *out_size) {
+  *out_size = sizeof(CheckInMessage) + (caps ? sizeof(ClientCapabilities) : 0);
   uint8_t *buffer = allocate_message_buffer(*out_size);
   if (!buffer)
     return NULL;
@@ -150,6 +503,9 @@ uint8_t *encode_check_in(const uint8_t *mac_address, uint32_t *out_size) {
   if (mac_address) {
     memcpy(msg->mac_address, mac_address, 6);
   }
+  if (caps) {
+    memcpy(buffer + sizeof(CheckInMessage), caps, sizeof(ClientCapabilities));
+  }
 
   return buffer;
 }
@@ -173,6 +529,118 @@ uint8_t *encode_send_logs(const char *logs, uint32_t *out_size) {
   return buffer;
 }
 
+uint8_t *encode_resync(uint32_t last_seq, uint32_t *out_size) {
+  *out_size = sizeof(ResyncMessage);
+  uint8_t *buffer = allocate_message_buffer(*out_size);
+  if (!buffer)
+    return NULL;
+
+  ResyncMessage *msg = (ResyncMessage *)buffer;
+  msg->header.size = *out_size;
+  msg->header.op_code = OP_RESYNC;
+  msg->last_seq = last_seq;
+
+  return buffer;
+}
+
+uint8_t *encode_udp_port(uint16_t port, uint32_t *out_size) {
+  *out_size = sizeof(UdpPortMessage);
+  uint8_t *buffer = allocate_message_buffer(*out_size);
+  if (!buffer)
+    return NULL;
+
+  UdpPortMessage *msg = (UdpPortMessage *)buffer;
+  msg->header.size = *out_size;
+  msg->header.op_code = OP_UDP_PORT;
+  msg->port = port;
+
+  return buffer;
+}
+
+uint32_t write_frame_ack(uint8_t *buf, uint32_t frame_seq, uint64_t recv_us,
+                         uint64_t latch_us) {
+  FrameAckMessage *msg = (FrameAckMessage *)buf;
+  msg->header.size = sizeof(FrameAckMessage);
+  msg->header.op_code = OP_FRAME_ACK;
+  msg->frame_seq = frame_seq;
+  msg->recv_us = recv_us;
+  msg->latch_us = latch_us;
+  return sizeof(FrameAckMessage);
+}
+
+uint32_t write_time_ping(uint8_t *buf, uint64_t client_send_us) {
+  TimePingMessage *msg = (TimePingMessage *)buf;
+  msg->header.size = sizeof(TimePingMessage);
+  msg->header.op_code = OP_TIME_PING;
+  msg->client_send_us = client_send_us;
+  return sizeof(TimePingMessage);
+}
+
+uint32_t write_time_pong(uint8_t *buf, uint64_t client_send_us,
+                         uint64_t server_recv_us, uint64_t server_send_us) {
+  TimePongMessage *msg = (TimePongMessage *)buf;
+  msg->header.size = sizeof(TimePongMessage);
+  msg->header.op_code = OP_TIME_PONG;
+  msg->client_send_us = client_send_us;
+  msg->server_recv_us = server_recv_us;
+  msg->server_send_us = server_send_us;
+  return sizeof(TimePongMessage);
+}
+
+// Every numbered frame message has its flags straight after the header.
+static bool is_numbered_frame(const uint8_t *buffer) {
+  switch (get_message_op_code(buffer)) {
+  case OP_SET_LEDS_FRAME:
+  case OP_SET_LEDS_DELTA:
+  case OP_SET_LEDS_COMPRESSED:
+  case OP_SET_LEDS_QUANTIZED:
+    return true;
+  default:
+    return false;
+  }
+}
+
+uint32_t frame_trailer_size(uint8_t flags) {
+  return flags & LEDS_FRAME_FLAG_PRESENT_AT ? sizeof(uint64_t) : 0;
+}
+
+bool frame_present_at(const uint8_t *buffer, uint64_t *present_at_us) {
+  if (!buffer || !is_numbered_frame(buffer))
+    return false;
+  uint32_t size = get_message_size(buffer);
+  if (size < sizeof(MessageHeader) + 1 + sizeof(uint64_t))
+    return false;
+  uint8_t flags = buffer[sizeof(MessageHeader)];
+  if (!(flags & LEDS_FRAME_FLAG_PRESENT_AT))
+    return false;
+  memcpy(present_at_us, buffer + size - sizeof(uint64_t), sizeof(uint64_t));
+  return true;
+}
+
+uint32_t append_present_at(uint8_t *buffer, uint64_t present_at_us) {
+  uint32_t size = get_message_size(buffer);
+  buffer[sizeof(MessageHeader)] |= LEDS_FRAME_FLAG_PRESENT_AT;
+  memcpy(buffer + size, &present_at_us, sizeof(uint64_t));
+  size += sizeof(uint64_t);
+  memcpy(buffer, &size, sizeof(uint32_t));
+  return size;
+}
+
+uint8_t *write_frame_fragment_header(uint8_t *buf, uint32_t size,
+                                     uint32_t frame_seq, uint32_t total_size,
+                                     uint32_t offset, uint16_t fragment_index,
+                                     uint16_t fragment_count) {
+  FrameFragmentMessage *msg = (FrameFragmentMessage *)buf;
+  msg->header.size = size;
+  msg->header.op_code = OP_FRAME_FRAGMENT;
+  msg->frame_seq = frame_seq;
+  msg->total_size = total_size;
+  msg->offset = offset;
+  msg->fragment_index = fragment_index;
+  msg->fragment_count = fragment_count;
+  return buf + sizeof(FrameFragmentMessage);
+}
+
 SetLedsMessage *decode_set_leds(const uint8_t *buffer) {
   if (!buffer)
     return NULL;
@@ -193,6 +661,42 @@ SetLedsBatchedMessage *decode_set_leds_batched(const uint8_t *buffer) {
   return (SetLedsBatchedMessage *)buffer;
 }
 
+SetLedsFrameMessage *decode_set_leds_frame(const uint8_t *buffer) {
+  if (!buffer)
+    return NULL;
+  uint32_t sz = get_message_size(buffer);
+  if (sz < sizeof(SetLedsFrameMessage))
+    return NULL;
+  return (SetLedsFrameMessage *)buffer;
+}
+
+SetLedsDeltaMessage *decode_set_leds_delta(const uint8_t *buffer) {
+  if (!buffer)
+    return NULL;
+  uint32_t sz = get_message_size(buffer);
+  if (sz < sizeof(SetLedsDeltaMessage))
+    return NULL;
+  return (SetLedsDeltaMessage *)buffer;
+}
+
+SetLedsCompressedMessage *decode_set_leds_compressed(const uint8_t *buffer) {
+  if (!buffer)
+    return NULL;
+  uint32_t sz = get_message_size(buffer);
+  if (sz < sizeof(SetLedsCompressedMessage))
+    return NULL;
+  return (SetLedsCompressedMessage *)buffer;
+}
+
+SetLedsQuantizedMessage *decode_set_leds_quantized(const uint8_t *buffer) {
+  if (!buffer)
+    return NULL;
+  uint32_t sz = get_message_size(buffer);
+  if (sz < sizeof(SetLedsQuantizedMessage))
+    return NULL;
+  return (SetLedsQuantizedMessage *)buffer;
+}
+
 GetLogsMessage *decode_get_logs(const uint8_t *buffer) {
   if (!buffer)
     return NULL;
@@ -237,6 +741,17 @@ CheckInMessage *decode_check_in(const uint8_t *buffer) {
   return (CheckInMessage *)buffer;
 }
 
+bool check_in_capabilities(const CheckInMessage *msg, ClientCapabilities *caps) {
+  // Every version is at least as long as the first.
+  if (!msg || msg->header.size <
+                  sizeof(CheckInMessage) + sizeof(ClientCapabilities))
+    return false;
+
+  memcpy(caps, (const uint8_t *)msg + sizeof(CheckInMessage),
+         sizeof(ClientCapabilities));
+  return caps->version >= 1;
+}
+
 SendLogsMessage *decode_send_logs(const uint8_t *buffer) {
   if (!buffer)
     return NULL;
@@ -247,3 +762,76 @@ SendLogsMessage *decode_send_logs(const uint8_t *buffer) {
 
   return (SendLogsMessage *)buffer;
 }
+
+ResyncMessage *decode_resync(const uint8_t *buffer) {
+  if (!buffer)
+    return NULL;
+  if (get_message_size(buffer) < sizeof(ResyncMessage))
+    return NULL;
+  return (ResyncMessage *)buffer;
+}
+
+UdpPortMessage *decode_udp_port(const uint8_t *buffer) {
+  if (!buffer)
+    return NULL;
+  if (get_message_size(buffer) < sizeof(UdpPortMessage))
+    return NULL;
+  return (UdpPortMessage *)buffer;
+}
+
+FrameAckMessage *decode_frame_ack(const uint8_t *buffer) {
+  if (!buffer)
+    return NULL;
+  if (get_message_size(buffer) < sizeof(FrameAckMessage))
+    return NULL;
+  return (FrameAckMessage *)buffer;
+}
+
+TimePingMessage *decode_time_ping(const uint8_t *buffer) {
+  if (!buffer)
+    return NULL;
+  if (get_message_size(buffer) < sizeof(TimePingMessage))
+    return NULL;
+  return (TimePingMessage *)buffer;
+}
+
+TimePongMessage *decode_time_pong(const uint8_t *buffer) {
+  if (!buffer)
+    return NULL;
+  if (get_message_size(buffer) < sizeof(TimePongMessage))
+    return NULL;
+  return (TimePongMessage *)buffer;
+}
+
+FrameFragmentMessage *decode_frame_fragment(const uint8_t *buffer) {
+  if (!buffer)
+    return NULL;
+  uint32_t sz = get_message_size(buffer);
+  if (sz < sizeof(FrameFragmentMessage))
+    return NULL;
+  FrameFragmentMessage *msg = (FrameFragmentMessage *)buffer;
+  uint32_t len = sz - sizeof(FrameFragmentMessage);
+  if (msg->fragment_count == 0 || msg->fragment_index >= msg->fragment_count ||
+      msg->offset > msg->total_size || len > msg->total_size - msg->offset)
+    return NULL;
+  return msg;
+}
+
+bool color_order_offsets(uint8_t color_order, uint8_t *r, uint8_t *g,
+                         uint8_t *b) {
+  static const uint8_t offsets[][3] = {
+      {0, 1, 2}, // RGB
+      {1, 0, 2}, // GRB
+      {2, 1, 0}, // BGR
+      {0, 2, 1}, // RBG
+      {2, 0, 1}, // GBR
+      {1, 2, 0}, // BRG
+  };
+  if (color_order >= sizeof(offsets) / sizeof(offsets[0]))
+    return false;
+
+  *r = offsets[color_order][0];
+  *g = offsets[color_order][1];
+  *b = offsets[color_order][2];
+  return true;
+}
@@ -9,10 +9,73 @@
 #define OP_CHECK_IN 0x05
 #define OP_SEND_LOGS 0x06
 #define OP_SET_LEDS_BATCHED 0x07
+#define OP_SET_LEDS_FRAME 0x08
+#define OP_SET_LEDS_DELTA 0x09
+#define OP_RESYNC 0x0A
+#define OP_SET_LEDS_COMPRESSED 0x0B
+#define OP_SET_LEDS_QUANTIZED 0x0C
+#define OP_UDP_PORT 0x0D
+#define OP_FRAME_FRAGMENT 0x0E
+#define OP_FRAME_ACK 0x0F
+#define OP_TIME_PING 0x10
+#define OP_TIME_PONG 0x11
 
 #define LED_TYPE_WS2811 0x01
 
+// Channel order of a pin's pixel data in SetLeds* messages
+#define COLOR_ORDER_RGB 0x00
 #define COLOR_ORDER_GRB 0x01
+#define COLOR_ORDER_BGR 0x02
+#define COLOR_ORDER_RBG 0x03
+#define COLOR_ORDER_GBR 0x04
+#define COLOR_ORDER_BRG 0x05
+
+// How a SetLedsCompressed pin entry's pixels are encoded
+// Plain pixels, 3 bytes each.
+#define PIXEL_ENCODING_RAW 0x00
+// Tokens of one byte n: below 0x80, n + 1 literal pixels follow; otherwise
+// one pixel follows, repeated n - 0x7F times.
+#define PIXEL_ENCODING_RLE 0x01
+// A palette size byte (1 to PALETTE_MAX_COLORS) and the palette's pixels,
+// then a byte per run: the high nibble is the run length - 1 and the low
+// nibble the palette index.
+#define PIXEL_ENCODING_PALETTE 0x02
+#define PALETTE_MAX_COLORS 16
+
+// Bits per pixel of a SetLedsQuantized frame. 16 bits is 5, 6 and 5 bits for
+// the three bytes of a pixel, packed little endian into two bytes; 12 bits
+// is 4 bits each, with two pixels packed into three bytes.
+#define WIRE_DEPTH_RGB888 24
+#define WIRE_DEPTH_RGB565 16
+#define WIRE_DEPTH_RGB444 12
+
+// SetLedsFrame flags
+// Refresh the strips as soon as the pixels are applied. Without it the pixels
+// are only loaded, and are shown by the next OP_REDRAW.
+#define LEDS_FRAME_FLAG_LATCH 0x01
+// With LEDS_FRAME_FLAG_LATCH, refresh at a set time instead: the message ends
+// in a uint64_t after the pin entries, the time in microseconds on the
+// server's clock (see TimePongMessage). Clients without a synced clock, or
+// that predate the flag, latch on arrival and ignore the extra bytes.
+#define LEDS_FRAME_FLAG_PRESENT_AT 0x02
+
+// Version of ClientCapabilities written by this code. Later versions only add
+// fields at the end, so a reader takes what it knows from a longer one.
+#define CHECK_IN_VERSION 1
+// Check-ins are never longer than this, whatever their version.
+#define MAX_CHECK_IN_SIZE 64
+// ClientCapabilities op_codes and pixel_encodings bit for an op code or
+// PIXEL_ENCODING_* value.
+#define CAPS_BIT(value) (1u << (value))
+// ClientCapabilities wire_depths, besides 24 bits which every client takes
+#define CAPS_WIRE_DEPTH_RGB565 0x01
+#define CAPS_WIRE_DEPTH_RGB444 0x02
+// ClientCapabilities features
+// Takes frames as FrameFragment datagrams once it has sent UdpPort.
+#define CAPS_FEATURE_UDP 0x01
+// Applies SetLedsFrame and SetLedsBatched over TCP as they arrive, so they
+// may be any size; max_message_size limits every other message.
+#define CAPS_FEATURE_STREAMED_BATCHES 0x02
 
 #pragma pack(push, 1)
 
@@ -32,11 +95,78 @@ typedef struct {
   uint8_t batch_count;
 } SetLedsBatchedMessage;
 
+// Same batch layout as SetLedsBatchedMessage; the entries follow batch_count.
+typedef struct {
+  MessageHeader header;
+  uint8_t flags;
+  uint32_t frame_seq;
+  uint8_t batch_count;
+} SetLedsFrameMessage;
+
 typedef struct {
   uint8_t gpio_pin;
   uint32_t num_leds;
 } LedsBatchEntryHeader;
 
+// The runs of pixels that changed since frame base_seq, which must be the
+// last SetLedsFrame or SetLedsDelta the client applied; otherwise the client
+// drops it and sends ResyncMessage. Pins follow batch_count as a
+// LedsDeltaEntryHeader and run_count runs, each a LedsDeltaRunHeader and
+// num_leds pixels. Pins with no changes are left out.
+typedef struct {
+  MessageHeader header;
+  uint8_t flags;
+  uint32_t frame_seq;
+  uint32_t base_seq;
+  uint8_t batch_count;
+} SetLedsDeltaMessage;
+
+typedef struct {
+  uint8_t gpio_pin;
+  uint16_t run_count;
+} LedsDeltaEntryHeader;
+
+// A full frame like SetLedsFrame whose pins follow batch_count as a
+// LedsCompressedEntryHeader and data_size bytes of pixels in its encoding.
+typedef struct {
+  MessageHeader header;
+  uint8_t flags;
+  uint32_t frame_seq;
+  uint8_t batch_count;
+} SetLedsCompressedMessage;
+
+typedef struct {
+  uint8_t gpio_pin;
+  uint8_t encoding;
+  uint32_t num_leds;
+  uint32_t data_size;
+} LedsCompressedEntryHeader;
+
+// A full frame like SetLedsFrame at a reduced depth. Each pin's entry is a
+// LedsQuantizedEntryHeader and the pixels, which were quantised over
+// 0..max_level (the most the pin's brightness lets through) so every level
+// in that range stays distinct when there are enough bits.
+typedef struct {
+  MessageHeader header;
+  uint8_t flags;
+  uint32_t frame_seq;
+  uint8_t depth;
+  uint8_t batch_count;
+} SetLedsQuantizedMessage;
+
+typedef struct {
+  uint8_t gpio_pin;
+  uint32_t num_leds;
+  uint8_t max_level;
+} LedsQuantizedEntryHeader;
+
+typedef struct {
+  uint32_t start;
+  uint16_t num_leds;
+} LedsDeltaRunHeader;
+
+// A NULL pixel_data leaves the batch's pixels unwritten in the encoded
+// message for the caller to fill in place.
 typedef struct {
   uint8_t gpio_pin;
   uint32_t num_leds;
@@ -65,20 +195,168 @@ typedef struct {
   PinInfo pin_info[];
 } SetConfigMessage;
 
+// The first message on every connection. Firmware that predates
+// ClientCapabilities sends only its MAC address; newer firmware follows it
+// with its capabilities, so the server knows what it may send.
 typedef struct {
   MessageHeader header;
   uint8_t mac_address[6];
 } CheckInMessage;
 
+// What a client's firmware handles, after the MAC address in its check-in.
+typedef struct {
+  uint8_t version;
+  // The largest message it takes, over TCP or reassembled from UDP.
+  uint32_t max_message_size;
+  // CAPS_BIT of every op code it handles from the server.
+  uint32_t op_codes;
+  // CAPS_BIT of every PIXEL_ENCODING_* it decodes in SetLedsCompressed.
+  uint8_t pixel_encodings;
+  // CAPS_WIRE_DEPTH_* it expands in SetLedsQuantized.
+  uint8_t wire_depths;
+  // LEDS_FRAME_FLAG_* it acts on.
+  uint8_t frame_flags;
+  // CAPS_FEATURE_*
+  uint8_t features;
+  // Strips it can refresh side by side, one per RMT channel.
+  uint8_t rmt_channels;
+} ClientCapabilities;
+
 typedef struct {
   MessageHeader header;
 } SendLogsMessage;
 
+// Sent by a client that got a SetLedsDelta it couldn't apply. The server
+// answers with a full SetLedsFrame. last_seq is the last frame the client
+// applied.
+typedef struct {
+  MessageHeader header;
+  uint32_t last_seq;
+} ResyncMessage;
+
+// Sent by a client over TCP once it is listening for frames on UDP port
+// (in host byte order) of the same address. The server may then send frames
+// as FrameFragment datagrams instead; everything else stays on TCP.
+typedef struct {
+  MessageHeader header;
+  uint16_t port;
+} UdpPortMessage;
+
+// One datagram of a frame message sent over UDP. The frame_seq message,
+// total_size bytes long, is split into fragment_count pieces; this one holds
+// the bytes from offset to the end of the datagram. A client only applies a
+// frame once every fragment has arrived, and drops fragments of frames older
+// than one it has started.
+typedef struct {
+  MessageHeader header;
+  uint32_t frame_seq;
+  uint32_t total_size;
+  uint32_t offset;
+  uint16_t fragment_index;
+  uint16_t fragment_count;
+} FrameFragmentMessage;
+
+// Sent by a client over TCP each time it finishes showing a numbered frame.
+// recv_us is when the frame's message was read and latch_us when the strips
+// finished refreshing with it, both in microseconds on the client's own
+// clock, so only their difference means anything to the server. Frames that
+// were replaced before they were shown are never acked.
+typedef struct {
+  MessageHeader header;
+  uint32_t frame_seq;
+  uint64_t recv_us;
+  uint64_t latch_us;
+} FrameAckMessage;
+
+// Sent by a client over TCP to learn the server's clock. client_send_us is
+// the client's clock when it was sent, and comes back in the answer.
+typedef struct {
+  MessageHeader header;
+  uint64_t client_send_us;
+} TimePingMessage;
+
+// The server's answer to a TimePing, with when it read the ping and when it
+// sent this, in microseconds on its own monotonic clock. Together with when
+// the answer arrives, the client works out the clock offset and round trip as
+// NTP does.
+typedef struct {
+  MessageHeader header;
+  uint64_t client_send_us;
+  uint64_t server_recv_us;
+  uint64_t server_send_us;
+} TimePongMessage;
+
 #pragma pack(pop)
 
 uint8_t *encode_set_leds_batched(uint8_t batch_count, const LedsBatch *batches,
                                  uint32_t *out_size);
 
+uint8_t *encode_set_leds_frame(uint8_t flags, uint32_t frame_seq,
+                               uint8_t batch_count, const LedsBatch *batches,
+                               uint32_t *out_size);
+
+// Write the fixed part of a message into a caller owned buffer and return
+// where the batch entries go, for senders that reuse their buffers. size is the
+// whole message size.
+uint8_t *write_set_leds_batched_header(uint8_t *buf, uint32_t size,
+                                       uint8_t batch_count);
+uint8_t *write_set_leds_frame_header(uint8_t *buf, uint32_t size,
+                                     uint8_t flags, uint32_t frame_seq,
+                                     uint8_t batch_count);
+// Writes a batch entry header at p and returns where its pixels go.
+uint8_t *write_batch_entry_header(uint8_t *p, uint8_t gpio_pin,
+                                  uint32_t num_leds);
+uint8_t *write_set_leds_delta_header(uint8_t *buf, uint32_t size,
+                                     uint8_t flags, uint32_t frame_seq,
+                                     uint32_t base_seq, uint8_t batch_count);
+uint8_t *write_delta_entry_header(uint8_t *p, uint8_t gpio_pin,
+                                  uint16_t run_count);
+// Returns where the run's pixels go.
+uint8_t *write_delta_run_header(uint8_t *p, uint32_t start,
+                                uint16_t num_leds);
+uint8_t *write_set_leds_compressed_header(uint8_t *buf, uint32_t size,
+                                          uint8_t flags, uint32_t frame_seq,
+                                          uint8_t batch_count);
+// Returns where the entry's encoded pixels go.
+uint8_t *write_compressed_entry_header(uint8_t *p, uint8_t gpio_pin,
+                                       uint8_t encoding, uint32_t num_leds,
+                                       uint32_t data_size);
+
+// Encode num_leds pixels into out, returning the encoded size, or 0 if it
+// doesn't fit in out_cap bytes (or, for the palette, there are more than
+// PALETTE_MAX_COLORS colours).
+uint32_t encode_pixels_rle(const uint8_t *pixels, uint32_t num_leds,
+                           uint8_t *out, uint32_t out_cap);
+uint32_t encode_pixels_palette(const uint8_t *pixels, uint32_t num_leds,
+                               uint8_t *out, uint32_t out_cap);
+
+// Called with each decoded pixel in order.
+typedef void (*pixel_sink)(void *ctx, uint32_t index, const uint8_t *pixel);
+
+// Decodes data_size bytes in a PIXEL_ENCODING_* into exactly num_leds
+// pixels, handing each to sink as it goes. Returns false if the data is
+// malformed.
+bool decode_pixels(uint8_t encoding, const uint8_t *data, uint32_t data_size,
+                   uint32_t num_leds, pixel_sink sink, void *ctx);
+
+uint8_t *write_set_leds_quantized_header(uint8_t *buf, uint32_t size,
+                                         uint8_t flags, uint32_t frame_seq,
+                                         uint8_t depth, uint8_t batch_count);
+// Returns where the entry's quantised pixels go.
+uint8_t *write_quantized_entry_header(uint8_t *p, uint8_t gpio_pin,
+                                      uint32_t num_leds, uint8_t max_level);
+// Bytes num_leds pixels take at depth, or 0 for an unknown depth.
+uint32_t quantized_pixels_size(uint8_t depth, uint32_t num_leds);
+// Quantises num_leds pixels with values up to max_level into out. With
+// dither, each channel's rounding error is carried on to the next pixel
+// along the strip.
+void quantize_pixels(uint8_t depth, uint8_t max_level, bool dither,
+                     const uint8_t *pixels, uint32_t num_leds, uint8_t *out);
+// Expands num_leds pixels quantised at depth back to bytes, handing each to
+// sink as it goes. Returns false for an unknown depth.
+bool expand_pixels(uint8_t depth, uint8_t max_level, const uint8_t *data,
+                   uint32_t num_leds, pixel_sink sink, void *ctx);
+
 uint8_t *encode_set_leds(uint8_t gpio_pin, const uint8_t *pixel_data,
                          uint32_t data_size, uint32_t *out_size);
 SetLedsMessage *encode_fixed_set_leds(uint8_t gpio_pin, uint32_t data_size,
@@ -91,16 +369,55 @@ uint8_t *encode_redraw(uint32_t *out_size);
 uint8_t *encode_set_config(uint8_t num_color_channels, uint8_t pins_used,
                            const PinInfo *pin_info, uint32_t *out_size);
 
-uint8_t *encode_check_in(const uint8_t *mac_address, uint32_t *out_size);
+// With NULL caps, encodes the bare check-in of older firmware.
+uint8_t *encode_check_in(const uint8_t *mac_address,
+                         const ClientCapabilities *caps, uint32_t *out_size);
 
 uint8_t *encode_send_logs(const char *buffer, uint32_t *out_size);
 
+uint8_t *encode_resync(uint32_t last_seq, uint32_t *out_size);
+
+uint8_t *encode_udp_port(uint16_t port, uint32_t *out_size);
+
+uint32_t write_time_ping(uint8_t *buf, uint64_t client_send_us);
+uint32_t write_time_pong(uint8_t *buf, uint64_t client_send_us,
+                         uint64_t server_recv_us, uint64_t server_send_us);
+
+// Bytes a SetLedsFrame, SetLedsDelta, SetLedsCompressed or SetLedsQuantized
+// message with these flags has after its pin entries.
+uint32_t frame_trailer_size(uint8_t flags);
+// Reads the present-at time of one of those messages, returning false if it
+// doesn't have one.
+bool frame_present_at(const uint8_t *buffer, uint64_t *present_at_us);
+// Appends a present-at time to one of those messages, setting the flag and
+// the size. The buffer needs room for 8 more bytes. Returns the new size.
+uint32_t append_present_at(uint8_t *buffer, uint64_t present_at_us);
+
+// Writes a FrameAck into a caller owned buffer, for clients that ack from a
+// task that shouldn't allocate. Returns the message size.
+uint32_t write_frame_ack(uint8_t *buf, uint32_t frame_seq, uint64_t recv_us,
+                         uint64_t latch_us);
+
+// Returns where the fragment's slice of the frame goes.
+uint8_t *write_frame_fragment_header(uint8_t *buf, uint32_t size,
+                                     uint32_t frame_seq, uint32_t total_size,
+                                     uint32_t offset, uint16_t fragment_index,
+                                     uint16_t fragment_count);
+
 uint8_t get_message_op_code(const uint8_t *buffer);
 
 SetLedsMessage *decode_set_leds(const uint8_t *buffer);
 
 SetLedsBatchedMessage *decode_set_leds_batched(const uint8_t *buffer);
 
+SetLedsFrameMessage *decode_set_leds_frame(const uint8_t *buffer);
+
+SetLedsDeltaMessage *decode_set_leds_delta(const uint8_t *buffer);
+
+SetLedsCompressedMessage *decode_set_leds_compressed(const uint8_t *buffer);
+
+SetLedsQuantizedMessage *decode_set_leds_quantized(const uint8_t *buffer);
+
 GetLogsMessage *decode_get_logs(const uint8_t *buffer);
 
 RedrawMessage *decode_redraw(const uint8_t *buffer);
@@ -108,9 +425,30 @@ RedrawMessage *decode_redraw(const uint8_t *buffer);
 SetConfigMessage *decode_set_config(const uint8_t *buffer);
 
 CheckInMessage *decode_check_in(const uint8_t *buffer);
+// Copies the capabilities following a check-in's MAC address into caps.
+// Returns false for a bare check-in, which has none.
+bool check_in_capabilities(const CheckInMessage *msg, ClientCapabilities *caps);
 
 SendLogsMessage *decode_send_logs(const uint8_t *buffer);
 
+ResyncMessage *decode_resync(const uint8_t *buffer);
+
+UdpPortMessage *decode_udp_port(const uint8_t *buffer);
+
+FrameAckMessage *decode_frame_ack(const uint8_t *buffer);
+
+TimePingMessage *decode_time_ping(const uint8_t *buffer);
+
+TimePongMessage *decode_time_pong(const uint8_t *buffer);
+
+// Also checks the fragment lies within its frame.
+FrameFragmentMessage *decode_frame_fragment(const uint8_t *buffer);
+
+// Offsets of red, green and blue within a pixel for a COLOR_ORDER_* value.
+// Returns false for an unknown order.
+bool color_order_offsets(uint8_t color_order, uint8_t *r, uint8_t *g,
+                         uint8_t *b);
+
 uint32_t get_message_size(const uint8_t *buffer);
 void free_message_buffer(void *buffer);
 
@@ -0,0 +1,194 @@
+#include "alloc-count.hpp"
+#include "client.hpp"
+#include "client-encoding.hpp"
+#include "frame.hpp"
+#include "protocol.hpp"
+#include "send-buffer.hpp"
+#include "tcp.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <netinet/in.h>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// Packs and sends frames to loopback clients through the server's own send
+// path, and fails unless frames after the first few neither call operator new
+// nor make a send buffer pool allocate. Built by make check-allocs with
+// COUNT_ALLOCS, which the server itself is not.
+
+// Frames sent before counting starts, while pools fill and encoders take
+// their first baseline.
+const int WARMUP_FRAMES = 20;
+const int CHECKED_FRAMES = 200;
+// Distinct canvases cycled through, so deltas have changes to send.
+const int CANVASES = 8;
+// Four 32x8 panels per client, one per pin.
+const uint32_t PANEL_WIDTH = 32;
+const uint32_t PANEL_HEIGHT = 8;
+const uint32_t PINS = 4;
+
+struct CheckClient {
+    Client* client;
+    // Whether it checks in with capabilities.
+    bool advertises;
+    int sender;
+    int receiver;
+};
+
+static Client* make_client(uint64_t mac, uint32_t row, feature_choice compress, uint8_t wire_depth,
+                           LEDMatrixSpec* spec, uint32_t canvas_width) {
+    std::vector<MatricesConnection> conns;
+    for (uint32_t pin = 0; pin < PINS; ++pin) {
+        MatricesConnection conn;
+        conn.pin = 16 + pin;
+        conn.color_order = pin % 2 ? COLOR_ORDER_GRB : COLOR_ORDER_RGB;
+        CanvasPos pos(pin * PANEL_WIDTH, row * PANEL_HEIGHT, PANEL_WIDTH, PANEL_HEIGHT, UP);
+        conn.matrices.push_back(new LEDMatrix("mat", spec, pos, DEFAULT_BRIGHTNESS));
+        conns.push_back(conn);
+    }
+    Client* c = new Client(mac, conns, compress, wire_depth, false, TRANSPORT_TCP);
+    c->compile_gather(canvas_width);
+    c->compile_pack(1.0);
+    return c;
+}
+
+// What the firmware lists at check-in.
+static void fill_capabilities(ClientCapabilities* caps) {
+    memset(caps, 0, sizeof(*caps));
+    caps->version = CHECK_IN_VERSION;
+    caps->max_message_size = 10000;
+    caps->op_codes = CAPS_BIT(OP_SET_LEDS) | CAPS_BIT(OP_SET_LEDS_BATCHED) | CAPS_BIT(OP_SET_LEDS_FRAME) |
+        CAPS_BIT(OP_SET_LEDS_COMPRESSED) | CAPS_BIT(OP_SET_LEDS_QUANTIZED) | CAPS_BIT(OP_SET_LEDS_DELTA) |
+        CAPS_BIT(OP_REDRAW) | CAPS_BIT(OP_SET_CONFIG) | CAPS_BIT(OP_TIME_PONG);
+    caps->pixel_encodings =
+        CAPS_BIT(PIXEL_ENCODING_RAW) | CAPS_BIT(PIXEL_ENCODING_RLE) | CAPS_BIT(PIXEL_ENCODING_PALETTE);
+    caps->wire_depths = CAPS_WIRE_DEPTH_RGB565 | CAPS_WIRE_DEPTH_RGB444;
+    caps->frame_flags = LEDS_FRAME_FLAG_LATCH | LEDS_FRAME_FLAG_PRESENT_AT;
+    caps->features = CAPS_FEATURE_STREAMED_BATCHES;
+    caps->rmt_channels = PINS;
+}
+
+static void drain(int socket) {
+    uint8_t buf[65536];
+    while (read(socket, buf, sizeof(buf)) > 0) {}
+}
+
+// A mostly flat canvas with a block that moves each frame, so some frames
+// compress, deltas stay small and every encoder gets used.
+static cv::Mat make_canvas(uint32_t width, uint32_t height, int index) {
+    cv::Mat canvas(height, width, CV_8UC3, cv::Scalar(40, 10, 90));
+    canvas(cv::Rect(index * 5 % (width - 6), 0, 6, height)).setTo(cv::Scalar(255, 200, 0));
+    return canvas;
+}
+
+int main() {
+    LEDMatrixSpec spec("ws2812b:32x8", 2.5, PANEL_WIDTH, PANEL_HEIGHT, PROGRESSIVE);
+    uint32_t canvas_width = PINS * PANEL_WIDTH;
+    std::vector<CheckClient> checks = {
+        {NULL, true, -1, -1},
+        {NULL, true, -1, -1},
+        {NULL, false, -1, -1},
+    };
+    std::vector<Client*> clients;
+    for (uint32_t i = 0; i < checks.size(); ++i) {
+        // Every encoding the firmware takes, plain 24 bit frames, and firmware
+        // from before capabilities were sent.
+        bool plain = i == 1;
+        checks[i].client = make_client(i + 1, i, plain ? FEATURE_OFF : FEATURE_AUTO,
+                                       plain ? WIRE_DEPTH_RGB888 : WIRE_DEPTH_AUTO, &spec, canvas_width);
+        clients.push_back(checks[i].client);
+    }
+    uint32_t canvas_height = checks.size() * PANEL_HEIGHT;
+
+    LEDTCPServer server(INADDR_LOOPBACK, 0, -1, clients, NULL);
+    server.delta_frames = FEATURE_AUTO;
+    server.keyframe_interval = 10;
+    for (CheckClient& check : checks) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            std::cerr << "socketpair failed: " << strerror(errno) << "\n";
+            return 2;
+        }
+        for (int fd : fds) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        }
+        check.sender = fds[0];
+        check.receiver = fds[1];
+        ClientCapabilities caps;
+        fill_capabilities(&caps);
+        server.admit(check.client, check.sender, check.advertises ? &caps : NULL);
+    }
+
+    // Frames are made up front: making them allocates, sending them mustn't.
+    std::vector<FrameHandle> frames;
+    std::vector<cv::Mat> canvases;
+    for (int i = 0; i < CANVASES; ++i) {
+        canvases.push_back(make_canvas(canvas_width, canvas_height, i));
+    }
+    for (int f = 0; f < WARMUP_FRAMES + CHECKED_FRAMES; ++f) {
+        frames.push_back(std::make_shared<const Frame>(
+            f, std::chrono::steady_clock::now(), canvases[f % CANVASES]));
+    }
+
+    uint64_t allocs = 0;
+    uint64_t misses = 0;
+    int allocating_frames = 0;
+    for (int f = 0; f < WARMUP_FRAMES + CHECKED_FRAMES; ++f) {
+        const Frame& frame = *frames[f];
+        latch_mode latch = f % 2 ? LATCH_SYNCHRONIZED : LATCH_IMMEDIATE;
+        uint64_t misses_before = 0;
+        for (CheckClient& check : checks) {
+            misses_before += server.send_buffers.at(check.client)->misses.load();
+        }
+        uint64_t allocs_before = thread_alloc_count();
+        for (CheckClient& check : checks) {
+            uint32_t size;
+            uint8_t* buf = server.pack_leds(check.client, frame, latch, &size);
+            if (buf) {
+                server.send_frame(check.client, check.sender, buf, size, frame.seq, frame.deadline);
+            }
+        }
+        uint64_t frame_allocs = thread_alloc_count() - allocs_before;
+        uint64_t frame_misses = 0;
+        for (CheckClient& check : checks) {
+            frame_misses += server.send_buffers.at(check.client)->misses.load();
+        }
+        frame_misses -= misses_before;
+        for (CheckClient& check : checks) {
+            drain(check.receiver);
+        }
+        if (f < WARMUP_FRAMES) {
+            continue;
+        }
+        allocs += frame_allocs;
+        misses += frame_misses;
+        if (frame_allocs || frame_misses) {
+            allocating_frames++;
+        }
+    }
+
+    std::cout << checks.size() << " clients, " << CHECKED_FRAMES << " frames after " << WARMUP_FRAMES
+              << " to warm up: " << allocs << " operator new calls, " << misses
+              << " send buffer misses, " << allocating_frames << " frames allocated\n";
+    for (CheckClient& check : checks) {
+        std::cout << "  client " << check.client->mac_addr << ": "
+                  << server.encodings.at(check.client)->load()->to_string() << "\n";
+    }
+    if (!alloc_counting()) {
+        std::cout << "FAIL: built without COUNT_ALLOCS, so operator new isn't counted\n";
+        return 1;
+    }
+    if (allocating_frames > 0) {
+        std::cout << "FAIL: the send path allocated\n";
+        return 1;
+    }
+    std::cout << "OK: the send path didn't allocate\n";
+    return 0;
+}
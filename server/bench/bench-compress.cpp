@@ -0,0 +1,174 @@
+#include "client.hpp"
+#include "config-parser.hpp"
+#include "frame-compressor.hpp"
+#include "pack-kernel.hpp"
+#include "protocol.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Packs every client's pixels in a server config from a blank canvas and from
+// each still image in a directory, scaled to the canvas, then reports how well
+// they compress and how long encoding and decoding take per frame. Fails if
+// any frame doesn't decode back to what was packed.
+//
+//     make bench-compress && ./bench-compress [config.yaml] [images]
+
+const int BENCH_ITERATIONS = 200;
+
+static void store_pixel(void* ctx, uint32_t index, const uint8_t* pixel) {
+    memcpy((uint8_t*)ctx + index * 3, pixel, 3);
+}
+
+// Decodes every entry of a SetLedsCompressed message into pixels, the way a
+// client streams them into its strips.
+static bool decode_frame(const uint8_t* msg, uint8_t* pixels) {
+    const SetLedsCompressedMessage* header = (const SetLedsCompressedMessage*)msg;
+    const uint8_t* p = msg + sizeof(SetLedsCompressedMessage);
+    for (uint8_t i = 0; i < header->batch_count; ++i) {
+        const LedsCompressedEntryHeader* eh = (const LedsCompressedEntryHeader*)p;
+        p += sizeof(LedsCompressedEntryHeader);
+        if (!decode_pixels(eh->encoding, p, eh->data_size, eh->num_leds, store_pixel, pixels)) {
+            return false;
+        }
+        p += eh->data_size;
+        pixels += eh->num_leds * 3;
+    }
+    return true;
+}
+
+// Packs a client's batch entries from canvas as pack_leds would.
+static void pack_entries(const Client* c, const cv::Mat& canvas, uint8_t* p) {
+    for (const MatricesConnection& conn : c->mat_connections) {
+        p = write_batch_entry_header(p, conn.pin, conn.gather.size());
+        const uint32_t* gather = conn.gather.data();
+        for (const PackSegment& seg : conn.segments) {
+            pack_pixels(canvas.data, gather, seg.num_leds, seg.params, p);
+            gather += seg.num_leds;
+            p += seg.num_leds * 3;
+        }
+    }
+}
+
+static bool bench_frame(const std::vector<Client*>& clients,
+                        const cv::Mat& canvas,
+                        const std::string& name,
+                        std::ostream& out) {
+    uint64_t full_total = 0;
+    uint64_t compressed_total = 0;
+    double encode_secs = 0;
+    double decode_secs = 0;
+    bool mismatch = false;
+    for (const Client* c : clients) {
+        uint32_t leds = 0;
+        uint32_t entries_size = 0;
+        for (const MatricesConnection& conn : c->mat_connections) {
+            leds += conn.gather.size();
+            entries_size += sizeof(LedsBatchEntryHeader) + conn.gather.size() * 3;
+        }
+        uint32_t full_size = sizeof(SetLedsFrameMessage) + entries_size;
+        std::vector<uint8_t> entries(entries_size);
+        std::vector<uint8_t> msg(full_size);
+        pack_entries(c, canvas, entries.data());
+
+        FrameCompressor compressor(c);
+        uint32_t size = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int it = 0; it < BENCH_ITERATIONS; ++it) {
+            size = compressor.compress(entries.data(), full_size, full_size, 0, it, msg.data());
+        }
+        auto end = std::chrono::steady_clock::now();
+        encode_secs += std::chrono::duration<double>(end - start).count();
+        full_total += full_size;
+        if (!size) {
+            compressed_total += full_size;
+            continue;
+        }
+        compressed_total += size;
+
+        std::vector<uint8_t> decoded(leds * 3);
+        start = std::chrono::steady_clock::now();
+        for (int it = 0; it < BENCH_ITERATIONS; ++it) {
+            mismatch = !decode_frame(msg.data(), decoded.data()) || mismatch;
+        }
+        end = std::chrono::steady_clock::now();
+        decode_secs += std::chrono::duration<double>(end - start).count();
+
+        // The entries' pixels without their headers, to compare against.
+        const uint8_t* entry = entries.data();
+        const uint8_t* px = decoded.data();
+        for (size_t i = 0; i < c->mat_connections.size(); ++i) {
+            uint32_t n = ((const LedsBatchEntryHeader*)entry)->num_leds;
+            mismatch = mismatch || memcmp(entry + sizeof(LedsBatchEntryHeader), px, n * 3) != 0;
+            entry += sizeof(LedsBatchEntryHeader) + n * 3;
+            px += n * 3;
+        }
+    }
+
+    out << "  " << std::left << std::setw(32) << name << std::right
+        << std::setw(7) << full_total << " -> " << std::setw(7) << compressed_total << " bytes"
+        << " (" << std::setprecision(2) << (double)full_total / compressed_total << "x)"
+        << std::setprecision(1)
+        << ", encode " << encode_secs / BENCH_ITERATIONS * 1e6 << " us"
+        << ", decode " << decode_secs / BENCH_ITERATIONS * 1e6 << " us";
+    if (mismatch) {
+        out << " (MISMATCH after decoding)";
+    }
+    out << "\n";
+    return !mismatch;
+}
+
+int main(int argc, char* argv[]) {
+    std::string config_file = argc > 1 ? argv[1] : "config.yaml";
+    std::string dir = argc > 2 ? argv[2] : "images";
+    ServerConfig config;
+    try {
+        config = parse_config_throws(config_file);
+    } catch (std::exception& ex) {
+        std::cerr << "Error parsing " << config_file << ": " << ex.what() << "\n";
+        return 2;
+    }
+    if (config.clients.empty()) {
+        std::cerr << "Nothing to compress\n";
+        return 2;
+    }
+    for (Client* c : config.clients) {
+        c->compile_pack(1.0);
+    }
+
+    std::cout << "Compressing every client's frame from a blank canvas and the images in " << dir << ":\n"
+              << std::fixed;
+    bool ok = bench_frame(config.clients, cv::Mat::zeros(config.canvas_size, CV_8UC3), "(blank canvas)", std::cout);
+
+    std::vector<std::filesystem::path> files;
+    std::error_code err;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, err)) {
+        if (entry.is_regular_file()) {
+            files.push_back(entry.path());
+        }
+    }
+    if (err) {
+        std::cerr << "Can't read " << dir << ": " << err.message() << "\n";
+        return 2;
+    }
+    std::sort(files.begin(), files.end());
+    for (const std::filesystem::path& file : files) {
+        cv::Mat image = cv::imread(file.string());
+        if (image.empty()) {
+            continue;
+        }
+        cv::Mat frame;
+        cv::resize(image, frame, config.canvas_size, 0, 0, cv::INTER_NEAREST);
+        ok = bench_frame(config.clients, frame, file.filename().string(), std::cout) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,336 @@
+#include "client.hpp"
+#include "net-backend.hpp"
+#include "protocol.hpp"
+#include "send-buffer.hpp"
+#include "send-queue.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <ostream>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Sends frames to loopback connections through each network backend the
+// kernel supports, from 1 client up to the given count in doublings, and
+// reports the CPU spent sending and the time until every client had the
+// whole frame. Fails if a frame never arrives.
+//
+//     make bench-net && ./bench-net [clients] [frames]
+
+// LEDs per pin of the clients sent to, three 32x8 panels.
+const uint32_t BENCH_LEDS = 768;
+// A frame that hasn't reached every client by then is given up on.
+const int BENCH_FRAME_TIMEOUT_MS = 2000;
+
+static int64_t cpu_ns(clockid_t clock) {
+    timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1'000'000'000LL + ts.tv_nsec;
+}
+
+// Drains the receiving end of every bench connection, signalling done_fd once
+// target bytes have arrived in all.
+class BenchReceiver {
+public:
+    std::atomic<uint64_t> received;
+    std::atomic<uint64_t> target;
+    std::atomic<int64_t> cpu;
+    std::atomic<bool> stopping;
+    int done_fd;
+
+    BenchReceiver(const std::vector<int>& sockets)
+        : received(0),
+          target(UINT64_MAX),
+          cpu(0),
+          stopping(false),
+          done_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+          epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+          thread()
+    {
+        for (int socket : sockets) {
+            epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.fd = socket;
+            epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, socket, &ev);
+        }
+        this->thread = std::thread(&BenchReceiver::loop, this);
+    }
+
+    ~BenchReceiver() {
+        this->stopping = true;
+        uint64_t one = 1;
+        write(this->done_fd, &one, sizeof(one));
+        this->thread.join();
+        close(this->epoll_fd);
+        close(this->done_fd);
+    }
+
+private:
+    int epoll_fd;
+    std::thread thread;
+
+    void loop() {
+        epoll_event events[64];
+        uint8_t scratch[1 << 16];
+        while (!this->stopping) {
+            int n = epoll_wait(this->epoll_fd, events, 64, 10);
+            uint64_t got = 0;
+            for (int i = 0; i < n; ++i) {
+                ssize_t r;
+                while ((r = recv(events[i].data.fd, scratch, sizeof(scratch), 0)) > 0) {
+                    got += r;
+                }
+            }
+            uint64_t total = this->received += got;
+            this->cpu = cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+            if (got > 0 && total >= this->target.load()) {
+                uint64_t one = 1;
+                write(this->done_fd, &one, sizeof(one));
+            }
+        }
+    }
+};
+
+// Opens count loopback connections, the sending ends non-blocking like client
+// sockets. Returns false if the descriptors ran out.
+static bool bench_connect(int count, std::vector<int>& senders, std::vector<int>& receivers) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (listener == -1 ||
+        bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(listener, count) != 0 ||
+        getsockname(listener, (sockaddr*)&addr, &len) != 0) {
+        if (listener != -1) {
+            close(listener);
+        }
+        return false;
+    }
+    bool ok = true;
+    for (int i = 0; i < count && ok; ++i) {
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        if (s == -1 || connect(s, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            ok = false;
+            break;
+        }
+        int r = accept4(listener, NULL, NULL, SOCK_NONBLOCK);
+        if (r == -1) {
+            close(s);
+            ok = false;
+            break;
+        }
+        int flags = fcntl(s, F_GETFL, 0);
+        fcntl(s, F_SETFL, flags | O_NONBLOCK);
+        int nodelay = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        senders.push_back(s);
+        receivers.push_back(r);
+    }
+    close(listener);
+    return ok;
+}
+
+// Hands every finished write back to its queue and submits whatever that
+// scheduled, as the reactor does.
+static void bench_reap(UringSender* uring, std::vector<UringCompletion>& done) {
+    uint64_t n;
+    read(uring->event_fd(), &n, sizeof(n));
+    done.clear();
+    uring->reap(done);
+    for (UringCompletion& c : done) {
+        ((ClientSendQueue*)c.first)->complete(c.second);
+    }
+    uring->submit();
+}
+
+// Sends frames to the first count queues and waits for each to arrive,
+// printing the averages. Returns false if a frame never arrived.
+static bool bench_round(net_backend backend,
+                        UringSender* uring,
+                        const std::vector<ClientSendQueue*>& queues,
+                        const std::vector<int>& senders,
+                        SendBufferPool* pool,
+                        BenchReceiver& receiver,
+                        int count,
+                        int frames,
+                        std::ostream& out) {
+    uint32_t size = sizeof(SetLedsFrameMessage) + pool->entries_size;
+    std::vector<UringCompletion> done;
+    done.reserve(count);
+    int64_t submits_before = uring ? uring->submits.load() : 0;
+    int64_t cpu_total = 0;
+    int64_t wire_total = 0;
+    int64_t wire_max = 0;
+    int completed = 0;
+    for (int f = 0; f < frames; ++f) {
+        if (uring) {
+            bench_reap(uring, done);
+        }
+        receiver.target = receiver.received.load() + (uint64_t)count * size;
+        int64_t cpu_before = cpu_ns(CLOCK_PROCESS_CPUTIME_ID) - receiver.cpu.load();
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; ++i) {
+            uint8_t* buf = pool->acquire();
+            write_set_leds_frame_header(buf, size, LEDS_FRAME_FLAG_LATCH, f, 1);
+            queues[i]->push_frame(senders[i], buf, size);
+        }
+        if (uring) {
+            uring->submit();
+        }
+
+        // Completions are reaped here as the reactor would. There is no
+        // reactor to say a waiting socket drained, so the queues are flushed
+        // whenever nothing arrives for a while.
+        bool arrived = false;
+        auto give_up = start + std::chrono::milliseconds(BENCH_FRAME_TIMEOUT_MS);
+        while (!arrived && std::chrono::steady_clock::now() < give_up) {
+            pollfd fds[2] = {{receiver.done_fd, POLLIN, 0}, {uring ? uring->event_fd() : -1, POLLIN, 0}};
+            int ready = poll(fds, 2, 100);
+            if (fds[0].revents & POLLIN) {
+                uint64_t n;
+                read(receiver.done_fd, &n, sizeof(n));
+            }
+            arrived = receiver.received.load() >= receiver.target.load();
+            if (uring && (fds[1].revents & POLLIN)) {
+                bench_reap(uring, done);
+            }
+            if (ready == 0) {
+                for (int i = 0; i < count; ++i) {
+                    queues[i]->flush(senders[i]);
+                }
+                if (uring) {
+                    uring->submit();
+                }
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        if (!arrived) {
+            out << "  " << net_backend_name(backend) << ", " << count << " clients: frame " << f
+                << " didn't arrive, giving up\n";
+            return false;
+        }
+        int64_t cpu_after = cpu_ns(CLOCK_PROCESS_CPUTIME_ID) - receiver.cpu.load();
+        int64_t wire = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        cpu_total += cpu_after - cpu_before;
+        wire_total += wire;
+        wire_max = std::max(wire_max, wire);
+        completed++;
+    }
+
+    out << "  " << std::setw(8) << net_backend_name(backend) << std::setw(5) << count << " clients: "
+        << "send cpu " << std::setw(7) << cpu_total / completed / 1000.0 << " us/frame ("
+        << std::setw(5) << cpu_total / completed / 1000.0 / count << " us/client), "
+        << "frame to wire avg " << std::setw(7) << wire_total / completed / 1000.0 << " us, max "
+        << std::setw(7) << wire_max / 1000.0 << " us";
+    if (uring) {
+        out << ", " << (double)(uring->submits.load() - submits_before) / completed << " submits/frame";
+    }
+    out << "\n";
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    int num_clients = argc > 1 ? atoi(argv[1]) : 256;
+    int frames = argc > 2 ? atoi(argv[2]) : 200;
+    if (num_clients <= 0 || frames <= 0) {
+        std::cerr << "Usage: " << argv[0] << " [clients] [frames]\n";
+        return 2;
+    }
+    std::ostream& out = std::cout;
+    out << "Sending frames to up to " << num_clients << " loopback clients with each network backend:\n";
+    // Each connection takes two descriptors.
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    std::vector<int> senders;
+    std::vector<int> receivers;
+    if (!bench_connect(num_clients, senders, receivers)) {
+        out << "  could only open " << senders.size() << " loopback connections: " << strerror(errno) << "\n";
+        num_clients = senders.size();
+    }
+    if (num_clients == 0) {
+        return 1;
+    }
+
+    MatricesConnection conn;
+    conn.pin = 0;
+    conn.color_order = COLOR_ORDER_RGB;
+    conn.gather.assign(BENCH_LEDS, 0);
+    Client client(0, {conn}, FEATURE_OFF, WIRE_DEPTH_RGB888, false, TRANSPORT_TCP);
+    SendBufferPool pool(&client);
+    out << std::fixed << std::setprecision(1);
+    out << "  " << sizeof(SetLedsFrameMessage) + pool.entries_size << " byte frames, "
+        << frames << " per round\n";
+
+    bool ok = true;
+    {
+        BenchReceiver receiver(receivers);
+        for (net_backend backend : {NET_BACKEND_EPOLL, NET_BACKEND_IO_URING}) {
+            UringSender* uring = NULL;
+            if (backend == NET_BACKEND_IO_URING) {
+                uring = new UringSender(num_clients);
+                if (!uring->ok()) {
+                    out << "  io_uring is not available, skipping it\n";
+                    delete uring;
+                    break;
+                }
+            }
+            std::vector<ClientSendQueue*> queues;
+            for (int i = 0; i < num_clients; ++i) {
+                ClientSendQueue* queue = new ClientSendQueue(&pool, NULL);
+                queue->use_uring(uring);
+                queue->open(senders[i]);
+                queues.push_back(queue);
+            }
+            for (int count = 1; ; count = std::min(count * 2, num_clients)) {
+                if (!bench_round(backend, uring, queues, senders, &pool, receiver, count, frames, out)) {
+                    ok = false;
+                }
+                if (count == num_clients) {
+                    break;
+                }
+            }
+            // Every write has arrived, but its completion may not have been
+            // reaped. The queues would close the sockets, which the next
+            // backend still needs.
+            std::vector<UringCompletion> done;
+            for (ClientSendQueue* queue : queues) {
+                while (uring && queue->queued() > 0) {
+                    pollfd fd = {uring->event_fd(), POLLIN, 0};
+                    poll(&fd, 1, 100);
+                    bench_reap(uring, done);
+                }
+                queue->release();
+                delete queue;
+            }
+            delete uring;
+        }
+    }
+    for (int s : senders) {
+        close(s);
+    }
+    for (int r : receivers) {
+        close(r);
+    }
+    return ok ? 0 : 1;
+}
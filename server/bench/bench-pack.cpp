@@ -0,0 +1,98 @@
+#include "client.hpp"
+#include "config-parser.hpp"
+#include "pack-kernel.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include <random>
+#include <string>
+#include <vector>
+
+// Packs a canvas for every client in a server config with each pack
+// implementation the CPU supports, and reports LEDs packed per second.
+// Fails if an implementation doesn't match the scalar one byte for byte.
+// gamma is what an input file's settings would give; anything but 1 sends
+// every implementation through the lookup tables.
+//
+//     make bench-pack && ./bench-pack [config.yaml] [iterations] [gamma]
+
+int main(int argc, char* argv[]) {
+    std::string config_file = argc > 1 ? argv[1] : "config.yaml";
+    int iterations = argc > 2 ? atoi(argv[2]) : 1000;
+    double gamma = argc > 3 ? atof(argv[3]) : 1.0;
+    ServerConfig config;
+    try {
+        config = parse_config_throws(config_file);
+    } catch (std::exception& ex) {
+        std::cerr << "Error parsing " << config_file << ": " << ex.what() << "\n";
+        return 2;
+    }
+
+    std::vector<const MatricesConnection*> conns;
+    uint64_t leds_per_pass = 0;
+    bool linear = true;
+    for (Client* c : config.clients) {
+        c->compile_pack(gamma);
+        for (const MatricesConnection& conn : c->mat_connections) {
+            conns.push_back(&conn);
+            leds_per_pass += conn.gather.size();
+            for (const PackSegment& seg : conn.segments) {
+                linear = linear && seg.params.linear;
+            }
+        }
+    }
+    if (leds_per_pass == 0 || iterations <= 0) {
+        std::cerr << "Nothing to pack\n";
+        return 2;
+    }
+
+    // Noise, so every channel and colour order gets exercised.
+    cv::Mat canvas(config.canvas_size, CV_8UC3);
+    std::mt19937 rng(1);
+    for (size_t i = 0; i < canvas.total() * 3; ++i) {
+        canvas.data[i] = rng();
+    }
+
+    std::cout << "Packing " << leds_per_pass << " LEDs for " << config.clients.size() << " clients "
+              << iterations << " times:\n";
+    if (!linear) {
+        std::cout << "  gamma is not 1, so every implementation goes through the lookup tables\n";
+    }
+    std::vector<uint8_t> reference(leds_per_pass * 3);
+    std::vector<uint8_t> packed(leds_per_pass * 3);
+    bool mismatch = false;
+    std::cout << std::fixed << std::setprecision(1);
+    for (pack_impl impl : {PACK_SCALAR, PACK_SSSE3, PACK_AVX2}) {
+        if (impl > best_pack_impl()) {
+            continue;
+        }
+        std::vector<uint8_t>& dst = impl == PACK_SCALAR ? reference : packed;
+        auto start = std::chrono::steady_clock::now();
+        for (int it = 0; it < iterations; ++it) {
+            uint8_t* p = dst.data();
+            for (const MatricesConnection* conn : conns) {
+                const uint32_t* gather = conn->gather.data();
+                for (const PackSegment& seg : conn->segments) {
+                    pack_pixels(impl, canvas.data, gather, seg.num_leds, seg.params, p);
+                    gather += seg.num_leds;
+                    p += seg.num_leds * 3;
+                }
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        double secs = std::chrono::duration<double>(end - start).count();
+
+        std::cout << "  " << pack_impl_name(impl) << ": "
+                  << (leds_per_pass * iterations) / secs / 1e6 << " M LEDs/s";
+        if (impl != PACK_SCALAR && dst != reference) {
+            std::cout << " (MISMATCH against scalar)";
+            mismatch = true;
+        }
+        std::cout << "\n";
+    }
+    return mismatch ? 1 : 0;
+}
@@ -0,0 +1,150 @@
+#include "alloc-count.hpp"
+#include "client.hpp"
+#include "conn-info.hpp"
+#include "protocol.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Connects and disconnects clients at random on a ClientConnInfo while
+// several threads read snapshots as the frame path does, and fails if any
+// snapshot was inconsistent or reading one allocated. Built with
+// COUNT_ALLOCS, like alloc-check; make check-conns runs it.
+//
+//     make conn-check && ./conn-check [ms] [clients]
+
+// Readers, as many as the frame path has: the frame or send thread, the pack
+// thread and the reactor.
+const int READERS = 3;
+// Connection changes made at most, so the expected contents of every
+// generation fit in a table allocated up front.
+const uint64_t MAX_CHANGES = 1 << 20;
+
+// What a snapshot should hold: the sum over connected clients of their index
+// times their socket. The sockets handed out are never reused, so every
+// change moves it.
+static uint64_t snapshot_digest(const std::vector<std::pair<const Client*, int>>& connected,
+                                const std::map<const Client*, size_t>& index) {
+    uint64_t digest = 0;
+    for (auto it : connected) {
+        digest += (index.at(it.first) + 1) * (uint64_t)it.second;
+    }
+    return digest;
+}
+
+int main(int argc, char* argv[]) {
+    int ms = argc > 1 ? atoi(argv[1]) : 2000;
+    int num_clients = argc > 2 ? atoi(argv[2]) : 16;
+    if (ms <= 0 || num_clients <= 0) {
+        std::cerr << "Usage: " << argv[0] << " [ms] [clients]\n";
+        return 2;
+    }
+    // Only the pointers matter here, so the clients drive no LEDs.
+    std::vector<Client*> clients;
+    std::map<const Client*, size_t> index;
+    for (int i = 0; i < num_clients; ++i) {
+        Client* c = new Client(i + 1, {}, FEATURE_OFF, WIRE_DEPTH_RGB888, false, TRANSPORT_TCP);
+        index[c] = clients.size();
+        clients.push_back(c);
+    }
+    ClientConnInfo info(clients);
+    // expected[g] is the digest of generation g, written before it is
+    // published.
+    std::vector<std::atomic<uint64_t>> expected(MAX_CHANGES + 2);
+    expected[1] = 0;
+
+    std::atomic<bool> stopping(false);
+    std::atomic<uint64_t> reads(0);
+    std::atomic<uint64_t> refreshes(0);
+    std::atomic<uint64_t> inconsistent(0);
+    std::atomic<uint64_t> allocations(0);
+    std::vector<std::thread> readers;
+    for (int r = 0; r < READERS; ++r) {
+        readers.emplace_back([&]() {
+            ConnSnapshotHandle handle;
+            info.snapshot(handle);
+            uint64_t last_generation = handle->generation;
+            uint64_t local_reads = 0;
+            uint64_t local_refreshes = 0;
+            uint64_t allocs_before = thread_alloc_count();
+            while (!stopping.load(std::memory_order_relaxed)) {
+                const ConnSnapshot& snap = info.snapshot(handle);
+                local_reads++;
+                if (snap.generation != last_generation) {
+                    local_refreshes++;
+                }
+                bool ok = snap.generation >= last_generation;
+                uint64_t digest = 0;
+                for (auto it : snap.connected) {
+                    std::optional<int> socket = snap.socket(it.first);
+                    ok = ok && socket.has_value() && socket.value() == it.second;
+                    digest += (index.at(it.first) + 1) * (uint64_t)it.second;
+                }
+                ok = ok && digest == expected[snap.generation].load(std::memory_order_acquire);
+                if (!ok) {
+                    inconsistent++;
+                }
+                last_generation = snap.generation;
+            }
+            allocations += thread_alloc_count() - allocs_before;
+            reads += local_reads;
+            refreshes += local_refreshes;
+        });
+    }
+
+    // The writer mirrors the connections so it knows each generation's
+    // digest before publishing it. Sockets count up so no two connections of
+    // a client share one.
+    std::mt19937 rng(1);
+    std::vector<std::pair<const Client*, int>> mirror;
+    std::map<const Client*, int> connected;
+    int next_socket = 1;
+    uint64_t generation = 1;
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    while (std::chrono::steady_clock::now() < end && generation <= MAX_CHANGES) {
+        const Client* c = clients[rng() % clients.size()];
+        if (connected.count(c)) {
+            connected.erase(c);
+        } else {
+            connected[c] = next_socket++;
+        }
+        mirror.assign(connected.begin(), connected.end());
+        expected[generation + 1].store(snapshot_digest(mirror, index), std::memory_order_release);
+        if (connected.count(c)) {
+            info.setConnected(c, connected[c]);
+        } else {
+            info.setDisconnected(c);
+        }
+        generation++;
+        // Connections change far less often than frames go out.
+        std::this_thread::yield();
+    }
+    stopping = true;
+    for (std::thread& t : readers) {
+        t.join();
+    }
+
+    std::cout << generation - 1 << " connects and disconnects over " << clients.size() << " clients, "
+              << reads.load() << " snapshot reads on " << READERS << " threads, "
+              << refreshes.load() << " of them picked up a new generation\n";
+    std::cout << inconsistent.load() << " inconsistent snapshots, "
+              << allocations.load() << " allocations reading\n";
+    if (!alloc_counting()) {
+        std::cout << "FAIL: built without COUNT_ALLOCS, so operator new isn't counted\n";
+        return 1;
+    }
+    if (inconsistent.load() || allocations.load()) {
+        std::cout << "FAIL: snapshots must be consistent and read without allocating\n";
+        return 1;
+    }
+    std::cout << "OK: every snapshot was consistent and read without allocating\n";
+    return 0;
+}
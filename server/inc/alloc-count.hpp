@@ -0,0 +1,14 @@
+#ifndef ALLOC_COUNT_HPP
+#define ALLOC_COUNT_HPP
+
+#include <cstdint>
+
+// The number of times operator new has been called on the calling thread.
+// Code that must not allocate takes the difference across a call. Only builds
+// with COUNT_ALLOCS (make check-allocs) replace operator new to count; in the
+// server itself this is always 0.
+uint64_t thread_alloc_count();
+// Whether this build counts allocations.
+bool alloc_counting();
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef BOUNDED_QUEUE_HPP
+#define BOUNDED_QUEUE_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+// A fixed capacity FIFO used to hand work between threads. push blocks while
+// the queue is full and pop blocks while it is empty, so a slow consumer
+// applies backpressure to its producer. Once closed, push fails and pop
+// drains the remaining items before returning std::nullopt.
+template <typename T>
+class BoundedQueue {
+private:
+    std::mutex mut;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<T> items;
+    size_t capacity;
+    bool closed;
+
+public:
+    BoundedQueue(size_t capacity)
+        : capacity(capacity > 0 ? capacity : 1),
+          closed(false)
+    {}
+
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(this->mut);
+        this->not_full.wait(lock, [this] {
+            return this->closed || this->items.size() < this->capacity;
+        });
+        if (this->closed) {
+            return false;
+        }
+        this->items.push_back(std::move(item));
+        this->not_empty.notify_one();
+        return true;
+    }
+
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> lock(this->mut);
+        this->not_empty.wait(lock, [this] {
+            return this->closed || !this->items.empty();
+        });
+        if (this->items.empty()) {
+            return std::nullopt;
+        }
+        T item = std::move(this->items.front());
+        this->items.pop_front();
+        this->not_full.notify_one();
+        return item;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(this->mut);
+        this->closed = true;
+        this->not_empty.notify_all();
+        this->not_full.notify_all();
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(this->mut);
+        return this->items.size();
+    }
+};
+
+#endif
@@ -118,6 +118,14 @@ class TextElement : public Element {
 };
   
 
+//A copy of one element's current frame, already cropped to the canvas. A list of these is everything
+//needed to composite a frame, so it can be handed to another thread while elements keep decoding.
+struct CanvasLayer {
+    cv::Point loc;
+    cv::Mat pixels;
+};
+
+
 //Originally, elementCount and PixelMatrix and the rest were in private, but for my MPI implementation, i needed to access them directly to init vCanvas with a default constructer
 class VirtualCanvas{        
     
@@ -126,7 +134,9 @@ class VirtualCanvas{
 
 
         cv::Mat pixelMatrix;
-        cv::Mat canvasLut;
+        //Gamma from the input file's settings. It's applied when pixels are packed for the LEDs, so the
+        //canvas itself stays in the source colours.
+        double gamma = 1.0;
         cv::Size dim;
         std::vector<Element *> elementPtrList;
 
@@ -148,6 +158,8 @@ class VirtualCanvas{
         void addElementToCanvas(Element* element);
         bool removeElementFromCanvas(int elementId);
         void pushToCanvas();
+        std::vector<CanvasLayer> snapshotLayers();
+        void composeLayers(std::vector<CanvasLayer>& layers, cv::Mat& out) const;
     };
 
 
@@ -0,0 +1,72 @@
+#ifndef CLIENT_ENCODING_HPP
+#define CLIENT_ENCODING_HPP
+
+#include "client.hpp"
+#include "protocol.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// How a client's frames are encoded on its current connection, chosen each
+// time it checks in. A client that sends its capabilities gets every encoding
+// its firmware handles that the config doesn't turn off, at the least wire
+// depth that loses nothing when the depth is left to auto. A client that
+// checks in with only its MAC address runs firmware from before this, and
+// gets full 24 bit SetLedsBatched frames over TCP whatever the config asks.
+//
+// Chosen on the connection thread into a new ClientEncoding, which is then
+// published whole and never changed, so everything the sending threads read
+// for one frame comes from the same choice.
+class ClientEncoding {
+public:
+    // Whether the client's check-in had capabilities.
+    bool advertised;
+    // Whether frames go out as SetLedsBatched, for firmware that predates
+    // SetLedsFrame. It shows them as they arrive, so they need no redraw.
+    bool batched;
+    bool delta;
+    bool compress;
+    // WIRE_DEPTH_* full frames are sent at.
+    uint8_t wire_depth;
+    bool udp;
+    bool present_at;
+    // Whether SetLedsFrame over TCP may be any size. Every other message,
+    // and any frame over UDP, must fit max_message_size, which is unlimited
+    // for a client that didn't say.
+    bool streamed;
+    uint32_t max_message_size;
+
+    ClientEncoding();
+
+    // Chooses for a connection that checked in with caps, or NULL without.
+    // max_level is the brightest value the client's pixels are packed to,
+    // and full_frame_size the size of its largest full frame. Warns about
+    // anything the client's firmware can't do that its config needs.
+    void choose(const Client* c,
+                const ClientCapabilities* caps,
+                feature_choice delta_frames,
+                uint8_t max_level,
+                uint32_t full_frame_size);
+    // The most a compressed, quantised or delta frame may be before its
+    // present-at time is appended.
+    uint32_t encoded_budget() const;
+    std::string to_string() const;
+};
+
+typedef std::shared_ptr<const ClientEncoding> ClientEncodingHandle;
+
+// A client's current ClientEncoding. A check-in swaps in a new one; a frame
+// takes a handle to whichever is current once and packs and sends with it,
+// which neither locks nor allocates.
+class PublishedEncoding {
+public:
+    PublishedEncoding();
+
+    void publish(ClientEncodingHandle encoding);
+    ClientEncodingHandle load() const;
+
+private:
+    ClientEncodingHandle current;
+};
+
+#endif
@@ -7,9 +7,35 @@
 #include <cstdint>
 #include <optional>
 #include <opencv2/opencv.hpp>
+#include "pack-kernel.hpp"
 
 enum rotation { UP, DOWN, LEFT, RIGHT };
 
+// How the LEDs of a matrix are chained, row by row in its unrotated frame.
+// SERPENTINE alternates direction every row, starting right to left.
+// PROGRESSIVE runs every row left to right.
+enum wiring_pattern { SERPENTINE, PROGRESSIVE };
+
+// How a client's frames travel. TRANSPORT_UDP only applies once the client
+// has said it listens on UDP, until then and for everything else it is TCP.
+enum transport { TRANSPORT_TCP, TRANSPORT_UDP };
+
+// Whether to send an optional encoding. FEATURE_AUTO sends it to clients whose
+// check-in says their firmware handles it, and never to firmware that checks
+// in without capabilities. FEATURE_ON also sends it to those, trusting the
+// config that their firmware handles it.
+enum feature_choice { FEATURE_OFF, FEATURE_ON, FEATURE_AUTO };
+
+// "false", "true" or "auto", as the config spells it.
+const char* feature_choice_name(feature_choice choice);
+
+// A wire depth picked per client when it checks in: the least that loses
+// nothing at its brightness of the depths its firmware expands, or 24 bits.
+const uint8_t WIRE_DEPTH_AUTO = 0;
+
+// Out of 255; about what the old fixed divide by 10 gave.
+const uint8_t DEFAULT_BRIGHTNESS = 26;
+
 class CanvasPos {
 public:
     uint32_t x;
@@ -34,11 +60,13 @@ public:
     uint32_t width;
     uint32_t height;
     uint64_t total_leds;
+    wiring_pattern wiring;
 
     LEDMatrixSpec(std::string id,
                   float power_limit_amps,
                   uint32_t width,
-                  uint32_t height);
+                  uint32_t height,
+                  wiring_pattern wiring);
 
     std::string to_string();
 };
@@ -49,19 +77,30 @@ public:
     LEDMatrixSpec* spec;
     CanvasPos pos;
     uint32_t packed_pixel_array_size;
-    unsigned char* packed_pixel_array;
+    // Out of 255, applied when packing.
+    uint8_t brightness;
 
     LEDMatrix(std::string id,
               LEDMatrixSpec* spec,
-              CanvasPos pos);
+              CanvasPos pos,
+              uint8_t brightness);
 
+    void append_gather(uint32_t canvas_width, std::vector<uint32_t>& gather) const;
     std::string to_string();
 };
 
 class MatricesConnection {
 public:
     uint8_t pin;
+    // COLOR_ORDER_* the pin's pixels are sent in.
+    uint8_t color_order;
     std::vector<LEDMatrix*> matrices;
+    // Byte offset in the canvas of the pixel for every LED on the pin, in
+    // chain order. Built once by Client::compile_gather.
+    std::vector<uint32_t> gather;
+    // Splits gather into runs of matrices packed with the same brightness.
+    // Built once by Client::compile_pack.
+    std::vector<PackSegment> segments;
 
     std::string to_string();
 };
@@ -70,10 +109,28 @@ class Client {
 public:
     uint64_t mac_addr;
     std::vector<MatricesConnection> mat_connections;
+    // Send full frames as SetLedsCompressed when that makes them smaller.
+    feature_choice compress;
+    // WIRE_DEPTH_* or WIRE_DEPTH_AUTO full frames are sent at. Below 24 bits
+    // they go out as SetLedsQuantized, dithered along each strip if dither is
+    // set.
+    uint8_t wire_depth;
+    bool dither;
+    transport frame_transport;
+    // The SetConfig message sent every time the client checks in. Built once
+    // by Client::compile_config.
+    std::vector<uint8_t> set_config;
 
     Client(uint64_t mac_addr,
-           std::vector<MatricesConnection> mat_connections);
-
+           std::vector<MatricesConnection> mat_connections,
+           feature_choice compress,
+           uint8_t wire_depth,
+           bool dither,
+           transport frame_transport);
+
+    void compile_gather(uint32_t canvas_width);
+    void compile_pack(double gamma);
+    void compile_config();
     std::string to_string();
 };
 
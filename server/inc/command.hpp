@@ -2,8 +2,9 @@
 #define COMMAND_HPP
 
 #include "canvas.hpp"
+#include "controller.hpp"
 
 bool inputAvailable();
-int processCommand(VirtualCanvas& vCanvas, const std::string& line, bool& isPaused);
+int processCommand(VirtualCanvas& vCanvas, Controller& cont, const std::string& line, bool& isPaused);
 
 #endif
@@ -5,6 +5,8 @@
 #include <string>
 #include <vector>
 #include "client.hpp"
+#include "frame-clock.hpp"
+#include "tcp.hpp"
 #include <opencv2/opencv.hpp>
 
 class ServerConfig {
@@ -12,12 +14,34 @@ public:
     std::vector<Client*> clients;
     cv::Size canvas_size;
     int64_t ns_per_frame;
+    int pipeline_depth;
+    int sender_threads;
+    latch_mode latch;
+    int64_t present_delay_ns;
+    overrun_policy overrun;
+    feature_choice delta_frames;
+    int keyframe_interval;
+    int udp_mtu;
+    double udp_simulated_loss;
+    int64_t check_in_timeout_ns;
+    net_backend backend;
 
     ServerConfig();
 
     ServerConfig(std::vector<Client*> clients,
                  cv::Size canvas_size,
-                 int64_t ns_per_frame);
+                 int64_t ns_per_frame,
+                 int pipeline_depth,
+                 int sender_threads,
+                 latch_mode latch,
+                 int64_t present_delay_ns,
+                 overrun_policy overrun,
+                 feature_choice delta_frames,
+                 int keyframe_interval,
+                 int udp_mtu,
+                 double udp_simulated_loss,
+                 int64_t check_in_timeout_ns,
+                 net_backend backend);
 };
 
 ServerConfig parse_config_throws(std::string file);
@@ -0,0 +1,62 @@
+#ifndef CONN_INFO_HPP
+#define CONN_INFO_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <utility>
+#include <vector>
+#include "client.hpp"
+
+// The clients connected at one moment and their sockets. Published whole and
+// never changed afterwards, so any number of threads can read one without
+// locking.
+class ConnSnapshot {
+public:
+    // Bumped every time a client connects or disconnects.
+    uint64_t generation;
+    std::vector<std::pair<const Client*, int>> connected;
+
+    std::optional<int> socket(const Client* c) const;
+
+private:
+    std::map<const Client*, int> sockets;
+
+    friend class ClientConnInfo;
+};
+
+typedef std::shared_ptr<const ConnSnapshot> ConnSnapshotHandle;
+
+// Which clients are connected. Connecting and disconnecting are rare and
+// publish a new snapshot under the lock. Readers keep a handle to the last
+// snapshot they took and only go back for a new one when the generation has
+// moved on, so reading every frame neither locks nor allocates.
+class ClientConnInfo {
+public:
+    ClientConnInfo(std::vector<Client*> clients);
+
+    void setConnected(const Client* c, int socket);
+    void setDisconnected(const Client* c);
+    std::optional<int> getSocket(const Client* c);
+    bool isConnected(const Client* c);
+    void getAllDisconnected(std::vector<const Client*>& v);
+
+    // Points snapshot at the current connections if they have changed since
+    // it was taken, or if it is empty.
+    const ConnSnapshot& snapshot(ConnSnapshotHandle& snapshot);
+
+private:
+    std::mutex mut;
+    std::map<const Client*, int> connected;
+    std::set<const Client*> disconnected;
+    std::atomic<uint64_t> generation;
+    ConnSnapshotHandle current;
+
+    void publish_locked();
+};
+
+#endif
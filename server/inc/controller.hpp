@@ -1,15 +1,17 @@
 #ifndef CONTROLLER_HPP
 #define CONTROLLER_HPP
 
+#include "alloc-count.hpp"
 #include "canvas.hpp"
 #include "client.hpp"
+#include "frame-clock.hpp"
+#include "pipeline.hpp"
+#include "sender-pool.hpp"
 #include "tcp.hpp"
 #include <chrono>
 #include <cstdint>
 #include <optional>
-
-using ns_ts = std::chrono::time_point<std::chrono::system_clock, std::chrono::nanoseconds>;
-using ns_dur = std::chrono::nanoseconds;
+#include <ostream>
 
 class Controller;
 
@@ -47,18 +49,40 @@ public:
     ClientConnInfo* client_conn_info;
     EventQueue event_queue;
     int64_t ns_per_frame;
+    FrameClock frame_clock;
+    latch_mode latch;
+    uint32_t frame_seq;
+    // Time between the first and last OP_REDRAW of a broadcast.
+    StageTimer latch_spread_timer;
+    SenderPool sender_pool;
+    // NULL when the pipeline depth is 0, in which case every stage of a frame
+    // runs in sequence on the frame thread.
+    FramePipeline* pipeline;
 
     Controller(VirtualCanvas &canvas,
                std::vector<Client*> clients,
                LEDTCPServer tcp_server,
-               int64_t ns_per_frame);
+               int64_t ns_per_frame,
+               int pipeline_depth,
+               int sender_threads,
+               latch_mode latch,
+               overrun_policy overrun);
 
-    void frame_exec(bool debug);
-    void set_leds_all();
+    void frame_exec(FrameTick tick, bool debug);
+    void set_leds_all(const FrameHandle& frame);
     void redraw_all();
+    void print_stats(std::ostream& out);
+    void stop();
 
 private:
-    void frame_wait();
+    // The connected clients as of the last frame, only refreshed when they
+    // change. The rest is reused every frame so the send path doesn't
+    // allocate.
+    ConnSnapshotHandle conns;
+    std::vector<SendJob> send_jobs;
+    SendWork send_work;
+
+    void run_events(ns_ts cutoff_time);
 };
 
 #endif
@@ -0,0 +1,56 @@
+#ifndef DELTA_ENCODER_HPP
+#define DELTA_ENCODER_HPP
+
+#include "client.hpp"
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+enum delta_result { DELTA_OK, DELTA_UNCHANGED, DELTA_TOO_BIG };
+
+// Turns a client's full frames into SetLedsDelta messages holding only the
+// runs of pixels that changed since the last frame packed for it. Frames are
+// compared after packing, so only changes the LEDs would show count. Used by
+// one packing thread at a time.
+class DeltaEncoder {
+public:
+    std::atomic<int64_t> keyframes;
+    std::atomic<int64_t> deltas;
+    // Frames with no changes, which aren't sent at all.
+    std::atomic<int64_t> unchanged;
+    // Frames sent in full because the delta came out no smaller.
+    std::atomic<int64_t> too_big;
+    std::atomic<int64_t> resyncs;
+    // Bytes of full frames that deltas replaced, and the deltas' bytes.
+    std::atomic<uint64_t> full_bytes;
+    std::atomic<uint64_t> delta_bytes;
+
+    DeltaEncoder(const Client* c, uint32_t entries_size);
+
+    // Whether the next frame should be a keyframe, interval frames after the
+    // last one.
+    bool keyframe_due(int interval);
+    // Makes the batch entries of a full frame the baseline for later deltas.
+    void set_baseline(const uint8_t* entries, uint32_t seq);
+    // Writes the delta from the baseline to entries, the batch entries of the
+    // full frame seq, full_size bytes, into out. It is only kept, and becomes
+    // the baseline, if it is smaller than max_size, which is the full frame's
+    // size unless the frame could be sent smaller some other way.
+    delta_result encode(const uint8_t* entries,
+                        uint32_t full_size,
+                        uint32_t max_size,
+                        uint8_t flags,
+                        uint32_t seq,
+                        uint8_t* out,
+                        uint32_t* out_size);
+
+private:
+    std::vector<uint8_t> pins;
+    std::vector<uint32_t> pin_leds;
+    std::vector<uint8_t> baseline;
+    uint32_t baseline_seq;
+    bool have_baseline;
+    int frames_since_keyframe;
+};
+
+#endif
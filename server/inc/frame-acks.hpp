@@ -0,0 +1,74 @@
+#ifndef FRAME_ACKS_HPP
+#define FRAME_ACKS_HPP
+
+#include "frame-clock.hpp"
+#include "protocol.hpp"
+#include "stage-timer.hpp"
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Frames sent to one client that are remembered until acked, about 6 seconds
+// at 20 fps.
+const size_t FRAME_ACK_WINDOW = 128;
+
+// Matches a client's FrameAcks to the frames it was sent. Clients show frames
+// in order and ack each one they show, so an ack also settles every frame
+// sent before it: any that weren't acked were dropped on the way, by the send
+// queue or the network, or replaced on the client before a refresh showed
+// them. Frames that fall out of the window unacked count the same way.
+//
+// Client timestamps are on the client's own clock, so only the time it held
+// the frame (latch_us - recv_us) is used. The round trip is what is left of
+// the time from the frame being written to its ack arriving, and display
+// latency runs from the frame's deadline to the ack arriving less half the
+// round trip.
+//
+// Frames are recorded from the sending threads and acks handled on the
+// reactor thread.
+class FrameAckTracker {
+public:
+    std::atomic<int64_t> acked;
+    std::atomic<int64_t> not_shown;
+    // Acks for frames that aren't in the window, sent before the client
+    // last checked in or long ago.
+    std::atomic<int64_t> unmatched;
+    StageTimer rtt;
+    StageTimer display_latency;
+    // From the client reading the frame to its strips finishing refreshing
+    // with it, which a slow panel stretches.
+    StageTimer on_client;
+
+    FrameAckTracker();
+
+    // Forgets the frames sent on the previous connection without counting
+    // them.
+    void reset();
+    // Records frame seq, due at deadline, being handed to the send queue or
+    // UDP socket.
+    void queued(uint32_t seq, ns_ts deadline);
+    // Records frame seq having been written to the socket in full.
+    void written(uint32_t seq, ns_ts now);
+    void ack(const FrameAckMessage* msg, ns_ts now);
+
+private:
+    struct SentFrame {
+        uint32_t seq;
+        ns_ts deadline;
+        ns_ts queued_at;
+        ns_ts written_at;
+        bool was_written;
+    };
+    std::mutex mut;
+    std::vector<SentFrame> window;
+    // Frames ever recorded and the first one not settled yet; frame n lives
+    // at window[n % FRAME_ACK_WINDOW].
+    uint64_t recorded;
+    uint64_t settled;
+    // Firmware from before FrameAck never acks, so frames only count as not
+    // shown once the connection has acked something.
+    bool acking;
+};
+
+#endif
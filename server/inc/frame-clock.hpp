@@ -0,0 +1,68 @@
+#ifndef FRAME_CLOCK_HPP
+#define FRAME_CLOCK_HPP
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <ostream>
+
+// Every timestamp in the server (frame deadlines, element events, stage
+// timings) uses this clock. On Linux steady_clock is CLOCK_MONOTONIC, so NTP
+// steps don't move it and it can be handed to timerfd as is.
+using ns_ts = std::chrono::time_point<std::chrono::steady_clock, std::chrono::nanoseconds>;
+using ns_dur = std::chrono::nanoseconds;
+
+// What to do when a frame starts more than a whole period late.
+// OVERRUN_CATCH_UP runs the missed frames back to back (up to a limit) so
+// element playback keeps its pace. OVERRUN_SKIP drops them and carries on from
+// the most recent deadline.
+enum overrun_policy { OVERRUN_CATCH_UP, OVERRUN_SKIP };
+
+class FrameTick {
+public:
+    ns_ts deadline;
+    ns_ts woke;
+};
+
+// Paces frames on absolute deadlines, start + n * ns_per_frame, so time spent
+// working on a frame never shifts the ones after it. The deadline is armed on
+// a timerfd so the frame tick can be waited on alongside other descriptors.
+class FrameClock {
+public:
+    int64_t ns_per_frame;
+    overrun_policy policy;
+
+    uint64_t frames;
+    // Deadlines that passed without a frame being run for them.
+    uint64_t missed_deadlines;
+    // Frames whose deadline had already passed when the previous frame
+    // finished.
+    uint64_t late_frames;
+
+    FrameClock(int64_t ns_per_frame, overrun_policy policy);
+    ~FrameClock();
+
+    int timer_fd() const;
+    void arm();
+    void disarm();
+    std::optional<FrameTick> expire();
+    FrameTick tick(bool overran);
+    ns_ts next_deadline() const;
+    void reset();
+    void print_stats(std::ostream& out);
+
+private:
+    static constexpr size_t JITTER_SAMPLES = 512;
+
+    int fd;
+    // Whether the deadline had already passed when the timer was armed.
+    bool armed_late;
+    ns_ts deadline;
+    // Wake-up lateness (woke - deadline) of the most recent frames.
+    std::array<int64_t, JITTER_SAMPLES> jitter;
+    int64_t jitter_max;
+    int64_t jitter_total;
+};
+
+#endif
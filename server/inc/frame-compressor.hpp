@@ -0,0 +1,39 @@
+#ifndef FRAME_COMPRESSOR_HPP
+#define FRAME_COMPRESSOR_HPP
+
+#include "client.hpp"
+#include <atomic>
+#include <cstdint>
+
+// Turns a client's full frames into SetLedsCompressed messages, encoding each
+// pin with whichever of run-length, palette or raw pixels comes out smallest.
+// Text and flat graphics shrink a lot; photos and video mostly don't, and are
+// left uncompressed.
+class FrameCompressor {
+public:
+    std::atomic<int64_t> compressed;
+    // Frames sent as they were, or quantised, because compressing didn't make
+    // them smaller.
+    std::atomic<int64_t> incompressible;
+    // Bytes of full frames that compressed ones replaced, and their bytes.
+    std::atomic<uint64_t> full_bytes;
+    std::atomic<uint64_t> compressed_bytes;
+
+    FrameCompressor(const Client* c);
+
+    // Compresses the batch entries of a full frame of full_size bytes into
+    // out, which must hold max_size bytes. Returns the message's size, or 0
+    // if it wouldn't be smaller than max_size, which is the full frame's size
+    // unless the frame could be sent smaller some other way.
+    uint32_t compress(const uint8_t* entries,
+                      uint32_t full_size,
+                      uint32_t max_size,
+                      uint8_t flags,
+                      uint32_t seq,
+                      uint8_t* out);
+
+private:
+    uint8_t batch_count;
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef FRAME_QUANTIZER_HPP
+#define FRAME_QUANTIZER_HPP
+
+#include "client.hpp"
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// Turns a client's full frames into SetLedsQuantized messages at a reduced
+// wire depth. Each pin is quantised over the range its brightness leaves, so at
+// low brightness 16 bits still carry every level the LEDs can show.
+class FrameQuantizer {
+public:
+    std::atomic<int64_t> frames;
+    // Bytes of full frames that quantised ones replaced, and their bytes.
+    std::atomic<uint64_t> full_bytes;
+    std::atomic<uint64_t> quantized_bytes;
+
+    FrameQuantizer(const Client* c);
+
+    // Writes the batch entries of a full frame of full_size bytes into out
+    // as a SetLedsQuantized message at depth, returning its size.
+    uint32_t quantize(uint8_t depth,
+                      const uint8_t* entries,
+                      uint32_t full_size,
+                      uint8_t flags,
+                      uint32_t seq,
+                      uint8_t* out);
+
+    // The size quantize gives at depth.
+    uint32_t size(uint8_t depth) const;
+    // The highest value packing can give any of the client's pixels.
+    uint8_t max_level() const;
+
+private:
+    bool dither;
+    // The highest value packing can give each pin's pixels, and its LEDs.
+    std::vector<uint8_t> max_levels;
+    std::vector<uint32_t> pin_leds;
+};
+
+#endif
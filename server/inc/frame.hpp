@@ -0,0 +1,27 @@
+#ifndef FRAME_HPP
+#define FRAME_HPP
+
+#include "frame-clock.hpp"
+#include <cstdint>
+#include <memory>
+#include <opencv2/opencv.hpp>
+
+// One composited canvas frame. Frames are never modified once made and are
+// shared by every client sender through a FrameHandle, so the seq a client was
+// sent identifies exactly which pixels it got.
+class Frame {
+public:
+    const uint32_t seq;
+    const ns_ts deadline;
+    const cv::Mat pixels;
+
+    Frame(uint32_t seq, ns_ts deadline, cv::Mat pixels)
+        : seq(seq),
+          deadline(deadline),
+          pixels(pixels)
+    {}
+};
+
+typedef std::shared_ptr<const Frame> FrameHandle;
+
+#endif
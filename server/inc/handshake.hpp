@@ -0,0 +1,77 @@
+#ifndef HANDSHAKE_HPP
+#define HANDSHAKE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include "client.hpp"
+#include "frame-clock.hpp"
+#include "protocol.hpp"
+#include "reactor.hpp"
+
+class LEDTCPServer;
+
+// How long an accepted connection has to check in and take its SetConfig.
+const int64_t DEFAULT_CHECK_IN_TIMEOUT_NS = 3'000'000'000;
+
+// Where an accepted connection is in checking in. It first waits for the
+// whole check-in, with or without capabilities, then sends SetConfig, and is admitted once all of it
+// has been written.
+enum handshake_state { HANDSHAKE_CHECK_IN, HANDSHAKE_SET_CONFIG };
+
+class Handshake {
+public:
+    int socket;
+    handshake_state state;
+    // The connection is dropped if it hasn't been admitted by then.
+    ns_ts deadline;
+    // The check-in as it arrives, header first.
+    uint8_t check_in[MAX_CHECK_IN_SIZE];
+    uint32_t received;
+    const Client* client;
+    uint32_t config_sent;
+};
+
+// Accepts clients on the listening socket and takes every connection through
+// its handshake at once on one non-blocking loop, so a client that stalls
+// while checking in only holds itself up. When the whole wall powers on the
+// clients are admitted as fast as they connect.
+class HandshakeLoop {
+public:
+    int64_t timeout_ns;
+    std::atomic<int64_t> admitted;
+    // Admitted clients that were sent the last frame straight away.
+    std::atomic<int64_t> replayed;
+    std::atomic<int64_t> timed_out;
+    std::atomic<int64_t> rejected;
+    // Admitted clients that checked in without capabilities, so run firmware
+    // from before they were sent.
+    std::atomic<int64_t> legacy;
+
+    HandshakeLoop(std::vector<Client*> clients);
+    ~HandshakeLoop();
+
+    // Runs the loop on the calling thread, handing admitted clients to
+    // server.
+    void run(int socket, LEDTCPServer* server);
+    void print_stats(std::ostream& out);
+
+private:
+    Reactor reactor;
+    int timer_fd;
+    int listen_socket;
+    LEDTCPServer* server;
+    std::map<uint64_t, const Client*> mac_to_client;
+    std::map<int, Handshake*> pending;
+
+    void accept_all();
+    void handshake_event(Handshake* h, uint32_t events);
+    bool receive_check_in(Handshake* h);
+    bool send_config(Handshake* h);
+    void finish(Handshake* h, bool admit);
+    void expire();
+    void arm_timer();
+};
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef NET_BACKEND_HPP
+#define NET_BACKEND_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <sys/socket.h>
+#include <utility>
+#include <vector>
+
+// How queued frames get onto client sockets. NET_BACKEND_EPOLL writes each
+// client's queue with sendmsg from whichever thread queued to it, and waits
+// for full sockets on the reactor. NET_BACKEND_IO_URING only queues, then
+// hands every client's write for the frame to the kernel in one
+// io_uring_enter and takes the results back on the reactor.
+enum net_backend { NET_BACKEND_EPOLL, NET_BACKEND_IO_URING };
+
+const char* net_backend_name(net_backend backend);
+
+// A finished write: the owner it was scheduled with and its result, the bytes
+// written or -errno.
+typedef std::pair<void*, int> UringCompletion;
+
+// An io_uring submitting IORING_OP_SENDMSG writes in batches. Built on the
+// raw system calls, so it needs no library; if the kernel doesn't support it
+// ok() is false and the caller should stay on epoll. Safe to use from several
+// threads.
+class UringSender {
+public:
+    // io_uring_enter calls made, and the writes they carried.
+    std::atomic<int64_t> submits;
+    std::atomic<int64_t> writes;
+    // Writes that came back because the socket was full.
+    std::atomic<int64_t> would_block;
+
+    // Sized for at least max_inflight writes at once.
+    UringSender(uint32_t max_inflight);
+    ~UringSender();
+
+    bool ok() const;
+    // Readable when completions are waiting to be reaped.
+    int event_fd() const;
+
+    // Adds a write of hdr to socket to the next submit. hdr and everything it
+    // points at must stay put until the write's completion is reaped.
+    void schedule(void* owner, int socket, const msghdr* hdr);
+    // Submits every scheduled write with as few io_uring_enter calls as the
+    // ring allows, usually one.
+    void submit();
+    // Appends every completed write to done.
+    void reap(std::vector<UringCompletion>& done);
+    void print_stats(std::ostream& out);
+
+private:
+    std::mutex mut;
+    int ring_fd;
+    int completion_fd;
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+    // The mapped rings. Heads and tails are shared with the kernel and only
+    // accessed atomically.
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    void* sqes;
+    size_t sqes_size;
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t* sq_mask;
+    uint32_t* sq_array;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    uint32_t* cq_mask;
+    void* cqes;
+    // Writes waiting for the next submit.
+    struct Scheduled {
+        void* owner;
+        int socket;
+        const msghdr* hdr;
+    };
+    std::vector<Scheduled> scheduled;
+    // Writes io_uring_enter failed to submit, handed back by the next reap.
+    std::vector<UringCompletion> failed;
+
+    bool setup(uint32_t entries);
+    void enter_locked(uint32_t count);
+    void fail_unsubmitted_locked(int res);
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef PACK_KERNEL_HPP
+#define PACK_KERNEL_HPP
+
+#include <cstdint>
+
+// Implementations of the pack kernel, widest last. The SIMD ones are only
+// built on x86 and only used when the CPU supports them.
+enum pack_impl { PACK_SCALAR, PACK_SSSE3, PACK_AVX2 };
+
+// Everything done to a canvas pixel on its way to an LED: gamma, brightness
+// and channel order, fused into one table per output byte.
+class PackParams {
+public:
+    // Which channel of the BGR canvas pixel goes to each output byte.
+    uint8_t src_channel[3];
+    uint8_t lut[3][256];
+    // With gamma 1 the tables are just v * scale >> 16 (or v at full
+    // brightness), which the SIMD paths compute without them.
+    bool linear;
+    uint16_t scale;
+    bool full_brightness;
+};
+
+// brightness is out of 255; color_order is a COLOR_ORDER_* value, unknown
+// orders fall back to RGB.
+PackParams make_pack_params(double gamma, uint8_t brightness, uint8_t color_order);
+
+pack_impl best_pack_impl();
+const char* pack_impl_name(pack_impl impl);
+
+// Reads the BGR canvas pixel at each of the num_leds gather offsets and
+// writes it to out through params, 3 bytes per LED.
+void pack_pixels(const uint8_t* canvas,
+                 const uint32_t* gather,
+                 uint32_t num_leds,
+                 const PackParams& params,
+                 uint8_t* out);
+void pack_pixels(pack_impl impl,
+                 const uint8_t* canvas,
+                 const uint32_t* gather,
+                 uint32_t num_leds,
+                 const PackParams& params,
+                 uint8_t* out);
+
+// A run of LEDs on a pin that share pack parameters.
+class PackSegment {
+public:
+    uint32_t num_leds;
+    PackParams params;
+};
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include "bounded-queue.hpp"
+#include "canvas.hpp"
+#include "client.hpp"
+#include "frame-clock.hpp"
+#include "frame.hpp"
+#include "sender-pool.hpp"
+#include "stage-timer.hpp"
+#include "tcp.hpp"
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Element frames for one tick, produced by the event/decode stage.
+class LayerFrame {
+public:
+    uint32_t seq;
+    ns_ts deadline;
+    std::vector<CanvasLayer> layers;
+};
+
+class PackedMessage {
+public:
+    const Client* client;
+    uint8_t* buf;
+    uint32_t size;
+};
+
+// Packed frame messages for every client connected at pack time.
+class PackedFrame {
+public:
+    FrameHandle frame;
+    std::vector<PackedMessage> messages;
+};
+
+// Runs composite, pack/encode and send on their own threads, connected by
+// queues holding at most `depth` frames each. The event/decode stage stays on
+// the caller's thread (it owns the canvas elements) and feeds the pipeline via
+// submit(). A deeper pipeline lets the frame thread run further ahead of the
+// wire at the cost of latency.
+class FramePipeline {
+public:
+    StageTimer event_timer;
+    StageTimer composite_timer;
+    StageTimer pack_timer;
+    StageTimer send_timer;
+    // Time from the frame's deadline to it being on the wire.
+    StageTimer deadline_to_wire_timer;
+
+    FramePipeline(VirtualCanvas& canvas,
+                  LEDTCPServer& tcp_server,
+                  size_t depth,
+                  latch_mode latch,
+                  int64_t ns_per_frame,
+                  StageTimer& latch_spread_timer,
+                  SenderPool& sender_pool);
+
+    void start();
+    void stop();
+
+    bool submit(std::vector<CanvasLayer> layers, FrameTick tick);
+    cv::Mat getLatestComposite();
+    void print_stats(std::ostream& out);
+
+private:
+    VirtualCanvas& canvas;
+    LEDTCPServer& tcp_server;
+    size_t depth;
+    latch_mode latch;
+    int64_t ns_per_frame;
+    StageTimer& latch_spread_timer;
+    SenderPool& sender_pool;
+    uint32_t next_seq;
+
+    BoundedQueue<LayerFrame> layer_queue;
+    BoundedQueue<FrameHandle> composed_queue;
+    BoundedQueue<PackedFrame> packed_queue;
+
+    std::mutex latest_mut;
+    cv::Mat latest_composite;
+
+    std::thread* composite_thread;
+    std::thread* pack_thread;
+    std::thread* send_thread;
+
+    // Each thread's view of the connected clients, only refreshed when they
+    // change.
+    ConnSnapshotHandle pack_conns;
+    ConnSnapshotHandle send_conns;
+    // Scratch for the send thread, reused every frame.
+    std::vector<std::pair<const Client*, int>> sent_to;
+    std::vector<SendJob> send_jobs;
+    SendWork send_work;
+
+    void composite_loop();
+    void pack_loop();
+    void send_loop();
+};
+
+#endif
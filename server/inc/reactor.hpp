@@ -0,0 +1,29 @@
+#ifndef REACTOR_HPP
+#define REACTOR_HPP
+
+#include <cstdint>
+#include <functional>
+#include <map>
+
+// A single threaded epoll loop. Each watched file descriptor has a handler
+// that is called with the epoll events that fired for it. Handlers may add
+// or remove descriptors, including their own. Only modify may be called from
+// other threads.
+class Reactor {
+public:
+    Reactor();
+    ~Reactor();
+
+    bool add(int fd, uint32_t events, std::function<void(uint32_t)> handler);
+    void remove(int fd);
+    bool modify(int fd, uint32_t events);
+    void run();
+    void stop();
+
+private:
+    int epoll_fd;
+    bool running;
+    std::map<int, std::function<void(uint32_t)>> handlers;
+};
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef SEND_BUFFER_HPP
+#define SEND_BUFFER_HPP
+
+#include "client.hpp"
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Message buffers for one client, each big enough for a whole frame of its
+// pixels. They are sized from the client's pins once and reused, so packing a
+// frame doesn't allocate. More than one is only needed while several frames
+// are in flight through the pipeline.
+class SendBufferPool {
+public:
+    // Bytes of batch entries (headers and pixels) in one of the client's
+    // frame messages.
+    uint32_t entries_size;
+    uint32_t capacity;
+    // Buffers acquire() had to allocate because every one was in use. Once
+    // the client is connected this should stop moving.
+    std::atomic<uint64_t> misses;
+
+    SendBufferPool(const Client* c);
+
+    // Makes sure a buffer is ready, so the first frame after a client checks
+    // in doesn't allocate either.
+    void prime();
+    // Allocates only when every buffer is in use. The buffer is held once.
+    uint8_t* acquire();
+    // Holds buf once more, so it isn't reused until released that many times.
+    void retain(uint8_t* buf);
+    void release(uint8_t* buf);
+
+private:
+    std::mutex mut;
+    std::vector<uint8_t*> free_buffers;
+
+    uint8_t* allocate();
+};
+
+// The last frame packed for a client, so a client checking in again can be
+// sent it straight after its SetConfig rather than staying dark until the
+// next frame. The buffer it was packed into is held rather than copied, and
+// only goes back to the pool once a newer frame replaces it.
+class LastFrame {
+public:
+    LastFrame(SendBufferPool* buffers);
+
+    // Holds buf, whose batch entries start at entries, in place of the last
+    // frame.
+    void store(uint8_t* buf, const uint8_t* entries, uint32_t seq);
+    // Points entries at the last frame's batch entries and returns the buffer
+    // holding them, which the caller must release, or NULL if no frame has
+    // been packed.
+    uint8_t* take(const uint8_t** entries, uint32_t* seq);
+
+private:
+    SendBufferPool* buffers;
+    std::mutex mut;
+    uint8_t* buf;
+    const uint8_t* entries;
+    uint32_t seq;
+};
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef SEND_QUEUE_HPP
+#define SEND_QUEUE_HPP
+
+#include "client.hpp"
+#include "frame-acks.hpp"
+#include "net-backend.hpp"
+#include "reactor.hpp"
+#include "send-buffer.hpp"
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <vector>
+
+// The most queued messages written by one sendmsg; the queue rarely holds
+// more than a frame and the controls around it.
+const size_t MAX_FLUSH_IOV = 8;
+
+// A message waiting in a ClientSendQueue. Frames own a buffer from the
+// client's SendBufferPool; control messages like OP_REDRAW and TimePong are
+// small enough to be copied in.
+class QueuedMessage {
+public:
+    uint8_t* buf;
+    uint8_t control[32];
+    uint32_t size;
+    // Bytes already written to the socket.
+    uint32_t sent;
+
+    const uint8_t* bytes() const;
+};
+
+// Everything on its way to one client's socket. Sockets are non-blocking, so
+// a write can come up short; the rest stays queued and is written when the
+// socket drains, from the next send or from the reactor on EPOLLOUT, so a
+// message is never cut off midway. While the socket is backed up, a newer
+// frame replaces any frame that hasn't started sending: latest frame wins and
+// only whole frames are dropped. A SetLedsDelta whose base frame was dropped
+// is dropped too, and a keyframe asked for in its place.
+//
+// The queue owns the socket while the client is connected. It is only
+// written and closed with the queue's lock held, so a sender can't write to a
+// descriptor that was closed, or reused, under it.
+//
+// With an io_uring sender nothing is written from push: the front of the
+// queue is moved to an in-flight batch and scheduled on the ring, and the
+// rest waits until complete is called with the result. In-flight messages are
+// never dropped, and their buffers are only released once the kernel is done
+// with them, even if the socket was closed in the meantime.
+class ClientSendQueue {
+public:
+    std::atomic<int64_t> dropped_frames;
+    // Writes that hit a full socket and had to wait for it to drain.
+    std::atomic<int64_t> stalls;
+    // Set when the client needs a full frame before any more deltas: it has
+    // just connected, a delta had to be dropped or the client asked for one.
+    std::atomic<bool> keyframe_wanted;
+
+    // acks, if not NULL, is told when each frame has been written in full.
+    ClientSendQueue(SendBufferPool* buffers, FrameAckTracker* acks);
+
+    // Starts sending to a newly checked-in socket, dropping anything left
+    // from the previous one.
+    void open(int socket);
+    // Closes the socket and drops whatever was queued for it. Returns false if
+    // socket was not the open one.
+    bool close(int socket);
+    void watch(Reactor* reactor);
+
+    // Queue a message for socket and write as much as the socket takes. A
+    // frame's buffer is handed over and released once it is sent or dropped.
+    // These return false if the socket failed and was closed; messages for a
+    // socket that is no longer the open one are dropped.
+    bool push_frame(int socket, uint8_t* buf, uint32_t size);
+    bool push_control(int socket, const void* data, uint32_t size);
+    // Called when the reactor reports the socket writable.
+    bool flush(int socket);
+    // Writes through uring from now on, or directly if it is NULL.
+    void use_uring(UringSender* uring);
+    // Called with the result of the in-flight write. Returns false if the
+    // socket failed and was closed.
+    bool complete(int res);
+    // Forgets the socket without closing it or waiting for the peer. Only
+    // for benchmarks that reuse their sockets; nothing may be in flight.
+    void release();
+
+    size_t queued();
+    // Clears keyframe_wanted, returning whether it was set.
+    bool take_keyframe_request();
+
+private:
+    SendBufferPool* buffers;
+    FrameAckTracker* acks;
+    Reactor* reactor;
+    UringSender* uring;
+    std::mutex mut;
+    int socket;
+    // Bumped whenever the socket is opened or closed, so a completion can
+    // tell whether it is for the current connection.
+    uint64_t conn_id;
+    // Whether EPOLLOUT is being watched for, which is only while a write is
+    // waiting on the socket.
+    bool waiting;
+    // The sequence number of the last frame fully written, if it had one.
+    bool sent_seq_valid;
+    uint32_t sent_seq;
+    // Holds at most a partly sent message, the newest frame and the newest
+    // unsent control message of each kind, so it never grows past its
+    // reserved size.
+    std::vector<QueuedMessage> messages;
+    // The write on the ring, taken from the front of messages. Its messages
+    // and iovecs stay put until it completes.
+    QueuedMessage inflight[MAX_FLUSH_IOV];
+    size_t inflight_count;
+    uint64_t inflight_conn;
+    // A closed socket the in-flight write still names, closed once its
+    // completion is reaped, or -1.
+    int closing_socket;
+    iovec inflight_iov[MAX_FLUSH_IOV];
+    msghdr inflight_hdr;
+
+    bool flush_locked();
+    void frame_written_locked(const uint8_t* buf);
+    void schedule_locked();
+    void requeue_inflight_locked();
+    bool last_kept_seq_locked(uint32_t* seq);
+    void drop_locked();
+    void set_waiting_locked(bool waiting);
+    void close_locked();
+};
+
+#endif
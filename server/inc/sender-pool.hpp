@@ -0,0 +1,112 @@
+#ifndef SENDER_POOL_HPP
+#define SENDER_POOL_HPP
+
+#include "client.hpp"
+#include "frame-clock.hpp"
+#include "frame.hpp"
+#include "stage-timer.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// One client's share of a frame. weight estimates the cost of sending it (its
+// payload size) and is used to spread clients evenly over the workers. buf and
+// size hold an already packed message, or NULL if the job packs its own.
+class SendJob {
+public:
+    const Client* client;
+    int socket;
+    uint64_t weight;
+    uint8_t* buf;
+    uint32_t size;
+};
+
+// Run for each job of a frame. Jobs are plain data and the work is set up once
+// by the caller, so handing out a frame doesn't allocate.
+typedef std::function<void(SendJob& job, const Frame& frame)> SendWork;
+
+// How long after each frame deadline a client's data was on the wire.
+class ClientSendStats {
+public:
+    StageTimer deadline_to_wire;
+    // Frames that were still being sent when the next frame was due.
+    std::atomic<int64_t> late;
+    // The last frame handed to the client's socket.
+    std::atomic<uint32_t> last_seq;
+
+    ClientSendStats(std::string name);
+};
+
+// Packs and sends every client's payload for a frame in parallel, so one slow
+// TCP peer only holds up the clients sharing its worker. Jobs are assigned
+// heaviest first to the least loaded worker. With 0 workers the jobs run in
+// sequence on the calling thread.
+class SenderPool {
+public:
+    // Time from the first job of a frame starting to the last one finishing.
+    StageTimer frame_timer;
+    // Heap allocations made sending the last frame, and how many frames
+    // allocated at all, in builds that count them. Once every client has
+    // connected both should stop moving: buffers and job lists are all reused.
+    std::atomic<uint64_t> last_frame_allocs;
+    std::atomic<int64_t> allocating_frames;
+
+    SenderPool(std::vector<Client*> clients, size_t num_workers, int64_t ns_per_frame);
+
+    void start();
+    void stop();
+
+    // Runs work for every job and returns once they have all finished, with
+    // the number of allocations the workers made doing so.
+    uint64_t run(std::vector<SendJob>& jobs, const Frame& frame, const SendWork& work);
+    // Records the allocations made sending a frame, counted by the caller
+    // around building the jobs and run().
+    void record_allocs(uint64_t allocs);
+    void print_stats(std::ostream& out);
+
+    static uint64_t payload_weight(const Client* c);
+
+private:
+    size_t num_workers;
+    int64_t ns_per_frame;
+    // Filled in the constructor and only read afterwards, so workers can look
+    // up their client's entry without locking.
+    std::map<const Client*, ClientSendStats*> client_stats;
+
+    std::vector<std::thread*> workers;
+
+    // Reused by every run() so assigning jobs doesn't allocate once they have
+    // grown to the number of clients.
+    std::vector<SendJob*> order;
+    std::vector<std::vector<SendJob*>> assigned;
+    std::vector<uint64_t> load;
+
+    // Set by run() before any jobs are handed out.
+    ns_ts current_deadline;
+    uint32_t current_seq;
+    const Frame* current_frame;
+    const SendWork* current_work;
+
+    // Workers wait for generation to change, then run their entry of
+    // assigned if their index is below used.
+    std::mutex mut;
+    std::condition_variable work_cond;
+    std::condition_variable done_cond;
+    uint64_t generation;
+    size_t used;
+    size_t outstanding;
+    bool stopping;
+    uint64_t worker_allocs;
+
+    void run_job(SendJob& job);
+    void worker_loop(size_t index);
+};
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef STAGE_TIMER_HPP
+#define STAGE_TIMER_HPP
+
+#include "frame-clock.hpp"
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Accumulates how long each pass through a pipeline stage took.
+class StageTimer {
+public:
+    std::string name;
+    std::atomic<int64_t> count;
+    std::atomic<int64_t> total_ns;
+    std::atomic<int64_t> max_ns;
+    std::atomic<int64_t> last_ns;
+
+    StageTimer(std::string name);
+
+    void record(ns_ts start, ns_ts end);
+    void record_ns(int64_t ns);
+    std::string to_string();
+};
+
+#endif
@@ -16,22 +16,38 @@
 #include <thread>
 #include "canvas.hpp"
 #include "client.hpp"
+#include "client-encoding.hpp"
+#include "conn-info.hpp"
+#include "delta-encoder.hpp"
+#include "frame-acks.hpp"
+#include "frame-compressor.hpp"
+#include "frame-quantizer.hpp"
+#include "handshake.hpp"
+#include "net-backend.hpp"
+#include "udp-transport.hpp"
+#include "frame.hpp"
 #include "protocol.hpp"
+#include "reactor.hpp"
+#include "send-buffer.hpp"
+#include "send-queue.hpp"
 
-class ClientConnInfo {
-public:
-    std::mutex mut;
-    std::map<const Client*, int> connected;
-    std::set<const Client*> disconnected;
+// When panels show a frame. LATCH_IMMEDIATE has each client refresh as soon as
+// its pixels arrive. LATCH_SYNCHRONIZED only loads the pixels, and OP_REDRAW
+// is sent to every client back to back at the frame deadline.
+// LATCH_SCHEDULED sends the frame as LATCH_IMMEDIATE does with a present-at
+// time, present_delay_ns after the deadline, that clients with a synced clock
+// wait for.
+enum latch_mode { LATCH_IMMEDIATE, LATCH_SYNCHRONIZED, LATCH_SCHEDULED };
 
-    ClientConnInfo(std::vector<Client*> clients);
+// Frames between full frames when sending deltas, 5 seconds at 20 fps.
+const int DEFAULT_KEYFRAME_INTERVAL = 100;
 
-    void setConnected(const Client* c, int socket);
-    std::optional<int> getSocket(const Client* c);
-    void getAllConnected(std::vector<std::pair<const Client*, int>>& v);
-    void getAllDisconnected(std::vector<const Client*>& v);
-    void setDisconnected(const Client* c);
-    bool isConnected(const Client* c);
+// Bytes received from a client that don't make up a whole message yet. Only
+// used on the reactor thread.
+class ClientInbox {
+public:
+    int socket;
+    std::vector<uint8_t> data;
 };
 
 class LEDTCPServer {
@@ -41,6 +57,33 @@ public:
     int socket;
     ClientConnInfo* conn_info;
     std::thread* conn_handling;
+    // Checks clients in on the connection thread.
+    HandshakeLoop* handshakes;
+    // Signalled by the connection thread whenever a client is admitted.
+    int conn_event_fd;
+    // Filled in the constructor and only read afterwards, so copies of the
+    // server and every sending thread share the same pools.
+    std::map<const Client*, SendBufferPool*> send_buffers;
+    std::map<const Client*, ClientSendQueue*> send_queues;
+    std::map<const Client*, DeltaEncoder*> delta_encoders;
+    std::map<const Client*, FrameCompressor*> compressors;
+    std::map<const Client*, FrameQuantizer*> quantizers;
+    std::map<const Client*, ClientInbox*> inboxes;
+    std::map<const Client*, UdpPeer*> udp_peers;
+    std::map<const Client*, LastFrame*> last_frames;
+    std::map<const Client*, FrameAckTracker*> frame_acks;
+    std::map<const Client*, PublishedEncoding*> encodings;
+    std::map<const ClientSendQueue*, const Client*> queue_clients;
+    // Shared by every copy of the server, like the maps above.
+    UdpTransport* udp;
+    // Set when frames are written through io_uring rather than directly.
+    UringSender* uring;
+    // Send frames as SetLedsDelta against the previous one, with a full
+    // frame every keyframe_interval frames.
+    feature_choice delta_frames;
+    int keyframe_interval;
+    // How long after its deadline a LATCH_SCHEDULED frame is shown.
+    int64_t present_delay_ns;
 
     LEDTCPServer(uint32_t addr,
                  uint16_t port,
@@ -49,15 +92,70 @@ public:
                  void(*handle_conns)(int socket, LEDTCPServer* server));
 
     void start();
+    // Picks how queued messages are written. Falls back to epoll if io_uring
+    // isn't available.
+    void use_backend(net_backend backend);
+    void watch_clients(Reactor& reactor);
+    // Starts sending to a client that has checked in and been sent its
+    // SetConfig on socket, beginning with the last frame packed for it, in
+    // the encodings its capabilities allow (NULL if it sent none). Returns
+    // whether there was a last frame. Called from the connection thread.
+    bool admit(const Client* c, int socket, const ClientCapabilities* caps);
 
-    void tcp_send(const Client* c, int socket, void* data, int size);
-    MessageHeader tcp_recv_header(int socket);
-    void tcp_recv(int socket, void* data, int size);
+    // Queues a small control message, which is copied.
+    void tcp_send(const Client* c, int socket, const void* data, int size);
+    // Queues a packed frame, due at deadline, handing its buffer over. Clients
+    // taking frames over UDP are sent it straight away instead.
+    void send_frame(const Client* c, int socket, uint8_t* buf, uint32_t size, uint32_t seq, ns_ts deadline);
+    // Hands the kernel every write queued since the last call. Called once
+    // everything for a frame has been queued; does nothing with epoll, where
+    // queuing writes straight away.
+    void submit_sends();
 
     void set_leds(const Client* c,
                   int client_socket,
-                  VirtualCanvas canvas);
-    void redraw(const Client* c, int client_socket);
+                  const Frame& frame,
+                  latch_mode latch);
+    uint8_t* pack_leds(const Client* c,
+                       const Frame& frame,
+                       latch_mode latch,
+                       uint32_t* out_size);
+    void release_leds(const Client* c, uint8_t* buf);
+    int64_t redraw_batch(const std::vector<std::pair<const Client*, int>>& conns);
+    void print_stats(std::ostream& out);
+
+private:
+    // Reused by reap_sends so taking completions doesn't allocate.
+    std::vector<UringCompletion> completions;
+
+    void sync_watched(Reactor& reactor);
+    void client_event(Reactor& reactor, const Client* c, int socket, uint32_t events);
+    void send_failed(const Client* c);
+    void reap_sends();
+    uint8_t* encode_leds(const Client* c,
+                         const ClientEncoding& encoding,
+                         const Frame& frame,
+                         uint8_t flags,
+                         uint32_t* out_size);
+    uint8_t* write_full_header(const Client* c,
+                               const ClientEncoding& encoding,
+                               uint8_t* msg_buf,
+                               uint8_t flags,
+                               uint32_t seq,
+                               uint32_t* out_size);
+    uint8_t* encode_last_frame(const Client* c,
+                               const ClientEncoding& encoding,
+                               uint32_t* seq,
+                               uint32_t* out_size);
+    uint8_t* encode_full_leds(const Client* c,
+                              const ClientEncoding& encoding,
+                              uint8_t* msg_buf,
+                              const uint8_t* entries,
+                              uint8_t flags,
+                              uint32_t seq,
+                              uint32_t* out_size);
+    bool receive(const Client* c, int socket);
+    void handle_message(const Client* c, int socket, const uint8_t* msg);
 };
 
 std::optional<LEDTCPServer> create_server(uint32_t addr,
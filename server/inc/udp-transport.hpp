@@ -0,0 +1,56 @@
+#ifndef UDP_TRANSPORT_HPP
+#define UDP_TRANSPORT_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <netinet/in.h>
+
+// The default link MTU fragments are sized to fit.
+const int DEFAULT_UDP_MTU = 1500;
+
+// Where a client takes frames over UDP, once it has said so on its TCP
+// connection, and how sending to it has gone.
+class UdpPeer {
+public:
+    std::atomic<int64_t> frames;
+    std::atomic<int64_t> fragments;
+    // Frames cut short because the socket wouldn't take a fragment.
+    std::atomic<int64_t> send_errors;
+    // Fragments left out on purpose to simulate a lossy link.
+    std::atomic<int64_t> simulated_losses;
+
+    UdpPeer();
+
+    void set(const sockaddr_in& addr);
+    void clear();
+    // Whether the client is listening, and if so its address.
+    bool get(sockaddr_in* addr);
+
+private:
+    std::mutex mut;
+    bool ready;
+    sockaddr_in addr;
+};
+
+// Sends frame messages to clients as FrameFragment datagrams sized to the
+// MTU. A lost fragment only loses its own frame: the client drops it when a
+// newer one starts arriving, rather than holding every later frame back the
+// way a lost TCP segment does. Safe to use from several threads.
+class UdpTransport {
+public:
+    int socket;
+    // Bytes of the frame each datagram carries.
+    uint32_t fragment_payload;
+    // Fraction of fragments to drop instead of sending, for testing.
+    double simulated_loss;
+
+    UdpTransport();
+
+    void set_mtu(int mtu);
+    // Sends frame seq, the whole message in buf, to peer. Returns false if
+    // the peer isn't listening, so the frame should go over TCP instead.
+    bool send_frame(UdpPeer* peer, const uint8_t* buf, uint32_t size, uint32_t seq);
+};
+
+#endif
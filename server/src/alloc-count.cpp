@@ -0,0 +1,48 @@
+#include "alloc-count.hpp"
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+#ifdef COUNT_ALLOCS
+
+// The global operator new is replaced so alloc-check can make sure the send
+// path really does run without allocating once clients are connected. new[]
+// and the nothrow forms go through this one.
+static thread_local uint64_t alloc_count = 0;
+
+uint64_t thread_alloc_count() {
+    return alloc_count;
+}
+
+bool alloc_counting() {
+    return true;
+}
+
+void* operator new(std::size_t size) {
+    alloc_count++;
+    void* p = std::malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+#else
+
+uint64_t thread_alloc_count() {
+    return 0;
+}
+
+bool alloc_counting() {
+    return false;
+}
+
+#endif
@@ -163,22 +163,39 @@ This also serves the same function as the update command now. nextFrame() cycles
 */
 void VirtualCanvas::pushToCanvas(){
 
+    std::vector<CanvasLayer> layers = snapshotLayers();
+
+    //Clear to remove everything on the matrix
+    clear();
+
+    composeLayers(layers, pixelMatrix);
+}
+
+
+/*
+Snapshot the current frame of every element -
+
+Sorts the elementPtrList to respect layer weights and copies each element's current frame, cropped to
+the canvas. The returned layers no longer reference the elements, so they can be composited on another
+thread while the elements move on to their next frame.
+
+*/
+std::vector<CanvasLayer> VirtualCanvas::snapshotLayers(){
 
     //Sort the element pointer list to respect layer weights
     std::sort(elementPtrList.begin(), elementPtrList.end(), [](const Element* a, const Element* b) {
         return a->getId() < b->getId();
     });
 
-    //Clear to remove everything on the matrix
-    clear();
+    std::vector<CanvasLayer> layers;
+    layers.reserve(elementPtrList.size());
 
-    //Add all elements to the canvas in new order
     for (Element * elemPtr : elementPtrList) {
 
         cv::Point loc = elemPtr->getLocation();
 
         //Gets the current frame of the element object referenced by elemPtr
-        cv::Mat elemMat = elemPtr->getPixelMatrix().clone();
+        cv::Mat elemMat = elemPtr->getPixelMatrix();
 
         cv::Size elemSize = elemMat.size();
 
@@ -188,8 +205,7 @@ void VirtualCanvas::pushToCanvas(){
 
 
         /*
-        Overwite a region of interest with the image. If the image does not fit on the canvas,
-        we derive a new size and crop the element to it before transferring it to the canvas.
+        If the image does not fit on the canvas, we derive a new size and crop the element to it.
         */
 
 
@@ -203,21 +219,33 @@ void VirtualCanvas::pushToCanvas(){
                 elemSize.height = dim.height - loc.y;
             }
 
-            
-            
-            elemMat = elemMat(cv::Rect(0, 0, elemSize.width, elemSize.height));
-
-            //Apply the gamma LUT here - OpenCV DOES support in place lutting
-            cv::LUT(elemMat, canvasLut, elemMat);
-
-
-            elemMat.copyTo(pixelMatrix(cv::Rect(loc, elemSize)));
+            layers.push_back({loc, elemMat(cv::Rect(0, 0, elemSize.width, elemSize.height)).clone()});
         }else{
 
             printf("\n Element with ID: %d was placed out of bounds and has not been loaded", elemPtr->getId());
         }  
         
     }
+
+    return layers;
+}
+
+
+/*
+Composite layers onto out -
+
+Overwrites a region of interest for each layer in order, so later layers are drawn on top. out must
+already be sized to the canvas.
+
+*/
+void VirtualCanvas::composeLayers(std::vector<CanvasLayer>& layers, cv::Mat& out) const {
+
+    for (CanvasLayer& layer : layers) {
+
+        cv::Mat elemMat = layer.pixels;
+
+        elemMat.copyTo(out(cv::Rect(layer.loc, elemMat.size())));
+    }
 }
 
 bool VirtualCanvas::moveElement(int elementId, cv::Point loc){
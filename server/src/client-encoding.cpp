@@ -0,0 +1,162 @@
+#include "client-encoding.hpp"
+#include "client.hpp"
+#include "protocol.hpp"
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <string>
+
+// The pixel encodings FrameCompressor picks between.
+const uint32_t COMPRESSOR_ENCODINGS =
+    CAPS_BIT(PIXEL_ENCODING_RAW) | CAPS_BIT(PIXEL_ENCODING_RLE) | CAPS_BIT(PIXEL_ENCODING_PALETTE);
+
+static bool handles_depth(uint8_t depths, uint8_t depth) {
+    switch (depth) {
+        case WIRE_DEPTH_RGB565:
+            return depths & CAPS_WIRE_DEPTH_RGB565;
+        case WIRE_DEPTH_RGB444:
+            return depths & CAPS_WIRE_DEPTH_RGB444;
+        default:
+            return true;
+    }
+}
+
+// The configured depth if the client expands it, otherwise the next deeper
+// one it does. Auto takes the least depth with a level for every value up to
+// max_level, 16 levels at 12 bits and 32 at 16 (green gets 64), so the
+// quantised pixels come out exactly as packed.
+static uint8_t pick_wire_depth(uint8_t configured, uint8_t depths, uint8_t max_level) {
+    if (configured == WIRE_DEPTH_AUTO) {
+        if (max_level <= 15 && handles_depth(depths, WIRE_DEPTH_RGB444)) {
+            return WIRE_DEPTH_RGB444;
+        }
+        if (max_level <= 31 && handles_depth(depths, WIRE_DEPTH_RGB565)) {
+            return WIRE_DEPTH_RGB565;
+        }
+        return WIRE_DEPTH_RGB888;
+    }
+    if (handles_depth(depths, configured)) {
+        return configured;
+    }
+    if (configured == WIRE_DEPTH_RGB444 && handles_depth(depths, WIRE_DEPTH_RGB565)) {
+        return WIRE_DEPTH_RGB565;
+    }
+    return WIRE_DEPTH_RGB888;
+}
+
+static std::ostream& warn(const Client* c) {
+    return std::cerr << "Client " << std::hex << c->mac_addr << std::dec;
+}
+
+ClientEncoding::ClientEncoding()
+    : advertised(false),
+      batched(false),
+      delta(false),
+      compress(false),
+      wire_depth(WIRE_DEPTH_RGB888),
+      udp(false),
+      present_at(false),
+      streamed(false),
+      max_message_size(UINT32_MAX)
+{}
+
+void ClientEncoding::choose(const Client* c,
+                            const ClientCapabilities* caps,
+                            feature_choice delta_frames,
+                            uint8_t max_level,
+                            uint32_t full_frame_size) {
+    this->advertised = caps != NULL;
+    // Firmware from before SetLedsFrame, which includes all that checks in
+    // without capabilities, only takes what it always has: full 24 bit
+    // SetLedsBatched frames over TCP, whatever the config turns on.
+    this->batched = !caps || !(caps->op_codes & CAPS_BIT(OP_SET_LEDS_FRAME));
+    if (this->batched) {
+        this->delta = false;
+        this->compress = false;
+        this->wire_depth = WIRE_DEPTH_RGB888;
+        this->udp = false;
+        // SetLedsBatched has nowhere to put a present-at time.
+        this->present_at = false;
+        this->streamed = caps && (caps->features & CAPS_FEATURE_STREAMED_BATCHES);
+        this->max_message_size = caps ? caps->max_message_size : UINT32_MAX;
+        if (delta_frames == FEATURE_ON || c->compress == FEATURE_ON ||
+            (c->wire_depth != WIRE_DEPTH_AUTO && c->wire_depth != WIRE_DEPTH_RGB888) ||
+            c->frame_transport == TRANSPORT_UDP) {
+            warn(c) << (caps ? " doesn't handle SetLedsFrame" : " checked in without capabilities")
+                    << ", sending it full 24 bit frames over TCP\n";
+        }
+        return;
+    }
+
+    bool handles_delta = caps->op_codes & CAPS_BIT(OP_SET_LEDS_DELTA);
+    bool handles_compressed = (caps->op_codes & CAPS_BIT(OP_SET_LEDS_COMPRESSED)) &&
+        (caps->pixel_encodings & COMPRESSOR_ENCODINGS) == COMPRESSOR_ENCODINGS;
+    uint8_t depths = (caps->op_codes & CAPS_BIT(OP_SET_LEDS_QUANTIZED)) ? caps->wire_depths : 0;
+    bool handles_udp = (caps->features & CAPS_FEATURE_UDP) && (caps->op_codes & CAPS_BIT(OP_FRAME_FRAGMENT));
+    this->delta = delta_frames != FEATURE_OFF && handles_delta;
+    this->compress = c->compress != FEATURE_OFF && handles_compressed;
+    this->wire_depth = pick_wire_depth(c->wire_depth, depths, max_level);
+    this->udp = c->frame_transport == TRANSPORT_UDP && handles_udp;
+    this->present_at = caps->frame_flags & LEDS_FRAME_FLAG_PRESENT_AT;
+    this->streamed = caps->features & CAPS_FEATURE_STREAMED_BATCHES;
+    this->max_message_size = caps->max_message_size;
+
+    if (delta_frames == FEATURE_ON && !handles_delta) {
+        warn(c) << " doesn't handle delta frames, sending it full frames\n";
+    }
+    if (c->compress == FEATURE_ON && !handles_compressed) {
+        warn(c) << " doesn't handle compressed frames, sending them uncompressed\n";
+    }
+    if (c->wire_depth != WIRE_DEPTH_AUTO && c->wire_depth != this->wire_depth) {
+        warn(c) << " doesn't handle " << (int)c->wire_depth << " bit frames, sending "
+                << (int)this->wire_depth << " bits\n";
+    }
+    if (c->frame_transport == TRANSPORT_UDP && !handles_udp) {
+        warn(c) << " doesn't take frames over UDP, sending them over TCP\n";
+    }
+    if (caps->max_message_size < full_frame_size) {
+        if (!this->streamed) {
+            warn(c) << " takes messages of up to " << caps->max_message_size
+                    << " bytes, but its full frames are " << full_frame_size << "\n";
+        } else if (this->udp) {
+            warn(c) << " reassembles frames of up to " << caps->max_message_size
+                    << " bytes from UDP, sending its " << full_frame_size
+                    << " byte full frames over TCP\n";
+        }
+    }
+    if (caps->rmt_channels < c->mat_connections.size()) {
+        warn(c) << " has " << (int)caps->rmt_channels << " RMT channels for "
+                << c->mat_connections.size() << " pins\n";
+    }
+}
+
+uint32_t ClientEncoding::encoded_budget() const {
+    uint32_t max_size = this->max_message_size;
+    return max_size > sizeof(uint64_t) ? max_size - sizeof(uint64_t) : 0;
+}
+
+std::string ClientEncoding::to_string() const {
+    std::stringstream ss;
+    ss << (this->advertised ? "capabilities" : "no capabilities") << ": "
+       << (this->batched ? "batched" : this->delta ? "delta" : "full") << " frames, "
+       << (int)this->wire_depth << " bit"
+       << (this->compress ? ", compressed" : "")
+       << (this->udp ? ", udp" : ", tcp")
+       << (this->present_at ? ", present-at" : "")
+       << (this->streamed ? ", streamed" : "");
+    return ss.str();
+}
+
+PublishedEncoding::PublishedEncoding()
+    : current(std::make_shared<const ClientEncoding>())
+{}
+
+void PublishedEncoding::publish(ClientEncodingHandle encoding) {
+    std::atomic_store(&this->current, encoding);
+}
+
+ClientEncodingHandle PublishedEncoding::load() const {
+    return std::atomic_load(&this->current);
+}
@@ -10,6 +10,17 @@
 const int NUM_CHANNELS = 3;
 const int BIT_DEPTH = 8;
 
+const char* feature_choice_name(feature_choice choice) {
+    switch (choice) {
+        case FEATURE_OFF:
+            return "false";
+        case FEATURE_ON:
+            return "true";
+        default:
+            return "auto";
+    }
+}
+
 CanvasPos::CanvasPos(uint32_t x,
                      uint32_t y,
                      uint32_t width,
@@ -21,12 +32,14 @@ CanvasPos::CanvasPos(uint32_t x,
 LEDMatrixSpec::LEDMatrixSpec(std::string id,
                              float power_limit_amps,
                              uint32_t width,
-                             uint32_t height):
+                             uint32_t height,
+                             wiring_pattern wiring):
     id(id),
     power_limit_amps(power_limit_amps),
     width(width),
     height(height),
-    total_leds(width * height)
+    total_leds(width * height),
+    wiring(wiring)
 {}
 
 std::string LEDMatrixSpec::to_string() {
@@ -36,14 +49,48 @@ std::string LEDMatrixSpec::to_string() {
     ss << "power_limit_amps: " << this->power_limit_amps << ", ";
     ss << "width: " << this->width << ",";
     ss << "height: " << this->height << ",";
-    ss << "total_leds: " << this->total_leds << "]";
+    ss << "total_leds: " << this->total_leds << ",";
+    ss << "wiring: " << (this->wiring == SERPENTINE ? "serpentine" : "progressive") << "]";
     return ss.str();
 }
 
-LEDMatrix::LEDMatrix(std::string id, LEDMatrixSpec *spec, CanvasPos pos)
-    : id(id), spec(spec), pos(pos) {
+LEDMatrix::LEDMatrix(std::string id, LEDMatrixSpec *spec, CanvasPos pos, uint8_t brightness)
+    : id(id), spec(spec), pos(pos), brightness(brightness) {
     this->packed_pixel_array_size = spec->total_leds * NUM_CHANNELS;
-    this->packed_pixel_array = static_cast<unsigned char*>(malloc(packed_pixel_array_size));
+}
+
+// Appends the canvas byte offset of each of the matrix's LEDs in chain order.
+// (r, c) is the LED's row and column with the matrix the way up its spec
+// describes; the rotation then says where that lands on the canvas.
+void LEDMatrix::append_gather(uint32_t canvas_width, std::vector<uint32_t>& gather) const {
+    uint32_t width = this->spec->width;
+    uint32_t height = this->spec->height;
+    for (uint32_t i = 0; i < this->spec->total_leds; ++i) {
+        uint32_t r = i / width;
+        uint32_t c = i % width;
+        if (this->spec->wiring == SERPENTINE && r % 2 == 0) {
+            c = (width - 1) - c;
+        }
+
+        uint32_t canvas_x;
+        uint32_t canvas_y;
+        if (this->pos.rot == DOWN) {
+            canvas_x = (width - 1) - c;
+            canvas_y = (height - 1) - r;
+        } else if (this->pos.rot == LEFT) {
+            canvas_x = r;
+            canvas_y = (width - 1) - c;
+        } else if (this->pos.rot == RIGHT) {
+            canvas_x = (height - 1) - r;
+            canvas_y = c;
+        } else {
+            canvas_x = c;
+            canvas_y = r;
+        }
+        canvas_x += this->pos.x;
+        canvas_y += this->pos.y;
+        gather.push_back((canvas_y * canvas_width + canvas_x) * NUM_CHANNELS);
+    }
 }
 
 std::string LEDMatrix::to_string() {
@@ -58,6 +105,7 @@ std::string MatricesConnection::to_string() {
     std::stringstream ss;
     ss << "MatricesConnection[";
     ss << "pin: " << std::to_string(this->pin) << ", ";
+    ss << "color_order: " << std::to_string(this->color_order) << ", ";
     ss << "matrices: (";
     for (LEDMatrix* mat : this->matrices) {
         ss << mat->to_string() << ", ";
@@ -67,15 +115,85 @@ std::string MatricesConnection::to_string() {
 }
 
 Client::Client(uint64_t mac_addr,
-               std::vector<MatricesConnection> mat_connections):
+               std::vector<MatricesConnection> mat_connections,
+               feature_choice compress,
+               uint8_t wire_depth,
+               bool dither,
+               transport frame_transport):
     mac_addr(mac_addr),
-    mat_connections(mat_connections)
+    mat_connections(mat_connections),
+    compress(compress),
+    wire_depth(wire_depth),
+    dither(dither),
+    frame_transport(frame_transport),
+    set_config()
 {}
 
+// Builds every connection's gather table for a canvas canvas_width pixels
+// wide, chaining the matrices in the order they are listed for the pin.
+void Client::compile_gather(uint32_t canvas_width) {
+    for (MatricesConnection& conn : this->mat_connections) {
+        conn.gather.clear();
+        for (LEDMatrix* mat : conn.matrices) {
+            mat->append_gather(canvas_width, conn.gather);
+        }
+    }
+}
+
+// Builds every connection's pack segments, merging neighbouring matrices with
+// the same brightness. gamma comes from the input file's settings.
+void Client::compile_pack(double gamma) {
+    for (MatricesConnection& conn : this->mat_connections) {
+        conn.segments.clear();
+        const LEDMatrix* prev = NULL;
+        for (LEDMatrix* mat : conn.matrices) {
+            if (prev && prev->brightness == mat->brightness) {
+                conn.segments.back().num_leds += mat->spec->total_leds;
+            } else {
+                conn.segments.push_back((PackSegment){
+                        (uint32_t)mat->spec->total_leds,
+                        make_pack_params(gamma, mat->brightness, conn.color_order)
+                    });
+            }
+            prev = mat;
+        }
+    }
+}
+
+// Encodes the SetConfig describing each of the client's pins, so checking in
+// only has to send it.
+void Client::compile_config() {
+    std::vector<PinInfo> pin_info;
+    for (const MatricesConnection& conn : this->mat_connections) {
+        uint32_t max_leds = 0;
+        for (LEDMatrix* mat : conn.matrices) {
+            max_leds += mat->spec->width * mat->spec->height;
+        }
+        pin_info.push_back((PinInfo){
+                conn.pin,
+                conn.color_order,
+                max_leds,
+                LED_TYPE_WS2811
+            });
+    }
+    uint32_t size;
+    uint8_t* msg = encode_set_config(NUM_CHANNELS, pin_info.size(), pin_info.data(), &size);
+    this->set_config.assign(msg, msg + size);
+    free_message_buffer(msg);
+}
+
 std::string Client::to_string() {
     std::stringstream ss;
     ss << "Client[";
     ss << "mac-addr: " << std::hex << this->mac_addr << ", ";
+    ss << "compress: " << feature_choice_name(this->compress) << ", ";
+    if (this->wire_depth == WIRE_DEPTH_AUTO) {
+        ss << "wire-depth: auto, ";
+    } else {
+        ss << "wire-depth: " << std::dec << (int)this->wire_depth << ", ";
+    }
+    ss << "dither: " << (this->dither ? "true" : "false") << ", ";
+    ss << "transport: " << (this->frame_transport == TRANSPORT_UDP ? "udp" : "tcp") << ", ";
     ss << "mat_connections: (";
     for (MatricesConnection conn : this->mat_connections) {
         ss << conn.to_string() << ", ";
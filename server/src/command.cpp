@@ -4,6 +4,7 @@
 #include <string>
 #include "canvas.hpp"
 #include "command.hpp"
+#include "controller.hpp"
 #include "text-render.hpp"
 
 /*
@@ -25,7 +26,7 @@ bool inputAvailable() {
 }
 
 
-int processCommand(VirtualCanvas& vCanvas, const std::string& line, bool& isPaused) {
+int processCommand(VirtualCanvas& vCanvas, Controller& cont, const std::string& line, bool& isPaused) {
     std::istringstream iss(line);
     std::string cmd;
     iss >> cmd;
@@ -40,9 +41,14 @@ int processCommand(VirtualCanvas& vCanvas, const std::string& line, bool& isPaus
     }
     if (cmd == "resume") {
         isPaused = false;
+        cont.frame_clock.reset();
         std::cout << "Resumed.\n";
         return 0;
     }
+    if (cmd == "stats") {
+        cont.print_stats(std::cout);
+        return 0;
+    }
     if (cmd == "move") {
         int id, x, y;
         if (!(iss >> id >> x >> y) || x < 0 || y < 0) {
@@ -276,6 +282,6 @@ int processCommand(VirtualCanvas& vCanvas, const std::string& line, bool& isPaus
         return 0;
     }
     std::cout << "Unknown command: " << cmd << "\n"
-                    "Available: pause, resume, quit, move <id> <x> <y>\n";
+                    "Available: pause, resume, quit, stats, move <id> <x> <y>\n";
         return 0;
     }
\ No newline at end of file
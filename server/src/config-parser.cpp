@@ -1,5 +1,6 @@
 #include "config-parser.hpp"
 #include "client.hpp"
+#include "protocol.hpp"
 #include <cstdint>
 #include <optional>
 #include <sstream>
@@ -14,19 +15,53 @@
 #include <regex>
 #include <opencv2/opencv.hpp>
 #include <limits>
+#include <map>
 
 ServerConfig::ServerConfig()
     : clients(),
       canvas_size(),
-      ns_per_frame()
+      ns_per_frame(),
+      pipeline_depth(),
+      sender_threads(),
+      latch(),
+      present_delay_ns(),
+      overrun(),
+      delta_frames(),
+      keyframe_interval(),
+      udp_mtu(),
+      udp_simulated_loss(),
+      check_in_timeout_ns(),
+      backend()
 {}
 
 ServerConfig::ServerConfig(std::vector<Client*> clients,
                            cv::Size canvas_size,
-                           int64_t ns_per_frame)
+                           int64_t ns_per_frame,
+                           int pipeline_depth,
+                           int sender_threads,
+                           latch_mode latch,
+                           int64_t present_delay_ns,
+                           overrun_policy overrun,
+                           feature_choice delta_frames,
+                           int keyframe_interval,
+                           int udp_mtu,
+                           double udp_simulated_loss,
+                           int64_t check_in_timeout_ns,
+                           net_backend backend)
     : clients(clients),
       canvas_size(canvas_size),
-      ns_per_frame(ns_per_frame)
+      ns_per_frame(ns_per_frame),
+      pipeline_depth(pipeline_depth),
+      sender_threads(sender_threads),
+      latch(latch),
+      present_delay_ns(present_delay_ns),
+      overrun(overrun),
+      delta_frames(delta_frames),
+      keyframe_interval(keyframe_interval),
+      udp_mtu(udp_mtu),
+      udp_simulated_loss(udp_simulated_loss),
+      check_in_timeout_ns(check_in_timeout_ns),
+      backend(backend)
 {}
 
 std::string parse_error(std::string error) {
@@ -52,6 +87,76 @@ std::optional<rotation> parse_rotation(std::string str) {
     return std::nullopt;
 }
 
+std::optional<latch_mode> parse_latch_mode(std::string str) {
+    if (str == "immediate") {
+        return LATCH_IMMEDIATE;
+    } else if (str == "synchronized") {
+        return LATCH_SYNCHRONIZED;
+    } else if (str == "scheduled") {
+        return LATCH_SCHEDULED;
+    }
+
+    return std::nullopt;
+}
+
+std::optional<net_backend> parse_net_backend(std::string str) {
+    if (str == "epoll") {
+        return NET_BACKEND_EPOLL;
+    } else if (str == "io_uring") {
+        return NET_BACKEND_IO_URING;
+    }
+
+    return std::nullopt;
+}
+
+std::optional<overrun_policy> parse_overrun_policy(std::string str) {
+    if (str == "catch-up") {
+        return OVERRUN_CATCH_UP;
+    } else if (str == "skip") {
+        return OVERRUN_SKIP;
+    }
+
+    return std::nullopt;
+}
+
+std::optional<feature_choice> parse_feature_choice(std::string str) {
+    if (str == "false") {
+        return FEATURE_OFF;
+    } else if (str == "true") {
+        return FEATURE_ON;
+    } else if (str == "auto") {
+        return FEATURE_AUTO;
+    }
+
+    return std::nullopt;
+}
+
+std::optional<wiring_pattern> parse_wiring(std::string str) {
+    if (str == "serpentine") {
+        return SERPENTINE;
+    } else if (str == "progressive") {
+        return PROGRESSIVE;
+    }
+
+    return std::nullopt;
+}
+
+std::optional<uint8_t> parse_color_order(std::string str) {
+    static const std::map<std::string, uint8_t> orders = {
+        {"rgb", COLOR_ORDER_RGB},
+        {"grb", COLOR_ORDER_GRB},
+        {"bgr", COLOR_ORDER_BGR},
+        {"rbg", COLOR_ORDER_RBG},
+        {"gbr", COLOR_ORDER_GBR},
+        {"brg", COLOR_ORDER_BRG},
+    };
+    auto it = orders.find(str);
+    if (it == orders.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
 std::regex mac_48_regex("^[0-9A-F][0-9A-F](-[0-9A-F][0-9A-F]){5}$");
 
 uint8_t parse_hex(char c) {
@@ -120,14 +225,26 @@ parse_matrix_specs(YAML::Node ynode_matrix_specs) {
         uint32_t width = width_height_node[0].as<uint32_t>();
         uint32_t height = width_height_node[1].as<uint32_t>();
 
-        matrix_specs[id] = new LEDMatrixSpec(id, power_limit, width, height);
+        wiring_pattern wiring = SERPENTINE;
+        YAML::Node wiring_node = spec_node["wiring"];
+        if (wiring_node) {
+            std::optional<wiring_pattern> wiring_opt = parse_wiring(wiring_node.as<std::string>());
+            if (!wiring_opt.has_value()) {
+                throw YAML::RepresentationException(wiring_node.Mark(),
+                                                    "'wiring' must be 'serpentine' or 'progressive'!");
+            }
+            wiring = wiring_opt.value();
+        }
+
+        matrix_specs[id] = new LEDMatrixSpec(id, power_limit, width, height, wiring);
     }
     return matrix_specs;
 }
 
 std::pair<std::map<std::string, LEDMatrix*>, cv::Size>
 parse_matrices(YAML::Node ynode_matrices,
-               std::map<std::string, LEDMatrixSpec*> matrix_specs) {
+               std::map<std::string, LEDMatrixSpec*> matrix_specs,
+               uint8_t default_brightness) {
     std::map<std::string, LEDMatrix*> matrices;
 
     uint32_t min_x = std::numeric_limits<uint32_t>::max();
@@ -178,7 +295,17 @@ parse_matrices(YAML::Node ynode_matrices,
                                   width,
                                   height,
                                   rot);
-        LEDMatrix* mat = new LEDMatrix(id, mat_spec, pos);
+        uint8_t brightness = default_brightness;
+        YAML::Node brightness_node = matrix_node["brightness"];
+        if (brightness_node) {
+            int value = brightness_node.as<int>();
+            if (value < 0 || value > 255) {
+                throw YAML::RepresentationException(brightness_node.Mark(),
+                                                    "'brightness' must be between 0 and 255!");
+            }
+            brightness = value;
+        }
+        LEDMatrix* mat = new LEDMatrix(id, mat_spec, pos, brightness);
         matrices[id] = mat;
     }
 
@@ -247,6 +374,16 @@ parse_clients(YAML::Node ynode_clients, std::map<std::string, LEDMatrix*> matric
             uint8_t pin = connection_node["pin"].as<uint8_t>();
             MatricesConnection conn;
             conn.pin = pin;
+            conn.color_order = COLOR_ORDER_RGB;
+            YAML::Node color_order_node = connection_node["color-order"];
+            if (color_order_node) {
+                std::optional<uint8_t> color_order_opt = parse_color_order(color_order_node.as<std::string>());
+                if (!color_order_opt.has_value()) {
+                    throw YAML::RepresentationException(color_order_node.Mark(),
+                                                        "'color-order' must be one of rgb, grb, bgr, rbg, gbr or brg!");
+                }
+                conn.color_order = color_order_opt.value();
+            }
             YAML::Node matrices_node = yaml_key_present_and_unique(connection_node, "matrices");
             for (size_t j = 0; j < matrices_node.size(); ++j) {
                 std::string id = matrices_node[j].as<std::string>();
@@ -254,7 +391,40 @@ parse_clients(YAML::Node ynode_clients, std::map<std::string, LEDMatrix*> matric
             }
             mat_connections.push_back(conn);
         }
-        clients.push_back(new Client(mac_addr, mat_connections));
+        feature_choice compress = FEATURE_AUTO;
+        YAML::Node compress_node = it->second["compress"];
+        if (compress_node) {
+            std::optional<feature_choice> compress_opt = parse_feature_choice(compress_node.as<std::string>());
+            if (!compress_opt.has_value()) {
+                throw YAML::RepresentationException(compress_node.Mark(), "'compress' must be true, false or auto!");
+            }
+            compress = compress_opt.value();
+        }
+        uint8_t wire_depth = WIRE_DEPTH_AUTO;
+        YAML::Node wire_depth_node = it->second["wire-depth"];
+        if (wire_depth_node && wire_depth_node.as<std::string>() != "auto") {
+            int depth = wire_depth_node.as<int>();
+            if (depth != WIRE_DEPTH_RGB888 && depth != WIRE_DEPTH_RGB565 && depth != WIRE_DEPTH_RGB444) {
+                throw YAML::RepresentationException(wire_depth_node.Mark(), "'wire-depth' must be 24, 16, 12 or auto!");
+            }
+            wire_depth = depth;
+        }
+        bool dither = false;
+        YAML::Node dither_node = it->second["dither"];
+        if (dither_node) {
+            dither = dither_node.as<bool>();
+        }
+        transport frame_transport = TRANSPORT_TCP;
+        YAML::Node transport_node = it->second["transport"];
+        if (transport_node) {
+            std::string name = transport_node.as<std::string>();
+            if (name == "udp") {
+                frame_transport = TRANSPORT_UDP;
+            } else if (name != "tcp") {
+                throw YAML::RepresentationException(transport_node.Mark(), "'transport' must be tcp or udp!");
+            }
+        }
+        clients.push_back(new Client(mac_addr, mat_connections, compress, wire_depth, dither, frame_transport));
     }
 
     return clients;
@@ -268,6 +438,18 @@ ServerConfig parse_config_throws(std::string file) {
     YAML::Node ynode_matrix_specs = yaml_key_present_and_unique(config, "matrix-specs");
     YAML::Node ynode_ignore_bounds_checks = config["ignore-bounds-checks"];
     YAML::Node ynode_ns_per_frame = yaml_key_present_and_unique(config, "ns-per-frame");
+    YAML::Node ynode_pipeline_depth = config["pipeline-depth"];
+    YAML::Node ynode_sender_threads = config["sender-threads"];
+    YAML::Node ynode_brightness = config["brightness"];
+    YAML::Node ynode_latch_mode = config["latch-mode"];
+    YAML::Node ynode_present_delay_ms = config["present-delay-ms"];
+    YAML::Node ynode_overrun_policy = config["overrun-policy"];
+    YAML::Node ynode_delta_frames = config["delta-frames"];
+    YAML::Node ynode_keyframe_interval = config["keyframe-interval"];
+    YAML::Node ynode_udp_mtu = config["udp-mtu"];
+    YAML::Node ynode_udp_simulated_loss = config["udp-simulated-loss"];
+    YAML::Node ynode_check_in_timeout_ms = config["check-in-timeout-ms"];
+    YAML::Node ynode_network_backend = config["network-backend"];
 
     // Parse ns per frame
     int64_t ns_per_frame = ynode_ns_per_frame.as<int64_t>();
@@ -276,6 +458,129 @@ ServerConfig parse_config_throws(std::string file) {
                                             "'ns-per-frame' must be non-zero and positive!");
     }
 
+    // Parse pipeline depth, 0 (the default) runs each frame in sequence
+    int pipeline_depth = 0;
+    if (ynode_pipeline_depth) {
+        pipeline_depth = ynode_pipeline_depth.as<int>();
+        if (pipeline_depth < 0) {
+            throw YAML::RepresentationException(ynode_pipeline_depth.Mark(),
+                                                "'pipeline-depth' must not be negative!");
+        }
+    }
+
+    // Parse sender threads, 0 sends to each client in turn on the frame thread
+    int sender_threads = 4;
+    if (ynode_sender_threads) {
+        sender_threads = ynode_sender_threads.as<int>();
+        if (sender_threads < 0) {
+            throw YAML::RepresentationException(ynode_sender_threads.Mark(),
+                                                "'sender-threads' must not be negative!");
+        }
+    }
+
+    // Parse brightness, out of 255
+    int brightness = DEFAULT_BRIGHTNESS;
+    if (ynode_brightness) {
+        brightness = ynode_brightness.as<int>();
+        if (brightness < 0 || brightness > 255) {
+            throw YAML::RepresentationException(ynode_brightness.Mark(),
+                                                "'brightness' must be between 0 and 255!");
+        }
+    }
+
+    // Parse latch mode
+    latch_mode latch = LATCH_IMMEDIATE;
+    if (ynode_latch_mode) {
+        std::optional<latch_mode> latch_opt = parse_latch_mode(ynode_latch_mode.as<std::string>());
+        if (!latch_opt.has_value()) {
+            throw YAML::RepresentationException(ynode_latch_mode.Mark(),
+                                                "'latch-mode' must be 'immediate', 'synchronized' or 'scheduled'!");
+        }
+        latch = latch_opt.value();
+    }
+    // Half a frame by default, so a frame is shown before the next one
+    // arrives and overwrites it.
+    int64_t present_delay_ns = ns_per_frame / 2;
+    if (ynode_present_delay_ms) {
+        double present_delay_ms = ynode_present_delay_ms.as<double>();
+        if (present_delay_ms < 0) {
+            throw YAML::RepresentationException(ynode_present_delay_ms.Mark(),
+                                                "'present-delay-ms' must not be negative!");
+        }
+        present_delay_ns = present_delay_ms * 1e6;
+    }
+
+    // Parse overrun policy
+    overrun_policy overrun = OVERRUN_SKIP;
+    if (ynode_overrun_policy) {
+        std::optional<overrun_policy> overrun_opt = parse_overrun_policy(ynode_overrun_policy.as<std::string>());
+        if (!overrun_opt.has_value()) {
+            throw YAML::RepresentationException(ynode_overrun_policy.Mark(),
+                                                "'overrun-policy' must be 'catch-up' or 'skip'!");
+        }
+        overrun = overrun_opt.value();
+    }
+
+    // Parse delta frames, by default only sent to clients that say they handle
+    // OP_SET_LEDS_DELTA
+    feature_choice delta_frames = FEATURE_AUTO;
+    if (ynode_delta_frames) {
+        std::optional<feature_choice> delta_opt = parse_feature_choice(ynode_delta_frames.as<std::string>());
+        if (!delta_opt.has_value()) {
+            throw YAML::RepresentationException(ynode_delta_frames.Mark(),
+                                                "'delta-frames' must be true, false or auto!");
+        }
+        delta_frames = delta_opt.value();
+    }
+    int keyframe_interval = DEFAULT_KEYFRAME_INTERVAL;
+    if (ynode_keyframe_interval) {
+        keyframe_interval = ynode_keyframe_interval.as<int>();
+        if (keyframe_interval <= 0) {
+            throw YAML::RepresentationException(ynode_keyframe_interval.Mark(),
+                                                "'keyframe-interval' must be positive!");
+        }
+    }
+
+    // Parse UDP transport settings, only used by clients with 'transport: udp'
+    int udp_mtu = DEFAULT_UDP_MTU;
+    if (ynode_udp_mtu) {
+        udp_mtu = ynode_udp_mtu.as<int>();
+        if (udp_mtu < 576 || udp_mtu > 65535) {
+            throw YAML::RepresentationException(ynode_udp_mtu.Mark(),
+                                                "'udp-mtu' must be between 576 and 65535!");
+        }
+    }
+    double udp_simulated_loss = 0;
+    if (ynode_udp_simulated_loss) {
+        udp_simulated_loss = ynode_udp_simulated_loss.as<double>();
+        if (udp_simulated_loss < 0 || udp_simulated_loss >= 1) {
+            throw YAML::RepresentationException(ynode_udp_simulated_loss.Mark(),
+                                                "'udp-simulated-loss' must be at least 0 and below 1!");
+        }
+    }
+
+    // Parse how long a new connection has to check in
+    int64_t check_in_timeout_ns = DEFAULT_CHECK_IN_TIMEOUT_NS;
+    if (ynode_check_in_timeout_ms) {
+        int64_t check_in_timeout_ms = ynode_check_in_timeout_ms.as<int64_t>();
+        if (check_in_timeout_ms <= 0) {
+            throw YAML::RepresentationException(ynode_check_in_timeout_ms.Mark(),
+                                                "'check-in-timeout-ms' must be positive!");
+        }
+        check_in_timeout_ns = check_in_timeout_ms * 1'000'000;
+    }
+
+    // Parse network backend
+    net_backend backend = NET_BACKEND_EPOLL;
+    if (ynode_network_backend) {
+        std::optional<net_backend> backend_opt = parse_net_backend(ynode_network_backend.as<std::string>());
+        if (!backend_opt.has_value()) {
+            throw YAML::RepresentationException(ynode_network_backend.Mark(),
+                                                "'network-backend' must be 'epoll' or 'io_uring'!");
+        }
+        backend = backend_opt.value();
+    }
+
 
     // Parse Matrix Specifications
     std::map<std::string, LEDMatrixSpec*> matrix_specs =
@@ -284,7 +589,7 @@ ServerConfig parse_config_throws(std::string file) {
 
     // Parse Matrices
     std::pair<std::map<std::string, LEDMatrix*>, cv::Size> matrices =
-        parse_matrices(ynode_matrices, matrix_specs);
+        parse_matrices(ynode_matrices, matrix_specs, brightness);
 
     // Do bounds checks
     if (!(ynode_ignore_bounds_checks && (ynode_ignore_bounds_checks.as<std::string>() == "true"))) {
@@ -294,6 +599,23 @@ ServerConfig parse_config_throws(std::string file) {
     // Parse Clients
     std::vector<Client*> clients =
         parse_clients(ynode_clients, matrices.first);
+    for (Client* c : clients) {
+        c->compile_gather(matrices.second.width);
+        c->compile_config();
+    }
 
-    return ServerConfig(clients, matrices.second, ns_per_frame);
+    return ServerConfig(clients,
+                        matrices.second,
+                        ns_per_frame,
+                        pipeline_depth,
+                        sender_threads,
+                        latch,
+                        present_delay_ns,
+                        overrun,
+                        delta_frames,
+                        keyframe_interval,
+                        udp_mtu,
+                        udp_simulated_loss,
+                        check_in_timeout_ns,
+                        backend);
 }
@@ -0,0 +1,88 @@
+#include "conn-info.hpp"
+#include "client.hpp"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+std::optional<int> ConnSnapshot::socket(const Client* c) const {
+    auto it = this->sockets.find(c);
+    if (it == this->sockets.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+ClientConnInfo::ClientConnInfo(std::vector<Client *> clients)
+    : mut(),
+      connected(),
+      disconnected(),
+      generation(0),
+      current()
+{
+    for (auto c : clients) {
+        disconnected.insert(c);
+    }
+    this->publish_locked();
+}
+
+// Replaces the current snapshot. Readers still holding the old one keep it
+// alive until they next look, and the last of them frees it.
+void ClientConnInfo::publish_locked() {
+    std::shared_ptr<ConnSnapshot> next = std::make_shared<ConnSnapshot>();
+    next->generation = this->generation.load() + 1;
+    next->sockets = this->connected;
+    next->connected.assign(this->connected.begin(), this->connected.end());
+    this->current = next;
+    this->generation.store(next->generation, std::memory_order_release);
+}
+
+void ClientConnInfo::setConnected(const Client *c, int socket) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    if (this->connected.find(c) == this->connected.end()) {
+        this->disconnected.erase(c);
+        this->connected[c] = socket;
+        this->publish_locked();
+    }
+}
+
+void ClientConnInfo::setDisconnected(const Client* c) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    if (this->disconnected.find(c) == this->disconnected.end()) {
+        this->connected.erase(c);
+        this->disconnected.insert(c);
+        this->publish_locked();
+    }
+}
+
+std::optional<int> ClientConnInfo::getSocket(const Client *c) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    auto conn = this->connected.find(c);
+    if (conn == this->connected.end()) {
+        return std::nullopt;
+    }
+    return conn->second;
+}
+
+bool ClientConnInfo::isConnected(const Client *c) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    return this->connected.find(c) != this->connected.end();
+}
+
+void ClientConnInfo::getAllDisconnected(std::vector<const Client*>& v) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    for (auto c : this->disconnected) {
+        v.push_back(c);
+    }
+}
+
+const ConnSnapshot& ClientConnInfo::snapshot(ConnSnapshotHandle& snapshot) {
+    uint64_t generation = this->generation.load(std::memory_order_acquire);
+    if (!snapshot || snapshot->generation != generation) {
+        std::lock_guard<std::mutex> lock(this->mut);
+        snapshot = this->current;
+    }
+    return *snapshot;
+}
@@ -50,16 +50,45 @@ std::optional<Event> EventQueue::tryPopEvent(ns_ts cutoff_time) {
 Controller::Controller(VirtualCanvas &canvas,
                        std::vector<Client*> clients,
                        LEDTCPServer tcp_server,
-                       int64_t ns_per_frame)
+                       int64_t ns_per_frame,
+                       int pipeline_depth,
+                       int sender_threads,
+                       latch_mode latch,
+                       overrun_policy overrun)
     : canvas(canvas),
       clients(clients),
       tcp_server(tcp_server),
       client_conn_info(tcp_server.conn_info),
       event_queue(),
-      ns_per_frame(ns_per_frame)
+      ns_per_frame(ns_per_frame),
+      frame_clock(ns_per_frame, overrun),
+      latch(latch),
+      frame_seq(0),
+      latch_spread_timer("latch spread"),
+      sender_pool(clients, sender_threads, ns_per_frame),
+      pipeline(NULL),
+      conns(),
+      send_jobs(),
+      send_work()
 {
+    this->send_jobs.reserve(this->clients.size());
+    this->send_work = [this](SendJob& job, const Frame& frame) {
+        this->tcp_server.set_leds(job.client, job.socket, frame, this->latch);
+    };
+    this->sender_pool.start();
+    if (pipeline_depth > 0) {
+        this->pipeline = new FramePipeline(this->canvas,
+                                           this->tcp_server,
+                                           pipeline_depth,
+                                           latch,
+                                           ns_per_frame,
+                                           this->latch_spread_timer,
+                                           this->sender_pool);
+        this->pipeline->start();
+    }
+
     // Add events for all elements
-    auto cur_time = std::chrono::system_clock::now();
+    ns_ts cur_time = std::chrono::steady_clock::now();
     for (auto elem : canvas.elementPtrList) {
         int frame_rate = elem->getFrameRate();
         if (frame_rate > 0) {
@@ -73,28 +102,43 @@ Controller::Controller(VirtualCanvas &canvas,
     }
 }
 
-void Controller::frame_wait() {
-    struct timespec cur_time;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &cur_time);
-    int64_t max_sec_as_ns = INT64_MAX / 1'000'000'000;
-    int64_t ns_cur_time = (cur_time.tv_sec % max_sec_as_ns) * 1'000'000'000 + cur_time.tv_nsec;
-    int64_t ns_wait = this->ns_per_frame - (ns_cur_time % this->ns_per_frame);
-    struct timespec wait_remaining;
-    struct timespec wait = {ns_wait / 1'000'000'000, ns_wait % 1'000'000'000};
-    nanosleep(&wait, &wait_remaining);
-}
-
-void Controller::frame_exec(bool debug) {
-    this->redraw_all();
-
-    frame_wait();
-    auto cur_time = std::chrono::system_clock::now();
-    std::optional<Event> event_opt = this->event_queue.tryPopEvent(cur_time);
+// Runs every event due by cutoff_time, the frame's deadline, so playback
+// follows the frame schedule rather than when the frame thread got to it.
+void Controller::run_events(ns_ts cutoff_time) {
+    std::optional<Event> event_opt = this->event_queue.tryPopEvent(cutoff_time);
     while(event_opt.has_value()) {
         Event event = event_opt.value();
         event.action(this);
-        event_opt = this->event_queue.tryPopEvent(cur_time);
+        event_opt = this->event_queue.tryPopEvent(cutoff_time);
+    }
+}
+
+// Runs the frame due at tick.deadline. Called when the frame clock's timer
+// fires.
+void Controller::frame_exec(FrameTick tick, bool debug) {
+    if (this->pipeline) {
+        // Only the event/decode stage runs here; composite, pack and send for
+        // this frame overlap with the next frame's wait and events.
+        this->run_events(tick.deadline);
+        this->pipeline->submit(this->canvas.snapshotLayers(), tick);
+
+        if (debug) {
+            cv::Mat latest = this->pipeline->getLatestComposite();
+            if (!latest.empty()) {
+                cv::namedWindow("Virtual Canvas", cv::WINDOW_NORMAL);
+                cv::imshow("Virtual Canvas", latest);
+                cv::waitKey(1);
+            }
+        }
+        return;
     }
+
+    // The previous frame was uploaded during the last period; latch it now, at
+    // the deadline. With LATCH_IMMEDIATE it latched itself on arrival.
+    if (this->latch == LATCH_SYNCHRONIZED) {
+        this->redraw_all();
+    }
+    this->run_events(tick.deadline);
     this->canvas.pushToCanvas();
 
     if(debug){ //If this is true, then display the virtual canvas client side. Used for debugging and virtual visualization.
@@ -103,21 +147,50 @@ void Controller::frame_exec(bool debug) {
         cv::imshow("Virtual Canvas", canvas.getPixelMatrix());
         cv::waitKey(1);
     }
-    this->set_leds_all();
+    // pushToCanvas composited into a freshly allocated matrix, so the frame can
+    // share it: the canvas won't write to it again.
+    FrameHandle frame = std::make_shared<const Frame>(this->frame_seq++, tick.deadline, this->canvas.getPixelMatrix());
+    this->set_leds_all(frame);
 }
 
-void Controller::set_leds_all() {
-    std::vector<std::pair<const Client*, int>> conns;
-    this->client_conn_info->getAllConnected(conns);
-    for (auto it : conns) {
-        this->tcp_server.set_leds(it.first, it.second, this->canvas);
+// Packs and sends every connected client's share of the canvas on the sender
+// pool, returning once all of it has been handed to the sockets.
+void Controller::set_leds_all(const FrameHandle& frame) {
+    uint64_t allocs_before = thread_alloc_count();
+    const ConnSnapshot& conns = this->client_conn_info->snapshot(this->conns);
+
+    this->send_jobs.clear();
+    for (auto it : conns.connected) {
+        const Client* c = it.first;
+        this->send_jobs.push_back((SendJob){c, it.second, SenderPool::payload_weight(c), NULL, 0});
     }
+    uint64_t worker_allocs = this->sender_pool.run(this->send_jobs, *frame, this->send_work);
+    this->tcp_server.submit_sends();
+    this->sender_pool.record_allocs(thread_alloc_count() - allocs_before + worker_allocs);
 }
 
 void Controller::redraw_all() {
-    std::vector<std::pair<const Client*, int>> conns;
-    this->client_conn_info->getAllConnected(conns);
-    for (auto it : conns) {
-        this->tcp_server.redraw(it.first, it.second);
+    const ConnSnapshot& conns = this->client_conn_info->snapshot(this->conns);
+    if (!conns.connected.empty()) {
+        this->latch_spread_timer.record_ns(this->tcp_server.redraw_batch(conns.connected));
+    }
+}
+
+void Controller::print_stats(std::ostream& out) {
+    this->frame_clock.print_stats(out);
+    if (this->pipeline) {
+        this->pipeline->print_stats(out);
+    } else {
+        out << "Pipeline disabled (pipeline-depth: 0)\n";
+    }
+    this->sender_pool.print_stats(out);
+    out << "  " << this->latch_spread_timer.to_string() << "\n";
+    this->tcp_server.print_stats(out);
+}
+
+void Controller::stop() {
+    if (this->pipeline) {
+        this->pipeline->stop();
     }
+    this->sender_pool.stop();
 }
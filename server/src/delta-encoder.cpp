@@ -0,0 +1,125 @@
+#include "delta-encoder.hpp"
+#include "client.hpp"
+#include "protocol.hpp"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// A run header costs as much as this many unchanged pixels, so runs closer
+// together than that are cheaper sent as one.
+const uint32_t MERGE_GAP = sizeof(LedsDeltaRunHeader) / 3;
+const uint32_t MAX_RUN_LEDS = UINT16_MAX;
+
+DeltaEncoder::DeltaEncoder(const Client* c, uint32_t entries_size)
+    : keyframes(0),
+      deltas(0),
+      unchanged(0),
+      too_big(0),
+      resyncs(0),
+      full_bytes(0),
+      delta_bytes(0),
+      pins(),
+      pin_leds(),
+      baseline(entries_size),
+      baseline_seq(0),
+      have_baseline(false),
+      frames_since_keyframe(0)
+{
+    for (const MatricesConnection& conn : c->mat_connections) {
+        this->pins.push_back(conn.pin);
+        this->pin_leds.push_back(conn.gather.size());
+    }
+}
+
+bool DeltaEncoder::keyframe_due(int interval) {
+    return !this->have_baseline || this->frames_since_keyframe >= interval;
+}
+
+void DeltaEncoder::set_baseline(const uint8_t* entries, uint32_t seq) {
+    memcpy(this->baseline.data(), entries, this->baseline.size());
+    this->baseline_seq = seq;
+    this->have_baseline = true;
+    this->frames_since_keyframe = 0;
+    this->keyframes++;
+}
+
+delta_result DeltaEncoder::encode(const uint8_t* entries,
+                                  uint32_t full_size,
+                                  uint32_t max_size,
+                                  uint8_t flags,
+                                  uint32_t seq,
+                                  uint8_t* out,
+                                  uint32_t* out_size) {
+    this->frames_since_keyframe++;
+    // Anything that doesn't fit here is no better than sending a full frame.
+    const uint8_t* limit = out + max_size - 1;
+    uint8_t* p = out + sizeof(SetLedsDeltaMessage);
+    uint8_t batch_count = 0;
+
+    const uint8_t* cur_pin = entries;
+    const uint8_t* base_pin = this->baseline.data();
+    for (size_t pin = 0; pin < this->pins.size(); ++pin) {
+        uint32_t n = this->pin_leds[pin];
+        const uint8_t* cur = cur_pin + sizeof(LedsBatchEntryHeader);
+        const uint8_t* base = base_pin + sizeof(LedsBatchEntryHeader);
+        uint32_t pin_size = sizeof(LedsBatchEntryHeader) + n * 3;
+        cur_pin += pin_size;
+        base_pin += pin_size;
+        if (memcmp(cur, base, n * 3) == 0) {
+            continue;
+        }
+
+        if (p + sizeof(LedsDeltaEntryHeader) > limit) {
+            this->too_big++;
+            return DELTA_TOO_BIG;
+        }
+        uint8_t* entry = p;
+        p += sizeof(LedsDeltaEntryHeader);
+        uint16_t run_count = 0;
+
+        uint32_t i = 0;
+        while (i < n) {
+            if (memcmp(cur + i * 3, base + i * 3, 3) == 0) {
+                ++i;
+                continue;
+            }
+            // Extend the run over gaps too short to be worth a new header.
+            uint32_t start = i;
+            uint32_t end = i + 1;
+            for (uint32_t j = i + 1; j < n && j - start < MAX_RUN_LEDS; ++j) {
+                if (memcmp(cur + j * 3, base + j * 3, 3) != 0) {
+                    end = j + 1;
+                } else if (j - end >= MERGE_GAP) {
+                    break;
+                }
+            }
+
+            uint32_t num_leds = end - start;
+            if (p + sizeof(LedsDeltaRunHeader) + num_leds * 3 > limit || run_count == UINT16_MAX) {
+                this->too_big++;
+                return DELTA_TOO_BIG;
+            }
+            p = write_delta_run_header(p, start, num_leds);
+            memcpy(p, cur + start * 3, num_leds * 3);
+            p += num_leds * 3;
+            run_count++;
+            i = end;
+        }
+        write_delta_entry_header(entry, this->pins[pin], run_count);
+        batch_count++;
+    }
+
+    if (batch_count == 0) {
+        this->unchanged++;
+        return DELTA_UNCHANGED;
+    }
+
+    *out_size = p - out;
+    write_set_leds_delta_header(out, *out_size, flags, seq, this->baseline_seq, batch_count);
+    memcpy(this->baseline.data(), entries, this->baseline.size());
+    this->baseline_seq = seq;
+    this->deltas++;
+    this->full_bytes += full_size;
+    this->delta_bytes += *out_size;
+    return DELTA_OK;
+}
@@ -0,0 +1,83 @@
+#include "frame-acks.hpp"
+#include "frame-clock.hpp"
+#include "protocol.hpp"
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+FrameAckTracker::FrameAckTracker()
+    : acked(0),
+      not_shown(0),
+      unmatched(0),
+      rtt("round trip"),
+      display_latency("deadline to display"),
+      on_client("read to display"),
+      mut(),
+      window(FRAME_ACK_WINDOW),
+      recorded(0),
+      settled(0),
+      acking(false)
+{}
+
+void FrameAckTracker::reset() {
+    std::lock_guard<std::mutex> lock(this->mut);
+    this->settled = this->recorded;
+    this->acking = false;
+}
+
+void FrameAckTracker::queued(uint32_t seq, ns_ts deadline) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    if (this->recorded - this->settled == FRAME_ACK_WINDOW) {
+        this->not_shown += this->acking;
+        this->settled++;
+    }
+    SentFrame& frame = this->window[this->recorded % FRAME_ACK_WINDOW];
+    frame.seq = seq;
+    frame.deadline = deadline;
+    frame.queued_at = std::chrono::steady_clock::now();
+    frame.was_written = false;
+    this->recorded++;
+}
+
+void FrameAckTracker::written(uint32_t seq, ns_ts now) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    // Frames are written in the order they were queued, so it is nearly
+    // always the newest.
+    for (uint64_t n = this->recorded; n > this->settled; --n) {
+        SentFrame& frame = this->window[(n - 1) % FRAME_ACK_WINDOW];
+        if (frame.seq == seq) {
+            frame.written_at = now;
+            frame.was_written = true;
+            return;
+        }
+    }
+}
+
+void FrameAckTracker::ack(const FrameAckMessage* msg, ns_ts now) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    uint64_t n = this->settled;
+    while (n < this->recorded && this->window[n % FRAME_ACK_WINDOW].seq != msg->frame_seq) {
+        n++;
+    }
+    if (n == this->recorded) {
+        this->unmatched++;
+        return;
+    }
+    this->not_shown += n - this->settled;
+    this->settled = n + 1;
+    this->acked++;
+    this->acking = true;
+
+    const SentFrame& frame = this->window[n % FRAME_ACK_WINDOW];
+    int64_t held_ns = msg->latch_us > msg->recv_us ? (int64_t)(msg->latch_us - msg->recv_us) * 1000 : 0;
+    // An ack can beat the io_uring completion for its own frame being
+    // reaped, in which case the time it was queued is the best there is.
+    ns_ts sent_at = frame.was_written ? frame.written_at : frame.queued_at;
+    int64_t rtt_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - sent_at).count() - held_ns;
+    if (rtt_ns < 0) {
+        rtt_ns = 0;
+    }
+    this->rtt.record_ns(rtt_ns);
+    this->on_client.record_ns(held_ns);
+    this->display_latency.record(frame.deadline, now - ns_dur(rtt_ns / 2));
+}
@@ -0,0 +1,143 @@
+#include "frame-clock.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <ctime>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <vector>
+
+// Beyond this many periods behind, OVERRUN_CATCH_UP gives up and skips too,
+// e.g. after the server was paused.
+const int64_t MAX_CATCH_UP_FRAMES = 10;
+
+FrameClock::FrameClock(int64_t ns_per_frame, overrun_policy policy)
+    : ns_per_frame(ns_per_frame),
+      policy(policy),
+      frames(0),
+      missed_deadlines(0),
+      late_frames(0),
+      fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
+      armed_late(false),
+      deadline(),
+      jitter(),
+      jitter_max(0),
+      jitter_total(0)
+{
+    if (this->fd == -1) {
+        std::cerr << "timerfd_create failed: " << strerror(errno) << "\n";
+    }
+    this->reset();
+}
+
+FrameClock::~FrameClock() {
+    close(this->fd);
+}
+
+// Readable once the armed deadline has passed.
+int FrameClock::timer_fd() const {
+    return this->fd;
+}
+
+// Arms the timer for the next deadline. A deadline in the past fires right
+// away.
+void FrameClock::arm() {
+    this->armed_late = std::chrono::steady_clock::now() >= this->deadline;
+    int64_t ns = this->deadline.time_since_epoch().count();
+    struct itimerspec spec = {};
+    spec.it_value.tv_sec = ns / 1'000'000'000;
+    spec.it_value.tv_nsec = ns % 1'000'000'000;
+    timerfd_settime(this->fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+void FrameClock::disarm() {
+    struct itimerspec spec = {};
+    timerfd_settime(this->fd, 0, &spec, NULL);
+}
+
+// Consumes the timer expiration and accounts for the frame, or returns
+// std::nullopt if the timer had not actually fired.
+std::optional<FrameTick> FrameClock::expire() {
+    uint64_t expirations;
+    if (read(this->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return std::nullopt;
+    }
+    return this->tick(this->armed_late);
+}
+
+// Restarts the schedule one period from now, without counting the time since
+// the last frame as missed deadlines.
+void FrameClock::reset() {
+    this->deadline = std::chrono::steady_clock::now() + ns_dur(this->ns_per_frame);
+}
+
+ns_ts FrameClock::next_deadline() const {
+    return this->deadline;
+}
+
+// Accounts for a frame starting now and advances the schedule. Called once per
+// frame after waking for next_deadline().
+FrameTick FrameClock::tick(bool overran) {
+    ns_ts now = std::chrono::steady_clock::now();
+    int64_t behind = (now - this->deadline).count() / this->ns_per_frame;
+    if (behind > 0 && (this->policy == OVERRUN_SKIP || behind > MAX_CATCH_UP_FRAMES)) {
+        this->missed_deadlines += behind;
+        this->deadline += ns_dur(behind * this->ns_per_frame);
+    }
+
+    int64_t lateness = (now - this->deadline).count();
+    this->jitter[this->frames % JITTER_SAMPLES] = lateness;
+    this->jitter_max = std::max(this->jitter_max, lateness);
+    this->jitter_total += lateness;
+    this->frames++;
+    if (overran) {
+        this->late_frames++;
+    }
+
+    FrameTick tick = {this->deadline, now};
+    this->deadline += ns_dur(this->ns_per_frame);
+    return tick;
+}
+
+void FrameClock::print_stats(std::ostream& out) {
+    size_t n = std::min<uint64_t>(this->frames, JITTER_SAMPLES);
+    std::vector<int64_t> recent(this->jitter.begin(), this->jitter.begin() + n);
+    std::sort(recent.begin(), recent.end());
+    double mean = 0.0;
+    double var = 0.0;
+    for (int64_t j : recent) {
+        mean += j;
+    }
+    mean = n > 0 ? mean / n : 0.0;
+    for (int64_t j : recent) {
+        var += (j - mean) * (j - mean);
+    }
+    double stddev = n > 0 ? std::sqrt(var / n) : 0.0;
+    auto pct = [&recent, n](double p) {
+        return n > 0 ? recent[std::min(n - 1, (size_t)(p * n))] / 1e3 : 0.0;
+    };
+
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(1);
+    ss << "Frame clock: " << this->frames << " frames at "
+       << this->ns_per_frame / 1e6 << " ms, "
+       << this->missed_deadlines << " missed deadlines, "
+       << this->late_frames << " late frames ("
+       << (this->policy == OVERRUN_SKIP ? "skip" : "catch-up") << ")\n";
+    ss << "  wake jitter (last " << n << " frames): "
+       << "mean " << mean / 1e3 << " us, "
+       << "stddev " << stddev / 1e3 << " us, "
+       << "p50 " << pct(0.50) << " us, "
+       << "p99 " << pct(0.99) << " us, "
+       << "max " << (n > 0 ? recent[n - 1] / 1e3 : 0.0) << " us\n";
+    ss << "  wake jitter (all frames): "
+       << "mean " << (this->frames > 0 ? this->jitter_total / 1e3 / this->frames : 0.0) << " us, "
+       << "max " << this->jitter_max / 1e3 << " us\n";
+    out << ss.str();
+}
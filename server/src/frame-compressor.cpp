@@ -0,0 +1,67 @@
+#include "frame-compressor.hpp"
+#include "protocol.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+FrameCompressor::FrameCompressor(const Client* c)
+    : compressed(0),
+      incompressible(0),
+      full_bytes(0),
+      compressed_bytes(0),
+      batch_count(c->mat_connections.size())
+{}
+
+uint32_t FrameCompressor::compress(const uint8_t* entries,
+                                   uint32_t full_size,
+                                   uint32_t max_size,
+                                   uint8_t flags,
+                                   uint32_t seq,
+                                   uint8_t* out) {
+    // Anything that doesn't fit here is no better than sending it otherwise.
+    uint8_t* limit = out + max_size - 1;
+    uint8_t* p = out + sizeof(SetLedsCompressedMessage);
+    const uint8_t* entry = entries;
+    for (uint8_t i = 0; i < this->batch_count; ++i) {
+        const LedsBatchEntryHeader* eh = (const LedsBatchEntryHeader*)entry;
+        uint8_t pin = eh->gpio_pin;
+        uint32_t num_leds = eh->num_leds;
+        const uint8_t* pixels = entry + sizeof(LedsBatchEntryHeader);
+        entry = pixels + num_leds * 3;
+
+        uint8_t* data = p + sizeof(LedsCompressedEntryHeader);
+        if (data > limit) {
+            this->incompressible++;
+            return 0;
+        }
+        uint32_t cap = limit - data;
+        // The palette is tried first, straight into place; RLE goes after it
+        // and is moved down if it turns out smaller.
+        uint8_t encoding = PIXEL_ENCODING_PALETTE;
+        uint32_t size = encode_pixels_palette(pixels, num_leds, data, cap);
+        uint32_t rle_cap = size ? std::min(size - 1, cap - size) : cap;
+        uint32_t rle_size = encode_pixels_rle(pixels, num_leds, data + size, rle_cap);
+        if (rle_size) {
+            memmove(data, data + size, rle_size);
+            encoding = PIXEL_ENCODING_RLE;
+            size = rle_size;
+        }
+        if (!size) {
+            if (num_leds * 3 > cap) {
+                this->incompressible++;
+                return 0;
+            }
+            encoding = PIXEL_ENCODING_RAW;
+            size = num_leds * 3;
+            memcpy(data, pixels, size);
+        }
+        p = write_compressed_entry_header(p, pin, encoding, num_leds, size) + size;
+    }
+
+    uint32_t out_size = p - out;
+    write_set_leds_compressed_header(out, out_size, flags, seq, this->batch_count);
+    this->compressed++;
+    this->full_bytes += full_size;
+    this->compressed_bytes += out_size;
+    return out_size;
+}
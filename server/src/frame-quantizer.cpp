@@ -0,0 +1,72 @@
+#include "frame-quantizer.hpp"
+#include "client.hpp"
+#include "pack-kernel.hpp"
+#include "protocol.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+FrameQuantizer::FrameQuantizer(const Client* c)
+    : frames(0),
+      full_bytes(0),
+      quantized_bytes(0),
+      dither(c->dither),
+      max_levels(),
+      pin_leds()
+{
+    for (const MatricesConnection& conn : c->mat_connections) {
+        // Packing tables only ever grow, so a segment's brightest output is
+        // its entry for 255.
+        uint8_t max_level = 0;
+        for (const PackSegment& seg : conn.segments) {
+            for (int k = 0; k < 3; ++k) {
+                max_level = std::max(max_level, seg.params.lut[k][255]);
+            }
+        }
+        this->max_levels.push_back(max_level);
+        this->pin_leds.push_back(conn.gather.size());
+    }
+}
+
+uint32_t FrameQuantizer::size(uint8_t depth) const {
+    uint32_t size = sizeof(SetLedsQuantizedMessage);
+    for (uint32_t num_leds : this->pin_leds) {
+        size += sizeof(LedsQuantizedEntryHeader) + quantized_pixels_size(depth, num_leds);
+    }
+    return size;
+}
+
+uint8_t FrameQuantizer::max_level() const {
+    uint8_t max_level = 0;
+    for (uint8_t level : this->max_levels) {
+        max_level = std::max(max_level, level);
+    }
+    return max_level;
+}
+
+uint32_t FrameQuantizer::quantize(uint8_t depth,
+                                  const uint8_t* entries,
+                                  uint32_t full_size,
+                                  uint8_t flags,
+                                  uint32_t seq,
+                                  uint8_t* out) {
+    uint8_t* p = out + sizeof(SetLedsQuantizedMessage);
+    const uint8_t* entry = entries;
+    for (uint8_t max_level : this->max_levels) {
+        const LedsBatchEntryHeader* eh = (const LedsBatchEntryHeader*)entry;
+        uint32_t num_leds = eh->num_leds;
+        const uint8_t* pixels = entry + sizeof(LedsBatchEntryHeader);
+        entry = pixels + num_leds * 3;
+
+        p = write_quantized_entry_header(p, eh->gpio_pin, num_leds, max_level);
+        quantize_pixels(depth, max_level, this->dither, pixels, num_leds, p);
+        p += quantized_pixels_size(depth, num_leds);
+    }
+
+    uint32_t out_size = p - out;
+    write_set_leds_quantized_header(out, out_size, flags, seq, depth, this->max_levels.size());
+    this->frames++;
+    this->full_bytes += full_size;
+    this->quantized_bytes += out_size;
+    return out_size;
+}
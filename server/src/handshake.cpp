@@ -0,0 +1,246 @@
+#include "handshake.hpp"
+#include "client.hpp"
+#include "protocol.hpp"
+#include "reactor.hpp"
+#include "tcp.hpp"
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <map>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <vector>
+
+const int MAX_WAITING_CLIENTS = 256;
+
+HandshakeLoop::HandshakeLoop(std::vector<Client*> clients)
+    : timeout_ns(DEFAULT_CHECK_IN_TIMEOUT_NS),
+      admitted(0),
+      replayed(0),
+      timed_out(0),
+      rejected(0),
+      legacy(0),
+      reactor(),
+      timer_fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)),
+      listen_socket(-1),
+      server(NULL),
+      mac_to_client(),
+      pending()
+{
+    if (this->timer_fd == -1) {
+        std::cerr << "timerfd_create failed: " << strerror(errno) << "\n";
+    }
+    for (const Client* c : clients) {
+        this->mac_to_client[c->mac_addr] = c;
+    }
+}
+
+HandshakeLoop::~HandshakeLoop() {
+    close(this->timer_fd);
+}
+
+void HandshakeLoop::run(int socket, LEDTCPServer* server) {
+    this->listen_socket = socket;
+    this->server = server;
+    listen(socket, MAX_WAITING_CLIENTS);
+    int flags = fcntl(socket, F_GETFL, 0);
+    fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+
+    this->reactor.add(socket, EPOLLIN, [this](uint32_t) {
+        this->accept_all();
+    });
+    this->reactor.add(this->timer_fd, EPOLLIN, [this](uint32_t) {
+        uint64_t expirations;
+        read(this->timer_fd, &expirations, sizeof(expirations));
+        this->expire();
+    });
+    this->reactor.run();
+}
+
+// Takes every connection waiting on the listening socket and starts its
+// handshake.
+void HandshakeLoop::accept_all() {
+    while (true) {
+        int client_socket = accept4(this->listen_socket, NULL, NULL, SOCK_NONBLOCK);
+        if (client_socket == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                std::cerr << "accept failed: " << strerror(errno) << "\n";
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        // Small messages like OP_REDRAW must not wait behind Nagle's algorithm
+        // for the previous frame to be acknowledged.
+        int nodelay = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        Handshake* h = new Handshake();
+        h->socket = client_socket;
+        h->state = HANDSHAKE_CHECK_IN;
+        h->deadline = std::chrono::steady_clock::now() + ns_dur(this->timeout_ns);
+        h->received = 0;
+        h->client = NULL;
+        h->config_sent = 0;
+        this->pending[client_socket] = h;
+        this->reactor.add(client_socket, EPOLLIN | EPOLLRDHUP, [this, h](uint32_t events) {
+            this->handshake_event(h, events);
+        });
+    }
+    this->arm_timer();
+}
+
+void HandshakeLoop::handshake_event(Handshake* h, uint32_t events) {
+    bool ok = !(events & (EPOLLHUP | EPOLLERR));
+    if (ok && h->state == HANDSHAKE_CHECK_IN) {
+        ok = this->receive_check_in(h);
+    } else if (ok && (events & EPOLLRDHUP)) {
+        ok = false;
+    }
+    if (ok && h->state == HANDSHAKE_SET_CONFIG) {
+        ok = this->send_config(h);
+    }
+    if (!ok) {
+        this->rejected++;
+        this->finish(h, false);
+    } else if (h->state == HANDSHAKE_SET_CONFIG && h->config_sent == h->client->set_config.size()) {
+        this->finish(h, true);
+    }
+}
+
+// Reads what has arrived of the check-in, and once it is all there looks up
+// the client and moves on to sending its SetConfig. Only the check-in itself
+// is read, its header first to learn its size, so anything the client sends
+// after it is left for the reactor it is handed to. Returns false if the
+// connection should be dropped.
+bool HandshakeLoop::receive_check_in(Handshake* h) {
+    const CheckInMessage* check_in = (const CheckInMessage*)h->check_in;
+    uint32_t wanted = h->received < sizeof(MessageHeader) ? sizeof(MessageHeader) : check_in->header.size;
+    while (h->received < wanted) {
+        int recved = recv(h->socket, h->check_in + h->received, wanted - h->received, 0);
+        if (recved == 0) {
+            return false;
+        }
+        if (recved < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        h->received += recved;
+        if (h->received == sizeof(MessageHeader)) {
+            if (check_in->header.op_code != OP_CHECK_IN ||
+                check_in->header.size < sizeof(CheckInMessage) ||
+                check_in->header.size > MAX_CHECK_IN_SIZE) {
+                std::cerr << "Expected check-in message, got invalid op-code or message size.\n";
+                return false;
+            }
+            wanted = check_in->header.size;
+        }
+    }
+
+    uint64_t mac_addr = 0;
+    memcpy(&mac_addr, check_in->mac_address, 6);
+    std::cout << "Got message from " << mac_addr << "\n";
+    auto it = this->mac_to_client.find(mac_addr);
+    if (it == this->mac_to_client.end()) {
+        std::cerr << "Did not recognize MAC address!\n";
+        return false;
+    }
+    h->client = it->second;
+    h->state = HANDSHAKE_SET_CONFIG;
+    // Nothing more is read until the client is admitted, so only wait for
+    // room to send.
+    this->reactor.modify(h->socket, EPOLLOUT | EPOLLRDHUP);
+    return true;
+}
+
+// Sends as much of the client's SetConfig as the socket takes. Returns false
+// if the connection should be dropped.
+bool HandshakeLoop::send_config(Handshake* h) {
+    const std::vector<uint8_t>& config = h->client->set_config;
+    while (h->config_sent < config.size()) {
+        int sent = send(h->socket, config.data() + h->config_sent, config.size() - h->config_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        h->config_sent += sent;
+    }
+    return true;
+}
+
+// Ends the handshake, either handing the connection to the server or closing
+// it.
+void HandshakeLoop::finish(Handshake* h, bool admit) {
+    this->reactor.remove(h->socket);
+    this->pending.erase(h->socket);
+    if (admit) {
+        std::cout << "Accepted client\n";
+        std::cout << "socket: " << h->socket << "\n";
+        std::cout << "Sent set_config to " << h->client->mac_addr << "\n";
+        ClientCapabilities caps;
+        bool has_caps = check_in_capabilities((const CheckInMessage*)h->check_in, &caps);
+        if (!has_caps) {
+            this->legacy++;
+        }
+        if (this->server->admit(h->client, h->socket, has_caps ? &caps : NULL)) {
+            this->replayed++;
+        }
+        this->admitted++;
+    } else {
+        close(h->socket);
+    }
+    delete h;
+}
+
+// Drops every connection that has run out of time.
+void HandshakeLoop::expire() {
+    ns_ts now = std::chrono::steady_clock::now();
+    std::vector<Handshake*> expired;
+    for (auto it : this->pending) {
+        if (it.second->deadline <= now) {
+            expired.push_back(it.second);
+        }
+    }
+    for (Handshake* h : expired) {
+        std::cerr << "Connection on socket " << h->socket << " did not finish checking in in time, dropping\n";
+        this->timed_out++;
+        this->finish(h, false);
+    }
+    this->arm_timer();
+}
+
+// Arms the timer for the earliest deadline, or disarms it with nothing
+// pending so an idle server sleeps.
+void HandshakeLoop::arm_timer() {
+    struct itimerspec spec = {};
+    bool any = false;
+    ns_ts earliest;
+    for (auto it : this->pending) {
+        if (!any || it.second->deadline < earliest) {
+            earliest = it.second->deadline;
+            any = true;
+        }
+    }
+    if (!any) {
+        timerfd_settime(this->timer_fd, 0, &spec, NULL);
+        return;
+    }
+    int64_t ns = earliest.time_since_epoch().count();
+    spec.it_value.tv_sec = ns / 1'000'000'000;
+    spec.it_value.tv_nsec = ns % 1'000'000'000;
+    timerfd_settime(this->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+void HandshakeLoop::print_stats(std::ostream& out) {
+    out << "Check-in: " << this->admitted.load() << " admitted ("
+        << this->replayed.load() << " sent the last frame straight away, "
+        << this->legacy.load() << " without capabilities), "
+        << this->timed_out.load() << " timed out, "
+        << this->rejected.load() << " rejected\n";
+}
@@ -21,27 +21,23 @@ void parseInput(VirtualCanvas& vCanvas,  std::string& inputFile) {
         
         /*
         =======================================================================
-                        LUT calculations for gamma application.
+                                    Gamma
         =======================================================================
 
-        Specifically, this precomputes the lookup table for the given gamma 
-        value so that we don't need to do compute per pixel per image
+        The gamma isn't applied to the canvas. It is folded into the lookup
+        tables the pixels go through when they are packed for the LEDs, along
+        with brightness, so each pixel is only quantised once.
 
    
         */
 
-        cv::Mat lut(1, 256, CV_8UC1);
         double gamma = config["settings"]["gamma"].as<double>();
 
         if(gamma < 0){
             throw std::invalid_argument("Bad gamma value given");
         }
 
-        uchar* lutPtr = lut.ptr();
-        for (int i = 0; i < 256; ++i) {
-            lutPtr[i] = cv::saturate_cast<uchar>(pow(i / 255.0, gamma) * 255.0);
-        }
-        vCanvas.canvasLut = lut;
+        vCanvas.gamma = gamma;
 
 
 
@@ -3,6 +3,7 @@
 #include <iostream>
 #include <iterator>
 #include <optional>
+#include <sstream>
 #include <string.h>
 #include <netinet/in.h>
 #include <string>
@@ -23,10 +24,38 @@
 #include <fcntl.h>
 #include <unistd.h>  
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include "reactor.hpp"
 
 //Change this flag as needed. Debug mode displays virtual canvas locally per update
 #define TMP_CMD "/tmp/led-cmd"
 
+/*
+Reads everything waiting in the command pipe and runs each line as a command.
+Returns true if one of them was quit.
+*/
+static bool readCommands(int pipe, VirtualCanvas& vCanvas, Controller& cont, bool& isPaused) {
+    char buf[256];
+    std::string input;
+    ssize_t n;
+    while ((n = read(pipe, buf, sizeof(buf))) > 0) {
+        input.append(buf, n);
+    }
+
+    std::istringstream lines(input);
+    std::string line;
+    while (std::getline(lines, line)) {
+        //Remove whitespaces
+        line.erase(line.find_last_not_of(" \t\r\n") + 1);
+
+        if (!line.empty()) {
+            int status = processCommand(vCanvas, cont, line, isPaused);
+            if (status == 1) {return true;}
+        }
+    }
+    return false;
+}
+
 int main(int argc, char* argv[]) {
 
      //Required for webcam streaming
@@ -71,6 +100,10 @@ int main(int argc, char* argv[]) {
                    << ex.what() << "\n";
          exit(-1);
      }
+
+     for (Client* c : server_config.clients) {
+         c->compile_pack(vCanvas.gamma);
+     }
  
      std::optional<LEDTCPServer> server_opt =
          create_server(INADDR_ANY, 7070, 7074, server_config.clients);
@@ -78,12 +111,23 @@ int main(int argc, char* argv[]) {
          exit(-1);
      }
      LEDTCPServer server = server_opt.value();
+     server.delta_frames = server_config.delta_frames;
+     server.keyframe_interval = server_config.keyframe_interval;
+    server.present_delay_ns = server_config.present_delay_ns;
+     server.udp->set_mtu(server_config.udp_mtu);
+     server.udp->simulated_loss = server_config.udp_simulated_loss;
+     server.handshakes->timeout_ns = server_config.check_in_timeout_ns;
+     server.use_backend(server_config.backend);
      server.start();
  
      Controller cont(vCanvas,
                      server_config.clients,
                      server,
-                     server_config.ns_per_frame);
+                     server_config.ns_per_frame,
+                     server_config.pipeline_depth,
+                     server_config.sender_threads,
+                     server_config.latch,
+                     server_config.overrun);
     
 
 
@@ -92,57 +136,63 @@ int main(int argc, char* argv[]) {
     if (mkfifo(TMP_CMD, 0666) == -1 && errno != EEXIST) {std::cerr << "mkfifo failed: " << strerror(errno) << "\n";return 1;} //Creates a fifo style pipe
     int pipe = open(TMP_CMD, O_RDONLY | O_NONBLOCK); //Opens the pipe for reading only
     if (pipe < 0) {std::cerr << "open failed: " << strerror(errno) << "\n";return 1;}
+    //Hold a write end open ourselves, otherwise the pipe reports a hangup to epoll every time a writer closes it
+    int pipe_keepalive = open(TMP_CMD, O_WRONLY | O_NONBLOCK);
 
     bool isPaused = false;
-    char buf[256];
-    std::cout << "\nWrite your command to " << TMP_CMD << std::endl << "Example: `echo \"move 5 10 10 > " << TMP_CMD << "\'" << std::endl <<  "Available Commands : \n- pause\n- resume\n- quit\n- move <ElementID> <x-coord> <y-coord>\n- add <type> <ElementID> <x-coord> <y-coord>\n- remove <ElementID>\n";
-     while(1) {
-
-        /*
-        ======================================================================================
-        Command line shenanigans: Using Pipes now:
-
-        From another process, you now enter commands by writing to the FIFO file in "TMP_CMD"
-        By default, it is "/tmp/led-cmd". 
-        
-        For example, open another terminal, and if I want to move an element, I would do:
-
-        `echo "move 5 10 10" > /tmp/led-cmd`
-
-        Available Commands : 
-        - pause
-        - resume
-        - quit
-        - move <ElementID> <x-coord> <y-coord
-
-        ======================================================================================
-        */
-
-       ssize_t n = read(pipe, buf, sizeof(buf) - 1);
-       if (n > 0) {
-            buf[n] = '\0';
-            //Remove whitespaces
-            std::string line(buf);
-            line.erase(line.find_last_not_of(" \t\r\n") + 1);
-
-            if (!line.empty()) {
-                int status = processCommand(vCanvas, line, isPaused);
-                if (status == 1) {goto EXIT_PROGRAM;}
-            }
-        }
+    std::cout << "\nWrite your command to " << TMP_CMD << std::endl << "Example: `echo \"move 5 10 10 > " << TMP_CMD << "\'" << std::endl <<  "Available Commands : \n- pause\n- resume\n- quit\n- stats\n- move <ElementID> <x-coord> <y-coord>\n- add <type> <ElementID> <x-coord> <y-coord>\n- remove <ElementID>\n";
 
-        /*
-        =============================================
-                        Continue
-        =============================================
-        */
+    /*
+    ======================================================================================
+    Command line shenanigans: Using Pipes now:
 
-        if (!isPaused) {
-            cont.frame_exec(debug_mode);
+    From another process, you now enter commands by writing to the FIFO file in "TMP_CMD"
+    By default, it is "/tmp/led-cmd". 
+    
+    For example, open another terminal, and if I want to move an element, I would do:
+
+    `echo "move 5 10 10" > /tmp/led-cmd`
+
+    Available Commands : 
+    - pause
+    - resume
+    - quit
+    - stats
+    - move <ElementID> <x-coord> <y-coord
+
+    The main loop sleeps in epoll until a command arrives, the frame timer fires or a
+    client socket has something to say, so commands are applied as soon as they are
+    written and a paused server doesn't use any CPU.
+    ======================================================================================
+    */
+
+    Reactor reactor;
+
+    reactor.add(pipe, EPOLLIN, [&](uint32_t) {
+        if (readCommands(pipe, vCanvas, cont, isPaused)) {
+            reactor.stop();
+        } else if (isPaused) {
+            cont.frame_clock.disarm();
+        } else {
+            cont.frame_clock.arm();
         }
-     }
+    });
+
+    reactor.add(cont.frame_clock.timer_fd(), EPOLLIN, [&](uint32_t) {
+        std::optional<FrameTick> tick = cont.frame_clock.expire();
+        if (tick.has_value() && !isPaused) {
+            cont.frame_exec(tick.value(), debug_mode);
+            cont.frame_clock.arm();
+        }
+    });
+
+    cont.tcp_server.watch_clients(reactor);
+
+    cont.frame_clock.arm();
+    reactor.run();
 
-    EXIT_PROGRAM:
+    cont.stop();
+    close(pipe_keepalive);
     close(pipe);
     unlink(TMP_CMD);
     return 0;
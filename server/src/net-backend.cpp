@@ -0,0 +1,271 @@
+#include "net-backend.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <ostream>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define NET_BACKEND_URING
+#endif
+
+// Ring sizes are powers of two between these.
+const uint32_t MIN_URING_ENTRIES = 64;
+const uint32_t MAX_URING_ENTRIES = 4096;
+
+const char* net_backend_name(net_backend backend) {
+    switch (backend) {
+        case NET_BACKEND_IO_URING: return "io_uring";
+        default: return "epoll";
+    }
+}
+
+UringSender::UringSender(uint32_t max_inflight)
+    : submits(0),
+      writes(0),
+      would_block(0),
+      mut(),
+      ring_fd(-1),
+      completion_fd(-1),
+      sq_entries(0),
+      cq_entries(0),
+      sq_ring(NULL),
+      sq_ring_size(0),
+      cq_ring(NULL),
+      cq_ring_size(0),
+      sqes(NULL),
+      sqes_size(0),
+      sq_head(NULL),
+      sq_tail(NULL),
+      sq_mask(NULL),
+      sq_array(NULL),
+      cq_head(NULL),
+      cq_tail(NULL),
+      cq_mask(NULL),
+      cqes(NULL),
+      scheduled(),
+      failed()
+{
+    uint32_t entries = MIN_URING_ENTRIES;
+    while (entries < max_inflight && entries < MAX_URING_ENTRIES) {
+        entries *= 2;
+    }
+    if (!this->setup(entries)) {
+        std::cerr << "io_uring is not available: " << strerror(errno) << "\n";
+    }
+    this->scheduled.reserve(entries);
+    this->failed.reserve(entries);
+}
+
+UringSender::~UringSender() {
+    if (this->sqes) {
+        munmap(this->sqes, this->sqes_size);
+    }
+    if (this->cq_ring && this->cq_ring != this->sq_ring) {
+        munmap(this->cq_ring, this->cq_ring_size);
+    }
+    if (this->sq_ring) {
+        munmap(this->sq_ring, this->sq_ring_size);
+    }
+    if (this->completion_fd != -1) {
+        close(this->completion_fd);
+    }
+    if (this->ring_fd != -1) {
+        close(this->ring_fd);
+    }
+}
+
+bool UringSender::ok() const {
+    return this->ring_fd != -1;
+}
+
+int UringSender::event_fd() const {
+    return this->completion_fd;
+}
+
+#ifdef NET_BACKEND_URING
+
+// Maps the rings the same way liburing does, and registers an eventfd so the
+// reactor can wait for completions.
+bool UringSender::setup(uint32_t entries) {
+    io_uring_params params = {};
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        return false;
+    }
+    this->sq_entries = params.sq_entries;
+    this->cq_entries = params.cq_entries;
+    this->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    this->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        this->sq_ring_size = this->cq_ring_size = std::max(this->sq_ring_size, this->cq_ring_size);
+    }
+
+    void* sq = mmap(NULL, this->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    this->sq_ring = sq;
+    void* cq = sq;
+    if (!single_mmap) {
+        cq = mmap(NULL, this->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+    }
+    this->cq_ring = cq;
+    this->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(NULL, this->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    this->sqes = sqes;
+
+    uint8_t* sq_base = (uint8_t*)sq;
+    uint8_t* cq_base = (uint8_t*)cq;
+    this->sq_head = (uint32_t*)(sq_base + params.sq_off.head);
+    this->sq_tail = (uint32_t*)(sq_base + params.sq_off.tail);
+    this->sq_mask = (uint32_t*)(sq_base + params.sq_off.ring_mask);
+    this->sq_array = (uint32_t*)(sq_base + params.sq_off.array);
+    this->cq_head = (uint32_t*)(cq_base + params.cq_off.head);
+    this->cq_tail = (uint32_t*)(cq_base + params.cq_off.tail);
+    this->cq_mask = (uint32_t*)(cq_base + params.cq_off.ring_mask);
+    this->cqes = cq_base + params.cq_off.cqes;
+
+    this->completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (this->completion_fd == -1 ||
+        syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &this->completion_fd, 1) < 0) {
+        close(fd);
+        return false;
+    }
+    this->ring_fd = fd;
+    return true;
+}
+
+void UringSender::schedule(void* owner, int socket, const msghdr* hdr) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    this->scheduled.push_back((Scheduled){owner, socket, hdr});
+}
+
+void UringSender::submit() {
+    std::lock_guard<std::mutex> lock(this->mut);
+    if (this->scheduled.empty()) {
+        return;
+    }
+    uint32_t tail = *this->sq_tail;
+    uint32_t pending = 0;
+    for (const Scheduled& s : this->scheduled) {
+        // Only while more writes are in flight than the ring was sized for.
+        if (tail - __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE) == this->sq_entries) {
+            __atomic_store_n(this->sq_tail, tail, __ATOMIC_RELEASE);
+            this->enter_locked(pending);
+            pending = 0;
+            // A failed enter takes back what the kernel didn't consume.
+            tail = *this->sq_tail;
+        }
+        uint32_t index = tail & *this->sq_mask;
+        io_uring_sqe* sqe = (io_uring_sqe*)this->sqes + index;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = s.socket;
+        sqe->addr = (uint64_t)(uintptr_t)s.hdr;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = (uint64_t)(uintptr_t)s.owner;
+        this->sq_array[index] = index;
+        tail++;
+        pending++;
+    }
+    __atomic_store_n(this->sq_tail, tail, __ATOMIC_RELEASE);
+    this->enter_locked(pending);
+    this->writes += this->scheduled.size();
+    this->scheduled.clear();
+}
+
+void UringSender::enter_locked(uint32_t count) {
+    while (count > 0) {
+        int submitted = syscall(__NR_io_uring_enter, this->ring_fd, count, 0, 0, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "io_uring_enter failed: " << strerror(errno) << "\n";
+            // EAGAIN and EBUSY mean the kernel is short of memory or of
+            // completion space for now, so those writes wait for their
+            // sockets to be writable and go again. Anything else fails them.
+            this->fail_unsubmitted_locked(errno == EAGAIN || errno == EBUSY ? -EAGAIN : -errno);
+            return;
+        }
+        this->submits++;
+        count -= submitted;
+    }
+}
+
+// Takes back every entry the kernel hasn't consumed and completes each write
+// with res on the next reap, so its owner isn't left waiting on it. Nothing
+// else reads the submission ring outside io_uring_enter, which needs the lock.
+void UringSender::fail_unsubmitted_locked(int res) {
+    uint32_t head = __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE);
+    for (uint32_t i = head; i != *this->sq_tail; ++i) {
+        const io_uring_sqe* sqe = (const io_uring_sqe*)this->sqes + this->sq_array[i & *this->sq_mask];
+        this->failed.push_back(std::make_pair((void*)(uintptr_t)sqe->user_data, res));
+    }
+    __atomic_store_n(this->sq_tail, head, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    write(this->completion_fd, &one, sizeof(one));
+}
+
+void UringSender::reap(std::vector<UringCompletion>& done) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    done.insert(done.end(), this->failed.begin(), this->failed.end());
+    this->failed.clear();
+    uint32_t head = *this->cq_head;
+    uint32_t tail = __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const io_uring_cqe* cqe = (const io_uring_cqe*)this->cqes + (head & *this->cq_mask);
+        if (cqe->res == -EAGAIN) {
+            this->would_block++;
+        }
+        done.push_back(std::make_pair((void*)(uintptr_t)cqe->user_data, cqe->res));
+    }
+    __atomic_store_n(this->cq_head, head, __ATOMIC_RELEASE);
+}
+
+#else
+
+bool UringSender::setup(uint32_t) {
+    errno = ENOSYS;
+    return false;
+}
+
+void UringSender::schedule(void*, int, const msghdr*) {}
+void UringSender::submit() {}
+void UringSender::enter_locked(uint32_t) {}
+void UringSender::reap(std::vector<UringCompletion>&) {}
+
+#endif
+
+void UringSender::print_stats(std::ostream& out) {
+    int64_t submits = this->submits.load();
+    out << "  io_uring: " << this->writes.load() << " writes in " << submits << " submits";
+    if (submits > 0) {
+        out << " (" << std::fixed << std::setprecision(1)
+            << (double)this->writes.load() / submits << " per submit)";
+    }
+    out << ", " << this->would_block.load() << " would have blocked\n";
+}
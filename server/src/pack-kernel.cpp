@@ -0,0 +1,193 @@
+#include "pack-kernel.hpp"
+#include "protocol.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PACK_KERNEL_X86
+#endif
+
+// Pixels are gathered into a small contiguous block first, so the SIMD loops
+// only ever see packed BGR triples. The padding lets vector loads run past
+// the last pixel of a block.
+const uint32_t BLOCK_LEDS = 160;
+const uint32_t BLOCK_PADDING = 32;
+
+PackParams make_pack_params(double gamma, uint8_t brightness, uint8_t color_order) {
+    uint8_t r, g, b;
+    if (!color_order_offsets(color_order, &r, &g, &b)) {
+        color_order_offsets(COLOR_ORDER_RGB, &r, &g, &b);
+    }
+    PackParams params;
+    // v * brightness * 257 >> 16 is v * brightness / 255 rounded down, except
+    // at 255 where it would lose one, so full brightness skips scaling.
+    params.scale = brightness * 257;
+    params.full_brightness = brightness == 255;
+    params.linear = gamma == 1.0;
+    params.src_channel[r] = 2;
+    params.src_channel[g] = 1;
+    params.src_channel[b] = 0;
+
+    // Gamma and brightness are applied together so content is only
+    // quantised once, at the end.
+    uint8_t table[256];
+    for (int v = 0; v < 256; ++v) {
+        if (params.linear) {
+            table[v] = params.full_brightness ? v : (v * params.scale) >> 16;
+        } else {
+            table[v] = (uint8_t)std::lround(std::pow(v / 255.0, gamma) * brightness);
+        }
+    }
+    for (int k = 0; k < 3; ++k) {
+        memcpy(params.lut[k], table, sizeof(table));
+    }
+    return params;
+}
+
+static void gather_block(const uint8_t* canvas, const uint32_t* gather, uint32_t n, uint8_t* block) {
+    for (uint32_t i = 0; i < n; ++i) {
+        const uint8_t* px = canvas + gather[i];
+        block[i * 3] = px[0];
+        block[i * 3 + 1] = px[1];
+        block[i * 3 + 2] = px[2];
+    }
+}
+
+static void convert_scalar(const uint8_t* block, uint32_t n, const PackParams& params, uint8_t* out) {
+    const uint8_t c0 = params.src_channel[0];
+    const uint8_t c1 = params.src_channel[1];
+    const uint8_t c2 = params.src_channel[2];
+    const uint8_t* lut0 = params.lut[0];
+    const uint8_t* lut1 = params.lut[1];
+    const uint8_t* lut2 = params.lut[2];
+    for (uint32_t i = 0; i < n; ++i) {
+        const uint8_t* px = block + i * 3;
+        out[i * 3] = lut0[px[c0]];
+        out[i * 3 + 1] = lut1[px[c1]];
+        out[i * 3 + 2] = lut2[px[c2]];
+    }
+}
+
+#ifdef PACK_KERNEL_X86
+
+// Shuffle reordering the 5 whole pixels in 16 bytes; the 16th byte is zeroed
+// and gets overwritten by the next store.
+static void shuffle_mask(const PackParams& params, uint8_t mask[16]) {
+    for (int i = 0; i < 15; ++i) {
+        mask[i] = (i / 3) * 3 + params.src_channel[i % 3];
+    }
+    mask[15] = 0x80;
+}
+
+// Each iteration converts 5 pixels (15 bytes) but loads and stores 16, so it
+// needs a 16th byte left in out; the rest goes to the scalar loop.
+__attribute__((target("ssse3")))
+static uint32_t convert_ssse3(const uint8_t* block, uint32_t n, const PackParams& params, uint8_t* out) {
+    uint8_t mask_bytes[16];
+    shuffle_mask(params, mask_bytes);
+    const __m128i mask = _mm_loadu_si128((const __m128i*)mask_bytes);
+    const __m128i scale = _mm_set1_epi16((short)params.scale);
+    const __m128i zero = _mm_setzero_si128();
+
+    uint32_t i = 0;
+    for (; i + 6 <= n; i += 5) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(block + i * 3));
+        v = _mm_shuffle_epi8(v, mask);
+        if (!params.full_brightness) {
+            __m128i lo = _mm_mulhi_epu16(_mm_unpacklo_epi8(v, zero), scale);
+            __m128i hi = _mm_mulhi_epu16(_mm_unpackhi_epi8(v, zero), scale);
+            v = _mm_packus_epi16(lo, hi);
+        }
+        _mm_storeu_si128((__m128i*)(out + i * 3), v);
+    }
+    return i;
+}
+
+// Same as the SSSE3 loop with one 5 pixel group in each 128 bit lane, since
+// AVX2 shuffles don't cross lanes.
+__attribute__((target("avx2")))
+static uint32_t convert_avx2(const uint8_t* block, uint32_t n, const PackParams& params, uint8_t* out) {
+    uint8_t mask_bytes[16];
+    shuffle_mask(params, mask_bytes);
+    const __m256i mask = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)mask_bytes));
+    const __m256i scale = _mm256_set1_epi16((short)params.scale);
+    const __m256i zero = _mm256_setzero_si256();
+
+    uint32_t i = 0;
+    for (; i + 11 <= n; i += 10) {
+        const uint8_t* src = block + i * 3;
+        __m256i v = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)src)),
+            _mm_loadu_si128((const __m128i*)(src + 15)),
+            1);
+        v = _mm256_shuffle_epi8(v, mask);
+        if (!params.full_brightness) {
+            __m256i lo = _mm256_mulhi_epu16(_mm256_unpacklo_epi8(v, zero), scale);
+            __m256i hi = _mm256_mulhi_epu16(_mm256_unpackhi_epi8(v, zero), scale);
+            v = _mm256_packus_epi16(lo, hi);
+        }
+        _mm_storeu_si128((__m128i*)(out + i * 3), _mm256_castsi256_si128(v));
+        _mm_storeu_si128((__m128i*)(out + i * 3 + 15), _mm256_extracti128_si256(v, 1));
+    }
+    return i;
+}
+
+#endif
+
+pack_impl best_pack_impl() {
+#ifdef PACK_KERNEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return PACK_AVX2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return PACK_SSSE3;
+    }
+#endif
+    return PACK_SCALAR;
+}
+
+const char* pack_impl_name(pack_impl impl) {
+    switch (impl) {
+        case PACK_AVX2: return "avx2";
+        case PACK_SSSE3: return "ssse3";
+        default: return "scalar";
+    }
+}
+
+void pack_pixels(pack_impl impl,
+                 const uint8_t* canvas,
+                 const uint32_t* gather,
+                 uint32_t num_leds,
+                 const PackParams& params,
+                 uint8_t* out) {
+    uint8_t block[BLOCK_LEDS * 3 + BLOCK_PADDING];
+    for (uint32_t start = 0; start < num_leds; start += BLOCK_LEDS) {
+        uint32_t n = std::min(BLOCK_LEDS, num_leds - start);
+        gather_block(canvas, gather + start, n, block);
+
+        uint8_t* block_out = out + start * 3;
+        uint32_t done = 0;
+#ifdef PACK_KERNEL_X86
+        if (impl == PACK_AVX2 && params.linear) {
+            done = convert_avx2(block, n, params, block_out);
+        }
+        if (impl >= PACK_SSSE3 && params.linear) {
+            done += convert_ssse3(block + done * 3, n - done, params, block_out + done * 3);
+        }
+#endif
+        convert_scalar(block + done * 3, n - done, params, block_out + done * 3);
+    }
+}
+
+void pack_pixels(const uint8_t* canvas,
+                 const uint32_t* gather,
+                 uint32_t num_leds,
+                 const PackParams& params,
+                 uint8_t* out) {
+    static const pack_impl impl = best_pack_impl();
+    pack_pixels(impl, canvas, gather, num_leds, params, out);
+}
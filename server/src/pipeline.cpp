@@ -0,0 +1,190 @@
+#include "pipeline.hpp"
+#include "alloc-count.hpp"
+#include "canvas.hpp"
+#include "client.hpp"
+#include "tcp.hpp"
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+FramePipeline::FramePipeline(VirtualCanvas& canvas,
+                             LEDTCPServer& tcp_server,
+                             size_t depth,
+                             latch_mode latch,
+                             int64_t ns_per_frame,
+                             StageTimer& latch_spread_timer,
+                             SenderPool& sender_pool)
+    : event_timer("event/decode"),
+      composite_timer("composite"),
+      pack_timer("pack/encode"),
+      send_timer("send"),
+      deadline_to_wire_timer("deadline-to-wire"),
+      canvas(canvas),
+      tcp_server(tcp_server),
+      depth(depth),
+      latch(latch),
+      ns_per_frame(ns_per_frame),
+      latch_spread_timer(latch_spread_timer),
+      sender_pool(sender_pool),
+      next_seq(0),
+      layer_queue(depth),
+      composed_queue(depth),
+      packed_queue(depth),
+      latest_mut(),
+      latest_composite(),
+      composite_thread(NULL),
+      pack_thread(NULL),
+      send_thread(NULL),
+      pack_conns(),
+      send_conns(),
+      sent_to(),
+      send_jobs(),
+      send_work()
+{
+    // With LATCH_IMMEDIATE clients show each frame on arrival, so there is no
+    // redraw to send alongside it.
+    this->send_work = [this](SendJob& job, const Frame& frame) {
+        this->tcp_server.send_frame(job.client, job.socket, job.buf, job.size, frame.seq, frame.deadline);
+    };
+}
+
+void FramePipeline::start() {
+    this->composite_thread = new std::thread(&FramePipeline::composite_loop, this);
+    this->pack_thread = new std::thread(&FramePipeline::pack_loop, this);
+    this->send_thread = new std::thread(&FramePipeline::send_loop, this);
+}
+
+// Closing the first queue lets each stage drain what it already has and then
+// close the queue after it, so frames in flight still reach the wire.
+void FramePipeline::stop() {
+    this->layer_queue.close();
+    for (std::thread* t : {this->composite_thread, this->pack_thread, this->send_thread}) {
+        if (t) {
+            t->join();
+            delete t;
+        }
+    }
+    this->composite_thread = NULL;
+    this->pack_thread = NULL;
+    this->send_thread = NULL;
+}
+
+// Called from the frame thread once the events for a tick have run. Blocks
+// while the pipeline is `depth` frames behind.
+bool FramePipeline::submit(std::vector<CanvasLayer> layers, FrameTick tick) {
+    this->event_timer.record(tick.woke, std::chrono::steady_clock::now());
+    LayerFrame frame = {this->next_seq++, tick.deadline, std::move(layers)};
+    return this->layer_queue.push(std::move(frame));
+}
+
+cv::Mat FramePipeline::getLatestComposite() {
+    std::lock_guard<std::mutex> lock(this->latest_mut);
+    return this->latest_composite;
+}
+
+void FramePipeline::print_stats(std::ostream& out) {
+    out << "Pipeline depth " << this->depth << ", "
+        << "queued (layers/composed/packed): "
+        << this->layer_queue.size() << "/"
+        << this->composed_queue.size() << "/"
+        << this->packed_queue.size() << "\n";
+    for (StageTimer* t : {&this->event_timer,
+                          &this->composite_timer,
+                          &this->pack_timer,
+                          &this->send_timer,
+                          &this->deadline_to_wire_timer}) {
+        out << "  " << t->to_string() << "\n";
+    }
+}
+
+void FramePipeline::composite_loop() {
+    std::optional<LayerFrame> frame_opt = this->layer_queue.pop();
+    while (frame_opt.has_value()) {
+        LayerFrame& frame = frame_opt.value();
+        ns_ts start = std::chrono::steady_clock::now();
+
+        // Every frame gets a fresh matrix, later stages may still be reading
+        // the previous one.
+        cv::Mat pixels = cv::Mat::zeros(this->canvas.dim, CV_8UC3);
+        this->canvas.composeLayers(frame.layers, pixels);
+
+        this->latest_mut.lock();
+        this->latest_composite = pixels;
+        this->latest_mut.unlock();
+
+        this->composite_timer.record(start, std::chrono::steady_clock::now());
+        this->composed_queue.push(std::make_shared<const Frame>(frame.seq, frame.deadline, pixels));
+        frame_opt = this->layer_queue.pop();
+    }
+    this->composed_queue.close();
+}
+
+void FramePipeline::pack_loop() {
+    std::optional<FrameHandle> frame_opt = this->composed_queue.pop();
+    while (frame_opt.has_value()) {
+        FrameHandle frame = frame_opt.value();
+        ns_ts start = std::chrono::steady_clock::now();
+
+        const ConnSnapshot& conns = this->tcp_server.conn_info->snapshot(this->pack_conns);
+
+        PackedFrame packed = {frame, {}};
+        packed.messages.reserve(conns.connected.size());
+        for (auto it : conns.connected) {
+            uint32_t size;
+            uint8_t* buf = this->tcp_server.pack_leds(it.first, *frame, this->latch, &size);
+            packed.messages.push_back((PackedMessage){it.first, buf, size});
+        }
+
+        this->pack_timer.record(start, std::chrono::steady_clock::now());
+        this->packed_queue.push(std::move(packed));
+        frame_opt = this->composed_queue.pop();
+    }
+    this->packed_queue.close();
+}
+
+void FramePipeline::send_loop() {
+    std::optional<PackedFrame> frame_opt = this->packed_queue.pop();
+    while (frame_opt.has_value()) {
+        PackedFrame& packed = frame_opt.value();
+        const Frame& frame = *packed.frame;
+        ns_ts start = std::chrono::steady_clock::now();
+
+        // The socket is looked up at send time rather than pack time, the
+        // client may have reconnected while the frame was in flight.
+        uint64_t allocs_before = thread_alloc_count();
+        const ConnSnapshot& conns = this->tcp_server.conn_info->snapshot(this->send_conns);
+        this->sent_to.clear();
+        this->send_jobs.clear();
+        for (PackedMessage& msg : packed.messages) {
+            std::optional<int> socket_opt = conns.socket(msg.client);
+            if (socket_opt.has_value() && msg.buf) {
+                int client_socket = socket_opt.value();
+                this->sent_to.push_back(std::make_pair(msg.client, client_socket));
+                this->send_jobs.push_back((SendJob){msg.client, client_socket, msg.size, msg.buf, msg.size});
+            } else {
+                this->tcp_server.release_leds(msg.client, msg.buf);
+            }
+        }
+        // Each job hands its buffer to the client's send queue.
+        uint64_t worker_allocs = this->sender_pool.run(this->send_jobs, frame, this->send_work);
+        this->tcp_server.submit_sends();
+        this->sender_pool.record_allocs(thread_alloc_count() - allocs_before + worker_allocs);
+
+        ns_ts end = std::chrono::steady_clock::now();
+        this->send_timer.record(start, end);
+        this->deadline_to_wire_timer.record(frame.deadline, end);
+
+        // Pixels were only loaded; show them everywhere at once when the next
+        // frame is due. A redraw queues behind its frame on each socket, so
+        // every client has applied the frame before it latches.
+        if (this->latch == LATCH_SYNCHRONIZED && !this->sent_to.empty()) {
+            std::this_thread::sleep_until(frame.deadline + ns_dur(this->ns_per_frame));
+            this->latch_spread_timer.record_ns(this->tcp_server.redraw_batch(this->sent_to));
+        }
+        frame_opt = this->packed_queue.pop();
+    }
+}
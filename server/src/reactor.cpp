@@ -0,0 +1,84 @@
+#include "reactor.hpp"
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+const int MAX_EVENTS = 64;
+
+Reactor::Reactor()
+    : epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+      running(false),
+      handlers()
+{
+    if (this->epoll_fd == -1) {
+        std::cerr << "epoll_create1 failed: " << strerror(errno) << "\n";
+    }
+}
+
+Reactor::~Reactor() {
+    close(this->epoll_fd);
+}
+
+// Watches fd, replacing the handler if it is already watched.
+bool Reactor::add(int fd, uint32_t events, std::function<void(uint32_t)> handler) {
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        if (errno != EEXIST || epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+            std::cerr << "Failed to watch fd " << fd << ": " << strerror(errno) << "\n";
+            return false;
+        }
+    }
+    this->handlers[fd] = handler;
+    return true;
+}
+
+// Closed descriptors leave the epoll set on their own, so a failure here is
+// not an error.
+void Reactor::remove(int fd) {
+    epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    this->handlers.erase(fd);
+}
+
+// Changes the events watched for on fd. It leaves the handlers alone, so
+// unlike add it is safe from any thread.
+bool Reactor::modify(int fd, uint32_t events) {
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+// Blocks in epoll_wait until a watched descriptor is ready, so an idle server
+// sleeps instead of polling.
+void Reactor::run() {
+    struct epoll_event events[MAX_EVENTS];
+    this->running = true;
+    while (this->running) {
+        int n = epoll_wait(this->epoll_fd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno != EINTR) {
+                std::cerr << "epoll_wait failed: " << strerror(errno) << "\n";
+                return;
+            }
+            continue;
+        }
+        for (int i = 0; i < n && this->running; ++i) {
+            // An earlier handler in this batch may have removed the fd.
+            auto it = this->handlers.find(events[i].data.fd);
+            if (it == this->handlers.end()) {
+                continue;
+            }
+            std::function<void(uint32_t)> handler = it->second;
+            handler(events[i].events);
+        }
+    }
+}
+
+void Reactor::stop() {
+    this->running = false;
+}
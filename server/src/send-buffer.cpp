@@ -0,0 +1,115 @@
+#include "send-buffer.hpp"
+#include "client.hpp"
+#include "protocol.hpp"
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// Each buffer is preceded by how many times it is held, in a block big
+// enough to leave the buffer as aligned as malloc made it.
+const size_t REFS_SIZE = 16;
+
+static std::atomic<uint32_t>* refs(uint8_t* buf) {
+    return (std::atomic<uint32_t>*)(buf - REFS_SIZE);
+}
+
+SendBufferPool::SendBufferPool(const Client* c)
+    : entries_size(0),
+      capacity(0),
+      misses(0),
+      mut(),
+      free_buffers()
+{
+    for (const MatricesConnection& conn : c->mat_connections) {
+        this->entries_size += sizeof(LedsBatchEntryHeader) + conn.gather.size() * 3;
+    }
+    // Room for either message header and a present-at time.
+    this->capacity = sizeof(SetLedsFrameMessage) + this->entries_size + sizeof(uint64_t);
+    this->free_buffers.reserve(8);
+}
+
+uint8_t* SendBufferPool::allocate() {
+    uint8_t* block = (uint8_t*)malloc(REFS_SIZE + this->capacity);
+    if (!block) {
+        return NULL;
+    }
+    new (block) std::atomic<uint32_t>(0);
+    return block + REFS_SIZE;
+}
+
+void SendBufferPool::prime() {
+    std::lock_guard<std::mutex> lock(this->mut);
+    if (this->free_buffers.empty()) {
+        uint8_t* buf = this->allocate();
+        if (buf) {
+            this->free_buffers.push_back(buf);
+        }
+    }
+}
+
+uint8_t* SendBufferPool::acquire() {
+    uint8_t* buf = NULL;
+    {
+        std::lock_guard<std::mutex> lock(this->mut);
+        if (!this->free_buffers.empty()) {
+            buf = this->free_buffers.back();
+            this->free_buffers.pop_back();
+        }
+    }
+    if (!buf) {
+        this->misses++;
+        buf = this->allocate();
+        if (!buf) {
+            return NULL;
+        }
+    }
+    refs(buf)->store(1);
+    return buf;
+}
+
+void SendBufferPool::retain(uint8_t* buf) {
+    refs(buf)->fetch_add(1);
+}
+
+void SendBufferPool::release(uint8_t* buf) {
+    if (!buf || refs(buf)->fetch_sub(1) != 1) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(this->mut);
+    this->free_buffers.push_back(buf);
+}
+
+LastFrame::LastFrame(SendBufferPool* buffers)
+    : buffers(buffers),
+      mut(),
+      buf(NULL),
+      entries(NULL),
+      seq(0)
+{}
+
+void LastFrame::store(uint8_t* buf, const uint8_t* entries, uint32_t seq) {
+    this->buffers->retain(buf);
+    uint8_t* old;
+    {
+        std::lock_guard<std::mutex> lock(this->mut);
+        old = this->buf;
+        this->buf = buf;
+        this->entries = entries;
+        this->seq = seq;
+    }
+    this->buffers->release(old);
+}
+
+uint8_t* LastFrame::take(const uint8_t** entries, uint32_t* seq) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    if (!this->buf) {
+        return NULL;
+    }
+    this->buffers->retain(this->buf);
+    *entries = this->entries;
+    *seq = this->seq;
+    return this->buf;
+}
@@ -0,0 +1,401 @@
+#include "send-queue.hpp"
+#include "reactor.hpp"
+#include "send-buffer.hpp"
+#include "protocol.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+const uint32_t CLIENT_EVENTS = EPOLLIN | EPOLLRDHUP;
+
+// The frame_seq of a SetLedsFrame, SetLedsDelta, SetLedsCompressed or
+// SetLedsQuantized message.
+static bool frame_seq(const uint8_t* buf, uint32_t* seq) {
+    switch (get_message_op_code(buf)) {
+        case OP_SET_LEDS_FRAME:
+            *seq = ((const SetLedsFrameMessage*)buf)->frame_seq;
+            return true;
+        case OP_SET_LEDS_DELTA:
+            *seq = ((const SetLedsDeltaMessage*)buf)->frame_seq;
+            return true;
+        case OP_SET_LEDS_COMPRESSED:
+            *seq = ((const SetLedsCompressedMessage*)buf)->frame_seq;
+            return true;
+        case OP_SET_LEDS_QUANTIZED:
+            *seq = ((const SetLedsQuantizedMessage*)buf)->frame_seq;
+            return true;
+        default:
+            return false;
+    }
+}
+
+const uint8_t* QueuedMessage::bytes() const {
+    return this->buf ? this->buf : this->control;
+}
+
+ClientSendQueue::ClientSendQueue(SendBufferPool* buffers, FrameAckTracker* acks)
+    : dropped_frames(0),
+      stalls(0),
+      keyframe_wanted(true),
+      buffers(buffers),
+      acks(acks),
+      reactor(NULL),
+      uring(NULL),
+      mut(),
+      socket(-1),
+      conn_id(0),
+      waiting(false),
+      sent_seq_valid(false),
+      sent_seq(0),
+      messages(),
+      inflight(),
+      inflight_count(0),
+      inflight_conn(0),
+      closing_socket(-1),
+      inflight_iov(),
+      inflight_hdr()
+{
+    this->messages.reserve(8);
+}
+
+void ClientSendQueue::open(int socket) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    this->close_locked();
+    this->socket = socket;
+    this->keyframe_wanted = true;
+}
+
+bool ClientSendQueue::close(int socket) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    if (socket != this->socket) {
+        return false;
+    }
+    this->close_locked();
+    return true;
+}
+
+void ClientSendQueue::watch(Reactor* reactor) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    this->reactor = reactor;
+    // Re-adding the socket to the reactor reset its events.
+    if (this->waiting && this->socket != -1) {
+        this->reactor->modify(this->socket, CLIENT_EVENTS | EPOLLOUT);
+    }
+}
+
+bool ClientSendQueue::push_frame(int socket, uint8_t* buf, uint32_t size) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    if (socket != this->socket) {
+        this->buffers->release(buf);
+        return true;
+    }
+
+    // Frames that haven't started sending are stale now.
+    for (size_t i = 0; i < this->messages.size();) {
+        QueuedMessage& msg = this->messages[i];
+        if (msg.buf && msg.sent == 0) {
+            this->buffers->release(msg.buf);
+            this->messages.erase(this->messages.begin() + i);
+            this->dropped_frames++;
+        } else {
+            ++i;
+        }
+    }
+
+    // A delta only applies on top of the frame before it reaching the client.
+    if (get_message_op_code(buf) == OP_SET_LEDS_DELTA) {
+        uint32_t kept_seq;
+        if (!this->last_kept_seq_locked(&kept_seq) ||
+            ((const SetLedsDeltaMessage*)buf)->base_seq != kept_seq) {
+            this->buffers->release(buf);
+            this->dropped_frames++;
+            this->keyframe_wanted = true;
+            return true;
+        }
+    }
+
+    QueuedMessage msg;
+    msg.buf = buf;
+    msg.size = size;
+    msg.sent = 0;
+    this->messages.push_back(msg);
+    return this->flush_locked();
+}
+
+bool ClientSendQueue::push_control(int socket, const void* data, uint32_t size) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    if (socket != this->socket || size > sizeof(QueuedMessage::control)) {
+        return true;
+    }
+    // Each kind of control message has one slot: one that hasn't started
+    // sending is superseded by this one, which goes behind whatever frame it
+    // follows. A TimePong carries newer times and a redraw latches whatever
+    // frame came before it, so nothing is lost, and the queue can't grow
+    // while the socket is backed up.
+    uint8_t op_code = get_message_op_code((const uint8_t*)data);
+    for (size_t i = 0; i < this->messages.size(); ++i) {
+        QueuedMessage& msg = this->messages[i];
+        if (!msg.buf && msg.sent == 0 && get_message_op_code(msg.control) == op_code) {
+            this->messages.erase(this->messages.begin() + i);
+            break;
+        }
+    }
+
+    QueuedMessage msg;
+    msg.buf = NULL;
+    memcpy(msg.control, data, size);
+    msg.size = size;
+    msg.sent = 0;
+    this->messages.push_back(msg);
+    return this->flush_locked();
+}
+
+bool ClientSendQueue::flush(int socket) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    if (socket != this->socket) {
+        return true;
+    }
+    // The ring only finds out the socket is full by trying, so the next
+    // write has to be scheduled before anything says it drained.
+    if (this->uring) {
+        this->set_waiting_locked(false);
+    }
+    return this->flush_locked();
+}
+
+void ClientSendQueue::use_uring(UringSender* uring) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    this->uring = uring;
+}
+
+bool ClientSendQueue::complete(int res) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    if (this->inflight_conn != this->conn_id) {
+        // The socket was closed while the write was in flight.
+        for (size_t i = 0; i < this->inflight_count; ++i) {
+            this->buffers->release(this->inflight[i].buf);
+        }
+        this->inflight_count = 0;
+        if (this->closing_socket != -1) {
+            ::close(this->closing_socket);
+            this->closing_socket = -1;
+        }
+        return true;
+    }
+    if (res == -EAGAIN || res == -EWOULDBLOCK || res == -EINTR) {
+        this->requeue_inflight_locked();
+        if (res != -EINTR) {
+            if (!this->waiting) {
+                this->stalls++;
+            }
+            this->set_waiting_locked(true);
+            return true;
+        }
+        return this->flush_locked();
+    }
+    if (res < 0) {
+        std::cout << "Error sending: " << strerror(-res) << "\n";
+        this->requeue_inflight_locked();
+        this->close_locked();
+        return false;
+    }
+
+    uint32_t sent = res;
+    for (size_t i = 0; i < this->inflight_count && sent > 0; ++i) {
+        QueuedMessage& msg = this->inflight[i];
+        uint32_t len = std::min(sent, msg.size - msg.sent);
+        msg.sent += len;
+        sent -= len;
+    }
+    this->requeue_inflight_locked();
+    return this->flush_locked();
+}
+
+void ClientSendQueue::release() {
+    std::lock_guard<std::mutex> lock(this->mut);
+    this->drop_locked();
+    this->socket = -1;
+    this->conn_id++;
+}
+
+size_t ClientSendQueue::queued() {
+    std::lock_guard<std::mutex> lock(this->mut);
+    return this->messages.size() + this->inflight_count;
+}
+
+bool ClientSendQueue::take_keyframe_request() {
+    return this->keyframe_wanted.exchange(false);
+}
+
+// The sequence number of the newest frame that is queued, in flight or was
+// written.
+bool ClientSendQueue::last_kept_seq_locked(uint32_t* seq) {
+    for (auto it = this->messages.rbegin(); it != this->messages.rend(); ++it) {
+        if (it->buf) {
+            return frame_seq(it->buf, seq);
+        }
+    }
+    for (size_t i = this->inflight_count; i > 0; --i) {
+        if (this->inflight[i - 1].buf) {
+            return frame_seq(this->inflight[i - 1].buf, seq);
+        }
+    }
+    *seq = this->sent_seq;
+    return this->sent_seq_valid;
+}
+
+// Writes queued messages in order until the queue is empty or the socket is
+// full. Everything queued goes to one sendmsg, so a frame and the redraw
+// behind it leave in the same write. On an error other than a full socket,
+// the socket is closed and false returned.
+bool ClientSendQueue::flush_locked() {
+    if (this->uring) {
+        this->schedule_locked();
+        return true;
+    }
+    while (!this->messages.empty()) {
+        iovec iov[MAX_FLUSH_IOV];
+        size_t count = std::min(this->messages.size(), MAX_FLUSH_IOV);
+        for (size_t i = 0; i < count; ++i) {
+            QueuedMessage& msg = this->messages[i];
+            iov[i].iov_base = (void*)(msg.bytes() + msg.sent);
+            iov[i].iov_len = msg.size - msg.sent;
+        }
+        msghdr hdr = {};
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = count;
+        ssize_t sent = sendmsg(this->socket, &hdr, MSG_NOSIGNAL);
+        if (sent > 0) {
+            size_t done = 0;
+            for (; done < count && sent > 0; ++done) {
+                QueuedMessage& msg = this->messages[done];
+                uint32_t len = std::min<uint64_t>(sent, msg.size - msg.sent);
+                msg.sent += len;
+                sent -= len;
+                if (msg.sent < msg.size) {
+                    break;
+                }
+                if (msg.buf) {
+                    this->frame_written_locked(msg.buf);
+                }
+                this->buffers->release(msg.buf);
+            }
+            this->messages.erase(this->messages.begin(), this->messages.begin() + done);
+            continue;
+        }
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!this->waiting) {
+                this->stalls++;
+            }
+            this->set_waiting_locked(true);
+            return true;
+        }
+        std::cout << "Error sending: " << strerror(errno) << "\n";
+        this->close_locked();
+        return false;
+    }
+    this->set_waiting_locked(false);
+    return true;
+}
+
+// Moves the front of the queue into the in-flight batch and schedules it on
+// the ring, unless a write is already in flight or the socket is full. The
+// caller submits.
+void ClientSendQueue::schedule_locked() {
+    if (this->inflight_count > 0 || this->socket == -1 || this->waiting) {
+        return;
+    }
+    if (this->messages.empty()) {
+        return;
+    }
+    size_t count = std::min(this->messages.size(), MAX_FLUSH_IOV);
+    for (size_t i = 0; i < count; ++i) {
+        this->inflight[i] = this->messages[i];
+        QueuedMessage& msg = this->inflight[i];
+        this->inflight_iov[i].iov_base = (void*)(msg.bytes() + msg.sent);
+        this->inflight_iov[i].iov_len = msg.size - msg.sent;
+    }
+    this->messages.erase(this->messages.begin(), this->messages.begin() + count);
+    this->inflight_count = count;
+    this->inflight_conn = this->conn_id;
+    this->inflight_hdr = {};
+    this->inflight_hdr.msg_iov = this->inflight_iov;
+    this->inflight_hdr.msg_iovlen = count;
+    this->uring->schedule(this, this->socket, &this->inflight_hdr);
+}
+
+// Releases the in-flight messages that were written in full and puts the
+// rest back at the front of the queue, where they can be dropped or written
+// again like any other.
+void ClientSendQueue::requeue_inflight_locked() {
+    size_t done = 0;
+    for (; done < this->inflight_count; ++done) {
+        QueuedMessage& msg = this->inflight[done];
+        if (msg.sent < msg.size) {
+            break;
+        }
+        if (msg.buf) {
+            this->frame_written_locked(msg.buf);
+        }
+        this->buffers->release(msg.buf);
+    }
+    this->messages.insert(this->messages.begin(), this->inflight + done, this->inflight + this->inflight_count);
+    this->inflight_count = 0;
+}
+
+void ClientSendQueue::frame_written_locked(const uint8_t* buf) {
+    this->sent_seq_valid = frame_seq(buf, &this->sent_seq);
+    if (this->sent_seq_valid && this->acks) {
+        this->acks->written(this->sent_seq, std::chrono::steady_clock::now());
+    }
+}
+
+void ClientSendQueue::drop_locked() {
+    for (QueuedMessage& msg : this->messages) {
+        this->buffers->release(msg.buf);
+    }
+    this->messages.clear();
+}
+
+void ClientSendQueue::set_waiting_locked(bool waiting) {
+    if (waiting == this->waiting) {
+        return;
+    }
+    this->waiting = waiting;
+    if (this->reactor) {
+        this->reactor->modify(this->socket, CLIENT_EVENTS | (waiting ? EPOLLOUT : 0));
+    }
+}
+
+void ClientSendQueue::close_locked() {
+    this->drop_locked();
+    if (this->socket != -1) {
+        if (this->inflight_count > 0 && this->inflight_conn == this->conn_id) {
+            // The ring looks the socket up by number when the write is
+            // submitted, which may not have happened yet, so closing it now
+            // could send the write to whichever connection gets the number
+            // next. Shut it down to have the write fail, and close it once
+            // the write's completion is reaped.
+            shutdown(this->socket, SHUT_RDWR);
+            this->closing_socket = this->socket;
+        } else {
+            ::close(this->socket);
+        }
+    }
+    this->socket = -1;
+    this->conn_id++;
+    this->waiting = false;
+    this->sent_seq_valid = false;
+}
@@ -0,0 +1,202 @@
+#include "sender-pool.hpp"
+#include "alloc-count.hpp"
+#include "client.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+ClientSendStats::ClientSendStats(std::string name)
+    : deadline_to_wire(name),
+      late(0),
+      last_seq(0)
+{}
+
+SenderPool::SenderPool(std::vector<Client*> clients, size_t num_workers, int64_t ns_per_frame)
+    : frame_timer("send (all clients)"),
+      last_frame_allocs(0),
+      allocating_frames(0),
+      num_workers(num_workers),
+      ns_per_frame(ns_per_frame),
+      client_stats(),
+      workers(),
+      order(),
+      assigned(num_workers),
+      load(num_workers),
+      current_deadline(),
+      current_seq(0),
+      current_frame(NULL),
+      current_work(NULL),
+      mut(),
+      work_cond(),
+      done_cond(),
+      generation(0),
+      used(0),
+      outstanding(0),
+      stopping(false),
+      worker_allocs(0)
+{
+    for (Client* c : clients) {
+        std::stringstream name;
+        name << "client " << std::hex << std::setw(12) << std::setfill('0') << c->mac_addr;
+        name << " deadline-to-wire";
+        this->client_stats[c] = new ClientSendStats(name.str());
+    }
+    this->order.reserve(clients.size());
+    for (std::vector<SendJob*>& jobs : this->assigned) {
+        jobs.reserve(clients.size());
+    }
+}
+
+void SenderPool::start() {
+    this->stopping = false;
+    for (size_t i = 0; i < this->num_workers; ++i) {
+        this->workers.push_back(new std::thread(&SenderPool::worker_loop, this, i));
+    }
+}
+
+void SenderPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(this->mut);
+        this->stopping = true;
+    }
+    this->work_cond.notify_all();
+    for (std::thread* t : this->workers) {
+        t->join();
+        delete t;
+    }
+    this->workers.clear();
+}
+
+// The number of bytes of pixel data the client is sent each frame.
+uint64_t SenderPool::payload_weight(const Client* c) {
+    uint64_t weight = 0;
+    for (const MatricesConnection& conn : c->mat_connections) {
+        for (LEDMatrix* mat : conn.matrices) {
+            weight += mat->packed_pixel_array_size;
+        }
+    }
+    return weight;
+}
+
+uint64_t SenderPool::run(std::vector<SendJob>& jobs, const Frame& frame, const SendWork& work) {
+    if (jobs.empty()) {
+        return 0;
+    }
+    ns_ts start = std::chrono::steady_clock::now();
+    this->current_deadline = frame.deadline;
+    this->current_seq = frame.seq;
+    this->current_frame = &frame;
+    this->current_work = &work;
+
+    if (this->workers.empty() || jobs.size() == 1) {
+        for (SendJob& job : jobs) {
+            this->run_job(job);
+        }
+        this->frame_timer.record(start, std::chrono::steady_clock::now());
+        return 0;
+    }
+
+    // Longest processing time first: hand the heaviest remaining job to the
+    // worker with the least work so far.
+    this->order.clear();
+    for (SendJob& job : jobs) {
+        this->order.push_back(&job);
+    }
+    std::sort(this->order.begin(), this->order.end(), [](const SendJob* a, const SendJob* b) {
+        return a->weight > b->weight;
+    });
+    size_t used = std::min(this->workers.size(), this->order.size());
+    for (size_t i = 0; i < used; ++i) {
+        this->assigned[i].clear();
+        this->load[i] = 0;
+    }
+    for (SendJob* job : this->order) {
+        size_t least = std::min_element(this->load.begin(), this->load.begin() + used) - this->load.begin();
+        this->assigned[least].push_back(job);
+        this->load[least] += job->weight;
+    }
+
+    std::unique_lock<std::mutex> lock(this->mut);
+    this->used = used;
+    this->outstanding = used;
+    this->worker_allocs = 0;
+    this->generation++;
+    this->work_cond.notify_all();
+    this->done_cond.wait(lock, [this] { return this->outstanding == 0; });
+    this->frame_timer.record(start, std::chrono::steady_clock::now());
+    return this->worker_allocs;
+}
+
+void SenderPool::record_allocs(uint64_t allocs) {
+    this->last_frame_allocs = allocs;
+    if (allocs > 0) {
+        this->allocating_frames++;
+    }
+}
+
+void SenderPool::run_job(SendJob& job) {
+    (*this->current_work)(job, *this->current_frame);
+
+    auto stats_it = this->client_stats.find(job.client);
+    if (stats_it == this->client_stats.end()) {
+        return;
+    }
+    ns_ts end = std::chrono::steady_clock::now();
+    ClientSendStats* stats = stats_it->second;
+    stats->deadline_to_wire.record(this->current_deadline, end);
+    stats->last_seq = this->current_seq;
+    if (end > this->current_deadline + ns_dur(this->ns_per_frame)) {
+        stats->late++;
+    }
+}
+
+void SenderPool::worker_loop(size_t index) {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(this->mut);
+    while (true) {
+        this->work_cond.wait(lock, [this, seen] { return this->stopping || this->generation != seen; });
+        if (this->stopping) {
+            return;
+        }
+        seen = this->generation;
+        if (index >= this->used) {
+            continue;
+        }
+        // run() doesn't touch the assignment again until outstanding drops
+        // to zero, so it can be read without the lock.
+        lock.unlock();
+        uint64_t allocs_before = thread_alloc_count();
+        for (SendJob* job : this->assigned[index]) {
+            this->run_job(*job);
+        }
+        uint64_t allocs = thread_alloc_count() - allocs_before;
+        lock.lock();
+        this->worker_allocs += allocs;
+        if (--this->outstanding == 0) {
+            this->done_cond.notify_one();
+        }
+    }
+}
+
+void SenderPool::print_stats(std::ostream& out) {
+    out << "Sender pool: " << this->num_workers << " workers\n";
+    out << "  " << this->frame_timer.to_string() << "\n";
+    for (auto it : this->client_stats) {
+        ClientSendStats* stats = it.second;
+        if (stats->deadline_to_wire.count.load() == 0) {
+            continue;
+        }
+        out << "  " << stats->deadline_to_wire.to_string()
+            << ", " << stats->late.load() << " late"
+            << ", last frame " << stats->last_seq.load() << "\n";
+    }
+    if (alloc_counting()) {
+        out << "  send path allocations: " << this->last_frame_allocs.load()
+            << " last frame, " << this->allocating_frames.load() << " frames allocated\n";
+    }
+}
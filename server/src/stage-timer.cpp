@@ -0,0 +1,39 @@
+#include "stage-timer.hpp"
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+StageTimer::StageTimer(std::string name)
+    : name(name),
+      count(0),
+      total_ns(0),
+      max_ns(0),
+      last_ns(0)
+{}
+
+void StageTimer::record(ns_ts start, ns_ts end) {
+    this->record_ns(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+}
+
+void StageTimer::record_ns(int64_t ns) {
+    this->count++;
+    this->total_ns += ns;
+    this->last_ns = ns;
+    int64_t prev_max = this->max_ns.load();
+    while (ns > prev_max && !this->max_ns.compare_exchange_weak(prev_max, ns)) {}
+}
+
+std::string StageTimer::to_string() {
+    int64_t n = this->count.load();
+    double avg_ms = n > 0 ? (double)this->total_ns.load() / n / 1e6 : 0.0;
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(3);
+    ss << this->name << ": ";
+    ss << "avg " << avg_ms << " ms, ";
+    ss << "max " << this->max_ns.load() / 1e6 << " ms, ";
+    ss << "last " << this->last_ns.load() / 1e6 << " ms ";
+    ss << "(" << n << " frames)";
+    return ss.str();
+}
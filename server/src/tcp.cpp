@@ -1,6 +1,7 @@
 #include "tcp.hpp"
 #include "canvas.hpp"
 #include "client.hpp"
+#include <algorithm>
 #include <cstdint>
 #include <cstdio>
 #include <iostream>
@@ -12,101 +13,26 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <unistd.h>
-#include <fcntl.h>
+#include <iomanip>
 #include <cstring>
 #include <map>
+#include <memory>
 #include <thread>
 #include <utility>
-#include <poll.h>
+#include <chrono>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <vector>
 #include "opencv2/core.hpp"
+#include "pack-kernel.hpp"
 #include "protocol.hpp"
 
-const int MAX_WAITING_CLIENTS = 256;
+// Larger than anything a client sends, so a bad size isn't waited on forever.
+const uint32_t MAX_CLIENT_MESSAGE_SIZE = 1 << 16;
 
 void handle_conns(int socket, LEDTCPServer* server) {
-
-    listen(socket, MAX_WAITING_CLIENTS);
-
-    std::map<uint64_t, const Client*> mac_to_client;
-
-    std::vector<const Client*> clients;
-    server->conn_info->getAllDisconnected(clients);
-    for (auto c : clients) {
-        mac_to_client[c->mac_addr] = c;
-    }
-
-    while (1) {
-        int client_socket = accept(socket, NULL, NULL);
-        int flags = fcntl(client_socket, F_GETFL, 0);
-        if (flags == -1) {
-            close(client_socket);
-            continue;
-        }
-        if (fcntl(client_socket, F_SETFL, flags | O_NONBLOCK) == -1) {
-            close(client_socket);
-            continue;
-        }
-        CheckInMessage msg;
-        MessageHeader* header = &msg.header;
-        *header = server->tcp_recv_header(client_socket);
-        if (msg.header.op_code != OP_CHECK_IN || msg.header.size != sizeof(CheckInMessage)) {
-            std::cerr << "Expected check-in message, got invalid op-code or message size.\n";
-            close(client_socket);
-            continue;
-        }
-        server->tcp_recv(client_socket,
-                         &(msg.mac_address),
-                         sizeof(msg) - sizeof(MessageHeader));
-        uint64_t mac_addr = 0;
-        std::cout << &(msg.mac_address) << "," << &msg + sizeof(MessageHeader) << "," << &msg << "," << sizeof(MessageHeader) << "\n";
-        memcpy(&mac_addr, &(msg.mac_address), 6);
-
-        // if c is the value representing the end of the iterator, it is not present
-        std::cout << "Got message from " << mac_addr << "\n";
-        auto it = mac_to_client.find(mac_addr);
-        if (!(it == mac_to_client.end())) {
-            const Client* c = it->second;
-
-            // If the client reconnects before its old socket has disconnected,
-            // close the old socket and mark the client as disconnected.
-            auto socket_opt = server->conn_info->getSocket(c);
-            if (socket_opt.has_value()) {
-                int socket = socket_opt.value();
-                server->conn_info->setDisconnected(c);
-                close(socket);
-            }
-
-            std::cout << "Accepted client\n";
-            std::cout << "socket: " << client_socket << "\n";
-
-            uint8_t num_pins = c->mat_connections.size();
-            std::vector<PinInfo> pin_info;
-            for (MatricesConnection conn : c->mat_connections) {
-                uint32_t max_leds = 0;
-                for (LEDMatrix* mat : conn.matrices) {
-                    max_leds += mat->spec->width * mat->spec->height;
-                }
-                pin_info.push_back((PinInfo){
-                        conn.pin,
-                        COLOR_ORDER_GRB,
-                        max_leds,
-                        LED_TYPE_WS2811
-                    });
-            }
-            const PinInfo* inf = pin_info.data();
-            uint32_t out_size;
-            uint8_t* msg = encode_set_config(3, num_pins, inf, &out_size);
-            struct pollfd pfd = {client_socket, POLLOUT, -1};
-            poll(&pfd, 1, -1);
-            send(client_socket, msg, out_size, 0);
-            std::cout << "Sent set_config to " << mac_addr << "\n";
-            server->conn_info->setConnected(c, client_socket);
-        } else {
-            std::cerr << "Did not recognize MAC address!\n";
-            close(client_socket);
-        }
-    }
+    server->handshakes->run(socket, server);
 }
 
 std::optional<LEDTCPServer> create_server(uint32_t addr,
@@ -158,194 +84,583 @@ LEDTCPServer::LEDTCPServer(uint32_t addr,
       port(port),
       socket(socket),
       conn_info(new ClientConnInfo(clients)),
-      conn_handling(NULL)
-{}
+      conn_handling(NULL),
+      handshakes(new HandshakeLoop(clients)),
+      conn_event_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      send_buffers(),
+      send_queues(),
+      delta_encoders(),
+      compressors(),
+      quantizers(),
+      inboxes(),
+      udp_peers(),
+      last_frames(),
+      frame_acks(),
+      encodings(),
+      queue_clients(),
+      udp(new UdpTransport()),
+      uring(NULL),
+      delta_frames(FEATURE_OFF),
+      keyframe_interval(DEFAULT_KEYFRAME_INTERVAL),
+      present_delay_ns(0),
+      completions()
+{
+    this->completions.reserve(clients.size());
+    for (Client* c : clients) {
+        this->send_buffers[c] = new SendBufferPool(c);
+        this->frame_acks[c] = new FrameAckTracker();
+        this->send_queues[c] = new ClientSendQueue(this->send_buffers[c], this->frame_acks[c]);
+        this->delta_encoders[c] = new DeltaEncoder(c, this->send_buffers[c]->entries_size);
+        this->compressors[c] = new FrameCompressor(c);
+        this->quantizers[c] = new FrameQuantizer(c);
+        this->inboxes[c] = new ClientInbox{-1, {}};
+        this->udp_peers[c] = new UdpPeer();
+        this->last_frames[c] = new LastFrame(this->send_buffers[c]);
+        this->encodings[c] = new PublishedEncoding();
+        this->queue_clients[this->send_queues[c]] = c;
+    }
+}
 
 void LEDTCPServer::start() {
     this->conn_handling = new std::thread(handle_conns, socket, this);
 }
 
-ClientConnInfo::ClientConnInfo(std::vector<Client *> clients)
-    : mut(),
-      connected(),
-      disconnected()
-{
-    for (auto c : clients) {
-        disconnected.insert(c);
+bool LEDTCPServer::admit(const Client* c, int client_socket, const ClientCapabilities* caps) {
+    // If the client reconnects before its old socket has disconnected,
+    // close the old socket and mark the client as disconnected.
+    auto socket_opt = this->conn_info->getSocket(c);
+    if (socket_opt.has_value()) {
+        int socket = socket_opt.value();
+        this->conn_info->setDisconnected(c);
+        this->send_queues.at(c)->close(socket);
     }
+    // Frames go over TCP until the new connection says otherwise.
+    this->udp_peers.at(c)->clear();
+    this->frame_acks.at(c)->reset();
+
+    SendBufferPool* pool = this->send_buffers.at(c);
+    std::shared_ptr<ClientEncoding> encoding = std::make_shared<ClientEncoding>();
+    uint32_t full_frame_size = sizeof(SetLedsFrameMessage) + pool->entries_size + sizeof(uint64_t);
+    encoding->choose(c, caps, this->delta_frames, this->quantizers.at(c)->max_level(), full_frame_size);
+    this->encodings.at(c)->publish(encoding);
+    std::cout << "Client " << std::hex << c->mac_addr << std::dec << " checked in with "
+              << encoding->to_string() << "\n";
+    pool->prime();
+    this->send_queues.at(c)->open(client_socket);
+    // Queued before the frame path can see the socket, so the next frame
+    // can't get in ahead of it and it goes out right behind the SetConfig.
+    uint32_t seq;
+    uint32_t size;
+    uint8_t* buf = this->encode_last_frame(c, *encoding, &seq, &size);
+    if (buf) {
+        // Its deadline has long passed, so display latency is taken from now.
+        this->send_frame(c, client_socket, buf, size, seq, std::chrono::steady_clock::now());
+        this->submit_sends();
+    }
+    this->conn_info->setConnected(c, client_socket);
+    uint64_t one = 1;
+    write(this->conn_event_fd, &one, sizeof(one));
+    return buf != NULL;
 }
 
-void ClientConnInfo::setConnected(const Client *c, int socket) {
-    this->mut.lock();
-    if (this->connected.find(c) == this->connected.end()) {
-        this->disconnected.erase(c);
-        this->connected[c] = socket;
+void LEDTCPServer::use_backend(net_backend backend) {
+    if (backend != NET_BACKEND_IO_URING) {
+        return;
+    }
+    UringSender* uring = new UringSender(this->send_queues.size());
+    if (!uring->ok()) {
+        std::cerr << "Falling back to the epoll network backend\n";
+        delete uring;
+        return;
+    }
+    this->uring = uring;
+    for (auto it : this->send_queues) {
+        it.second->use_uring(uring);
     }
-    this->mut.unlock();
 }
 
-std::optional<int> ClientConnInfo::getSocket(const Client *c) {
-    this->mut.lock();
-    auto conn = this->connected.find(c);
-    this->mut.unlock();
-    if (conn != this->connected.end()) {
-        return conn->second;
-    } else {
-        return std::nullopt;
+// Watches connected client sockets on the reactor, so a client hanging up is
+// noticed as soon as it happens rather than on the next failed send.
+void LEDTCPServer::watch_clients(Reactor& reactor) {
+    reactor.add(this->conn_event_fd, EPOLLIN, [this, &reactor](uint32_t) {
+        uint64_t count;
+        read(this->conn_event_fd, &count, sizeof(count));
+        this->sync_watched(reactor);
+    });
+    if (this->uring) {
+        reactor.add(this->uring->event_fd(), EPOLLIN, [this](uint32_t) {
+            uint64_t count;
+            read(this->uring->event_fd(), &count, sizeof(count));
+            this->reap_sends();
+        });
     }
+    this->sync_watched(reactor);
 }
 
-void ClientConnInfo::getAllConnected(std::vector<std::pair<const Client*, int>>& v) {
-    this->mut.lock();
-    for (auto it : this->connected) {
-        v.push_back(std::make_pair(it.first, it.second));
+// Hands each finished io_uring write back to its queue, which schedules
+// whatever is waiting behind it.
+void LEDTCPServer::reap_sends() {
+    this->completions.clear();
+    this->uring->reap(this->completions);
+    for (UringCompletion& it : this->completions) {
+        ClientSendQueue* queue = (ClientSendQueue*)it.first;
+        if (!queue->complete(it.second)) {
+            this->send_failed(this->queue_clients.at(queue));
+        }
     }
-    this->mut.unlock();
+    this->submit_sends();
 }
 
-void ClientConnInfo::getAllDisconnected(std::vector<const Client*>& v) {
-    this->mut.lock();
-    for (auto c : this->disconnected) {
-        v.push_back(c);
+// Re-adds every connected socket: a closed socket drops out of the epoll set
+// by itself and its descriptor may since have been reused by a new client.
+void LEDTCPServer::sync_watched(Reactor& reactor) {
+    ConnSnapshotHandle conns;
+    for (auto it : this->conn_info->snapshot(conns).connected) {
+        const Client* c = it.first;
+        int client_socket = it.second;
+        reactor.add(client_socket, EPOLLIN | EPOLLRDHUP, [this, &reactor, c, client_socket](uint32_t events) {
+            this->client_event(reactor, c, client_socket, events);
+        });
+        this->send_queues.at(c)->watch(&reactor);
     }
-    this->mut.unlock();
 }
 
-void ClientConnInfo::setDisconnected(const Client* c) {
-    this->mut.lock();
-    if (this->disconnected.find(c) == this->disconnected.end()) {
-        this->connected.erase(c);
-        this->disconnected.insert(c);
+void LEDTCPServer::client_event(Reactor& reactor, const Client* c, int client_socket, uint32_t events) {
+    ClientSendQueue* queue = this->send_queues.at(c);
+    bool hung_up = events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+    if (!hung_up && (events & EPOLLOUT)) {
+        hung_up = !queue->flush(client_socket);
+        this->submit_sends();
+    }
+    if (!hung_up && (events & EPOLLIN)) {
+        hung_up = !this->receive(c, client_socket);
+    }
+    if (!hung_up) {
+        return;
+    }
+
+    reactor.remove(client_socket);
+    // The socket may already have been closed by a failed send or replaced by
+    // the client checking in again.
+    if (queue->close(client_socket)) {
+        std::cout << "Client " << std::hex << c->mac_addr << std::dec << " hung up\n";
+        this->udp_peers.at(c)->clear();
+        this->conn_info->setDisconnected(c);
     }
-    this->mut.unlock();
 }
 
-bool ClientConnInfo::isConnected(const Client *c) {
-    this->mut.lock();
-    return this->connected.find(c) != this->connected.end();
-    this->mut.unlock();
+// Reads what the client sent and handles each whole message in it. Returns
+// false if the client hung up, or sent a size that leaves no way to find the
+// next message, so the connection has to go.
+bool LEDTCPServer::receive(const Client* c, int client_socket) {
+    ClientInbox* inbox = this->inboxes.at(c);
+    if (inbox->socket != client_socket) {
+        inbox->socket = client_socket;
+        inbox->data.clear();
+    }
+
+    uint8_t scratch[512];
+    int recved = recv(client_socket, scratch, sizeof(scratch), 0);
+    if (recved == 0 || (recved < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        return false;
+    }
+    if (recved < 0) {
+        return true;
+    }
+    inbox->data.insert(inbox->data.end(), scratch, scratch + recved);
+
+    size_t offset = 0;
+    while (inbox->data.size() - offset >= sizeof(MessageHeader)) {
+        const uint8_t* msg = inbox->data.data() + offset;
+        uint32_t size = get_message_size(msg);
+        if (size < sizeof(MessageHeader) || size > MAX_CLIENT_MESSAGE_SIZE) {
+            std::cerr << "Bad message size " << size << " from client "
+                      << std::hex << c->mac_addr << std::dec << ", disconnecting\n";
+            inbox->data.clear();
+            return false;
+        }
+        if (inbox->data.size() - offset < size) {
+            break;
+        }
+        this->handle_message(c, client_socket, msg);
+        offset += size;
+    }
+    inbox->data.erase(inbox->data.begin(), inbox->data.begin() + offset);
+    return true;
+}
+
+// The server's clock as TimePong and present-at times give it.
+static uint64_t steady_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-void LEDTCPServer::tcp_send(const Client* c, int socket, void* data, int size) {
-    int sent = send(socket, data, size, MSG_NOSIGNAL);
-    if (sent != size) {
-        std::cout << "Error sending: " << strerror(errno) << "\n";
-        if (errno == ECONNRESET) {
-            auto socket_opt = this->conn_info->getSocket(c);
-            if (socket_opt.has_value()) {
-                close(socket_opt.value());
+void LEDTCPServer::handle_message(const Client* c, int client_socket, const uint8_t* msg) {
+    switch (get_message_op_code(msg)) {
+        case OP_RESYNC: {
+            ResyncMessage* resync = decode_resync(msg);
+            if (!resync) {
+                break;
+            }
+            std::cout << "Client " << std::hex << c->mac_addr << std::dec
+                      << " asked for a resync after frame " << resync->last_seq << "\n";
+            this->delta_encoders.at(c)->resyncs++;
+            this->send_queues.at(c)->keyframe_wanted = true;
+            break;
+        }
+        case OP_UDP_PORT: {
+            UdpPortMessage* udp_port = decode_udp_port(msg);
+            sockaddr_in addr;
+            socklen_t len = sizeof(addr);
+            if (!udp_port || getpeername(client_socket, (sockaddr*)&addr, &len) != 0 || addr.sin_family != AF_INET) {
+                break;
             }
-            this->conn_info->setDisconnected(c);
+            addr.sin_port = htons(udp_port->port);
+            this->udp_peers.at(c)->set(addr);
+            std::cout << "Client " << std::hex << c->mac_addr << std::dec
+                      << " takes frames on UDP port " << udp_port->port << "\n";
+            break;
+        }
+        case OP_TIME_PING: {
+            TimePingMessage* ping = decode_time_ping(msg);
+            if (!ping) {
+                break;
+            }
+            uint64_t recv_us = steady_us();
+            uint8_t pong[sizeof(TimePongMessage)];
+            uint32_t size = write_time_pong(pong, ping->client_send_us, recv_us, steady_us());
+            this->tcp_send(c, client_socket, pong, size);
+            this->submit_sends();
+            break;
+        }
+        case OP_FRAME_ACK: {
+            FrameAckMessage* ack = decode_frame_ack(msg);
+            if (ack) {
+                this->frame_acks.at(c)->ack(ack, std::chrono::steady_clock::now());
+            }
+            break;
         }
+        default:
+            // Nothing else is expected unprompted.
+            break;
     }
 }
 
-MessageHeader LEDTCPServer::tcp_recv_header(int socket) {
-    MessageHeader header;
-    struct pollfd pfd = {socket, POLLIN, 0};
-    int total = 0;
-    while (total < (int)sizeof(MessageHeader)) {
-        poll(&pfd, 1, -1);
-        int recved = recv(socket, (char*)&header + total, sizeof(header) - total, 0);
-        if (recved < 0) {
-            std::cerr << "Error receiving header: " << strerror(errno) << "\n";
-        } else {
-            total += recved;
-        }
+void LEDTCPServer::tcp_send(const Client* c, int socket, const void* data, int size) {
+    if (!this->send_queues.at(c)->push_control(socket, data, size)) {
+        this->send_failed(c);
     }
-    return header;
 }
 
-void LEDTCPServer::tcp_recv(int socket, void* data, int size) {
-    struct pollfd pfd = {socket, POLLIN, 0};
-    poll(&pfd, 1, -1);
-    int total = 0;
-    while (total < size) {
-        poll(&pfd, 1, -1);
-        int recved = recv(socket, (char*)data + total, size - total, 0);
-        if (recved < 0) {
-            std::cerr << "Error receiving: " << strerror(errno) << "\n";
-        } else {
-            total += recved;
-        }
+void LEDTCPServer::send_frame(const Client* c, int socket, uint8_t* buf, uint32_t size, uint32_t seq, ns_ts deadline) {
+    FrameAckTracker* acks = this->frame_acks.at(c);
+    acks->queued(seq, deadline);
+    // A frame too big to reassemble from UDP goes over TCP, which the client
+    // streams into its strips.
+    ClientEncodingHandle encoding = this->encodings.at(c)->load();
+    if (encoding->udp && size <= encoding->max_message_size &&
+        this->udp->send_frame(this->udp_peers.at(c), buf, size, seq)) {
+        acks->written(seq, std::chrono::steady_clock::now());
+        this->release_leds(c, buf);
+        return;
+    }
+    if (!this->send_queues.at(c)->push_frame(socket, buf, size)) {
+        this->send_failed(c);
     }
 }
 
+void LEDTCPServer::submit_sends() {
+    if (this->uring) {
+        this->uring->submit();
+    }
+}
+
+// The queue has already closed the socket.
+void LEDTCPServer::send_failed(const Client* c) {
+    this->udp_peers.at(c)->clear();
+    std::cout << "Dropping client " << std::hex << c->mac_addr << std::dec << " after a failed send\n";
+    this->conn_info->setDisconnected(c);
+}
+
 void LEDTCPServer::set_leds(const Client* c,
                             int client_socket,
-                            VirtualCanvas canvas) {
-    std::vector<LedsBatch> leds_batches;
-    for (MatricesConnection conn : c->mat_connections) {
-        uint64_t total_size = 0;
-        for (LEDMatrix* mat : conn.matrices) {
-            total_size += mat->packed_pixel_array_size;
-        }
-        // temp_buf is a buffer that will contain all the re-oriented/processed submatrices
-        // of each led strip for the client
-        uint8_t* temp_buf = (uint8_t*)malloc(total_size);
-        uint8_t pin = conn.pin;
-
-        // This loop processes each submatrix (corresponding to a ledstrip) one at a time.
-        // pixel_buf points to the next part of the temp_buf for the current submatrix.
-        // Note that pixel_buf is also updated at the end of each iteration of this loop.
-        uint8_t* pixel_buf = temp_buf;
-        for (LEDMatrix* ledmat : conn.matrices) {
-            uint32_t width = ledmat->spec->width;
-            uint32_t height = ledmat->spec->height;
-            // swap width and height if rotated +/-90 degrees
-            rotation rot = ledmat->pos.rot;
-            if (rot == LEFT || rot == RIGHT) {
-                uint32_t temp = width;
-                height = width;
-                height = temp;
-            }
-            uint32_t x = ledmat->pos.x;
-            uint32_t y = ledmat->pos.y;
-
-            cv::Mat sub_cvmat = canvas.getPixelMatrix()(cv::Rect(x, y, width, height)).clone();
-            if (rot == LEFT) {
-                cv::rotate(sub_cvmat, sub_cvmat, cv::ROTATE_90_CLOCKWISE);
-            } else if (rot == RIGHT) {
-                cv::rotate(sub_cvmat, sub_cvmat, cv::ROTATE_90_COUNTERCLOCKWISE);
-            } else if (rot == DOWN) {
-                cv::rotate(sub_cvmat, sub_cvmat, cv::ROTATE_180);
-            }
+                            const Frame& frame,
+                            latch_mode latch) {
+    uint32_t msg_size;
+    uint8_t* msg_buf = this->pack_leds(c, frame, latch, &msg_size);
+    if (!msg_buf) {
+        return;
+    }
+    this->send_frame(c, client_socket, msg_buf, msg_size, frame.seq, frame.deadline);
+}
 
-            const uint8_t* data = sub_cvmat.data;
-            // todo: brightness_reduction should be configurable!
-            const int brightness_reduction = 10;
-            uint32_t num_leds = ledmat->packed_pixel_array_size / 3;
-            for (uint32_t i = 0; (i < num_leds); ++i) {
-                uint32_t a = i * 3;
-                if ((i / width) % 2 != 0) {
-                    pixel_buf[a + 2] = data[a] / brightness_reduction;
-                    pixel_buf[a + 1] = data[a + 1] / brightness_reduction;
-                    pixel_buf[a] = data[a + 2] / brightness_reduction;
-                } else {
-                    uint32_t irem = i % width;
-                    uint32_t b = (((width - 1) - irem) + (i - irem)) * 3;
-                    pixel_buf[a + 2] = data[b] / brightness_reduction;
-                    pixel_buf[a + 1] = data[b + 1] / brightness_reduction;
-                    pixel_buf[a] = data[b + 2] / brightness_reduction;
-                }
-            }
-            pixel_buf += ledmat->packed_pixel_array_size;
+// Encodes the client's portion of the frame's pixels into one of its send
+// buffers as a SetLedsFrame. With LATCH_IMMEDIATE it has the latch flag, so
+// clients show it as soon as it is applied without a separate OP_REDRAW, and
+// with LATCH_SCHEDULED a present-at time as well. Clients without SetLedsFrame
+// get a SetLedsBatched, which they show on arrival whatever the latch mode
+// (a LATCH_SYNCHRONIZED redraw just shows it again). For clients taking delta
+// frames it may instead be a SetLedsDelta with the same flags, or NULL if
+// nothing changed and there is nothing to send. Full frames go out as
+// SetLedsQuantized at a reduced wire depth or SetLedsCompressed when the
+// client's encoding has them and they are smaller, both with the same flags.
+// The buffer must be handed back with release_leds.
+uint8_t* LEDTCPServer::pack_leds(const Client* c,
+                                 const Frame& frame,
+                                 latch_mode latch,
+                                 uint32_t* out_size) {
+    uint8_t flags = latch == LATCH_SYNCHRONIZED ? 0 : LEDS_FRAME_FLAG_LATCH;
+    // Taken once, so a client checking in again can't change the encoding
+    // part way through the frame.
+    ClientEncodingHandle encoding = this->encodings.at(c)->load();
+    uint8_t* msg_buf = this->encode_leds(c, *encoding, frame, flags, out_size);
+    if (msg_buf && latch == LATCH_SCHEDULED && encoding->present_at) {
+        ns_ts present_at = frame.deadline + ns_dur(this->present_delay_ns);
+        *out_size = append_present_at(msg_buf, std::chrono::duration_cast<std::chrono::microseconds>(
+            present_at.time_since_epoch()).count());
+    }
+    return msg_buf;
+}
+
+uint8_t* LEDTCPServer::encode_leds(const Client* c,
+                                   const ClientEncoding& encoding,
+                                   const Frame& frame,
+                                   uint8_t flags,
+                                   uint32_t* out_size) {
+    SendBufferPool* pool = this->send_buffers.at(c);
+    uint8_t* msg_buf = pool->acquire();
+    if (!msg_buf) {
+        return NULL;
+    }
+    uint8_t* entries = this->write_full_header(c, encoding, msg_buf, flags, frame.seq, out_size);
+    uint8_t* p = entries;
+
+    // Each pin's pixels are gathered straight into the message. Gamma and
+    // brightness are only applied here, the canvas holds the source colours.
+    for (const MatricesConnection& conn : c->mat_connections) {
+        p = write_batch_entry_header(p, conn.pin, conn.gather.size());
+        const uint32_t* gather = conn.gather.data();
+        for (const PackSegment& seg : conn.segments) {
+            pack_pixels(frame.pixels.data, gather, seg.num_leds, seg.params, p);
+            gather += seg.num_leds;
+            p += seg.num_leds * 3;
         }
-        uint32_t num_leds_total = total_size / 3;
-        leds_batches.push_back((LedsBatch){pin, num_leds_total, temp_buf});
     }
-    uint32_t msg_size;
-    uint8_t* msg_buf = encode_set_leds_batched(c->mat_connections.size(), leds_batches.data(), &msg_size);
-    this->tcp_send(c, client_socket, msg_buf, msg_size);
-    for (LedsBatch batch : leds_batches) {
-        free((void*)batch.pixel_data);
+    this->last_frames.at(c)->store(msg_buf, entries, frame.seq);
+    if (encoding.batched) {
+        return msg_buf;
+    }
+    if (!encoding.delta) {
+        return this->encode_full_leds(c, encoding, msg_buf, entries, flags, frame.seq, out_size);
+    }
+
+    DeltaEncoder* delta = this->delta_encoders.at(c);
+    bool keyframe_wanted = this->send_queues.at(c)->take_keyframe_request();
+    if (keyframe_wanted || delta->keyframe_due(this->keyframe_interval)) {
+        delta->set_baseline(entries, frame.seq);
+        return this->encode_full_leds(c, encoding, msg_buf, entries, flags, frame.seq, out_size);
+    }
+    uint8_t* delta_buf = pool->acquire();
+    if (!delta_buf) {
+        // The full frame is already packed, so send that and delta from it.
+        delta->set_baseline(entries, frame.seq);
+        return this->encode_full_leds(c, encoding, msg_buf, entries, flags, frame.seq, out_size);
+    }
+    uint32_t delta_size;
+    // At a reduced depth the delta has to beat the quantised frame, and it
+    // always has to fit in one of the client's messages.
+    uint8_t depth = encoding.wire_depth;
+    uint32_t max_size = depth != WIRE_DEPTH_RGB888 ? this->quantizers.at(c)->size(depth) : *out_size;
+    max_size = std::min(max_size, encoding.encoded_budget());
+    switch (delta->encode(entries, *out_size, max_size, flags, frame.seq, delta_buf, &delta_size)) {
+        case DELTA_OK:
+            pool->release(msg_buf);
+            *out_size = delta_size;
+            return delta_buf;
+        case DELTA_UNCHANGED:
+            pool->release(delta_buf);
+            pool->release(msg_buf);
+            return NULL;
+        default:
+            pool->release(delta_buf);
+            delta->set_baseline(entries, frame.seq);
+            return this->encode_full_leds(c, encoding, msg_buf, entries, flags, frame.seq, out_size);
     }
-    free_message_buffer(msg_buf);
 }
 
-void LEDTCPServer::redraw(const Client* c, int client_socket) {
-    uint32_t msg_size;
-    uint8_t* msg_buf = encode_redraw(&msg_size);
-    this->tcp_send(c, client_socket, msg_buf, msg_size);
-    free_message_buffer(msg_buf);
+// Writes the header of a full frame in the client's encoding, a SetLedsFrame
+// or for older firmware a SetLedsBatched, returning where its batch entries
+// go.
+uint8_t* LEDTCPServer::write_full_header(const Client* c,
+                                         const ClientEncoding& encoding,
+                                         uint8_t* msg_buf,
+                                         uint8_t flags,
+                                         uint32_t seq,
+                                         uint32_t* out_size) {
+    uint8_t batch_count = c->mat_connections.size();
+    uint32_t entries_size = this->send_buffers.at(c)->entries_size;
+    if (encoding.batched) {
+        *out_size = sizeof(SetLedsBatchedMessage) + entries_size;
+        return write_set_leds_batched_header(msg_buf, *out_size, batch_count);
+    }
+    *out_size = sizeof(SetLedsFrameMessage) + entries_size;
+    return write_set_leds_frame_header(msg_buf, *out_size, flags, seq, batch_count);
+}
+
+// Encodes the last frame packed for the client as a full frame that shows
+// as soon as it is applied, the way a live frame with LATCH_IMMEDIATE would
+// be for its encoding. Returns NULL if there is no last frame.
+uint8_t* LEDTCPServer::encode_last_frame(const Client* c,
+                                         const ClientEncoding& encoding,
+                                         uint32_t* seq,
+                                         uint32_t* out_size) {
+    SendBufferPool* pool = this->send_buffers.at(c);
+    const uint8_t* last;
+    uint8_t* held = this->last_frames.at(c)->take(&last, seq);
+    if (!held) {
+        return NULL;
+    }
+    uint8_t* msg_buf = pool->acquire();
+    if (!msg_buf) {
+        pool->release(held);
+        return NULL;
+    }
+    // It may have been packed under the connection's old encoding, with the
+    // other header, so the entries are copied behind this one's.
+    uint8_t* entries = this->write_full_header(c, encoding, msg_buf, LEDS_FRAME_FLAG_LATCH, *seq, out_size);
+    memcpy(entries, last, pool->entries_size);
+    pool->release(held);
+    if (encoding.batched) {
+        return msg_buf;
+    }
+    return this->encode_full_leds(c, encoding, msg_buf, entries, LEDS_FRAME_FLAG_LATCH, *seq, out_size);
+}
+
+// Swaps a full frame for the smaller of its SetLedsQuantized form, if the
+// client has a reduced wire depth, and its SetLedsCompressed form, if the
+// client takes them, returning whichever buffer is kept.
+uint8_t* LEDTCPServer::encode_full_leds(const Client* c,
+                                        const ClientEncoding& encoding,
+                                        uint8_t* msg_buf,
+                                        const uint8_t* entries,
+                                        uint8_t flags,
+                                        uint32_t seq,
+                                        uint32_t* out_size) {
+    uint8_t depth = encoding.wire_depth;
+    bool quantize = depth != WIRE_DEPTH_RGB888;
+    bool compress = encoding.compress;
+    if (!quantize && !compress) {
+        return msg_buf;
+    }
+    SendBufferPool* pool = this->send_buffers.at(c);
+    uint8_t* compressed_buf = pool->acquire();
+    if (!compressed_buf) {
+        return msg_buf;
+    }
+    // A quantised frame's size is known up front, and compressing has to beat
+    // it to be worth sending. Both have to fit in one of the client's
+    // messages; a SetLedsFrame that doesn't is streamed.
+    FrameQuantizer* quantizer = this->quantizers.at(c);
+    uint32_t budget = encoding.encoded_budget();
+    quantize = quantize && quantizer->size(depth) <= budget;
+    uint32_t max_size = std::min(quantize ? quantizer->size(depth) : *out_size, budget);
+    uint32_t size = compress
+        ? this->compressors.at(c)->compress(entries, *out_size, max_size, flags, seq, compressed_buf)
+        : 0;
+    if (!size && quantize) {
+        size = quantizer->quantize(depth, entries, *out_size, flags, seq, compressed_buf);
+    }
+    if (!size) {
+        pool->release(compressed_buf);
+        return msg_buf;
+    }
+    pool->release(msg_buf);
+    *out_size = size;
+    return compressed_buf;
+}
+
+void LEDTCPServer::release_leds(const Client* c, uint8_t* buf) {
+    this->send_buffers.at(c)->release(buf);
+}
+
+// Sends OP_REDRAW to every connection with nothing in between, so the clients
+// latch as close together as the network allows. Returns the time in ns from
+// the first send starting to the last one returning.
+int64_t LEDTCPServer::redraw_batch(const std::vector<std::pair<const Client*, int>>& conns) {
+    static const RedrawMessage msg = {{sizeof(RedrawMessage), OP_REDRAW}};
+    if (conns.empty()) {
+        return 0;
+    }
+    auto first = std::chrono::steady_clock::now();
+    for (auto it : conns) {
+        this->tcp_send(it.first, it.second, &msg, sizeof(msg));
+    }
+    this->submit_sends();
+    auto last = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(last - first).count();
+}
+
+void LEDTCPServer::print_stats(std::ostream& out) {
+    this->handshakes->print_stats(out);
+    out << "Send queues (" << net_backend_name(this->uring ? NET_BACKEND_IO_URING : NET_BACKEND_EPOLL) << "):\n";
+    if (this->uring) {
+        this->uring->print_stats(out);
+    }
+    for (auto it : this->send_queues) {
+        ClientSendQueue* queue = it.second;
+        out << "  client " << std::hex << std::setw(12) << std::setfill('0') << it.first->mac_addr
+            << std::dec << std::setfill(' ') << ": "
+            << queue->dropped_frames.load() << " frames dropped, "
+            << queue->stalls.load() << " stalls, "
+            << queue->queued() << " queued, "
+            << this->send_buffers.at(it.first)->misses.load() << " send buffers allocated while sending\n";
+        ClientEncodingHandle encoding = this->encodings.at(it.first)->load();
+        out << "    " << encoding->to_string() << "\n";
+        FrameAckTracker* acks = this->frame_acks.at(it.first);
+        if (acks->acked.load() > 0) {
+            out << "    " << acks->acked.load() << " frames shown, "
+                << acks->not_shown.load() << " not shown, "
+                << acks->unmatched.load() << " stray acks\n"
+                << "    " << acks->rtt.to_string() << "\n"
+                << "    " << acks->display_latency.to_string() << "\n"
+                << "    " << acks->on_client.to_string() << "\n";
+        }
+        if (encoding->delta) {
+            DeltaEncoder* delta = this->delta_encoders.at(it.first);
+            uint64_t full = delta->full_bytes.load();
+            out << "    " << delta->keyframes.load() << " keyframes, "
+                << delta->deltas.load() << " deltas";
+            if (full > 0) {
+                out << " (" << delta->delta_bytes.load() * 100 / full << "% of full size)";
+            }
+            out << ", " << delta->unchanged.load() << " unchanged, "
+                << delta->too_big.load() << " sent full, "
+                << delta->resyncs.load() << " resyncs\n";
+        }
+        if (encoding->compress) {
+            FrameCompressor* compressor = this->compressors.at(it.first);
+            uint64_t full = compressor->full_bytes.load();
+            out << "    " << compressor->compressed.load() << " frames compressed";
+            if (full > 0) {
+                out << " (" << compressor->compressed_bytes.load() * 100 / full << "% of full size)";
+            }
+            out << ", " << compressor->incompressible.load() << " sent uncompressed\n";
+        }
+        if (encoding->wire_depth != WIRE_DEPTH_RGB888) {
+            FrameQuantizer* quantizer = this->quantizers.at(it.first);
+            uint64_t full = quantizer->full_bytes.load();
+            out << "    " << quantizer->frames.load() << " frames at " << (int)encoding->wire_depth << " bits";
+            if (full > 0) {
+                out << " (" << quantizer->quantized_bytes.load() * 100 / full << "% of full size)";
+            }
+            out << "\n";
+        }
+        if (encoding->udp) {
+            UdpPeer* peer = this->udp_peers.at(it.first);
+            out << "    udp: " << peer->frames.load() << " frames in "
+                << peer->fragments.load() << " fragments, "
+                << peer->send_errors.load() << " cut short, "
+                << peer->simulated_losses.load() << " fragments dropped by simulated loss\n";
+        }
+    }
 }
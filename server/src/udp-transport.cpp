@@ -0,0 +1,94 @@
+#include "udp-transport.hpp"
+#include "protocol.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <netinet/in.h>
+#include <random>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// IPv4 and UDP headers.
+const int IP_UDP_OVERHEAD = 20 + 8;
+// Enough for a few whole frames to every client between two sends.
+const int UDP_SEND_BUFFER = 1 << 20;
+
+UdpPeer::UdpPeer()
+    : frames(0),
+      fragments(0),
+      send_errors(0),
+      simulated_losses(0),
+      mut(),
+      ready(false),
+      addr()
+{}
+
+void UdpPeer::set(const sockaddr_in& addr) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    this->addr = addr;
+    this->ready = true;
+}
+
+void UdpPeer::clear() {
+    std::lock_guard<std::mutex> lock(this->mut);
+    this->ready = false;
+}
+
+bool UdpPeer::get(sockaddr_in* addr) {
+    std::lock_guard<std::mutex> lock(this->mut);
+    *addr = this->addr;
+    return this->ready;
+}
+
+UdpTransport::UdpTransport()
+    : socket(::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)),
+      fragment_payload(0),
+      simulated_loss(0)
+{
+    int size = UDP_SEND_BUFFER;
+    setsockopt(this->socket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    this->set_mtu(DEFAULT_UDP_MTU);
+}
+
+void UdpTransport::set_mtu(int mtu) {
+    this->fragment_payload = mtu - IP_UDP_OVERHEAD - sizeof(FrameFragmentMessage);
+}
+
+bool UdpTransport::send_frame(UdpPeer* peer, const uint8_t* buf, uint32_t size, uint32_t seq) {
+    sockaddr_in addr;
+    if (!peer->get(&addr)) {
+        return false;
+    }
+    thread_local std::minstd_rand rng(std::random_device{}());
+    std::uniform_real_distribution<double> chance(0, 1);
+
+    uint16_t count = (size + this->fragment_payload - 1) / this->fragment_payload;
+    uint8_t header[sizeof(FrameFragmentMessage)];
+    for (uint16_t i = 0; i < count; ++i) {
+        uint32_t offset = i * this->fragment_payload;
+        uint32_t len = std::min(this->fragment_payload, size - offset);
+        if (this->simulated_loss > 0 && chance(rng) < this->simulated_loss) {
+            peer->simulated_losses++;
+            continue;
+        }
+        write_frame_fragment_header(header, sizeof(header) + len, seq, size, offset, i, count);
+
+        // The frame is sent from where it was packed, behind a header.
+        iovec iov[2] = {{header, sizeof(header)}, {(void*)(buf + offset), len}};
+        msghdr msg = {};
+        msg.msg_name = &addr;
+        msg.msg_namelen = sizeof(addr);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        if (sendmsg(this->socket, &msg, MSG_DONTWAIT) < 0) {
+            // The rest of the frame is no use without this fragment.
+            peer->send_errors++;
+            break;
+        }
+        peer->fragments++;
+    }
+    peer->frames++;
+    return true;
+}